@@ -0,0 +1,472 @@
+//
+// Contains implementation of batch mode and its work stealing pool
+//
+
+#include "batch.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//
+// Struct definition of a Share, the files a thread of the pool has yet to
+// work on, as indices into the BatchList.
+//
+// lock: Lock of head and tail, which thieves take from as well.
+// items: Files of the share, from items[head] up to items[tail].
+// head: Next file the owner takes.
+// tail: End of the share, which thieves take from.
+//
+typedef struct Share {
+  pthread_mutex_t lock;
+  uint32_t *items;
+  uint32_t head;
+  uint32_t tail;
+} Share;
+
+//
+// Struct definition of a Crew, the pool of threads running a batch.
+//
+// list: Files of the batch.
+// shares: Share of each thread.
+// threads: Number of threads.
+// job: Job to run on each file.
+//
+typedef struct Crew {
+  const BatchList *list;
+  Share *shares;
+  uint32_t threads;
+  BatchJob job;
+} Crew;
+
+//
+// Struct definition of a Worker, one thread of a Crew.
+//
+// crew: Crew the thread belongs to.
+// self: Index of the thread's Share.
+// state: State passed to the job.
+// failed: Number of files the job failed on.
+//
+typedef struct Worker {
+  Crew *crew;
+  uint32_t self;
+  void *state;
+  uint32_t failed;
+} Worker;
+
+//
+// Struct definition of a file and its size, for sorting.
+//
+// size: Size of the file.
+// index: Index of the file in the BatchList.
+//
+typedef struct SizedFile {
+  uint64_t size;
+  uint32_t index;
+} SizedFile;
+
+//
+// Sets up an empty BatchList.
+//
+// list: BatchList to set up.
+// returns: Void.
+//
+void batch_list_init(BatchList *list) {
+  memset(list, 0, sizeof(BatchList));
+  return;
+}
+
+//
+// Frees the files of a BatchList.
+//
+// list: BatchList to free.
+// returns: Void.
+//
+void batch_list_free(BatchList *list) {
+  for (uint32_t i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+  free(list->sizes);
+  batch_list_init(list);
+  return;
+}
+
+//
+// Appends a file to a BatchList, growing it if need be.
+//
+// list: BatchList to append to.
+// path: Path of the file, which is copied.
+// size: Size of the file.
+// returns: True on success, false if allocation failed.
+//
+static bool list_push(BatchList *list, const char *path, uint64_t size) {
+  if (list->count == list->cap) {
+    uint32_t cap = list->cap > 0 ? 2 * list->cap : 64;
+    char **paths = (char **)realloc(list->paths, cap * sizeof(char *));
+    if (paths == NULL) {
+      return false;
+    }
+    list->paths = paths;
+    uint64_t *sizes =
+        (uint64_t *)realloc(list->sizes, cap * sizeof(uint64_t));
+    if (sizes == NULL) {
+      return false;
+    }
+    list->sizes = sizes;
+    list->cap = cap;
+  }
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    return false;
+  }
+  list->paths[list->count] = copy;
+  list->sizes[list->count] = size;
+  list->count++;
+  return true;
+}
+
+//
+// Returns whether a path ends with BATCH_SUFFIX.
+//
+// path: Path to check.
+// returns: True if it does, false otherwise.
+//
+static bool has_suffix(const char *path) {
+  size_t len = strlen(path);
+  size_t suffix = strlen(BATCH_SUFFIX);
+  return len > suffix && strcmp(path + len - suffix, BATCH_SUFFIX) == 0;
+}
+
+//
+// Adds every regular file below a directory that is compressed, or not,
+// to a BatchList.
+//
+// list: BatchList to add to.
+// dir: Path of the directory.
+// compressed: Whether to pick compressed files.
+// returns: True on success, false if a directory could not be read or
+//          memory ran out.
+//
+static bool add_dir(BatchList *list, const char *dir, bool compressed) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    printf("%s: Unable to read directory.\n", dir);
+    return false;
+  }
+  size_t dir_len = strlen(dir);
+  bool slash = dir_len > 0 && dir[dir_len - 1] == '/';
+  bool ok = true;
+  struct dirent *ent = NULL;
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+    char *path = (char *)malloc(dir_len + strlen(ent->d_name) + 2);
+    if (path == NULL) {
+      printf("Failed to allocate file list.\n");
+      ok = false;
+      break;
+    }
+    strcpy(path, dir);
+    strcpy(path + dir_len, slash ? "" : "/");
+    strcat(path, ent->d_name);
+    // Files that cannot be read are left out, and the rest are still added
+    struct stat sb;
+    bool pushed = true;
+    if (lstat(path, &sb) == -1) {
+      printf("%s: Unable to open input file.\n", path);
+      ok = false;
+    } else if (S_ISDIR(sb.st_mode)) {
+      ok = add_dir(list, path, compressed) && ok;
+    } else if (S_ISREG(sb.st_mode) && has_suffix(path) == compressed) {
+      pushed = list_push(list, path, sb.st_size);
+    }
+    free(path);
+    if (!pushed) {
+      printf("Failed to allocate file list.\n");
+      ok = false;
+      break;
+    }
+  }
+  closedir(d);
+  return ok;
+}
+
+//
+// Adds a regular file to a BatchList, or, if recurse is set, every regular
+// file below a directory. Files found in a directory are only added if
+// they are compressed (end with BATCH_SUFFIX) when compressed is set, and
+// only if they are not otherwise, so a batch is not run over its own
+// output. Symbolic links found in a directory are skipped.
+//
+// list: BatchList to add to.
+// path: Path of the file or directory.
+// recurse: Whether to add the files below a directory.
+// compressed: Whether to pick compressed files out of directories.
+// returns: True on success, false if the path could not be read or
+//          memory ran out. The reason is printed.
+//
+bool batch_add(BatchList *list, const char *path, bool recurse,
+    bool compressed) {
+  struct stat sb;
+  if (stat(path, &sb) == -1) {
+    printf("%s: Unable to open input file.\n", path);
+    return false;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    if (!recurse) {
+      printf("%s: Is a directory, give -R to add the files below it.\n",
+          path);
+      return false;
+    }
+    return add_dir(list, path, compressed);
+  }
+  if (!S_ISREG(sb.st_mode)) {
+    printf("%s: Not a regular file.\n", path);
+    return false;
+  }
+  if (!list_push(list, path, sb.st_size)) {
+    printf("Failed to allocate file list.\n");
+    return false;
+  }
+  return true;
+}
+
+//
+// Adds the files and directories named in a manifest, one path per line,
+// as batch_add does. Empty lines are skipped.
+//
+// list: BatchList to add to.
+// f: Manifest to read, such as stdin.
+// recurse: Whether to add the files below a directory.
+// compressed: Whether to pick compressed files out of directories.
+// returns: True on success, false if a path could not be read or memory
+//          ran out.
+//
+bool batch_add_manifest(BatchList *list, FILE *f, bool recurse,
+    bool compressed) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len = 0;
+  bool ok = true;
+  while ((len = getline(&line, &line_cap, f)) != -1) {
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len > 0) {
+      ok = batch_add(list, line, recurse, compressed) && ok;
+    }
+  }
+  free(line);
+  return ok;
+}
+
+//
+// Returns the path a file of a batch is written to: the path with
+// BATCH_SUFFIX added when compressing, and with it taken off (or with
+// BATCH_RAW_SUFFIX added if it has none) when decompressing.
+//
+// path: Path of the input file.
+// compressed: Whether the input file is compressed.
+// returns: Path of the output file, to be freed, or NULL if allocation
+//          failed.
+//
+char *batch_out_name(const char *path, bool compressed) {
+  size_t len = strlen(path);
+  const char *suffix = compressed ? BATCH_RAW_SUFFIX : BATCH_SUFFIX;
+  if (compressed && has_suffix(path)) {
+    len -= strlen(BATCH_SUFFIX);
+    suffix = "";
+  }
+  char *name = (char *)malloc(len + strlen(suffix) + 1);
+  if (name == NULL) {
+    return (void *)0;
+  }
+  memcpy(name, path, len);
+  strcpy(name + len, suffix);
+  return name;
+}
+
+//
+// Takes the next file of a thread's own Share.
+//
+// s: Share of the thread.
+// index: Pointer to memory which stores the index of the file.
+// returns: True if a file was taken, false if the Share is empty.
+//
+static bool take(Share *s, uint32_t *index) {
+  bool found = false;
+  pthread_mutex_lock(&s->lock);
+  if (s->head < s->tail) {
+    *index = s->items[s->head++];
+    found = true;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return found;
+}
+
+//
+// Moves half of the files left in another thread's Share, from its end,
+// into the empty Share of a thread. Only the other Share is locked while
+// the files are copied: nothing reads an empty Share, so filling one needs
+// no lock, and no thread ever holds two locks.
+//
+// crew: Crew of the thread.
+// self: Index of the thread's Share.
+// returns: True if files were stolen, false if every Share is empty.
+//
+static bool steal(Crew *crew, uint32_t self) {
+  Share *own = &crew->shares[self];
+  for (uint32_t k = 1; k < crew->threads; k++) {
+    Share *victim = &crew->shares[(self + k) % crew->threads];
+    uint32_t half = 0;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail) {
+      half = (victim->tail - victim->head + 1) / 2;
+      victim->tail -= half;
+      memcpy(own->items, victim->items + victim->tail,
+          half * sizeof(uint32_t));
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (half > 0) {
+      pthread_mutex_lock(&own->lock);
+      own->head = 0;
+      own->tail = half;
+      pthread_mutex_unlock(&own->lock);
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Runs the job on files of a batch until no Share has any left. No files
+// are added once the batch starts, so a thread that finds every Share
+// empty is done, even while others finish their last file.
+//
+// arg: Worker of the thread.
+// returns: NULL.
+//
+static void *batch_worker(void *arg) {
+  Worker *w = (Worker *)arg;
+  Crew *crew = w->crew;
+  uint32_t index = 0;
+  while (true) {
+    if (!take(&crew->shares[w->self], &index)) {
+      if (!steal(crew, w->self)) {
+        break;
+      }
+      continue;
+    }
+    if (!crew->job(w->state, crew->list->paths[index])) {
+      w->failed++;
+    }
+  }
+  return NULL;
+}
+
+//
+// Orders files largest first, keeping the listed order of ties.
+//
+// a: First SizedFile.
+// b: Second SizedFile.
+// returns: Negative if a goes first, positive if b does.
+//
+static int by_size(const void *a, const void *b) {
+  const SizedFile *x = (const SizedFile *)a;
+  const SizedFile *y = (const SizedFile *)b;
+  if (x->size != y->size) {
+    return x->size > y->size ? -1 : 1;
+  }
+  return x->index < y->index ? -1 : 1;
+}
+
+//
+// Runs a job on every file of a BatchList, on a pool of threads.
+//
+// The files are dealt out largest first, and each thread works through
+// its own share from the largest down. A thread whose share runs out
+// steals half of what is left of another's, from the smallest up, so one
+// large file keeps a single thread busy while the others carry on.
+//
+// list: Files to run the job on.
+// threads: Number of threads, at least 1.
+// job: Job to run on each file.
+// states: State of each thread, passed to job.
+// returns: Number of files the job failed on.
+//
+uint32_t batch_run(const BatchList *list, uint32_t threads, BatchJob job,
+    void **states) {
+  if (list->count == 0) {
+    return 0;
+  }
+  threads = threads < list->count ? threads : list->count;
+
+  // Every Share holds at most as many files as it is dealt, as a thief
+  // takes at most half of a Share and only once its own is empty
+  uint32_t cap = (list->count + threads - 1) / threads;
+  SizedFile *sorted = (SizedFile *)malloc(list->count * sizeof(SizedFile));
+  Share *shares = (Share *)calloc(threads, sizeof(Share));
+  uint32_t *items = (uint32_t *)malloc(
+      (size_t)threads * cap * sizeof(uint32_t));
+  Worker *workers = (Worker *)calloc(threads, sizeof(Worker));
+  pthread_t *ids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (sorted == NULL || shares == NULL || items == NULL || workers == NULL ||
+      ids == NULL) {
+    free(sorted);
+    free(shares);
+    free(items);
+    free(workers);
+    free(ids);
+    return list->count;
+  }
+  for (uint32_t i = 0; i < list->count; i++) {
+    sorted[i].size = list->sizes[i];
+    sorted[i].index = i;
+  }
+  qsort(sorted, list->count, sizeof(SizedFile), by_size);
+
+  Crew crew = {list, shares, threads, job};
+  for (uint32_t t = 0; t < threads; t++) {
+    pthread_mutex_init(&shares[t].lock, NULL);
+    shares[t].items = items + (size_t)t * cap;
+  }
+  for (uint32_t i = 0; i < list->count; i++) {
+    Share *s = &shares[i % threads];
+    s->items[s->tail++] = sorted[i].index;
+  }
+  free(sorted);
+
+  // The first thread is this one. Threads that fail to start leave their
+  // share to be stolen by the rest
+  uint32_t started = 1;
+  for (uint32_t t = 0; t < threads; t++) {
+    workers[t].crew = &crew;
+    workers[t].self = t;
+    workers[t].state = states[t];
+  }
+  for (uint32_t t = 1; t < threads; t++) {
+    if (pthread_create(&ids[t], NULL, batch_worker, &workers[t]) != 0) {
+      break;
+    }
+    started++;
+  }
+  batch_worker(&workers[0]);
+  uint32_t failed = workers[0].failed;
+  for (uint32_t t = 1; t < started; t++) {
+    pthread_join(ids[t], NULL);
+    failed += workers[t].failed;
+  }
+
+  for (uint32_t t = 0; t < threads; t++) {
+    pthread_mutex_destroy(&shares[t].lock);
+  }
+  free(shares);
+  free(items);
+  free(workers);
+  free(ids);
+  return failed;
+}
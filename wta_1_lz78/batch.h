@@ -0,0 +1,121 @@
+//
+// Contains definitions for batch mode, which compresses or decompresses
+// many files in one process on a work stealing pool of threads
+//
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Suffix of the files batch mode compresses to
+#define BATCH_SUFFIX ".lz"
+
+// Suffix of the files batch mode decompresses to, when the compressed file
+// does not end with BATCH_SUFFIX
+#define BATCH_RAW_SUFFIX ".out"
+
+//
+// Struct definition of a BatchList, the files of a batch.
+//
+// paths: Path of each file.
+// sizes: Size of each file, which decides the order they are taken in.
+// count: Number of files.
+// cap: Number of files paths and sizes have room for.
+//
+typedef struct BatchList {
+  char **paths;
+  uint64_t *sizes;
+  uint32_t count;
+  uint32_t cap;
+} BatchList;
+
+//
+// Work done on one file of a batch by a worker thread.
+//
+// state: State of the worker, which only it uses, such as its encoder.
+// path: Path of the file.
+// returns: True on success, false if the file failed.
+//
+typedef bool (*BatchJob)(void *state, const char *path);
+
+//
+// Sets up an empty BatchList.
+//
+// list: BatchList to set up.
+// returns: Void.
+//
+void batch_list_init(BatchList *list);
+
+//
+// Frees the files of a BatchList.
+//
+// list: BatchList to free.
+// returns: Void.
+//
+void batch_list_free(BatchList *list);
+
+//
+// Adds a regular file to a BatchList, or, if recurse is set, every regular
+// file below a directory. Files found in a directory are only added if
+// they are compressed (end with BATCH_SUFFIX) when compressed is set, and
+// only if they are not otherwise, so a batch is not run over its own
+// output. Symbolic links found in a directory are skipped.
+//
+// list: BatchList to add to.
+// path: Path of the file or directory.
+// recurse: Whether to add the files below a directory.
+// compressed: Whether to pick compressed files out of directories.
+// returns: True on success, false if the path could not be read or
+//          memory ran out. The reason is printed.
+//
+bool batch_add(BatchList *list, const char *path, bool recurse,
+    bool compressed);
+
+//
+// Adds the files and directories named in a manifest, one path per line,
+// as batch_add does. Empty lines are skipped.
+//
+// list: BatchList to add to.
+// f: Manifest to read, such as stdin.
+// recurse: Whether to add the files below a directory.
+// compressed: Whether to pick compressed files out of directories.
+// returns: True on success, false if a path could not be read or memory
+//          ran out.
+//
+bool batch_add_manifest(BatchList *list, FILE *f, bool recurse,
+    bool compressed);
+
+//
+// Returns the path a file of a batch is written to: the path with
+// BATCH_SUFFIX added when compressing, and with it taken off (or with
+// BATCH_RAW_SUFFIX added if it has none) when decompressing.
+//
+// path: Path of the input file.
+// compressed: Whether the input file is compressed.
+// returns: Path of the output file, to be freed, or NULL if allocation
+//          failed.
+//
+char *batch_out_name(const char *path, bool compressed);
+
+//
+// Runs a job on every file of a BatchList, on a pool of threads.
+//
+// The files are dealt out largest first, and each thread works through
+// its own share from the largest down. A thread whose share runs out
+// steals half of what is left of another's, from the smallest up, so one
+// large file keeps a single thread busy while the others carry on.
+//
+// list: Files to run the job on.
+// threads: Number of threads, at least 1.
+// job: Job to run on each file.
+// states: State of each thread, passed to job.
+// returns: Number of files the job failed on.
+//
+uint32_t batch_run(const BatchList *list, uint32_t threads, BatchJob job,
+    void **states);
+
+#endif
@@ -0,0 +1,1056 @@
+//
+// Benchmarks for the Trie backends, the library and the encode and decode
+// programs
+//
+
+#include "code.h"
+#include "io.h"
+#include "lz78.h"
+#include "trie.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "s:r:pdmja:b:t:"
+
+#define MEGABYTE 0x100000
+
+// Number of pairs packed and unpacked per code width by the pair benchmark
+#define PAIRS (1 << 24)
+
+// Number of files in the small files corpus of the suite, and the size of
+// the largest
+#define SMALL_FILES 128
+#define SMALL_MAX 0x2000
+
+// Copy of the image the suite benchmarks, relative to this directory
+#define SAMPLE_PNG "../wta_2_py_image/sample.png"
+
+// Most corpora and encode arguments the suite handles
+#define SUITE_CORPORA 16
+#define SUITE_ARGS 16
+
+// Percent a metric of the suite may get worse by before it is flagged
+#define DEFAULT_SLACK 10
+
+// Longest path of a file the suite works with
+#define PATH_LEN 256
+
+//
+// Struct definition of a Corpus: a named, in-memory input to benchmark.
+//
+// name: Name of the Corpus to report.
+// data: Bytes of the Corpus.
+// len: Number of bytes in the Corpus.
+//
+typedef struct Corpus {
+  const char *name;
+  uint8_t *data;
+  uint64_t len;
+} Corpus;
+
+//
+// Struct definition of a RunStats, what one run of encode or decode cost.
+//
+// seconds: Wall clock time from fork to exit.
+// rss_kb: Peak resident set size in KB.
+// syscalls: Number of read and write system calls made.
+//
+typedef struct RunStats {
+  double seconds;
+  long rss_kb;
+  uint64_t syscalls;
+} RunStats;
+
+//
+// Struct definition of a SuiteResult, the suite's measurements of one
+// corpus. Speeds are from the fastest round, the rest from the worst.
+//
+// corpus: Name of the corpus.
+// files: Number of files in the corpus.
+// bytes: Number of bytes in the corpus.
+// compressed: Number of bytes the corpus compressed to.
+// encode_mb_s: MB of input encoded per second.
+// decode_mb_s: MB of input decoded per second.
+// encode_rss_kb: Peak resident set size of encode in KB.
+// decode_rss_kb: Peak resident set size of decode in KB.
+// encode_syscalls_per_mb: Read and write system calls of encode per MB.
+// decode_syscalls_per_mb: Read and write system calls of decode per MB.
+//
+typedef struct SuiteResult {
+  char corpus[32];
+  uint32_t files;
+  uint64_t bytes;
+  uint64_t compressed;
+  double encode_mb_s;
+  double decode_mb_s;
+  long encode_rss_kb;
+  long decode_rss_kb;
+  double encode_syscalls_per_mb;
+  double decode_syscalls_per_mb;
+} SuiteResult;
+
+// One SuiteResult as suite_print writes it, and as suite_load reads it
+static const char *result_format =
+    "    {\"corpus\": \"%s\", \"files\": %" PRIu32 ", \"bytes\": %" PRIu64
+    ", \"compressed\": %" PRIu64 ", \"encode_mb_s\": %.2f, "
+    "\"decode_mb_s\": %.2f, \"encode_rss_kb\": %ld, "
+    "\"decode_rss_kb\": %ld, \"encode_syscalls_per_mb\": %.2f, "
+    "\"decode_syscalls_per_mb\": %.2f}";
+static const char *result_scan =
+    " {\"corpus\": \"%31[^\"]\", \"files\": %" SCNu32 ", \"bytes\": %" SCNu64
+    ", \"compressed\": %" SCNu64 ", \"encode_mb_s\": %lf, "
+    "\"decode_mb_s\": %lf, \"encode_rss_kb\": %ld, "
+    "\"decode_rss_kb\": %ld, \"encode_syscalls_per_mb\": %lf, "
+    "\"decode_syscalls_per_mb\": %lf}";
+
+//
+// Returns the next value of a xorshift generator, so corpora are the same
+// on every run and every machine.
+//
+// state: Pointer to the state of the generator.
+// returns: The next pseudo-random value.
+//
+static uint64_t next_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+//
+// Fills a buffer with English-like text drawn from a small vocabulary.
+//
+// data: Buffer to fill.
+// len: Number of bytes to fill.
+// returns: Void.
+//
+static void make_text(uint8_t *data, uint64_t len) {
+  static const char *words[] = {"the", "trie", "of", "compression", "and",
+    "a", "code", "symbol", "to", "in", "dictionary", "is", "phrase", "that",
+    "encoder", "with", "decoder", "for", "stream", "bits", "as", "on", "it",
+    "word", "table", "by", "output", "input", "file", "buffer"};
+  uint64_t state = 0x5eed;
+  uint64_t i = 0;
+  while (i < len) {
+    const char *w = words[next_rand(&state) % (sizeof(words) / sizeof(*words))];
+    while (*w != '\0' && i < len) {
+      data[i++] = *w++;
+    }
+    if (i < len) {
+      data[i++] = next_rand(&state) % 12 == 0 ? '\n' : ' ';
+    }
+  }
+  return;
+}
+
+//
+// Fills a buffer with structured binary records: a counter, a small
+// bounded integer and a sparse flag word, all little endian.
+//
+// data: Buffer to fill.
+// len: Number of bytes to fill.
+// returns: Void.
+//
+static void make_binary(uint8_t *data, uint64_t len) {
+  uint64_t state = 0xb1a5;
+  uint32_t counter = 0;
+  for (uint64_t i = 0; i < len; i++) {
+    uint32_t field = (i / 4) % 3;
+    uint32_t value = 0;
+    if (field == 0) {
+      value = counter++;
+    } else if (field == 1) {
+      value = next_rand(&state) % 1000;
+    } else {
+      value = next_rand(&state) % 16 == 0 ? 0x80000001 : 0;
+    }
+    data[i] = value >> (8 * (i % 4));
+  }
+  return;
+}
+
+//
+// Fills a buffer with uniformly random bytes, which behave like data that
+// has already been compressed.
+//
+// data: Buffer to fill.
+// len: Number of bytes to fill.
+// returns: Void.
+//
+static void make_random(uint8_t *data, uint64_t len) {
+  uint64_t state = 0xc0ffee;
+  for (uint64_t i = 0; i < len; i++) {
+    data[i] = next_rand(&state) >> 56;
+  }
+  return;
+}
+
+//
+// Fills a buffer with JSON log lines, the kind of data services write:
+// fixed keys with timestamps, levels, ids and latencies that vary.
+//
+// data: Buffer to fill.
+// len: Number of bytes to fill.
+// returns: Void.
+//
+static void make_logs(uint8_t *data, uint64_t len) {
+  static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR"};
+  static const char *paths[] = {"/v1/items", "/v1/users", "/v1/orders",
+    "/healthz", "/v2/search"};
+  uint64_t state = 0x106;
+  uint64_t ms = 0;
+  uint64_t i = 0;
+  char line[256];
+  while (i < len) {
+    ms += next_rand(&state) % 50;
+    uint64_t status = next_rand(&state) % 20 == 0 ? 500 : 200;
+    int n = snprintf(line, sizeof(line),
+        "{\"ts\":\"2020-06-%02" PRIu64 "T%02" PRIu64 ":%02" PRIu64
+        ":%02" PRIu64 ".%03" PRIu64 "Z\",\"level\":\"%s\","
+        "\"service\":\"api\",\"path\":\"%s/%" PRIu64 "\",\"user\":%" PRIu64
+        ",\"status\":%" PRIu64 ",\"latency_ms\":%" PRIu64 "}\n",
+        1 + ms / 86400000 % 28, ms / 3600000 % 24, ms / 60000 % 60,
+        ms / 1000 % 60, ms % 1000, levels[next_rand(&state) % 5],
+        paths[next_rand(&state) % 5], next_rand(&state) % 10000,
+        next_rand(&state) % 100000, status, next_rand(&state) % 300);
+    for (int k = 0; k < n && i < len; k++) {
+      data[i++] = line[k];
+    }
+  }
+  return;
+}
+
+//
+// Reads a whole file into memory as a Corpus.
+//
+// name: Name of the file to read.
+// corpus: Pointer to the Corpus to fill.
+// returns: True if the file was read, false otherwise.
+//
+static bool load_file(const char *name, Corpus *corpus) {
+  FILE *f = fopen(name, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fileno(f), &sb) == -1 || sb.st_size <= 0) {
+    fclose(f);
+    return false;
+  }
+  corpus->name = name;
+  corpus->len = sb.st_size;
+  corpus->data = (uint8_t *)malloc(corpus->len);
+  bool ok = corpus->data != NULL &&
+            fread(corpus->data, 1, corpus->len, f) == corpus->len;
+  fclose(f);
+  return ok;
+}
+
+//
+// Returns the current time in seconds from a monotonic clock.
+//
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Parses a buffer into phrases the same way encode.c does, without I/O.
+//
+// t: Trie to parse with.
+// data: Bytes to parse.
+// len: Number of bytes to parse.
+// returns: Number of (code, symbol) pairs the encoder would emit.
+//
+static uint64_t parse(Trie *t, const uint8_t *data, uint64_t len) {
+  TrieNode *curr_node = t->root;
+  uint32_t next_code = START_CODE;
+  uint64_t pairs = 0;
+  for (uint64_t i = 0; i < len; i++) {
+    TrieNode *next_node = trie_step(t, curr_node, data[i]);
+    if (next_node != NULL) {
+      curr_node = next_node;
+      continue;
+    }
+    trie_insert(t, curr_node, data[i], next_code);
+    curr_node = t->root;
+    pairs++;
+    next_code++;
+    if (next_code >= MAX_CODE) {
+      trie_reset(t);
+      next_code = START_CODE;
+    }
+  }
+  return pairs + (curr_node != t->root);
+}
+
+//
+// Benchmarks one backend on one Corpus in a child process, so the peak
+// resident set size reported belongs to that backend alone.
+//
+// backend: Backend to benchmark.
+// corpus: Corpus to parse.
+// rounds: Number of times to parse the Corpus; the fastest round counts.
+// returns: Void.
+//
+static void run(TrieBackend backend, Corpus *corpus, uint32_t rounds) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    Trie *t = trie_create(backend, DEFAULT_CODE_BITS);
+    if (t == NULL) {
+      _exit(1);
+    }
+    double best = 0;
+    uint64_t pairs = 0;
+    for (uint32_t r = 0; r < rounds; r++) {
+      trie_reset(t);
+      double start = now();
+      pairs = parse(t, corpus->data, corpus->len);
+      double elapsed = now() - start;
+      if (r == 0 || elapsed < best) {
+        best = elapsed;
+      }
+    }
+    printf("%-8s %-16s %10.1f %10" PRIu64, trie_backend_name(backend),
+        corpus->name, corpus->len / best / MEGABYTE, pairs);
+    fflush(stdout);
+    trie_delete(t);
+    _exit(0);
+  }
+  int status = 0;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) == -1 || status != 0) {
+    printf("%-8s %-16s failed\n", trie_backend_name(backend), corpus->name);
+    return;
+  }
+  printf(" %12ld\n", usage.ru_maxrss);
+  return;
+}
+
+//
+// Benchmarks buffer_pair and read_pair at one code width, packing into and
+// unpacking from memory so no I/O is timed.
+//
+// bitlen: Width in bits of the codes to pack and unpack.
+// rounds: Number of times to pack and unpack; the fastest round counts.
+// returns: Void.
+//
+static void run_pairs(uint8_t bitlen, uint32_t rounds) {
+  // Pairs are drawn from a small table so the loops time only the packing
+  uint32_t codes[ALPHABET];
+  uint8_t syms[ALPHABET];
+  uint64_t state = 0x9a125 + bitlen;
+  for (uint32_t i = 0; i < ALPHABET; i++) {
+    codes[i] = next_rand(&state) & ((1u << bitlen) - 1);
+    syms[i] = next_rand(&state);
+  }
+  uint8_t *packed = (uint8_t *)malloc((size_t)PAIRS * 4 + 8);
+  if (packed == NULL) {
+    printf("%5u failed\n", bitlen);
+    return;
+  }
+  double pack = 0;
+  double unpack = 0;
+  for (uint32_t r = 0; r < rounds; r++) {
+    PairWriter w = {packed, 0, 0, 0, 0, NULL, NULL, 0, 0};
+    double start = now();
+    for (uint32_t i = 0; i < PAIRS; i++) {
+      buffer_pair(&w, codes[i % ALPHABET], syms[i % ALPHABET], bitlen);
+    }
+    flush_pairs(&w);
+    double elapsed = now() - start;
+    pack = r == 0 || elapsed < pack ? elapsed : pack;
+
+    PairReader reader = {packed, w.len, 0, 0, 0, NULL, NULL, 0, 0};
+    uint32_t code = 0;
+    uint8_t sym = 0;
+    bool ok = true;
+    start = now();
+    for (uint32_t i = 0; i < PAIRS; i++) {
+      ok &= read_pair(&reader, &code, &sym, bitlen);
+      ok &= code == codes[i % ALPHABET] && sym == syms[i % ALPHABET];
+    }
+    elapsed = now() - start;
+    unpack = r == 0 || elapsed < unpack ? elapsed : unpack;
+    if (!ok) {
+      printf("%5u failed\n", bitlen);
+      free(packed);
+      return;
+    }
+  }
+  printf("%5u %14.1f %14.1f\n", bitlen, PAIRS / pack / 1e6,
+      PAIRS / unpack / 1e6);
+  free(packed);
+  return;
+}
+
+//
+// Benchmarks compressing and decompressing one Corpus in memory with a
+// given dictionary size and mode, in a child process so the peak resident
+// set size reported belongs to those options alone.
+//
+// code_bits: Dictionary size in bits.
+// mode: How phrases are sent.
+// corpus: Corpus to compress.
+// rounds: Number of times to compress; the fastest round counts.
+// returns: Void.
+//
+static void run_dict(uint8_t code_bits, CodecMode mode, Corpus *corpus,
+    uint32_t rounds) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    lz78_options opts;
+    lz78_options_default(&opts);
+    opts.code_bits = code_bits;
+    opts.mode = mode;
+    lz78_encoder *e = lz78_encoder_create(&opts);
+    lz78_decoder *d = lz78_decoder_create();
+    // A pair takes at most 4 bytes and holds at least one byte of input
+    uint64_t cap = corpus->len * 4 + 2 * LZ78_MIN_OUT;
+    uint8_t *comp = (uint8_t *)malloc(cap);
+    uint8_t *raw = (uint8_t *)malloc(corpus->len + 1);
+    if (e == NULL || d == NULL || comp == NULL || raw == NULL) {
+      _exit(1);
+    }
+    double best_comp = 0;
+    double best_decomp = 0;
+    uint64_t comp_len = 0;
+    for (uint32_t r = 0; r < rounds; r++) {
+      lz78_encoder_reset(e, true);
+      size_t used = 0;
+      size_t pos = 0;
+      int64_t len = 0;
+      double start = now();
+      // The encoder may take the input in parts while its Trie grows
+      while (pos < corpus->len && len >= 0) {
+        int64_t part = lz78_compress(e, corpus->data + pos, corpus->len - pos,
+            &used, comp + len, cap - len);
+        len = part < 0 ? part : len + part;
+        pos += used;
+      }
+      int64_t last = len < 0 ? len : lz78_compress_finish(e, comp + len,
+          cap - len);
+      double elapsed = now() - start;
+      if (last < 0) {
+        _exit(1);
+      }
+      comp_len = len + last;
+      best_comp = r == 0 || elapsed < best_comp ? elapsed : best_comp;
+
+      lz78_decoder_reset(d, NULL);
+      start = now();
+      len = lz78_decompress(d, comp, comp_len, &used, raw, corpus->len + 1);
+      elapsed = now() - start;
+      if (len != (int64_t)corpus->len || !lz78_decoder_done(d) ||
+          memcmp(raw, corpus->data, corpus->len) != 0) {
+        _exit(1);
+      }
+      best_decomp = r == 0 || elapsed < best_decomp ? elapsed : best_decomp;
+    }
+    float ratio = 100.0 * ((float)1 - (float)comp_len / corpus->len);
+    printf("%5u %-5s %-16s %8.2f %10.1f %10.1f", code_bits,
+        lz78_mode_name(mode), corpus->name, ratio,
+        corpus->len / best_comp / MEGABYTE,
+        corpus->len / best_decomp / MEGABYTE);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status = 0;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) == -1 || status != 0) {
+    printf("%5u %-5s %-16s failed\n", code_bits, lz78_mode_name(mode),
+        corpus->name);
+    return;
+  }
+  printf(" %12ld\n", usage.ru_maxrss);
+  return;
+}
+
+//
+// Returns the number of read and write system calls an exited, not yet
+// reaped, process made, from /proc.
+//
+// pid: Process to look up.
+// returns: Number of system calls, 0 if /proc does not say.
+//
+static uint64_t proc_syscalls(pid_t pid) {
+  char path[PATH_LEN];
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  uint64_t total = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    uint64_t count = 0;
+    if (sscanf(line, "syscr: %" SCNu64, &count) == 1 ||
+        sscanf(line, "syscw: %" SCNu64, &count) == 1) {
+      total += count;
+    }
+  }
+  fclose(f);
+  return total;
+}
+
+//
+// Runs encode or decode to completion and measures it. The process is
+// left unreaped until its system calls have been read from /proc.
+//
+// argv: Arguments of the program, argv[0] being its path.
+// stats: Pointer to memory which stores the measurements.
+// returns: True if the program ran and exited with status 0.
+//
+static bool run_tool(char **argv, RunStats *stats) {
+  fflush(stdout);
+  double start = now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  siginfo_t info;
+  if (pid < 0 || waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1) {
+    return false;
+  }
+  stats->seconds = now() - start;
+  stats->syscalls = proc_syscalls(pid);
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) == -1) {
+    return false;
+  }
+  stats->rss_kb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//
+// Writes a buffer to a new file.
+//
+// path: Path of the file.
+// data: Bytes to write.
+// len: Number of bytes to write.
+// returns: True if the file was written, false otherwise.
+//
+static bool save_file(const char *path, const uint8_t *data, uint64_t len) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fwrite(data, 1, len, f) == len;
+  return fclose(f) == 0 && ok;
+}
+
+//
+// Checks that two files hold the same bytes.
+//
+// a: Path of the first file.
+// b: Path of the second file.
+// returns: True if the files match, false otherwise.
+//
+static bool same_files(const char *a, const char *b) {
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  bool ok = fa != NULL && fb != NULL;
+  static uint8_t buf_a[0x10000];
+  static uint8_t buf_b[0x10000];
+  while (ok) {
+    size_t got_a = fread(buf_a, 1, sizeof(buf_a), fa);
+    size_t got_b = fread(buf_b, 1, sizeof(buf_b), fb);
+    ok = got_a == got_b && memcmp(buf_a, buf_b, got_a) == 0;
+    if (got_a == 0) {
+      break;
+    }
+  }
+  if (fa != NULL) {
+    fclose(fa);
+  }
+  if (fb != NULL) {
+    fclose(fb);
+  }
+  return ok;
+}
+
+//
+// Returns the size of a file.
+//
+// path: Path of the file.
+// returns: Size of the file in bytes, 0 if it cannot be found.
+//
+static uint64_t file_size(const char *path) {
+  struct stat sb;
+  return stat(path, &sb) == 0 ? (uint64_t)sb.st_size : 0;
+}
+
+//
+// Benchmarks encode and decode on the files of one corpus, found in dir
+// as name-0, name-1 and so on, running each through both programs once
+// per round. The output of decode is checked against the input every
+// round.
+//
+// dir: Directory the files are in.
+// name: Name of the corpus.
+// nfiles: Number of files.
+// args: Extra arguments for encode.
+// nargs: Number of extra arguments.
+// rounds: Number of rounds.
+// res: Pointer to memory which stores the result.
+// returns: True on success, false if a program failed or got it wrong.
+//
+static bool suite_run(const char *dir, const char *name, uint32_t nfiles,
+    char **args, uint32_t nargs, uint32_t rounds, SuiteResult *res) {
+  memset(res, 0, sizeof(*res));
+  snprintf(res->corpus, sizeof(res->corpus), "%s", name);
+  res->files = nfiles;
+  char raw[PATH_LEN];
+  char comp[PATH_LEN + 8];
+  char out[PATH_LEN + 8];
+  char *enc_argv[SUITE_ARGS + 6];
+  char *dec_argv[] = {"./decode", "-i", comp, "-o", out, NULL};
+  enc_argv[0] = "./encode";
+  memcpy(enc_argv + 1, args, nargs * sizeof(char *));
+  enc_argv[nargs + 1] = "-i";
+  enc_argv[nargs + 2] = raw;
+  enc_argv[nargs + 3] = "-o";
+  enc_argv[nargs + 4] = comp;
+  enc_argv[nargs + 5] = NULL;
+
+  double enc_best = 0;
+  double dec_best = 0;
+  uint64_t enc_calls = 0;
+  uint64_t dec_calls = 0;
+  bool ok = true;
+  for (uint32_t r = 0; r < rounds && ok; r++) {
+    double enc_time = 0;
+    double dec_time = 0;
+    res->bytes = 0;
+    res->compressed = 0;
+    enc_calls = 0;
+    dec_calls = 0;
+    for (uint32_t i = 0; i < nfiles && ok; i++) {
+      snprintf(raw, sizeof(raw), "%s/%s-%" PRIu32, dir, name, i);
+      snprintf(comp, sizeof(comp), "%s.lz", raw);
+      snprintf(out, sizeof(out), "%s.out", raw);
+      RunStats enc;
+      RunStats dec;
+      ok = run_tool(enc_argv, &enc) && run_tool(dec_argv, &dec) &&
+           same_files(raw, out);
+      if (ok) {
+        res->bytes += file_size(raw);
+        res->compressed += file_size(comp);
+        enc_time += enc.seconds;
+        dec_time += dec.seconds;
+        enc_calls += enc.syscalls;
+        dec_calls += dec.syscalls;
+        res->encode_rss_kb =
+            enc.rss_kb > res->encode_rss_kb ? enc.rss_kb : res->encode_rss_kb;
+        res->decode_rss_kb =
+            dec.rss_kb > res->decode_rss_kb ? dec.rss_kb : res->decode_rss_kb;
+      }
+      unlink(comp);
+      unlink(out);
+    }
+    enc_best = r == 0 || enc_time < enc_best ? enc_time : enc_best;
+    dec_best = r == 0 || dec_time < dec_best ? dec_time : dec_best;
+  }
+  double mb = (double)res->bytes / MEGABYTE;
+  res->encode_mb_s = enc_best > 0 ? mb / enc_best : 0;
+  res->decode_mb_s = dec_best > 0 ? mb / dec_best : 0;
+  res->encode_syscalls_per_mb = mb > 0 ? enc_calls / mb : 0;
+  res->decode_syscalls_per_mb = mb > 0 ? dec_calls / mb : 0;
+  return ok;
+}
+
+//
+// Reads the results of a run of the suite saved by suite_print.
+//
+// path: Path of the saved run.
+// results: Memory for up to SUITE_CORPORA results.
+// returns: Number of results read, 0 if the file cannot be read.
+//
+static uint32_t suite_load(const char *path, SuiteResult *results) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  uint32_t count = 0;
+  char line[1024];
+  while (count < SUITE_CORPORA && fgets(line, sizeof(line), f) != NULL) {
+    SuiteResult *r = &results[count];
+    if (sscanf(line, result_scan, r->corpus, &r->files, &r->bytes,
+            &r->compressed, &r->encode_mb_s, &r->decode_mb_s,
+            &r->encode_rss_kb, &r->decode_rss_kb, &r->encode_syscalls_per_mb,
+            &r->decode_syscalls_per_mb) == 10) {
+      count++;
+    }
+  }
+  fclose(f);
+  return count;
+}
+
+//
+// Prints one regression of the suite as a JSON object.
+//
+// first: True if it is the first regression printed.
+// corpus: Name of the corpus.
+// metric: Name of the metric that got worse.
+// base: Value of the metric in the baseline.
+// curr: Value of the metric now.
+// returns: Void.
+//
+static void print_regression(bool first, const char *corpus,
+    const char *metric, double base, double curr) {
+  printf("%s\n    {\"corpus\": \"%s\", \"metric\": \"%s\", "
+         "\"baseline\": %.2f, \"current\": %.2f}",
+      first ? "" : ",", corpus, metric, base, curr);
+  return;
+}
+
+//
+// Prints the results of the suite as JSON, followed by every metric that
+// got worse than in the baseline by more than slack percent. Compressed
+// sizes do not vary between runs, so any growth of more than 0.1% is
+// flagged. Resident set sizes and system calls are given a little more
+// room, as small values vary in absolute terms.
+//
+// results: Results of this run.
+// count: Number of results.
+// base: Results of the baseline, or NULL.
+// base_count: Number of baseline results.
+// slack: Percent a speed, size or count may get worse by.
+// args: Extra arguments encode was run with, as given.
+// rounds: Number of rounds.
+// returns: Number of regressions.
+//
+static uint32_t suite_print(SuiteResult *results, uint32_t count,
+    SuiteResult *base, uint32_t base_count, double slack, const char *args,
+    uint32_t rounds) {
+  printf("{\n  \"encode_args\": \"%s\",\n  \"rounds\": %" PRIu32 ",\n"
+         "  \"results\": [",
+      args, rounds);
+  for (uint32_t i = 0; i < count; i++) {
+    SuiteResult *r = &results[i];
+    printf(i == 0 ? "\n" : ",\n");
+    printf(result_format, r->corpus, r->files, r->bytes, r->compressed,
+        r->encode_mb_s, r->decode_mb_s, r->encode_rss_kb, r->decode_rss_kb,
+        r->encode_syscalls_per_mb, r->decode_syscalls_per_mb);
+  }
+  printf("\n  ]");
+
+  uint32_t regressions = 0;
+  if (base != NULL) {
+    double lo = 1 - slack / 100;
+    double hi = 1 + slack / 100;
+    printf(",\n  \"regressions\": [");
+    for (uint32_t i = 0; i < count; i++) {
+      SuiteResult *r = &results[i];
+      SuiteResult *b = NULL;
+      for (uint32_t j = 0; j < base_count && b == NULL; j++) {
+        b = strcmp(base[j].corpus, r->corpus) == 0 ? &base[j] : NULL;
+      }
+      if (b == NULL) {
+        continue;
+      }
+      struct {
+        const char *metric;
+        double base;
+        double curr;
+        bool worse;
+      } checks[] = {
+          {"compressed", b->compressed, r->compressed,
+              r->compressed > b->compressed + b->compressed / 1000},
+          {"encode_mb_s", b->encode_mb_s, r->encode_mb_s,
+              r->encode_mb_s < b->encode_mb_s * lo},
+          {"decode_mb_s", b->decode_mb_s, r->decode_mb_s,
+              r->decode_mb_s < b->decode_mb_s * lo},
+          {"encode_rss_kb", b->encode_rss_kb, r->encode_rss_kb,
+              r->encode_rss_kb > b->encode_rss_kb * hi + 1024},
+          {"decode_rss_kb", b->decode_rss_kb, r->decode_rss_kb,
+              r->decode_rss_kb > b->decode_rss_kb * hi + 1024},
+          {"encode_syscalls_per_mb", b->encode_syscalls_per_mb,
+              r->encode_syscalls_per_mb,
+              r->encode_syscalls_per_mb > b->encode_syscalls_per_mb * hi + 1},
+          {"decode_syscalls_per_mb", b->decode_syscalls_per_mb,
+              r->decode_syscalls_per_mb,
+              r->decode_syscalls_per_mb > b->decode_syscalls_per_mb * hi + 1},
+      };
+      for (uint32_t k = 0; k < sizeof(checks) / sizeof(*checks); k++) {
+        if (checks[k].worse) {
+          print_regression(regressions++ == 0, r->corpus, checks[k].metric,
+              checks[k].base, checks[k].curr);
+        }
+      }
+    }
+    printf("\n  ]");
+  }
+  printf("\n}\n");
+  return regressions;
+}
+
+//
+// Runs the suite: generates text, log, random, zero and small file
+// corpora, adds the sample image, and benchmarks the encode and decode
+// programs of this directory on each of them.
+//
+// size: Number of bytes in each generated corpus.
+// rounds: Number of rounds per corpus.
+// args: Extra arguments for encode, separated by spaces, or NULL.
+// baseline: Path of a saved run to compare with, or NULL.
+// slack: Percent a metric may get worse by before it is flagged.
+// returns: 0 on success, 1 if there were regressions, -1 on failure.
+//
+static int suite(uint64_t size, uint32_t rounds, const char *args,
+    const char *baseline, double slack) {
+  char *split[SUITE_ARGS];
+  uint32_t nargs = 0;
+  char *arg_copy = strdup(args != NULL ? args : "");
+  for (char *tok = strtok(arg_copy, " "); tok != NULL && nargs < SUITE_ARGS;
+       tok = strtok(NULL, " ")) {
+    split[nargs++] = tok;
+  }
+
+  SuiteResult base[SUITE_CORPORA];
+  uint32_t base_count = 0;
+  if (baseline != NULL && (base_count = suite_load(baseline, base)) == 0) {
+    fprintf(stderr, "Unable to read baseline %s.\n", baseline);
+    return -1;
+  }
+
+  char dir[] = "/tmp/lz78-bench-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "Unable to make a directory to work in.\n");
+    return -1;
+  }
+
+  // Every corpus is written out and freed before anything is run, as a
+  // forked child starts out with the peak resident set size of this
+  // process. The small files are cut from text and logs.
+  const char *names[] = {"text", "logs", "random", "zeros", "small", "png"};
+  uint32_t files[] = {1, 1, 1, 1, SMALL_FILES, 1};
+  uint32_t count = 0;
+  bool ok = true;
+  uint8_t *gen[2] = {NULL, NULL};
+  for (uint32_t i = 0; i < 4 && ok; i++) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s-0", dir, names[i]);
+    uint8_t *data = (uint8_t *)calloc(size, 1);
+    if (i == 0 && data != NULL) {
+      make_text(data, size);
+    } else if (i == 1 && data != NULL) {
+      make_logs(data, size);
+    } else if (i == 2 && data != NULL) {
+      make_random(data, size);
+    }
+    ok = data != NULL && save_file(path, data, size);
+    if (i < 2) {
+      gen[i] = data;
+    } else {
+      free(data);
+    }
+  }
+  uint64_t state = 0x5a11;
+  for (uint32_t i = 0; i < SMALL_FILES && ok; i++) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/small-%" PRIu32, dir, i);
+    uint64_t len = 1 + next_rand(&state) % SMALL_MAX;
+    len = len < size ? len : size;
+    uint64_t from = next_rand(&state) % (size - len + 1);
+    ok = save_file(path, gen[i % 2] + from, len);
+  }
+  free(gen[0]);
+  free(gen[1]);
+  Corpus png = {NULL, NULL, 0};
+  bool has_png = ok && load_file(SAMPLE_PNG, &png);
+  if (has_png) {
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/png-0", dir);
+    ok = save_file(path, png.data, png.len);
+  } else if (ok) {
+    fprintf(stderr, "Unable to read %s, skipping it.\n", SAMPLE_PNG);
+  }
+  free(png.data);
+
+  SuiteResult results[SUITE_CORPORA];
+  for (uint32_t i = 0; i < 6 && ok; i++) {
+    if (i < 5 || has_png) {
+      ok = suite_run(dir, names[i], files[i], split, nargs, rounds,
+          &results[count++]);
+    }
+  }
+  for (uint32_t i = 0; i < 6; i++) {
+    for (uint32_t k = 0; k < files[i]; k++) {
+      char path[PATH_LEN];
+      snprintf(path, sizeof(path), "%s/%s-%" PRIu32, dir, names[i], k);
+      unlink(path);
+    }
+  }
+  rmdir(dir);
+  if (!ok) {
+    fprintf(stderr, "%s failed; are encode and decode built?\n",
+        count > 0 ? results[count - 1].corpus : "Writing the corpora");
+    free(arg_copy);
+    return -1;
+  }
+
+  uint32_t regressions = suite_print(results, count,
+      baseline != NULL ? base : NULL, base_count, slack,
+      args != NULL ? args : "", rounds);
+  free(arg_copy);
+  return regressions > 0 ? 1 : 0;
+}
+
+//
+// Default entry to program
+//
+// Generates text, binary and random corpora, adds any files named on the
+// command line, and reports parse speed and peak memory of each backend.
+// With "-p", reports how many pairs per second are packed and unpacked at
+// each code width instead. With "-d", reports ratio and speed at each
+// dictionary size, on each corpus and on all of them joined together, and
+// with "-m" in each mode at the default dictionary size. With "-j", runs
+// the suite of the encode and decode programs instead and reports it as
+// JSON, passing the arguments given with "-a" to encode, and comparing
+// with the saved run given with "-b".
+//
+int main(int argc, char **argv) {
+  uint64_t size = 8 * MEGABYTE;
+  uint32_t rounds = 3;
+  bool pairs = false;
+  bool dicts = false;
+  bool modes = false;
+  bool json = false;
+  const char *args = NULL;
+  const char *baseline = NULL;
+  double slack = DEFAULT_SLACK;
+
+  int c = 0;
+  while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+    if (c == 's') {
+      size = strtoull(optarg, NULL, 10) * MEGABYTE;
+    } else if (c == 'r') {
+      rounds = strtoul(optarg, NULL, 10);
+    } else if (c == 'p') {
+      pairs = true;
+    } else if (c == 'd') {
+      dicts = true;
+    } else if (c == 'm') {
+      modes = true;
+    } else if (c == 'j') {
+      json = true;
+    } else if (c == 'a') {
+      args = optarg;
+    } else if (c == 'b') {
+      baseline = optarg;
+    } else if (c == 't') {
+      slack = strtod(optarg, NULL);
+    }
+  }
+  if (size == 0 || rounds == 0) {
+    printf("Corpus size and rounds must be positive.\n");
+    return -1;
+  }
+
+  if (json) {
+    return suite(size, rounds, args, baseline, slack);
+  }
+
+  if (pairs) {
+    printf("%5s %14s %14s\n", "width", "pack_Mpairs/s", "unpack_Mpairs/s");
+    for (uint8_t bitlen = 1; bitlen <= MAX_CODE_BITS; bitlen++) {
+      run_pairs(bitlen, rounds);
+    }
+    return 0;
+  }
+
+  uint32_t count = 3 + (argc - optind);
+  Corpus *corpora = (Corpus *)calloc(count, sizeof(Corpus));
+  if (corpora == NULL) {
+    printf("Failed to allocate corpora.\n");
+    return -1;
+  }
+  corpora[0].name = "text";
+  corpora[1].name = "binary";
+  corpora[2].name = "random";
+  for (uint32_t i = 0; i < 3; i++) {
+    corpora[i].len = size;
+    corpora[i].data = (uint8_t *)malloc(size);
+    if (corpora[i].data == NULL) {
+      printf("Failed to allocate corpus.\n");
+      return -1;
+    }
+  }
+  make_text(corpora[0].data, size);
+  make_binary(corpora[1].data, size);
+  make_random(corpora[2].data, size);
+  for (int i = optind; i < argc; i++) {
+    if (!load_file(argv[i], &corpora[3 + i - optind])) {
+      printf("Unable to read %s.\n", argv[i]);
+      return -1;
+    }
+  }
+
+  if (dicts || modes) {
+    // The mixed corpus is every other corpus, one after another
+    Corpus mixed = {"mixed", NULL, 0};
+    for (uint32_t i = 0; i < count; i++) {
+      mixed.len += corpora[i].len;
+    }
+    mixed.data = (uint8_t *)malloc(mixed.len);
+    if (mixed.data == NULL) {
+      printf("Failed to allocate corpus.\n");
+      return -1;
+    }
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(mixed.data + pos, corpora[i].data, corpora[i].len);
+      pos += corpora[i].len;
+    }
+    printf("%5s %-5s %-16s %8s %10s %10s %12s\n", "bits", "mode", "corpus",
+        "saved_%", "comp_MB/s", "dec_MB/s", "peak_rss_kb");
+    for (uint32_t i = 0; i <= count; i++) {
+      Corpus *corpus = i < count ? &corpora[i] : &mixed;
+      if (modes) {
+        for (CodecMode mode = MODE_LZ78; mode <= MODE_LZAP; mode++) {
+          run_dict(DEFAULT_CODE_BITS, mode, corpus, rounds);
+        }
+        continue;
+      }
+      for (uint8_t bits = MIN_CODE_BITS; bits <= MAX_CODE_BITS; bits += 2) {
+        run_dict(bits, MODE_LZ78, corpus, rounds);
+      }
+    }
+    free(mixed.data);
+  } else {
+    printf("%-8s %-16s %10s %10s %12s\n", "backend", "corpus", "MB/s",
+        "pairs", "peak_rss_kb");
+    TrieBackend backends[] = {TRIE_DENSE, TRIE_HYBRID, TRIE_HASH};
+    for (uint32_t i = 0; i < count; i++) {
+      for (uint32_t b = 0; b < sizeof(backends) / sizeof(*backends); b++) {
+        run(backends[b], &corpora[i], rounds);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    free(corpora[i].data);
+  }
+  free(corpora);
+  return 0;
+}
@@ -0,0 +1,944 @@
+//
+// Round trip and regression checks for the library, run by "make check":
+// every mode, policy, backend and level through the streaming and one-shot
+// APIs, files written by the original encode, and truncated or corrupt
+// input
+//
+
+#include "code.h"
+#include "dict.h"
+#include "frame.h"
+#include "io.h"
+#include "lz78.h"
+#include "pipe.h"
+#include "trie.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "w:"
+
+// Bytes fed to each streaming call, and room given for its output, the
+// least the API allows, so that every phrase and pair straddles a call
+#define CHUNK_IN 1
+#define CHUNK_OUT LZ78_MIN_OUT
+
+// Room given to each call when a stream is fed whole
+#define WHOLE_OUT OUT_BLOCK
+
+// Files of the original encode in the testdata directory, and the inputs
+// they were made from, see make_input
+#define BASE_TEXT "base-text.lz"
+#define BASE_RANDOM "base-random.lz"
+#define BASE_TEXT_LEN 60000
+#define BASE_RANDOM_LEN 100000
+
+// Longest path of a file the checks read
+#define PATH_LEN 256
+
+// Compressed bytes every truncation of is decoded, after which a spread of
+// truncations is, and the bits flipped one at a time, of each stream
+#define CORRUPT_BYTES 2048
+#define CORRUPT_FLIPS 512
+
+// Kinds of input make_input makes
+#define INPUT_TEXT 0
+#define INPUT_BINARY 1
+#define INPUT_RANDOM 2
+#define INPUT_ZEROS 3
+
+//
+// Struct definition of an Input to check with.
+//
+// name: Name of the Input to report.
+// data: Bytes of the Input.
+// len: Number of bytes in the Input.
+//
+typedef struct Input {
+  const char *name;
+  uint8_t *data;
+  uint64_t len;
+} Input;
+
+//
+// Struct definition of a Buffer, which output is gathered into.
+//
+// bytes: Bytes gathered.
+// len: Number of bytes gathered.
+// cap: Number of bytes bytes has room for.
+//
+typedef struct Buffer {
+  uint8_t *bytes;
+  uint64_t len;
+  uint64_t cap;
+} Buffer;
+
+// Number of checks made, and of those that failed
+static uint64_t checks = 0;
+static uint64_t failures = 0;
+
+//
+// Records the result of a check, printing the ones that fail.
+//
+// ok: Whether the check passed.
+// what: What was checked.
+// name: Name of the case checked.
+// returns: ok.
+//
+static bool expect(bool ok, const char *what, const char *name) {
+  checks++;
+  if (!ok) {
+    failures++;
+    printf("FAIL: %s: %s\n", name, what);
+  }
+  return ok;
+}
+
+//
+// Returns the next value of a xorshift generator, so inputs are the same
+// on every run and every machine.
+//
+// state: Pointer to the state of the generator.
+// returns: The next pseudo-random value.
+//
+static uint64_t next_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+//
+// Makes an input of one of the INPUT_ kinds: English-like text drawn from
+// a small vocabulary, structured binary records, uniformly random bytes,
+// or zeros.
+//
+// kind: One of the INPUT_ kinds.
+// len: Number of bytes to make.
+// returns: Pointer to the bytes, which the caller frees, or NULL if
+//          allocation failed.
+//
+static uint8_t *make_input(int kind, uint64_t len) {
+  static const char *words[] = {"the", "trie", "of", "compression", "and",
+    "a", "code", "symbol", "to", "in", "dictionary", "is", "phrase", "that",
+    "encoder", "with", "decoder", "for", "stream", "bits", "as", "on", "it",
+    "word", "table", "by", "output", "input", "file", "buffer"};
+  uint8_t *data = (uint8_t *)calloc(len + 1, 1);
+  if (data == NULL) {
+    return (void *)0;
+  }
+  uint64_t state = 0x5eed + kind;
+  uint64_t i = 0;
+  while (kind == INPUT_TEXT && i < len) {
+    const char *w = words[next_rand(&state) % (sizeof(words) / sizeof(*words))];
+    while (*w != '\0' && i < len) {
+      data[i++] = *w++;
+    }
+    if (i < len) {
+      data[i++] = next_rand(&state) % 12 == 0 ? '\n' : ' ';
+    }
+  }
+  for (; kind == INPUT_BINARY && i < len; i++) {
+    uint32_t field = (i / 4) % 3;
+    uint32_t value = (uint32_t)(i / 12);
+    if (field == 1) {
+      value = next_rand(&state) % 1000;
+    } else if (field == 2) {
+      value = next_rand(&state) % 16 == 0 ? 0x80000001 : 0;
+    }
+    data[i] = value >> (8 * (i % 4));
+  }
+  for (; kind == INPUT_RANDOM && i < len; i++) {
+    data[i] = next_rand(&state) >> 56;
+  }
+  return data;
+}
+
+//
+// Makes sure a Buffer has room for len more bytes.
+//
+// b: Buffer to grow.
+// len: Number of bytes needed after b->len.
+// returns: True on success, false if memory ran out.
+//
+static bool reserve(Buffer *b, uint64_t len) {
+  if (b->cap - b->len < len) {
+    uint64_t cap = b->cap * 2 + len;
+    uint8_t *bytes = (uint8_t *)realloc(b->bytes, cap);
+    if (bytes == NULL) {
+      return false;
+    }
+    b->bytes = bytes;
+    b->cap = cap;
+  }
+  return true;
+}
+
+//
+// Compresses an input as one stream, chunk bytes per call with room bytes
+// of room for each call's output.
+//
+// e: Encoder of the stream, at its start.
+// in: Bytes to compress.
+// in_len: Number of bytes to compress.
+// chunk: Most bytes to feed each call.
+// room: Room to give each call.
+// out: Buffer to gather the stream into, emptied first.
+// returns: True on success, false otherwise.
+//
+static bool encode_stream(lz78_encoder *e, const uint8_t *in, uint64_t in_len,
+    uint64_t chunk, uint64_t room, Buffer *out) {
+  out->len = 0;
+  uint64_t pos = 0;
+  while (pos < in_len) {
+    if (!reserve(out, room)) {
+      return false;
+    }
+    uint64_t take = in_len - pos < chunk ? in_len - pos : chunk;
+    size_t used = 0;
+    int64_t len = lz78_compress(e, in + pos, take, &used, out->bytes + out->len,
+        room);
+    if (len < 0 || (len == 0 && used == 0)) {
+      return false;
+    }
+    pos += used;
+    out->len += len;
+  }
+  if (!reserve(out, room)) {
+    return false;
+  }
+  int64_t len = lz78_compress_finish(e, out->bytes + out->len, room);
+  if (len < 0) {
+    return false;
+  }
+  out->len += len;
+  return true;
+}
+
+//
+// Decompresses a stream, chunk bytes per call with room bytes of room for
+// each call's output.
+//
+// d: Decoder of the stream, at its start.
+// in: Compressed bytes.
+// in_len: Number of compressed bytes.
+// chunk: Most bytes to feed each call.
+// room: Room to give each call.
+// out: Buffer to gather the output into, emptied first.
+// returns: 0 once the stream has ended, a negative LZ78_ERR_ value, or
+//          LZ78_ERR_CORRUPT if it ran out of input before it ended.
+//
+static int64_t decode_stream(lz78_decoder *d, const uint8_t *in,
+    uint64_t in_len, uint64_t chunk, uint64_t room, Buffer *out) {
+  out->len = 0;
+  uint64_t pos = 0;
+  while (!lz78_decoder_done(d)) {
+    if (!reserve(out, room)) {
+      return LZ78_ERR_MEMORY;
+    }
+    uint64_t take = in_len - pos < chunk ? in_len - pos : chunk;
+    size_t used = 0;
+    int64_t len = lz78_decompress(d, in + pos, take, &used,
+        out->bytes + out->len, room);
+    if (len < 0) {
+      return len;
+    }
+    if (len == 0 && used == 0) {
+      return LZ78_ERR_CORRUPT;
+    }
+    pos += used;
+    out->len += len;
+  }
+  return 0;
+}
+
+//
+// Checks that a Buffer holds the bytes of an input.
+//
+// b: Buffer to check.
+// in: Input the Buffer should hold.
+// returns: True if they match, false otherwise.
+//
+static bool same(const Buffer *b, const Input *in) {
+  return b->len == in->len && memcmp(b->bytes, in->data, in->len) == 0;
+}
+
+//
+// Round trips an input with one set of options: streamed a byte at a time
+// into the smallest output buffers and whole, and through a workspace when
+// the options allow one. Both streams are sampled from the whole input, so
+// that both are stored or neither is. At level 1 the output must not depend
+// on how the input was fed, unless it is stored as records of what each call
+// was given, and the one-shot output must match the streamed output.
+//
+// opts: Options to compress with.
+// in: Input to compress.
+// name: Name of the case to report.
+// returns: Void.
+//
+static void check_round_trip(const lz78_options *opts, const Input *in,
+    const char *name) {
+  Buffer small = {NULL, 0, 0};
+  Buffer whole = {NULL, 0, 0};
+  Buffer plain = {NULL, 0, 0};
+  lz78_encoder *e = lz78_encoder_create(opts);
+  lz78_decoder *d = lz78_decoder_create();
+  if (expect(e != NULL && d != NULL, "create", name)) {
+    lz78_decoder_set_dict(d, opts->dict);
+    lz78_encoder_sample(e, in->data, in->len);
+    bool ok = expect(encode_stream(e, in->data, in->len, CHUNK_IN, CHUNK_OUT,
+                         &small), "encode a byte at a time", name);
+    lz78_encoder_reset(e, true);
+    ok = expect(encode_stream(e, in->data, in->len, in->len + 1, WHOLE_OUT,
+                    &whole), "encode whole", name) && ok;
+    if (ok && opts->level == LZ78_MIN_LEVEL && !e->stored) {
+      expect(small.len == whole.len &&
+                 memcmp(small.bytes, whole.bytes, small.len) == 0,
+          "output depends on how input is fed", name);
+    }
+    if (ok) {
+      expect(decode_stream(d, small.bytes, small.len, CHUNK_IN, CHUNK_OUT,
+                 &plain) == 0 && same(&plain, in),
+          "decode a byte at a time", name);
+      lz78_decoder_reset(d, NULL);
+      expect(decode_stream(d, whole.bytes, whole.len, whole.len, WHOLE_OUT,
+                 &plain) == 0 && same(&plain, in),
+          "decode whole", name);
+    }
+  }
+
+  size_t size = lz78_workspace_size(opts);
+  void *mem = size > 0 ? malloc(size) : NULL;
+  lz78_workspace *ws = mem != NULL ? lz78_workspace_init(mem, size, opts) :
+      NULL;
+  if (size > 0 && expect(ws != NULL, "workspace", name)) {
+    plain.len = 0;
+    bool ok = reserve(&plain, lz78_compress_bound(in->len));
+    int64_t len = !ok ? LZ78_ERR_MEMORY :
+        lz78_compress_buffer(ws, in->data, in->len, plain.bytes,
+            plain.cap);
+    ok = expect(len >= 0, "one-shot encode", name);
+    if (ok && opts->level == LZ78_MIN_LEVEL) {
+      expect((uint64_t)len == whole.len &&
+                 memcmp(plain.bytes, whole.bytes, whole.len) == 0,
+          "one-shot output differs from streamed output", name);
+    }
+    Buffer back = {NULL, 0, 0};
+    if (ok && reserve(&back, in->len + 1)) {
+      int64_t n = lz78_decompress_buffer(ws, plain.bytes, len, back.bytes,
+          back.cap);
+      back.len = n < 0 ? 0 : n;
+      expect(n >= 0 && same(&back, in), "one-shot decode", name);
+    }
+    free(back.bytes);
+  }
+
+  free(mem);
+  lz78_encoder_delete(e);
+  lz78_decoder_delete(d);
+  free(small.bytes);
+  free(whole.bytes);
+  free(plain.bytes);
+  return;
+}
+
+//
+// Round trips every input with every mode, policy, backend and a range of
+// levels and code bits, and those that are stored also with storing off.
+//
+// inputs: Inputs to check with.
+// count: Number of inputs.
+// returns: Void.
+//
+static void check_options(const Input *inputs, uint32_t count) {
+  static const uint8_t levels[] = {1, 2, 9};
+  char name[PATH_LEN];
+  for (CodecMode mode = MODE_LZ78; mode <= MODE_LZAP; mode++) {
+    for (DictPolicy policy = DICT_RESET; policy <= DICT_PRUNE; policy++) {
+      for (TrieBackend backend = TRIE_DENSE; backend <= TRIE_HASH;
+           backend++) {
+        for (uint32_t l = 0; l < sizeof(levels); l++) {
+          for (uint8_t bits = MIN_CODE_BITS; bits <= 16; bits += 4) {
+            lz78_options opts;
+            lz78_options_default(&opts);
+            opts.mode = mode;
+            opts.policy = policy;
+            opts.backend = backend;
+            opts.level = levels[l];
+            opts.code_bits = bits;
+            bool valid = policy != DICT_PRUNE ||
+                         (mode == MODE_LZ78 && levels[l] == LZ78_MIN_LEVEL);
+            // Higher levels and wider codes once per backend are enough
+            if (!valid || (backend != TRIE_HYBRID &&
+                              (levels[l] != LZ78_MIN_LEVEL || bits != 12))) {
+              continue;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+              snprintf(name, sizeof(name), "%s %s %s -%u -d %u %s",
+                  lz78_mode_name(mode), lz78_policy_name(policy),
+                  trie_backend_name(backend), levels[l], bits,
+                  inputs[i].name);
+              check_round_trip(&opts, &inputs[i], name);
+              if (lz78_incompressible(inputs[i].data, inputs[i].len)) {
+                opts.store = false;
+                strncat(name, " -N", sizeof(name) - strlen(name) - 1);
+                check_round_trip(&opts, &inputs[i], name);
+                opts.store = true;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  return;
+}
+
+//
+// Builds a shared dictionary whose phrases are the lines of the first 16 KB
+// of a text input.
+//
+// text: Input to cut the phrases from.
+// returns: Pointer to the dictionary, or NULL if allocation failed.
+//
+static lz78_dict *text_dict(const Input *text) {
+  const uint8_t *phrases[1024];
+  uint32_t lens[1024];
+  uint32_t n = 0;
+  uint64_t start = 0;
+  for (uint64_t i = 0; i < 0x4000 && i < text->len && n < 1024; i++) {
+    if (text->data[i] == '\n') {
+      phrases[n] = text->data + start;
+      lens[n++] = i + 1 - start < 64 ? i + 1 - start : 64;
+      start = i + 1;
+    }
+  }
+  return lz78_dict_build(phrases, lens, n);
+}
+
+//
+// Round trips inputs with a shared dictionary in every mode, and checks
+// that a decoder without it refuses the stream.
+//
+// dict: Dictionary cut from the first input, see text_dict.
+// inputs: Inputs to check with, the first of them text.
+// count: Number of inputs.
+// returns: Void.
+//
+static void check_dict(const lz78_dict *dict, const Input *inputs,
+    uint32_t count) {
+  char name[PATH_LEN];
+  for (CodecMode mode = MODE_LZ78; mode <= MODE_LZAP; mode++) {
+    lz78_options opts;
+    lz78_options_default(&opts);
+    opts.mode = mode;
+    opts.dict = dict;
+    for (uint32_t i = 0; i < count; i++) {
+      snprintf(name, sizeof(name), "%s dictionary %s", lz78_mode_name(mode),
+          inputs[i].name);
+      check_round_trip(&opts, &inputs[i], name);
+    }
+
+    // A stream naming a dictionary cannot be decoded without it
+    Buffer comp = {NULL, 0, 0};
+    Buffer plain = {NULL, 0, 0};
+    lz78_encoder *e = lz78_encoder_create(&opts);
+    lz78_decoder *d = lz78_decoder_create();
+    snprintf(name, sizeof(name), "%s dictionary", lz78_mode_name(mode));
+    if (e != NULL && d != NULL &&
+        encode_stream(e, inputs[0].data, inputs[0].len, inputs[0].len,
+            WHOLE_OUT, &comp)) {
+      expect(decode_stream(d, comp.bytes, comp.len, comp.len, WHOLE_OUT,
+                 &plain) == LZ78_ERR_DICT,
+          "decoded without its dictionary", name);
+    }
+    lz78_encoder_delete(e);
+    lz78_decoder_delete(d);
+    free(comp.bytes);
+    free(plain.bytes);
+  }
+  return;
+}
+
+//
+// Reads a whole file into a Buffer.
+//
+// path: Path of the file.
+// b: Buffer to read into, emptied first.
+// returns: True if the file was read, false otherwise.
+//
+static bool load(const char *path, Buffer *b) {
+  b->len = 0;
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = true;
+  while (ok && !feof(f)) {
+    ok = reserve(b, 0x10000);
+    if (ok) {
+      b->len += fread(b->bytes + b->len, 1, 0x10000, f);
+      ok = !ferror(f);
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+//
+// Checks that a file written by the original encode decodes to the input
+// it was made from, streamed and one-shot, and that the default options
+// still write it byte for byte once storing, which it did not have, is off.
+//
+// dir: Directory holding the file.
+// file: Name of the file.
+// in: Input the file was made from.
+// returns: Void.
+//
+static void check_baseline(const char *dir, const char *file,
+    const Input *in) {
+  char path[PATH_LEN];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  Buffer comp = {NULL, 0, 0};
+  Buffer plain = {NULL, 0, 0};
+  if (!expect(load(path, &comp) && comp.len >= HEADER_SIZE, "read", path)) {
+    free(comp.bytes);
+    return;
+  }
+  lz78_decoder *d = lz78_decoder_create();
+  expect(d != NULL &&
+             decode_stream(d, comp.bytes, comp.len, CHUNK_IN, CHUNK_OUT,
+                 &plain) == 0 && same(&plain, in),
+      "decode a byte at a time", path);
+
+  lz78_options opts;
+  lz78_options_default(&opts);
+  FileHeader header;
+  read_header(comp.bytes, &header);
+  opts.protection = header.protection;
+  opts.store = false;
+  size_t size = lz78_workspace_size(&opts);
+  void *mem = malloc(size);
+  lz78_workspace *ws = mem != NULL ? lz78_workspace_init(mem, size, &opts) :
+      NULL;
+  plain.len = 0;
+  if (expect(ws != NULL && reserve(&plain, in->len + 1), "workspace",
+          path)) {
+    int64_t n = lz78_decompress_buffer(ws, comp.bytes, comp.len, plain.bytes,
+        plain.cap);
+    plain.len = n < 0 ? 0 : n;
+    expect(n >= 0 && same(&plain, in), "one-shot decode", path);
+    plain.len = 0;
+    n = reserve(&plain, lz78_compress_bound(in->len)) ?
+        lz78_compress_buffer(ws, in->data, in->len, plain.bytes, plain.cap) :
+        LZ78_ERR_MEMORY;
+    expect((uint64_t)n == comp.len &&
+               memcmp(plain.bytes, comp.bytes, comp.len) == 0,
+        "default output differs from the original encode", path);
+  }
+  free(mem);
+  lz78_decoder_delete(d);
+  free(comp.bytes);
+  free(plain.bytes);
+  return;
+}
+
+//
+// Opens a temporary file, removed once it is closed.
+//
+// returns: File descriptor of the file, or -1 if it could not be made.
+//
+static int temp_file(void) {
+  char path[] = "/tmp/lz78-check-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd != -1) {
+    unlink(path);
+  }
+  return fd;
+}
+
+//
+// Decompresses a plain stream in MODE_LZ78 with pipe_decode, as "decode
+// -P" does, into a file.
+//
+// d: Decoder of the stream, at its start.
+// in: Compressed bytes.
+// in_len: Number of compressed bytes.
+// fd: File descriptor of the file to decode into.
+// returns: True if the stream decoded to its end, false otherwise.
+//
+static bool decode_pipe(lz78_decoder *d, const uint8_t *in, uint64_t in_len,
+    int fd) {
+  uint8_t none = 0;
+  size_t used = 0;
+  if (lz78_decompress(d, in, in_len, &used, &none, 0) < 0 ||
+      !lz78_decoder_has_header(d) || ftruncate(fd, 0) == -1) {
+    return false;
+  }
+  SymReader reader;
+  sym_reader_init(&reader, -1);
+  OutWriter writer;
+  out_writer_init(&writer, fd, 0);
+  bool ok = pipe_decode(d, &reader, in + used, in_len - used, &writer);
+  return out_writer_close(&writer) && ok;
+}
+
+//
+// Decodes every truncation of the start of a stream and a spread of longer
+// ones, streamed, one-shot and pipelined (MODE_LZ78, unless the stream is
+// stored), and the stream with single bits flipped. A truncated stream must
+// fail and a corrupt one must not crash or overrun its output.
+//
+// opts: Options to compress with.
+// in: Input to compress.
+// name: Name of the case to report.
+// returns: Void.
+//
+static void check_corrupt(const lz78_options *opts, const Input *in,
+    const char *name) {
+  Buffer comp = {NULL, 0, 0};
+  Buffer plain = {NULL, 0, 0};
+  lz78_encoder *e = lz78_encoder_create(opts);
+  lz78_decoder *d = lz78_decoder_create();
+  size_t size = lz78_workspace_size(opts);
+  void *mem = malloc(size);
+  lz78_workspace *ws = mem != NULL ? lz78_workspace_init(mem, size, opts) :
+      NULL;
+  uint64_t cap = in->len * 2 + 64;
+  if (!expect(e != NULL && d != NULL && ws != NULL &&
+                  encode_stream(e, in->data, in->len, in->len, WHOLE_OUT,
+                      &comp) && reserve(&plain, cap),
+          "setup", name)) {
+    comp.len = 0;
+  }
+  int fd = opts->mode == MODE_LZ78 && e != NULL && !e->stored ? temp_file() :
+      -1;
+  bool truncated = true;
+  uint64_t step = comp.len / 97 + 1;
+  for (uint64_t len = 0; len < comp.len;
+       len += len < CORRUPT_BYTES ? 1 : step) {
+    lz78_decoder_reset(d, NULL);
+    truncated = truncated &&
+                decode_stream(d, comp.bytes, len, len, WHOLE_OUT, &plain) < 0;
+    truncated = truncated &&
+                lz78_decompress_buffer(ws, comp.bytes, len, plain.bytes,
+                    cap) < 0;
+    lz78_decoder_reset(d, NULL);
+    truncated = truncated &&
+                (fd == -1 || !decode_pipe(d, comp.bytes, len, fd));
+  }
+  expect(truncated, "truncated stream decoded", name);
+  lz78_decoder_reset(d, NULL);
+  expect(fd == -1 || decode_pipe(d, comp.bytes, comp.len, fd),
+      "pipelined decode", name);
+  if (fd != -1) {
+    close(fd);
+  }
+
+  step = comp.len * 8 / CORRUPT_FLIPS + 1;
+  for (uint64_t bit = 0; bit < comp.len * 8; bit += step) {
+    comp.bytes[bit / 8] ^= 1 << (bit % 8);
+    lz78_decoder_reset(d, NULL);
+    decode_stream(d, comp.bytes, comp.len, comp.len, WHOLE_OUT, &plain);
+    int64_t n = lz78_decompress_buffer(ws, comp.bytes, comp.len, plain.bytes,
+        cap);
+    expect(n < 0 || (uint64_t)n <= cap, "corrupt stream overran", name);
+    comp.bytes[bit / 8] ^= 1 << (bit % 8);
+  }
+  free(mem);
+  lz78_encoder_delete(e);
+  lz78_decoder_delete(d);
+  free(comp.bytes);
+  free(plain.bytes);
+  return;
+}
+
+//
+// Checks that random input is stored, its FileHeader flagged and no more
+// than the lengths of its records added to it, that text is not, and that
+// storing can be turned off.
+//
+// random: Random input.
+// text: Text input.
+// returns: Void.
+//
+static void check_stored(const Input *random, const Input *text) {
+  Buffer comp = {NULL, 0, 0};
+  lz78_options opts;
+  lz78_options_default(&opts);
+  lz78_encoder *e = lz78_encoder_create(&opts);
+  bool ok = e != NULL && encode_stream(e, random->data, random->len,
+                             random->len, WHOLE_OUT, &comp);
+  if (expect(ok, "encode", "stored random")) {
+    // Each call of encode_stream makes a record, and the last one ends it
+    uint64_t records = random->len / (WHOLE_OUT - MAX_HEADER_SIZE) + 2;
+    uint64_t most = HEADER_SIZE + random->len + records * STORED_LEN_SIZE;
+    expect(e->stored && (comp.bytes[HEADER_SIZE - 1] & HEADER_STORED) &&
+               comp.len <= most,
+        "random input not stored", "stored random");
+  }
+  if (e != NULL) {
+    lz78_encoder_reset(e, true);
+    expect(encode_stream(e, text->data, text->len, text->len, WHOLE_OUT,
+               &comp) && !e->stored,
+        "text stored", "stored text");
+  }
+  lz78_encoder_delete(e);
+  opts.store = false;
+  e = lz78_encoder_create(&opts);
+  expect(e != NULL && encode_stream(e, random->data, random->len,
+                          random->len, WHOLE_OUT, &comp) && !e->stored,
+      "stored with storing off", "stored random -N");
+  lz78_encoder_delete(e);
+  free(comp.bytes);
+  return;
+}
+
+//
+// Round trips an input through a framed file: decoded in order, on a pool
+// of threads through its index, and a range at a time. Every truncation of
+// the file must then fail to decode in order, as must a file whose blocks
+// start from a dictionary when it is not given.
+//
+// in: Input to compress.
+// dict: Dictionary the blocks start from, or NULL.
+// entropy: Whether the blocks are entropy coded.
+// threads: Number of threads to compress and decompress with.
+// name: Name of the case to report.
+// returns: Void.
+//
+static void check_framed(const Input *in, const lz78_dict *dict,
+    bool entropy, uint32_t threads, const char *name) {
+  lz78_options opts;
+  lz78_options_default(&opts);
+  opts.entropy = entropy;
+  opts.dict = dict;
+  int raw = temp_file();
+  int comp = temp_file();
+  int back = temp_file();
+  bool ok = raw != -1 && comp != -1 && back != -1 &&
+            pwrite_bytes(raw, in->data, in->len, 0);
+  uint64_t total_in = 0;
+  uint64_t total_out = 0;
+  if (ok) {
+    SymReader reader;
+    sym_reader_init(&reader, raw);
+    OutWriter writer;
+    out_writer_init(&writer, comp, 0);
+    ok = frame_encode(&reader, &writer, &opts, threads, MIN_BLOCK_SIZE,
+             &total_in, &total_out, NULL) &&
+         out_writer_close(&writer) && total_in == in->len;
+    sym_reader_close(&reader);
+  }
+  Buffer file = {NULL, 0, 0};
+  ok = expect(ok && reserve(&file, total_out) &&
+                  pread(comp, file.bytes, total_out, 0) == (ssize_t)total_out,
+           "encode", name);
+  file.len = ok ? total_out : 0;
+
+  FrameIndex index;
+  Buffer plain = {NULL, 0, 0};
+  if (ok && expect(frame_index_read(file.bytes, file.len, &index), "index",
+                name) && reserve(&plain, in->len + 1)) {
+    OutWriter writer;
+    out_writer_init(&writer, back, 0);
+    bool decoded = frame_decode_parallel(file.bytes, &index, dict, &writer,
+                       threads, &total_out) &&
+                   out_writer_close(&writer) && total_out == in->len;
+    if (decoded) {
+      plain.len = pread(back, plain.bytes, in->len, 0);
+    }
+    expect(decoded && same(&plain, in), "decode in parallel", name);
+    uint64_t offset = in->len / 3;
+    uint64_t len = in->len / 2;
+    int64_t n = frame_read_range(file.bytes, &index, dict, offset, len,
+        plain.bytes);
+    expect(n == (int64_t)len &&
+               memcmp(plain.bytes, in->data + offset, len) == 0,
+        "decode a range", name);
+    expect(dict == NULL || frame_read_range(file.bytes, &index, NULL, offset,
+                               len, plain.bytes) < 0,
+        "decoded without its dictionary", name);
+    frame_index_free(&index);
+  }
+
+  // Every truncation is refused, checked at a spread of lengths
+  bool truncated = true;
+  uint64_t step = file.len / 97 + 1;
+  for (uint64_t len = FRAME_HEADER_SIZE; ok && len < file.len; len += step) {
+    FrameHeader header;
+    read_frame_header(file.bytes, &header);
+    uint64_t skip = frame_header_len(&header);
+    if (ftruncate(back, 0) == -1 || skip > len) {
+      continue;
+    }
+    SymReader reader;
+    sym_reader_init(&reader, -1);
+    OutWriter writer;
+    out_writer_init(&writer, back, 0);
+    truncated = truncated &&
+                !frame_decode(&reader, file.bytes + skip, len - skip, &header,
+                    dict, &writer, &total_in, &total_out);
+    out_writer_close(&writer);
+    if (frame_index_read(file.bytes, len, &index)) {
+      truncated = false;
+      frame_index_free(&index);
+    }
+  }
+  expect(truncated, "truncated file decoded", name);
+
+  // A raw_size the blocks do not add up to is refused, and never used to
+  // size the output file
+  bool refused = true;
+  uint64_t sizes[] = {in->len - 1, in->len + 1, (uint64_t)1 << 50};
+  for (uint32_t i = 0; ok && i < 3; i++) {
+    FrameHeader header;
+    read_frame_header(file.bytes, &header);
+    if (i == 0 && !expect(header.flags & FRAME_SIZED &&
+                              frame_checked_size(file.bytes, file.len,
+                                  &header) == in->len,
+                      "sized", name)) {
+      break;
+    }
+    for (uint32_t b = 0; b < FRAME_SIZE_FIELD; b++) {
+      file.bytes[FRAME_HEADER_SIZE + b] = (uint8_t)(sizes[i] >> (8 * b));
+    }
+    read_frame_header(file.bytes, &header);
+    uint64_t skip = frame_header_len(&header);
+    if (ftruncate(back, 0) == -1) {
+      continue;
+    }
+    SymReader reader;
+    sym_reader_init(&reader, -1);
+    OutWriter writer;
+    out_writer_init(&writer, back, 0);
+    refused = refused &&
+              frame_checked_size(file.bytes, file.len, &header) == 0 &&
+              !frame_decode(&reader, file.bytes + skip, file.len - skip,
+                  &header, dict, &writer, &total_in, &total_out);
+    out_writer_close(&writer);
+    if (frame_index_read(file.bytes, file.len, &index)) {
+      refused = false;
+      frame_index_free(&index);
+    }
+  }
+  expect(refused, "file of the wrong size decoded", name);
+
+  free(file.bytes);
+  free(plain.bytes);
+  close(raw);
+  close(comp);
+  close(back);
+  return;
+}
+
+//
+// Writes the inputs the files of the original encode in the testdata
+// directory are made from, so that they can be made again.
+//
+// dir: Directory to write the inputs to.
+// returns: 0 on success, 1 otherwise.
+//
+static int write_inputs(const char *dir) {
+  char path[PATH_LEN];
+  uint8_t *text = make_input(INPUT_TEXT, BASE_TEXT_LEN);
+  uint8_t *random = make_input(INPUT_RANDOM, BASE_RANDOM_LEN);
+  bool ok = text != NULL && random != NULL;
+  snprintf(path, sizeof(path), "%s/base-text", dir);
+  FILE *f = ok ? fopen(path, "wb") : NULL;
+  ok = f != NULL && fwrite(text, 1, BASE_TEXT_LEN, f) == BASE_TEXT_LEN;
+  ok = (f == NULL || fclose(f) == 0) && ok;
+  snprintf(path, sizeof(path), "%s/base-random", dir);
+  f = ok ? fopen(path, "wb") : NULL;
+  ok = f != NULL && fwrite(random, 1, BASE_RANDOM_LEN, f) == BASE_RANDOM_LEN;
+  ok = (f == NULL || fclose(f) == 0) && ok;
+  free(text);
+  free(random);
+  if (!ok) {
+    printf("Unable to write the inputs.\n");
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  int c = 0;
+  while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+    if (c == 'w') {
+      return write_inputs(optarg);
+    }
+    printf("Usage: lz78-check [-w DIR] [TESTDATA]\n");
+    return 1;
+  }
+  const char *dir = optind < argc ? argv[optind] : "testdata";
+
+  Input inputs[] = {{"text", NULL, 200000}, {"binary", NULL, 100000},
+      {"random", NULL, 50000}, {"zeros", NULL, 100000}, {"empty", NULL, 0},
+      {"one", NULL, 1}};
+  uint32_t count = sizeof(inputs) / sizeof(*inputs);
+  static const int kinds[] = {INPUT_TEXT, INPUT_BINARY, INPUT_RANDOM,
+    INPUT_ZEROS, INPUT_ZEROS, INPUT_TEXT};
+  bool ok = true;
+  for (uint32_t i = 0; i < count; i++) {
+    inputs[i].data = make_input(kinds[i], inputs[i].len);
+    ok = ok && inputs[i].data != NULL;
+  }
+  Input text = {"base text", make_input(INPUT_TEXT, BASE_TEXT_LEN),
+      BASE_TEXT_LEN};
+  Input random = {"base random", make_input(INPUT_RANDOM, BASE_RANDOM_LEN),
+      BASE_RANDOM_LEN};
+  Input big = {"framed text", make_input(INPUT_TEXT, 5 * MEGABYTE / 2),
+      5 * MEGABYTE / 2};
+  if (!ok || text.data == NULL || random.data == NULL || big.data == NULL) {
+    printf("Failed to allocate inputs.\n");
+    return 1;
+  }
+
+  check_options(inputs, count);
+  lz78_dict *dict = text_dict(&inputs[0]);
+  if (expect(dict != NULL, "build", "dictionary")) {
+    check_dict(dict, inputs, count);
+  }
+  check_baseline(dir, BASE_TEXT, &text);
+  check_baseline(dir, BASE_RANDOM, &random);
+  char name[PATH_LEN];
+  for (CodecMode mode = MODE_LZ78; mode <= MODE_LZAP; mode++) {
+    lz78_options opts;
+    lz78_options_default(&opts);
+    opts.mode = mode;
+    opts.code_bits = MIN_CODE_BITS;
+    for (uint32_t i = 0; i < 3; i++) {
+      snprintf(name, sizeof(name), "%s corrupt %s", lz78_mode_name(mode),
+          inputs[i].name);
+      check_corrupt(&opts, &inputs[i], name);
+    }
+    // Random input is stored, so it is checked coded as well
+    opts.store = false;
+    snprintf(name, sizeof(name), "%s corrupt %s -N", lz78_mode_name(mode),
+        inputs[2].name);
+    check_corrupt(&opts, &inputs[2], name);
+  }
+  check_stored(&inputs[2], &inputs[0]);
+  check_framed(&big, NULL, false, 1, "framed");
+  check_framed(&big, NULL, true, 2, "framed entropy");
+  check_framed(&inputs[2], NULL, false, 2, "framed random");
+  if (dict != NULL) {
+    check_framed(&big, dict, true, 2, "framed dictionary");
+  }
+  lz78_dict_delete(dict);
+
+  for (uint32_t i = 0; i < count; i++) {
+    free(inputs[i].data);
+  }
+  free(text.data);
+  free(random.data);
+  free(big.data);
+  printf("%" PRIu64 " checks, %" PRIu64 " failed\n", checks, failures);
+  return failures > 0;
+}
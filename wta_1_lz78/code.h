@@ -13,4 +13,100 @@
 #define START_CODE 2
 #define MAX_CODE UINT16_MAX
 
+// Range of dictionary sizes, in bits per code, and the size of the format
+// before it was configurable
+#define MIN_CODE_BITS 12
+#define MAX_CODE_BITS 24
+#define DEFAULT_CODE_BITS 16
+
+// Code after the last one of a dictionary of the given number of bits.
+// DEFAULT_CODE_BITS gives MAX_CODE.
+#define MAX_CODE_OF(bits) (((uint32_t)1 << (bits)) - 1)
+
+// Symbol sent with STOP_CODE to reset the dictionary instead of stopping
+#define RESET_SYM 1
+
+// Codes of the single symbols in the modes that send codes only, and the
+// code the first longer phrase is given. EMPTY_CODE resets the dictionary.
+#define LITERAL_CODE(sym) (START_CODE + (sym))
+#define WORD_START_CODE LITERAL_CODE(256)
+
+//
+// How phrases are sent and how the dictionary grows from them.
+//
+// MODE_LZ78: A (code, symbol) pair per phrase; the phrase with the symbol
+//            appended is added, as in the original format.
+// MODE_LZW: A code per phrase, starting from every single symbol; the
+//           previous phrase with the first symbol of this one appended is
+//           added.
+// MODE_LZAP: As MODE_LZW, but the previous phrase with every prefix of
+//            this one appended is added.
+//
+typedef enum CodecMode { MODE_LZ78, MODE_LZW, MODE_LZAP } CodecMode;
+
+//
+// What happens once every code of the dictionary has been given out.
+//
+// DICT_RESET: Start over with an empty dictionary, as the original format.
+// DICT_FREEZE: Keep the dictionary as it is for the rest of the stream.
+// DICT_ADAPTIVE: Keep it while the ratio holds, and reset it with an
+//                in-band (STOP_CODE, RESET_SYM) pair once the ratio drops.
+// DICT_PRUNE: Give the code of the least recently made leaf phrase to each
+//             new phrase.
+//
+typedef enum DictPolicy {
+  DICT_RESET,
+  DICT_FREEZE,
+  DICT_ADAPTIVE,
+  DICT_PRUNE
+} DictPolicy;
+
+//
+// Returns how many bits are required to represent a given number
+//
+// The loops of the codec only call it when the code width changes, see
+// CodeWidth, so the bits are simply counted.
+//
+// code: the number to represent
+// returns: the number of bits required to represent the code
+//
+static inline uint8_t bit_len(uint32_t code) {
+  uint8_t len = 1;
+  while (code >> len != 0) {
+    len++;
+  }
+  return len;
+}
+
+//
+// Struct definition of a CodeWidth, the width codes are sent with while
+// the next code stays in [low, high). Codes only change width at powers of
+// two, so the loops of the codec keep one and only work the width out again
+// once the next code leaves its range, after growing past a power of two or
+// starting over.
+//
+// bits: Width of the codes.
+// low: Lowest next code sent with bits bits.
+// high: Lowest next code sent with more bits.
+//
+typedef struct CodeWidth {
+  uint8_t bits;
+  uint32_t low;
+  uint32_t high;
+} CodeWidth;
+
+//
+// Returns the CodeWidth of a next code.
+//
+// next_code: Code the next phrase will be given.
+// returns: The CodeWidth next_code falls in.
+//
+static inline CodeWidth code_width(uint32_t next_code) {
+  CodeWidth w;
+  w.bits = bit_len(next_code);
+  w.low = next_code < 2 ? 0 : (uint32_t)1 << (w.bits - 1);
+  w.high = (uint32_t)1 << w.bits;
+  return w;
+}
+
 #endif
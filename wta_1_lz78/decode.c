@@ -1,8 +1,9 @@
+#include "batch.h"
 #include "code.h"
+#include "frame.h"
 #include "io.h"
-#include "math.h"
-#include "trie.h"
-#include "word.h"
+#include "lz78.h"
+#include "pipe.h"
 
 #include <errno.h>
 #include <getopt.h>
@@ -12,27 +13,354 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define OPTIONS "vi:o:"
+#define OPTIONS "vPi:o:T:r:I:RL:D:"
 
-// Keep track of how many total bytes are written/read for statistics
-uint64_t read_total = 0;
-uint64_t write_total = 0;
+// Long forms of the options
+static struct option long_options[] = {
+    {"range", required_argument, NULL, 'r'}, {NULL, 0, NULL, 0}};
 
 //
-// Calculates how many bits are required to represent a given code
+// Gathers the blocks of input that follow a short first block into lead,
+// until it holds at least want bytes or the input runs out.
 //
-// code: the code to represent
-// returns: how many bits are required to represent the code
+// r: SymReader of the input file.
+// syms: Pointer to the first block, which is pointed at lead once done.
+// syms_len: Number of bytes in the first block, below want.
+// lead: Memory of want bytes plus the largest block r reads.
+// want: Number of bytes wanted.
+// returns: Number of bytes in lead.
 //
-uint16_t bit_len(uint16_t code) {
-  if (code == 0) {
-    return 1;
+static uint64_t gather_lead(SymReader *r, uint8_t **syms, uint64_t syms_len,
+    uint8_t *lead, uint32_t want) {
+  uint64_t lead_len = 0;
+  do {
+    memcpy(lead + lead_len, *syms, syms_len);
+    lead_len += syms_len;
+  } while (lead_len < want && (syms_len = read_syms(r, syms)) > 0);
+  *syms = lead;
+  return lead_len;
+}
+
+//
+// Reads the FileHeader of a plain stream into a decoder, with no room for
+// output yet.
+//
+// dec: Decoder of the stream.
+// r: SymReader of the input file.
+// syms: Pointer to the bytes read so far, moved past those used.
+// syms_len: Pointer to the number of bytes in syms.
+// returns: 0 once the header is read, LZ78_ERR_MAGIC if the input ran out
+//          before it or it is not a plain stream, or another negative
+//          LZ78_ERR_ value.
+//
+static int64_t read_plain_header(lz78_decoder *dec, SymReader *r,
+    uint8_t **syms, uint64_t *syms_len) {
+  int64_t len = 0;
+  uint8_t none = 0;
+  size_t used = 0;
+  while (!lz78_decoder_has_header(dec) && len == 0) {
+    if (*syms_len == 0 && (*syms_len = read_syms(r, syms)) == 0) {
+      break;
+    }
+    len = lz78_decompress(dec, *syms, *syms_len, &used, &none, 0);
+    *syms += used;
+    *syms_len -= used;
+  }
+  return lz78_decoder_has_header(dec) ? len : LZ78_ERR_MAGIC;
+}
+
+//
+// Decompresses the rest of a plain stream, whose FileHeader has been read,
+// into the output.
+//
+// dec: Decoder of the stream.
+// r: SymReader of the input file.
+// syms: Bytes already read from r that follow the FileHeader.
+// syms_len: Number of bytes in syms.
+// writer: OutWriter of the output file.
+// returns: 0 on success, LZ78_ERR_CAPACITY if the output could not be
+//          written, or another negative LZ78_ERR_ value if the input is
+//          corrupt, LZ78_ERR_CORRUPT if it ends before the stream does.
+//
+static int64_t decode_plain(lz78_decoder *dec, SymReader *r, uint8_t *syms,
+    uint64_t syms_len, OutWriter *writer) {
+  bool eof = false;
+  size_t used = 0;
+  while (!lz78_decoder_done(dec)) {
+    if (syms_len == 0 && !eof) {
+      syms_len = read_syms(r, &syms);
+      eof = syms_len == 0;
+    }
+    uint64_t room = 0;
+    uint8_t *out = out_reserve(writer, OUT_BLOCK, &room);
+    if (out == NULL) {
+      return LZ78_ERR_CAPACITY;
+    }
+    int64_t len = lz78_decompress(dec, syms, syms_len, &used, out, room);
+    if (len < 0) {
+      return len;
+    }
+    out_commit(writer, len);
+    syms += used;
+    syms_len -= used;
+    if (eof && len == 0) {
+      break;
+    }
+  }
+  return lz78_decoder_done(dec) ? 0 : LZ78_ERR_CORRUPT;
+}
+
+//
+// Returns whether a decoder has the dictionary the blocks of a framed file
+// start from, if they start from one.
+//
+// frame: FrameHeader of the file.
+// dict: Dictionary of the decoder, or NULL.
+// returns: True if the blocks can be decoded, false otherwise.
+//
+static bool frame_dict_ok(const FrameHeader *frame, const lz78_dict *dict) {
+  return !(frame->flags & FRAME_DICT) ||
+         (dict != NULL && dict->id == frame->dict_id);
+}
+
+//
+// Stops the threads reading input ahead and writing output behind, which
+// must be done before either file is closed, so that neither thread is
+// left with a file descriptor that has been closed or handed out again.
+//
+// reader: SymReader of the input file.
+// writer: OutWriter of the output file, or NULL if it is not set up yet.
+// returns: True if every byte was written, false otherwise.
+//
+static bool stop_io(SymReader *reader, OutWriter *writer) {
+  bool ok = writer == NULL || out_writer_close(writer);
+  sym_reader_close(reader);
+  return ok;
+}
+
+//
+// Struct definition of the state of a thread of batch mode.
+//
+// dec: Decoder reused for every plain file the thread decompresses, so
+//      that its WordTable is only allocated once.
+// reader: SymReader of the file being decompressed.
+// lead: Memory to gather the start of a file in, see gather_lead.
+// total_in: Number of bytes read.
+// total_out: Number of bytes written.
+//
+typedef struct BatchDecoder {
+  lz78_decoder *dec;
+  SymReader reader;
+  uint8_t *lead;
+  uint64_t total_in;
+  uint64_t total_out;
+} BatchDecoder;
+
+//
+// Decompresses one plain or framed file of a batch to a file named with
+// BATCH_SUFFIX taken off, with the protection recorded in its header.
+// Output of a file that fails is removed.
+//
+// state: BatchDecoder of the thread.
+// path: Path of the file.
+// returns: True on success, false otherwise.
+//
+static bool decode_file(void *state, const char *path) {
+  BatchDecoder *b = (BatchDecoder *)state;
+  int32_t infile = open(path, O_RDONLY);
+  if (infile == -1) {
+    printf("%s: Unable to open input file.\n", path);
+    return false;
+  }
+  sym_reader_init(&b->reader, infile);
+  uint8_t *syms = NULL;
+  uint64_t syms_len = read_syms(&b->reader, &syms);
+  uint32_t lead_want = MAX_FRAME_HEADER_SIZE;
+  if (syms_len > 0 && syms_len < lead_want) {
+    syms_len = gather_lead(&b->reader, &syms, syms_len, b->lead, lead_want);
+  }
+
+  // The protection of the output is in the header of either kind of file
+  FrameHeader frame;
+  bool framed = syms_len >= FRAME_HEADER_SIZE;
+  if (framed) {
+    read_frame_header(syms, &frame);
+    framed = frame.magic == FRAME_MAGIC;
+  }
+  int64_t len = 0;
+  uint16_t protection = 0;
+  if (framed) {
+    len = syms_len < frame_header_len(&frame) ? LZ78_ERR_CORRUPT : 0;
+    if (len == 0 && !frame_dict_ok(&frame, b->dec->dict)) {
+      len = LZ78_ERR_DICT;
+    }
+    protection = frame.protection;
   } else {
-    return log2(code) + 1;
+    lz78_decoder_reset(b->dec, NULL);
+    len = read_plain_header(b->dec, &b->reader, &syms, &syms_len);
+    protection = b->dec->header.protection;
+  }
+
+  char *out_name = len < 0 ? NULL : batch_out_name(path, true);
+  int32_t outfile = out_name == NULL ? -1 :
+      open(out_name, O_RDWR | O_CREAT | O_TRUNC, protection);
+  if (len >= 0 && outfile == -1) {
+    printf("%s: Unable to open output file.\n", path);
+    len = 0;
+  } else if (len >= 0) {
+    uint64_t total_in = 0;
+    uint64_t total_out = 0;
+    OutWriter writer;
+    out_writer_init(&writer, outfile, framed ? frame_checked_size(
+        b->reader.map, b->reader.map_len, &frame) : 0);
+    if (framed) {
+      uint32_t skip = frame_header_len(&frame);
+      len = frame_decode(&b->reader, syms + skip, syms_len - skip, &frame,
+                b->dec->dict, &writer, &total_in, &total_out) ? 0 :
+          LZ78_ERR_CORRUPT;
+    } else {
+      len = decode_plain(b->dec, &b->reader, syms, syms_len, &writer);
+      total_in = b->dec->total_in;
+      total_out = b->dec->total_out;
+    }
+    if (!out_writer_close(&writer) && len >= 0) {
+      len = LZ78_ERR_CAPACITY;
+    }
+    if (len >= 0) {
+      b->total_in += total_in;
+      b->total_out += total_out;
+    }
+  }
+  if (len == LZ78_ERR_MAGIC) {
+    printf("%s: Input file has an invalid magic number.\n", path);
+  } else if (len == LZ78_ERR_DICT) {
+    printf("%s: Input file needs the dictionary it was compressed with.\n",
+        path);
+  } else if (len == LZ78_ERR_CAPACITY) {
+    printf("%s: Unable to write output file.\n", path);
+  } else if (len < 0) {
+    printf("%s: Input file is corrupt.\n", path);
+  }
+  bool ok = len >= 0 && outfile != -1;
+  if (outfile != -1) {
+    close(outfile);
+    if (!ok) {
+      unlink(out_name);
+    }
+  }
+  sym_reader_close(&b->reader);
+  close(infile);
+  free(out_name);
+  return ok;
+}
+
+//
+// Frees the BatchDecoders of a batch and their decoders.
+//
+// workers: Array of BatchDecoders, any of which may be NULL.
+// threads: Number of BatchDecoders in workers.
+// returns: Void.
+//
+static void free_workers(BatchDecoder **workers, uint32_t threads) {
+  for (uint32_t t = 0; t < threads; t++) {
+    if (workers[t] != NULL) {
+      lz78_decoder_delete(workers[t]->dec);
+      free(workers[t]->lead);
+      free(workers[t]);
+    }
+  }
+  free(workers);
+  return;
+}
+
+//
+// Decompresses every file of a batch on a work stealing pool of threads
+// that each reuse one decoder.
+//
+// paths: Files and directories named on the command line.
+// count: Number of paths.
+// manifest: File naming more files and directories, one per line, "-" for
+//           stdin, or NULL.
+// recurse: Whether to decompress the files below directories that end
+//          with BATCH_SUFFIX.
+// threads: Number of threads, or 0 for one per processor.
+// dict: Dictionary shared by the decoders, or NULL.
+// display_stats: Whether to print the sizes and ratio of the batch.
+// returns: 0 if every file was decompressed, -1 otherwise.
+//
+static int decode_batch(char **paths, uint32_t count, const char *manifest,
+    bool recurse, uint32_t threads, const lz78_dict *dict,
+    bool display_stats) {
+  BatchList list;
+  batch_list_init(&list);
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    failed += !batch_add(&list, paths[i], recurse, true);
+  }
+  if (manifest != NULL) {
+    FILE *f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (f == NULL) {
+      printf("Unable to open manifest file specified.\n");
+      batch_list_free(&list);
+      return -1;
+    }
+    failed += !batch_add_manifest(&list, f, recurse, true);
+    if (f != stdin) {
+      fclose(f);
+    }
+  }
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online < 1 ? 1 : online > 256 ? 256 : online;
+  }
+  threads = threads < list.count ? threads : list.count;
+
+  BatchDecoder **workers =
+      (BatchDecoder **)calloc(threads + 1, sizeof(BatchDecoder *));
+  if (workers == NULL) {
+    printf("Failed to allocate decoder.\n");
+    batch_list_free(&list);
+    return -1;
+  }
+  for (uint32_t t = 0; t < threads; t++) {
+    workers[t] = (BatchDecoder *)calloc(1, sizeof(BatchDecoder));
+    if (workers[t] == NULL ||
+        (workers[t]->dec = lz78_decoder_create()) == NULL ||
+        (workers[t]->lead = (uint8_t *)malloc(
+             MAX_FRAME_HEADER_SIZE + SYMS_BLOCK)) == NULL) {
+      printf("Failed to allocate decoder.\n");
+      free_workers(workers, threads);
+      batch_list_free(&list);
+      return -1;
+    }
+    lz78_decoder_set_dict(workers[t]->dec, dict);
+  }
+  failed += batch_run(&list, threads, decode_file, (void **)workers);
+
+  uint64_t read_total = 0;
+  uint64_t write_total = 0;
+  for (uint32_t t = 0; t < threads; t++) {
+    read_total += workers[t]->total_in;
+    write_total += workers[t]->total_out;
   }
+  free_workers(workers, threads);
+
+  if (display_stats) {
+    printf("Decompressed files: %" PRIu32 " of %" PRIu32 "\n",
+        list.count - (failed > list.count ? list.count : failed),
+        list.count);
+    printf("Compressed file size: %" PRIu64 " bytes\n", read_total);
+    printf("Uncompressed file size: %" PRIu64 " bytes\n", write_total);
+    float ratio = write_total == 0 ? (float)0.0 :
+        100.0 * ((float)1 - ((float)read_total / (float)write_total));
+    printf("Compression ratio: %2.2f%%\n", ratio);
+  }
+  batch_list_free(&list);
+  return failed > 0 ? -1 : 0;
 }
 
 //
@@ -44,16 +372,77 @@ int main(int argc, char **argv) {
   bool display_stats = false;
   char *in_file_name = NULL;
   char *out_file_name = NULL;
+  uint32_t threads = 0;
+  bool range = false;
+  uint64_t range_offset = 0;
+  uint64_t range_len = 0;
+  bool pipelined = false;
+  uint64_t io_size = IO_BUFFER;
+  uint32_t io_depth = IO_DEPTH;
+  bool recurse = false;
+  char *manifest = NULL;
+  char *dict_name = NULL;
 
   char c = 0;
-  while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+  while ((c = getopt_long(argc, argv, OPTIONS, long_options, NULL)) != -1) {
     if (c == 'v') {
       display_stats = true;
+    } else if (c == 'P') {
+      pipelined = true;
     } else if (c == 'i') {
       in_file_name = optarg;
     } else if (c == 'o') {
       out_file_name = optarg;
+    } else if (c == 'T') {
+      threads = strtoul(optarg, NULL, 10);
+      if (threads < 1 || threads > 256) {
+        printf("Thread count must be between 1 and 256.\n");
+        return -1;
+      }
+    } else if (c == 'r') {
+      int end = 0;
+      range = sscanf(optarg, "%" SCNu64 ":%" SCNu64 "%n", &range_offset,
+                  &range_len, &end) == 2 && optarg[end] == '\0';
+      if (!range) {
+        printf("Range must be given as OFFSET:LEN.\n");
+        return -1;
+      }
+    } else if (c == 'R') {
+      recurse = true;
+    } else if (c == 'L') {
+      manifest = optarg;
+    } else if (c == 'D') {
+      dict_name = optarg;
+    } else if (c == 'I') {
+      if (!io_buffers_parse(optarg, &io_size, &io_depth)) {
+        printf("I/O buffers must be given as KB[:COUNT], from %d to %d KB "
+               "and %d to %d buffers, or 0.\n",
+            IO_MIN_BUFFER / 1024, IO_MAX_BUFFER / 1024, IO_MIN_DEPTH,
+            IO_MAX_DEPTH);
+        return -1;
+      }
+    }
+  }
+
+  // A shared dictionary is loaded once, for the files that name it
+  lz78_dict *dict = NULL;
+  if (dict_name != NULL && (dict = lz78_dict_load(dict_name)) == NULL) {
+    printf("Unable to load dictionary file specified.\n");
+    return -1;
+  }
+
+  // Files named after the options, or in a manifest, are decompressed in
+  // batch mode, with "-T" threads
+  if (optind < argc || manifest != NULL) {
+    if (range || in_file_name != NULL || out_file_name != NULL) {
+      printf("Batch mode writes each file beside its input, so it cannot be "
+             "used with -r, -i or -o.\n");
+      return -1;
     }
+    int status = decode_batch(argv + optind, argc - optind, manifest,
+        recurse, threads, dict, display_stats);
+    lz78_dict_delete(dict);
+    return status;
   }
 
   // Default values for input/output if a user does not provide them
@@ -68,56 +457,196 @@ int main(int argc, char **argv) {
     }
   }
 
-  // Read File Header from Input File
-  struct FileHeader fh;
-  memset(&fh, 0, sizeof(fh));
-  read_header(infile, &fh);
-
-  // Check if file has been compressed by this program
-  if (fh.magic != MAGIC) {
-    printf("Provided Magic: %" PRIu32 "\n", fh.magic);
-    printf("Input file specified has an invalid magic number.\n");
+  lz78_decoder *dec = lz78_decoder_create();
+  if (dec == NULL) {
     return -1;
   }
+  lz78_decoder_set_dict(dec, dict);
+  static SymReader reader;
+  OutWriter writer;
+  sym_reader_init(&reader, infile);
+  sym_reader_ahead(&reader, io_size, io_depth);
+  uint8_t *syms = NULL;
+  uint64_t syms_len = read_syms(&reader, &syms);
 
-  // Create output file if it does not exist, using input file's protection
-  if (out_file_name != NULL) {
-    outfile = open(out_file_name, O_WRONLY | O_CREAT | O_TRUNC, fh.protection);
-    if (outfile == -1) {
-      printf("Unable to open output file specified.\n");
+  // Gather enough input to tell a framed file from a plain one, and to
+  // read the size a FrameHeader may carry. Whole blocks are gathered, and
+  // a block read ahead can be larger than SYMS_BLOCK
+  uint32_t lead_want = MAX_FRAME_HEADER_SIZE;
+  uint64_t block = io_depth > 0 && io_size > SYMS_BLOCK ? io_size : SYMS_BLOCK;
+  uint8_t *lead = NULL;
+  if (syms_len > 0 && syms_len < lead_want) {
+    lead = (uint8_t *)malloc(lead_want + block);
+    if (lead == NULL) {
+      printf("Failed to allocate input buffer.\n");
+      stop_io(&reader, NULL);
       return -1;
     }
+    syms_len = gather_lead(&reader, &syms, syms_len, lead, lead_want);
   }
 
-  // Main Decompression Logic
-  WordTable *table = wt_create();
-  uint8_t curr_sym = 0;
-  uint16_t curr_code = 0;
-  uint16_t next_code = START_CODE;
-  while (read_pair(infile, &curr_code, &curr_sym, bit_len(next_code))) {
-    if (curr_code == STOP_CODE) {
-      break;
+  FrameHeader frame;
+  if (syms_len >= FRAME_HEADER_SIZE) {
+    read_frame_header(syms, &frame);
+  }
+  if (syms_len >= FRAME_HEADER_SIZE && frame.magic == FRAME_MAGIC) {
+    if (syms_len < frame_header_len(&frame)) {
+      printf("Input file is corrupt.\n");
+      stop_io(&reader, NULL);
+      return -1;
+    }
+    if (!frame_dict_ok(&frame, dict)) {
+      printf("Input file needs the dictionary it was compressed with.\n");
+      stop_io(&reader, NULL);
+      return -1;
+    }
+    // Opened for reading as well, so that it can be mapped
+    if (out_file_name != NULL) {
+      outfile =
+          open(out_file_name, O_RDWR | O_CREAT | O_TRUNC, frame.protection);
+      if (outfile == -1) {
+        printf("Unable to open output file specified.\n");
+        stop_io(&reader, NULL);
+        return -1;
+      }
+    }
+    // A range or a parallel decode sizes the output itself
+    bool whole = !range && !(threads > 0 && reader.map != NULL);
+    out_writer_init(&writer, outfile, whole ? frame_checked_size(reader.map,
+        reader.map_len, &frame) : 0);
+    out_writer_behind(&writer, io_size, io_depth);
+    // Blocks are independent, so they are decoded outside of dec. With
+    // threads, a mapped input and a seekable output they are decoded in
+    // parallel using the block index
+    FrameIndex index;
+    bool ok = false;
+    if (range) {
+      if (reader.map == NULL ||
+          !frame_index_read(reader.map, reader.map_len, &index)) {
+        printf("A range can only be read from an indexed framed file.\n");
+        stop_io(&reader, &writer);
+        return -1;
+      }
+      madvise(reader.map, reader.map_len, MADV_RANDOM);
+
+      // Read the range a block at a time, so each block is decoded once
+      uint32_t block_size = index.header.block_size;
+      uint64_t pos = range_offset;
+      uint64_t end = range_offset + range_len;
+      end = end < range_offset || end > index.raw_size ? index.raw_size : end;
+      ok = true;
+      while (ok && pos < end) {
+        uint64_t want = block_size - pos % block_size;
+        want = want < end - pos ? want : end - pos;
+        uint64_t room = 0;
+        uint8_t *slice = out_reserve(&writer, want, &room);
+        int64_t len = slice == NULL ? LZ78_ERR_CAPACITY :
+            frame_read_range(reader.map, &index, dict, pos, want, slice);
+        ok = len > 0;
+        if (ok) {
+          out_commit(&writer, len);
+          pos += len;
+          dec->total_out += len;
+        }
+      }
+      dec->total_in = reader.map_len;
+      frame_index_free(&index);
+    } else if (threads > 0 && reader.map != NULL &&
+        lseek(outfile, 0, SEEK_CUR) != -1 &&
+        frame_index_read(reader.map, reader.map_len, &index)) {
+      ok = frame_decode_parallel(reader.map, &index, dict, &writer, threads,
+          &dec->total_out);
+      dec->total_in = reader.map_len;
+      frame_index_free(&index);
+    } else {
+      ok = frame_decode(&reader, syms + frame_header_len(&frame),
+          syms_len - frame_header_len(&frame), &frame, dict, &writer,
+          &dec->total_in, &dec->total_out);
+    }
+    if (!ok) {
+      printf("Input file is corrupt.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+  } else if (range) {
+    printf("A range can only be read from an indexed framed file.\n");
+    stop_io(&reader, NULL);
+    return -1;
+  } else {
+    // Read File Header from Input File, with no room for output yet
+    int64_t len = read_plain_header(dec, &reader, &syms, &syms_len);
+
+    // Check if file has been compressed by this program
+    if (!lz78_decoder_has_header(dec) || len == LZ78_ERR_MAGIC) {
+      printf("Provided Magic: %" PRIu32 "\n", dec->header.magic);
+      printf("Input file specified has an invalid magic number.\n");
+      stop_io(&reader, NULL);
+      return -1;
+    }
+    if (len == LZ78_ERR_DICT) {
+      printf("Input file needs the dictionary it was compressed with.\n");
+      stop_io(&reader, NULL);
+      return -1;
     }
-    table[next_code] = word_append_sym(table[curr_code], curr_sym);
-    buffer_word(outfile, table[next_code]);
-    next_code = next_code + 1;
-    if (next_code >= MAX_CODE) {
-      wt_reset(table);
-      next_code = START_CODE;
+    if (len < 0) {
+      printf("Input file is corrupt.\n");
+      stop_io(&reader, NULL);
+      return -1;
+    }
+
+    // Create output file if it does not exist, using input file's protection
+    if (out_file_name != NULL) {
+      outfile = open(out_file_name, O_RDWR | O_CREAT | O_TRUNC,
+          dec->header.protection);
+      if (outfile == -1) {
+        printf("Unable to open output file specified.\n");
+        stop_io(&reader, NULL);
+        return -1;
+      }
     }
+    // The plain format does not record the size, so the output is grown
+    out_writer_init(&writer, outfile, 0);
+    out_writer_behind(&writer, io_size, io_depth);
+
+    // Pairs are unpacked on another thread, in the mode that allows it
+    if (pipelined && dec->header.mode == MODE_LZ78 && !dec->header.stored) {
+      len = pipe_decode(dec, &reader, syms, syms_len, &writer) ? 0 :
+          LZ78_ERR_CORRUPT;
+    } else {
+      // Main Decompression Logic
+      len = decode_plain(dec, &reader, syms, syms_len, &writer);
+    }
+    if (len == LZ78_ERR_CAPACITY) {
+      printf("Unable to write output file.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+    if (len < 0) {
+      printf("Input file is corrupt.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+  }
+  if (!stop_io(&reader, &writer)) {
+    printf("Unable to write output file.\n");
+    return -1;
   }
-  flush_words(outfile);
+  uint64_t read_total = dec->total_in;
+  uint64_t write_total = dec->total_out;
 
   if (display_stats) {
     printf("Compressed file size: %" PRIu64 " bytes\n", read_total);
     printf("Uncompressed file size: %" PRIu64 " bytes\n", write_total);
-    float ratio = 100.0 * ((float)1 - ((float)read_total / (float)write_total));
+    float ratio = write_total == 0 ? (float)0.0 :
+        100.0 * ((float)1 - ((float)read_total / (float)write_total));
     printf("Compression ratio: %2.2f%%\n", ratio);
   }
 
   // Cleanup
   close(infile);
   close(outfile);
-  wt_delete(table);
+  lz78_decoder_delete(dec);
+  lz78_dict_delete(dict);
+  free(lead);
   return 0;
 }
@@ -0,0 +1,360 @@
+//
+// Contains implementation of shared dictionaries
+//
+
+#include "dict.h"
+#include "endian.h"
+#include "io.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Offset basis and prime of the 32 bit FNV-1a hash the ID is taken with
+#define FNV_BASIS 0x811C9DC5u
+#define FNV_PRIME 0x01000193u
+
+//
+// Hashes the part of a dictionary file that follows its ID.
+//
+// buf: Bytes to hash.
+// len: Number of bytes to hash.
+// returns: The hash, never 0, as an ID of 0 means no dictionary.
+//
+static uint32_t dict_hash(const uint8_t *buf, size_t len) {
+  uint32_t hash = FNV_BASIS;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ buf[i]) * FNV_PRIME;
+  }
+  return hash != 0 ? hash : 1;
+}
+
+//
+// Checks that no two phrases of a dictionary are the same symbol appended
+// to the same parent, as a Trie holds each phrase once.
+//
+// dict: Dictionary whose entries and text are set.
+// returns: True if every phrase is different, false if memory ran out or
+//          a phrase is repeated.
+//
+static bool dict_unique(const lz78_dict *dict) {
+  uint32_t bits = 1;
+  while (((uint32_t)1 << bits) < 2 * dict->count) {
+    bits++;
+  }
+  uint32_t mask = ((uint32_t)1 << bits) - 1;
+  uint64_t *keys = (uint64_t *)calloc((size_t)mask + 1, sizeof(uint64_t));
+  if (keys == NULL) {
+    return false;
+  }
+  bool unique = true;
+  for (uint32_t i = 0; i < dict->count && unique; i++) {
+    uint64_t key = ((uint64_t)dict->entries[i].parent << 8 | dict_sym(dict, i))
+                   + 1;
+    uint32_t slot = (uint32_t)(key * 0x9E3779B97F4A7C15u >> 32) & mask;
+    while (keys[slot] != 0 && keys[slot] != key) {
+      slot = (slot + 1) & mask;
+    }
+    unique = keys[slot] == 0;
+    keys[slot] = key;
+  }
+  free(keys);
+  return unique;
+}
+
+//
+// Checks the image of a dictionary file and makes a dictionary of it.
+//
+// image: The dictionary as it is on disk, aligned to 4 bytes.
+// len: Number of bytes in image.
+// mapped: True if image is a mapping, false if it is allocated.
+// returns: Pointer to the dictionary, which owns image, or NULL if the
+//          image is not valid or memory ran out, in which case the caller
+//          still owns image.
+//
+static lz78_dict *dict_open(uint8_t *image, size_t len, bool mapped) {
+  if (len < DICT_HEADER_SIZE || load32(image) != DICT_MAGIC) {
+    return (void *)0;
+  }
+  uint32_t id = load32(image + 4);
+  uint32_t count = load32(image + 8);
+  uint32_t singles = load32(image + 12);
+  uint32_t text_len = load32(image + 16);
+  if (count > DICT_MAX_PHRASES || singles > count || singles > 256 ||
+      len != DICT_HEADER_SIZE + (size_t)count * DICT_ENTRY_SIZE + text_len ||
+      id != dict_hash(image + 8, len - 8)) {
+    return (void *)0;
+  }
+  lz78_dict *new = (lz78_dict *)calloc(1, sizeof(lz78_dict));
+  if (new == NULL) {
+    return (void *)0;
+  }
+  new->id = id;
+  new->count = count;
+  new->singles = singles;
+  new->text = image + DICT_HEADER_SIZE + (size_t)count * DICT_ENTRY_SIZE;
+  new->text_len = text_len;
+  new->image = image;
+  new->image_len = len;
+  new->mapped = mapped;
+  // Entries are used where they lie, unless the byte order differs
+  const uint8_t *raw = image + DICT_HEADER_SIZE;
+  if (is_big()) {
+    new->native = (DictEntry *)malloc((size_t)count * sizeof(DictEntry) + 1);
+    if (new->native == NULL) {
+      free(new);
+      return (void *)0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      new->native[i].parent = load32(raw + (size_t)i * DICT_ENTRY_SIZE);
+      new->native[i].pos = load32(raw + (size_t)i * DICT_ENTRY_SIZE + 4);
+      new->native[i].len = load32(raw + (size_t)i * DICT_ENTRY_SIZE + 8);
+    }
+    new->entries = new->native;
+  } else {
+    new->entries = (const DictEntry *)raw;
+  }
+
+  // Each phrase extends an earlier one by a symbol, and appears in the text
+  bool valid = true;
+  for (uint32_t i = 0; i < count && valid; i++) {
+    const DictEntry *e = &new->entries[i];
+    const DictEntry *p = e->parent != 0 ? &new->entries[e->parent - 1] : NULL;
+    uint32_t parent_len = p != NULL ? p->len : 0;
+    valid = e->parent <= i && (e->parent == 0) == (i < singles) &&
+            e->len == parent_len + 1 &&
+            (uint64_t)e->pos + e->len <= text_len &&
+            (p == NULL ||
+                memcmp(new->text + e->pos, new->text + p->pos, p->len) == 0);
+  }
+  if (!valid || !dict_unique(new)) {
+    free(new->native);
+    free(new);
+    return (void *)0;
+  }
+  return new;
+}
+
+//
+// Loads a dictionary file by mapping it, so that its pages are shared with
+// every other process that loads it. The file is checked in full.
+//
+// path: Path of the dictionary file.
+// returns: Pointer to the dictionary, or NULL if the file could not be read
+//          or is not a valid dictionary.
+//
+lz78_dict *lz78_dict_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return (void *)0;
+  }
+  struct stat sb;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return (void *)0;
+  }
+  lz78_dict *dict = dict_open((uint8_t *)map, sb.st_size, true);
+  if (dict == NULL) {
+    munmap(map, sb.st_size);
+  }
+  return dict;
+}
+
+//
+// Struct definition of a phrase given to lz78_dict_build.
+//
+// syms: Bytes of the phrase.
+// len: Length of the phrase.
+//
+typedef struct Phrase {
+  const uint8_t *syms;
+  uint32_t len;
+} Phrase;
+
+//
+// Orders phrases by their bytes, a phrase before those it is a prefix of.
+//
+static int phrase_cmp(const void *a, const void *b) {
+  const Phrase *x = (const Phrase *)a;
+  const Phrase *y = (const Phrase *)b;
+  int c = memcmp(x->syms, y->syms, x->len < y->len ? x->len : y->len);
+  if (c != 0) {
+    return c;
+  }
+  return x->len < y->len ? -1 : x->len > y->len;
+}
+
+//
+// Returns the length of the common prefix of two phrases.
+//
+static uint32_t common_len(const Phrase *x, const Phrase *y) {
+  uint32_t n = x->len < y->len ? x->len : y->len;
+  uint32_t i = 0;
+  while (i < n && x->syms[i] == y->syms[i]) {
+    i++;
+  }
+  return i;
+}
+
+//
+// Builds a dictionary holding the given phrases and every prefix of them.
+//
+// Once sorted, each phrase adds a phrase for each of its prefixes longer
+// than what it has in common with the one before. The text holds each
+// phrase that is not a prefix of the next, which the prefixes added since
+// the last one appear in. The phrases are then put in order of length.
+//
+// phrases: Bytes of each phrase.
+// lens: Length of each phrase; phrases of length 0 are skipped.
+// count: Number of phrases.
+// returns: Pointer to the dictionary, or NULL if allocation failed or the
+//          phrases and their prefixes number more than DICT_MAX_PHRASES.
+//
+lz78_dict *lz78_dict_build(const uint8_t *const *phrases,
+    const uint32_t *lens, uint32_t count) {
+  Phrase *sorted = (Phrase *)malloc(((size_t)count + 1) * sizeof(Phrase));
+  uint32_t n = 0;
+  uint32_t longest = 0;
+  uint64_t total = 0;
+  for (uint32_t i = 0; sorted != NULL && i < count; i++) {
+    if (lens[i] > 0) {
+      sorted[n].syms = phrases[i];
+      sorted[n++].len = lens[i];
+      longest = lens[i] > longest ? lens[i] : longest;
+      total += lens[i];
+    }
+  }
+  if (sorted == NULL || total > UINT32_MAX) {
+    free(sorted);
+    return (void *)0;
+  }
+  qsort(sorted, n, sizeof(Phrase), phrase_cmp);
+
+  // Phrases in the order they are made, and the text they appear in
+  uint32_t cap = total < DICT_MAX_PHRASES ? total : DICT_MAX_PHRASES;
+  DictEntry *made = (DictEntry *)malloc(((size_t)cap + 1) * sizeof(DictEntry));
+  uint32_t *path = (uint32_t *)malloc(((size_t)longest + 1) * sizeof(uint32_t));
+  uint8_t *text = (uint8_t *)malloc(total + 1);
+  uint32_t made_count = 0;
+  uint32_t pending = 0;
+  uint32_t text_len = 0;
+  bool ok = made != NULL && path != NULL && text != NULL;
+  for (uint32_t k = 0; ok && k < n; k++) {
+    Phrase *s = &sorted[k];
+    uint32_t l = k > 0 ? common_len(&sorted[k - 1], s) : 0;
+    path[0] = 0;
+    for (l++; l <= s->len && ok; l++) {
+      ok = made_count < DICT_MAX_PHRASES;
+      if (ok) {
+        made[made_count].parent = path[l - 1];
+        made[made_count].len = l;
+        path[l] = ++made_count;
+      }
+    }
+    if (ok && (k + 1 == n || common_len(s, &sorted[k + 1]) < s->len)) {
+      memcpy(text + text_len, s->syms, s->len);
+      for (; pending < made_count; pending++) {
+        made[pending].pos = text_len;
+      }
+      text_len += s->len;
+    }
+  }
+  free(sorted);
+  free(path);
+
+  // Order the phrases by length, which puts every parent before its
+  // children and the single symbols first
+  uint32_t *order = NULL;
+  uint32_t *index = NULL;
+  uint32_t *starts = NULL;
+  uint8_t *image = NULL;
+  size_t image_len = DICT_HEADER_SIZE +
+                     (size_t)made_count * DICT_ENTRY_SIZE + text_len;
+  if (ok) {
+    order = (uint32_t *)malloc(((size_t)made_count + 1) * sizeof(uint32_t));
+    index = (uint32_t *)malloc(((size_t)made_count + 1) * sizeof(uint32_t));
+    starts = (uint32_t *)calloc((size_t)longest + 2, sizeof(uint32_t));
+    image = (uint8_t *)malloc(image_len);
+    ok = order != NULL && index != NULL && starts != NULL && image != NULL;
+  }
+  lz78_dict *dict = NULL;
+  if (ok) {
+    for (uint32_t i = 0; i < made_count; i++) {
+      starts[made[i].len + 1]++;
+    }
+    for (uint32_t l = 1; l <= longest; l++) {
+      starts[l + 1] += starts[l];
+    }
+    for (uint32_t i = 0; i < made_count; i++) {
+      index[i] = starts[made[i].len]++;
+      order[index[i]] = i;
+    }
+    memset(image, 0, DICT_HEADER_SIZE);
+    store32(image, DICT_MAGIC);
+    store32(image + 8, made_count);
+    store32(image + 12, longest > 0 ? starts[1] : 0);
+    store32(image + 16, text_len);
+    uint8_t *raw = image + DICT_HEADER_SIZE;
+    for (uint32_t j = 0; j < made_count; j++) {
+      DictEntry *e = &made[order[j]];
+      store32(raw, e->parent != 0 ? index[e->parent - 1] + 1 : 0);
+      store32(raw + 4, e->pos);
+      store32(raw + 8, e->len);
+      raw += DICT_ENTRY_SIZE;
+    }
+    memcpy(raw, text, text_len);
+    store32(image + 4, dict_hash(image + 8, image_len - 8));
+    dict = dict_open(image, image_len, false);
+  }
+  if (dict == NULL) {
+    free(image);
+  }
+  free(made);
+  free(text);
+  free(order);
+  free(index);
+  free(starts);
+  return dict;
+}
+
+//
+// Writes a dictionary to a file that lz78_dict_load reads.
+//
+// dict: Dictionary to write.
+// path: Path of the file, which is created or truncated.
+// returns: True on success, false if the file could not be written.
+//
+bool lz78_dict_save(const lz78_dict *dict, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = write_bytes(fd, dict->image, dict->image_len);
+  return close(fd) == 0 && ok;
+}
+
+//
+// Destructor for a dictionary. No encoder or decoder may still use it.
+//
+// dict: Dictionary to free memory for.
+// returns: Void.
+//
+void lz78_dict_delete(lz78_dict *dict) {
+  if (dict != NULL) {
+    if (dict->mapped) {
+      munmap(dict->image, dict->image_len);
+    } else {
+      free(dict->image);
+    }
+    free(dict->native);
+    free(dict);
+  }
+  return;
+}
@@ -0,0 +1,186 @@
+//
+// Contains definitions for shared dictionaries, phrases the dictionary of
+// a stream starts out with, so that short inputs that look alike, such as
+// small records, compress well from their first byte
+//
+
+#ifndef __DICT_H__
+#define __DICT_H__
+
+#include "code.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Magic number of a dictionary file, next to the MAGIC of a plain file
+#define DICT_MAGIC 0x8badd1c7
+
+// Number of bytes the header of a dictionary file and each of its entries
+// take up
+#define DICT_HEADER_SIZE 32
+#define DICT_ENTRY_SIZE 12
+
+// Most phrases a dictionary may hold, so that its codes fit in the largest
+// dictionary with room to spare
+#define DICT_MAX_PHRASES (MAX_CODE_OF(MAX_CODE_BITS) / 2)
+
+//
+// Struct definition of a DictEntry, a phrase of a dictionary. On disk an
+// entry is its three fields, little endian.
+//
+// parent: Index plus one of the phrase without its last symbol, or 0 for a
+//         phrase of a single symbol.
+// pos: Position in the text of the dictionary where the phrase appears.
+// len: Length of the phrase.
+//
+typedef struct DictEntry {
+  uint32_t parent;
+  uint32_t pos;
+  uint32_t len;
+} DictEntry;
+
+//
+// Struct definition of a dictionary, which is read only once loaded, so
+// one dictionary may be shared by any number of encoders and decoders on
+// any number of threads.
+//
+// A dictionary file is a header of DICT_HEADER_SIZE bytes: DICT_MAGIC, the
+// ID, the number of phrases, the number of single symbols and the length
+// of the text, little endian, and 12 reserved bytes. The entries follow,
+// then the text. Every prefix of a phrase is itself a phrase that comes
+// before it, and the single symbols come first.
+//
+// id: Identifier of the dictionary, a hash of everything after it in the
+//     file, recorded in the FileHeader of each stream it is used for.
+// count: Number of phrases.
+// singles: Number of phrases of a single symbol, the first ones.
+// entries: One DictEntry per phrase.
+// text: Bytes every phrase appears in.
+// text_len: Number of bytes in text.
+// image: The dictionary as it is on disk.
+// image_len: Number of bytes in image.
+// mapped: True if image is a mapping of the file, false if it is allocated.
+// native: Entries in the byte order of the system, allocated only if it is
+//         not little endian, or NULL.
+//
+typedef struct lz78_dict {
+  uint32_t id;
+  uint32_t count;
+  uint32_t singles;
+  const DictEntry *entries;
+  const uint8_t *text;
+  uint32_t text_len;
+  uint8_t *image;
+  size_t image_len;
+  bool mapped;
+  DictEntry *native;
+} lz78_dict;
+
+//
+// Loads a dictionary file by mapping it, so that its pages are shared with
+// every other process that loads it. The file is checked in full.
+//
+// path: Path of the dictionary file.
+// returns: Pointer to the dictionary, or NULL if the file could not be read
+//          or is not a valid dictionary.
+//
+lz78_dict *lz78_dict_load(const char *path);
+
+//
+// Builds a dictionary holding the given phrases and every prefix of them.
+//
+// phrases: Bytes of each phrase.
+// lens: Length of each phrase; phrases of length 0 are skipped.
+// count: Number of phrases.
+// returns: Pointer to the dictionary, or NULL if allocation failed or the
+//          phrases and their prefixes number more than DICT_MAX_PHRASES.
+//
+lz78_dict *lz78_dict_build(const uint8_t *const *phrases,
+    const uint32_t *lens, uint32_t count);
+
+//
+// Writes a dictionary to a file that lz78_dict_load reads.
+//
+// dict: Dictionary to write.
+// path: Path of the file, which is created or truncated.
+// returns: True on success, false if the file could not be written.
+//
+bool lz78_dict_save(const lz78_dict *dict, const char *path);
+
+//
+// Destructor for a dictionary. No encoder or decoder may still use it.
+//
+// dict: Dictionary to free memory for.
+// returns: Void.
+//
+void lz78_dict_delete(lz78_dict *dict);
+
+//
+// Returns the code a phrase of a dictionary is given. In MODE_LZ78 the
+// phrases take the codes from START_CODE up. In the modes that send codes
+// only, a single symbol keeps its LITERAL_CODE and the longer phrases take
+// the codes from WORD_START_CODE up.
+//
+// dict: Dictionary of the phrase.
+// mode: CodecMode of the stream.
+// i: Index of the phrase.
+// returns: Code of the phrase.
+//
+static inline uint32_t dict_code(const lz78_dict *dict, CodecMode mode,
+    uint32_t i) {
+  if (mode == MODE_LZ78) {
+    return START_CODE + i;
+  }
+  if (i < dict->singles) {
+    return LITERAL_CODE(dict->text[dict->entries[i].pos]);
+  }
+  return WORD_START_CODE + (i - dict->singles);
+}
+
+//
+// Returns the code of the parent of a phrase of a dictionary.
+//
+// dict: Dictionary of the phrase.
+// mode: CodecMode of the stream.
+// i: Index of the phrase.
+// returns: Code of the phrase without its last symbol, EMPTY_CODE for a
+//          single symbol.
+//
+static inline uint32_t dict_parent_code(const lz78_dict *dict,
+    CodecMode mode, uint32_t i) {
+  uint32_t parent = dict->entries[i].parent;
+  return parent == 0 ? EMPTY_CODE : dict_code(dict, mode, parent - 1);
+}
+
+//
+// Returns the last symbol of a phrase of a dictionary.
+//
+// dict: Dictionary of the phrase.
+// i: Index of the phrase.
+// returns: Last symbol of the phrase.
+//
+static inline uint8_t dict_sym(const lz78_dict *dict, uint32_t i) {
+  const DictEntry *e = &dict->entries[i];
+  return dict->text[e->pos + e->len - 1];
+}
+
+//
+// Returns the code the first phrase a stream makes is given, the code
+// after the last one the dictionary of the stream starts out with.
+//
+// dict: Dictionary of the stream, or NULL for none.
+// mode: CodecMode of the stream.
+// returns: First code of the stream's own phrases.
+//
+static inline uint32_t dict_first_code(const lz78_dict *dict,
+    CodecMode mode) {
+  uint32_t first = mode == MODE_LZ78 ? START_CODE : WORD_START_CODE;
+  if (dict != NULL) {
+    first += dict->count - (mode == MODE_LZ78 ? 0 : dict->singles);
+  }
+  return first;
+}
+
+#endif
@@ -1,8 +1,10 @@
+#include "batch.h"
 #include "code.h"
+#include "frame.h"
 #include "io.h"
-#include "math.h"
+#include "lz78.h"
+#include "pipe.h"
 #include "trie.h"
-#include "word.h"
 
 #include <errno.h>
 #include <getopt.h>
@@ -15,24 +17,303 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define OPTIONS "vi:o:"
+#define OPTIONS "vSPNi:o:b:T:B:d:p:m:eI:RL:D:123456789"
 
-// Keeps track of how many bytes are written/read from for statistics
-uint64_t read_total = 0;
-uint64_t write_total = 0;
+//
+// Prints the statistics of a run as one JSON object on stderr, so they
+// stay apart from output written to stdout.
+//
+// stats: Statistics of the run.
+// total_in: Number of bytes read.
+// total_out: Number of bytes written.
+// syscalls: Number of read and write system calls made.
+// returns: Void.
+//
+static void print_stats(const lz78_stats *stats, uint64_t total_in,
+    uint64_t total_out, uint64_t syscalls) {
+  double avg = stats->phrases > 0 ? (double)total_in / stats->phrases : 0;
+  fprintf(stderr,
+      "{\"input_bytes\": %" PRIu64 ", \"output_bytes\": %" PRIu64
+      ", \"read_ns\": %" PRIu64 ", \"code_ns\": %" PRIu64
+      ", \"write_ns\": %" PRIu64 ", \"phrases\": %" PRIu64
+      ", \"avg_phrase_len\": %.2f, \"trie_nodes\": %" PRIu64
+      ", \"resets\": %" PRIu64 ", \"stored_blocks\": %" PRIu64
+      ", \"syscalls\": %" PRIu64 ", \"code_widths\": {",
+      total_in, total_out, stats->read_ns, stats->code_ns, stats->write_ns,
+      stats->phrases, avg, stats->nodes, stats->resets, stats->stored,
+      syscalls);
+  bool first = true;
+  for (uint32_t bits = 0; bits <= MAX_CODE_BITS; bits++) {
+    if (stats->widths[bits] > 0) {
+      fprintf(stderr, "%s\"%" PRIu32 "\": %" PRIu64, first ? "" : ", ", bits,
+          stats->widths[bits]);
+      first = false;
+    }
+  }
+  fprintf(stderr, "}}\n");
+  return;
+}
+
+//
+// Compresses the input file into a plain stream, packing the pairs straight
+// into the output, see OutWriter.
+//
+// enc: Encoder of the stream, at its start.
+// reader: SymReader of the input file.
+// writer: OutWriter of the output file.
+// timed: Statistics to add the time spent reading, compressing and writing
+//        to, or NULL to not read the clock.
+// returns: True on success, false if the output could not be written.
+//
+static bool compress_plain(lz78_encoder *enc, SymReader *reader,
+    OutWriter *writer, lz78_stats *timed) {
+  uint8_t *syms = NULL;
+  uint64_t syms_len = 0;
+  uint64_t mark = timed != NULL ? clock_ns() : 0;
+  while ((syms_len = read_syms(reader, &syms)) > 0) {
+    if (timed != NULL) {
+      timed->read_ns += clock_ns() - mark;
+    }
+    while (syms_len > 0) {
+      size_t used = 0;
+      uint64_t room = 0;
+      mark = timed != NULL ? clock_ns() : 0;
+      uint8_t *out = out_reserve(writer, OUT_BLOCK, &room);
+      if (timed != NULL) {
+        uint64_t reserved = clock_ns();
+        timed->write_ns += reserved - mark;
+        mark = reserved;
+      }
+      int64_t len = out == NULL ? LZ78_ERR_CAPACITY :
+          lz78_compress(enc, syms, syms_len, &used, out, room);
+      if (timed != NULL) {
+        timed->code_ns += clock_ns() - mark;
+      }
+      if (len < 0) {
+        return false;
+      }
+      out_commit(writer, len);
+      syms += used;
+      syms_len -= used;
+    }
+    mark = timed != NULL ? clock_ns() : 0;
+  }
+  uint64_t room = 0;
+  uint8_t *out = out_reserve(writer, OUT_BLOCK, &room);
+  int64_t len = out == NULL ? LZ78_ERR_CAPACITY :
+      lz78_compress_finish(enc, out, room);
+  if (len < 0) {
+    return false;
+  }
+  out_commit(writer, len);
+  return true;
+}
+
+//
+// Stops the threads reading input ahead and writing output behind, which
+// must be done before either file is closed, so that neither thread is
+// left with a file descriptor that has been closed or handed out again.
+//
+// reader: SymReader of the input file.
+// writer: OutWriter of the output file.
+// returns: True if every byte was written, false otherwise.
+//
+static bool stop_io(SymReader *reader, OutWriter *writer) {
+  bool ok = out_writer_close(writer);
+  sym_reader_close(reader);
+  return ok;
+}
 
 //
-// Returns how many bits are required to represent a given number
+// Struct definition of the state of a thread of batch mode.
 //
-// code: the number to represent
-// returns: the number of bits required to represent the code
+// enc: Encoder reused for every file the thread compresses, so that its
+//      dictionary is only allocated once.
+// reader: SymReader of the file being compressed.
+// timed: Whether the time spent is added to stats.
+// stats: Statistics of the files the thread compressed.
+// total_in: Number of bytes read.
+// total_out: Number of bytes written.
+//
+typedef struct BatchEncoder {
+  lz78_encoder *enc;
+  SymReader reader;
+  bool timed;
+  lz78_stats stats;
+  uint64_t total_in;
+  uint64_t total_out;
+} BatchEncoder;
+
 //
-uint16_t bit_len(uint16_t code) {
-  if (code == 0) {
-    return 1;
+// Compresses one file of a batch to a file named with BATCH_SUFFIX added,
+// with the same protection. Output of a file that fails is removed.
+//
+// state: BatchEncoder of the thread.
+// path: Path of the file.
+// returns: True on success, false otherwise.
+//
+static bool encode_file(void *state, const char *path) {
+  BatchEncoder *b = (BatchEncoder *)state;
+  int32_t infile = open(path, O_RDONLY);
+  struct stat sb;
+  if (infile == -1 || fstat(infile, &sb) == -1) {
+    printf("%s: Unable to open input file.\n", path);
+    if (infile != -1) {
+      close(infile);
+    }
+    return false;
+  }
+  char *out_name = batch_out_name(path, false);
+  int32_t outfile = out_name == NULL ? -1 :
+      open(out_name, O_RDWR | O_CREAT | O_TRUNC, sb.st_mode);
+  if (outfile == -1) {
+    printf("%s: Unable to open output file.\n", path);
+    free(out_name);
+    close(infile);
+    return false;
+  }
+
+  // The encoder keeps its FileHeader from stream to stream, so only the
+  // protection of each file is filled in
+  lz78_encoder_set_protection(b->enc, sb.st_mode);
+  lz78_encoder_reset(b->enc, true);
+  sym_reader_init(&b->reader, infile);
+  OutWriter writer;
+  out_writer_init(&writer, outfile, 0);
+  bool ok = compress_plain(b->enc, &b->reader, &writer,
+      b->timed ? &b->stats : NULL);
+  ok = out_writer_close(&writer) && ok;
+  sym_reader_close(&b->reader);
+  close(infile);
+  close(outfile);
+  if (ok) {
+    b->total_in += b->enc->total_in;
+    b->total_out += b->enc->total_out;
+    lz78_encoder_stats(b->enc, &b->stats);
   } else {
-    return log2(code) + 1;
+    printf("%s: Unable to write output file.\n", path);
+    unlink(out_name);
+  }
+  free(out_name);
+  return ok;
+}
+
+//
+// Frees the BatchEncoders of a batch and their encoders.
+//
+// workers: Array of BatchEncoders, any of which may be NULL.
+// threads: Number of BatchEncoders in workers.
+// returns: Void.
+//
+static void free_workers(BatchEncoder **workers, uint32_t threads) {
+  for (uint32_t t = 0; t < threads; t++) {
+    if (workers[t] != NULL) {
+      lz78_encoder_delete(workers[t]->enc);
+      free(workers[t]);
+    }
   }
+  free(workers);
+  return;
+}
+
+//
+// Compresses every file of a batch, each to its own plain stream, on a
+// work stealing pool of threads that each reuse one encoder.
+//
+// paths: Files and directories named on the command line.
+// count: Number of paths.
+// manifest: File naming more files and directories, one per line, "-" for
+//           stdin, or NULL.
+// recurse: Whether to compress the files below directories.
+// opts: Options for the encoders.
+// threads: Number of threads, or 0 for one per processor.
+// display_stats: Whether to print the sizes and ratio of the batch.
+// json_stats: Whether to print the statistics of the batch as JSON.
+// returns: 0 if every file was compressed, -1 otherwise.
+//
+static int encode_batch(char **paths, uint32_t count, const char *manifest,
+    bool recurse, const lz78_options *opts, uint32_t threads,
+    bool display_stats, bool json_stats) {
+  BatchList list;
+  batch_list_init(&list);
+  uint32_t failed = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    failed += !batch_add(&list, paths[i], recurse, false);
+  }
+  if (manifest != NULL) {
+    FILE *f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (f == NULL) {
+      printf("Unable to open manifest file specified.\n");
+      batch_list_free(&list);
+      return -1;
+    }
+    failed += !batch_add_manifest(&list, f, recurse, false);
+    if (f != stdin) {
+      fclose(f);
+    }
+  }
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online < 1 ? 1 : online > 256 ? 256 : online;
+  }
+  threads = threads < list.count ? threads : list.count;
+
+  BatchEncoder **workers =
+      (BatchEncoder **)calloc(threads + 1, sizeof(BatchEncoder *));
+  if (workers == NULL) {
+    printf("Failed to allocate encoder.\n");
+    batch_list_free(&list);
+    return -1;
+  }
+  for (uint32_t t = 0; t < threads; t++) {
+    workers[t] = (BatchEncoder *)calloc(1, sizeof(BatchEncoder));
+    if (workers[t] == NULL ||
+        (workers[t]->enc = lz78_encoder_create(opts)) == NULL) {
+      printf("Failed to allocate encoder.\n");
+      free_workers(workers, threads);
+      batch_list_free(&list);
+      return -1;
+    }
+    workers[t]->timed = json_stats;
+  }
+  failed += batch_run(&list, threads, encode_file, (void **)workers);
+
+  lz78_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  uint64_t read_total = 0;
+  uint64_t write_total = 0;
+  for (uint32_t t = 0; t < threads; t++) {
+    BatchEncoder *b = workers[t];
+    stats.phrases += b->stats.phrases;
+    stats.nodes += b->stats.nodes;
+    stats.resets += b->stats.resets;
+    for (uint32_t bits = 0; bits <= MAX_CODE_BITS; bits++) {
+      stats.widths[bits] += b->stats.widths[bits];
+    }
+    stats.read_ns += b->stats.read_ns;
+    stats.code_ns += b->stats.code_ns;
+    stats.write_ns += b->stats.write_ns;
+    read_total += b->total_in;
+    write_total += b->total_out;
+  }
+  free_workers(workers, threads);
+
+  if (json_stats) {
+    print_stats(&stats, read_total, write_total, io_syscalls());
+  }
+  if (display_stats) {
+    float ratio = read_total == 0 ? (float)0.0 :
+        (float)1 - (float)write_total / read_total;
+    ratio = ratio * (float)100.0;
+    printf("Compressed files: %" PRIu32 " of %" PRIu32 "\n",
+        list.count - (failed > list.count ? list.count : failed),
+        list.count);
+    printf("Compressed file size: %" PRIu64 " bytes\n", write_total);
+    printf("Uncompressed file size: %" PRIu64 " bytes\n", read_total);
+    printf("Compression ratio: %2.2f%%\n", ratio);
+  }
+  batch_list_free(&list);
+  return failed > 0 ? -1 : 0;
 }
 
 //
@@ -42,18 +323,160 @@ int main(int argc, char **argv) {
 
   // Default values for program arguments
   bool display_stats = false;
+  bool json_stats = false;
   char *in_file_name = NULL;
   char *out_file_name = NULL;
+  TrieBackend backend = TRIE_HYBRID;
+  uint32_t threads = 0;
+  uint32_t block_size = DEFAULT_BLOCK_SIZE;
+  uint32_t code_bits = DEFAULT_CODE_BITS;
+  DictPolicy policy = DICT_RESET;
+  CodecMode mode = MODE_LZ78;
+  bool entropy = false;
+  bool pipelined = false;
+  bool store = true;
+  uint64_t io_size = IO_BUFFER;
+  uint32_t io_depth = IO_DEPTH;
+  bool recurse = false;
+  char *manifest = NULL;
+  char *dict_name = NULL;
+  uint8_t level = LZ78_MIN_LEVEL;
 
   char c = 0;
   while ((c = getopt(argc, argv, OPTIONS)) != -1) {
     if (c == 'v') {
       display_stats = true;
+    } else if (c == 'S') {
+      json_stats = true;
+    } else if (c == 'P') {
+      pipelined = true;
+    } else if (c == 'N') {
+      store = false;
     } else if (c == 'i') {
       in_file_name = optarg;
     } else if (c == 'o') {
       out_file_name = optarg;
+    } else if (c == 'b') {
+      if (!trie_backend_parse(optarg, &backend)) {
+        printf("Unknown trie backend, expected dense, hybrid or hash.\n");
+        return -1;
+      }
+    } else if (c == 'T') {
+      threads = strtoul(optarg, NULL, 10);
+      if (threads < 1 || threads > 256) {
+        printf("Thread count must be between 1 and 256.\n");
+        return -1;
+      }
+    } else if (c == 'B') {
+      uint64_t mb = strtoul(optarg, NULL, 10);
+      if (mb < MIN_BLOCK_SIZE / MEGABYTE || mb > MAX_BLOCK_SIZE / MEGABYTE) {
+        printf("Block size must be between %d and %d MB.\n",
+            MIN_BLOCK_SIZE / MEGABYTE, MAX_BLOCK_SIZE / MEGABYTE);
+        return -1;
+      }
+      block_size = mb * MEGABYTE;
+    } else if (c == 'd') {
+      code_bits = strtoul(optarg, NULL, 10);
+      if (code_bits < MIN_CODE_BITS || code_bits > MAX_CODE_BITS) {
+        printf("Dictionary size must be between %d and %d bits.\n",
+            MIN_CODE_BITS, MAX_CODE_BITS);
+        return -1;
+      }
+    } else if (c == 'p') {
+      if (!lz78_policy_parse(optarg, &policy)) {
+        printf("Unknown dictionary policy, expected reset, freeze, adaptive "
+               "or prune.\n");
+        return -1;
+      }
+    } else if (c == 'm') {
+      if (!lz78_mode_parse(optarg, &mode)) {
+        printf("Unknown mode, expected lz78, lzw or lzap.\n");
+        return -1;
+      }
+    } else if (c == 'e') {
+      entropy = true;
+    } else if (c == 'R') {
+      recurse = true;
+    } else if (c == 'L') {
+      manifest = optarg;
+    } else if (c == 'D') {
+      dict_name = optarg;
+    } else if (c >= '0' + LZ78_MIN_LEVEL && c <= '0' + LZ78_MAX_LEVEL) {
+      level = c - '0';
+    } else if (c == 'I') {
+      if (!io_buffers_parse(optarg, &io_size, &io_depth)) {
+        printf("I/O buffers must be given as KB[:COUNT], from %d to %d KB "
+               "and %d to %d buffers, or 0.\n",
+            IO_MIN_BUFFER / 1024, IO_MAX_BUFFER / 1024, IO_MIN_DEPTH,
+            IO_MAX_DEPTH);
+        return -1;
+      }
+    }
+  }
+  if (policy == DICT_PRUNE && mode != MODE_LZ78) {
+    printf("The prune policy can only be used with the lz78 mode.\n");
+    return -1;
+  }
+  if (policy == DICT_PRUNE && level > LZ78_MIN_LEVEL) {
+    printf("The prune policy can only be used with level 1.\n");
+    return -1;
+  }
+
+  // A shared dictionary is loaded once, and every encoder starts from it
+  lz78_dict *dict = NULL;
+  if (dict_name != NULL) {
+    dict = lz78_dict_load(dict_name);
+    if (dict == NULL) {
+      printf("Unable to load dictionary file specified.\n");
+      return -1;
+    }
+    if (policy == DICT_PRUNE) {
+      printf("The prune policy cannot be used with a dictionary.\n");
+      return -1;
+    }
+    if (dict_first_code(dict, mode) >= MAX_CODE_OF(code_bits)) {
+      printf("The dictionary holds too many phrases for %" PRIu32
+             " bit codes.\n",
+          code_bits);
+      return -1;
+    }
+  }
+  lz78_options opts;
+  lz78_options_default(&opts);
+  opts.backend = backend;
+  opts.code_bits = code_bits;
+  opts.policy = policy;
+  opts.mode = mode;
+  opts.entropy = entropy;
+  opts.dict = dict;
+  opts.level = level;
+  opts.store = store;
+
+  // Files named after the options, or in a manifest, are compressed in
+  // batch mode, with "-T" threads
+  if (optind < argc || manifest != NULL) {
+    if (entropy || pipelined || in_file_name != NULL ||
+        out_file_name != NULL) {
+      printf("Batch mode writes a plain file beside each input, so it "
+             "cannot be used with -e, -P, -i or -o.\n");
+      return -1;
     }
+    int status = encode_batch(argv + optind, argc - optind, manifest,
+        recurse, &opts, threads, display_stats, json_stats);
+    lz78_dict_delete(dict);
+    return status;
+  }
+
+  // Pipelining splits the work of one plain stream, which a framed file
+  // splits into blocks instead
+  if (pipelined && (threads > 0 || entropy)) {
+    printf("-P writes a plain file, so it cannot be used with -T or -e.\n");
+    return -1;
+  }
+
+  // Entropy coding works on whole blocks, so it needs a framed file
+  if (entropy && threads == 0) {
+    threads = 1;
   }
 
   // If no user choice is provided, default files are STDIN/OUT
@@ -77,62 +500,76 @@ int main(int argc, char **argv) {
   }
 
   if (out_file_name != NULL) {
-    outfile = open(out_file_name, O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode);
+    // Opened for reading as well, so that it can be mapped
+    outfile = open(out_file_name, O_RDWR | O_CREAT | O_TRUNC, sb.st_mode);
     if (outfile == -1) {
       printf("Unable to open output file specified.\n");
       return -1;
     }
   }
 
-  // Write Header to Output File
-  struct FileHeader fh;
-  memset(&fh, 0, sizeof(fh));
-
-  fh.magic = MAGIC;
-  fh.protection = sb.st_mode;
-  write_header(outfile, &fh);
-
   // Main Compression Logic
-  TrieNode *root = trie_create();
-  TrieNode *curr_node = root;
-  TrieNode *prev_node = NULL;
-  uint8_t curr_sym = 0;
-  uint8_t prev_sym = 0;
-  uint16_t next_code = START_CODE;
-
-  while (read_sym(infile, &curr_sym)) {
-    if (curr_node != NULL) {
-      TrieNode *next_node = trie_step(curr_node, curr_sym);
-      if (next_node != NULL) {
-        prev_node = curr_node;
-        curr_node = next_node;
-      } else {
-        buffer_pair(outfile, curr_node->code, curr_sym, bit_len(next_code));
-        curr_node->children[curr_sym] = trie_node_create(next_code);
-        curr_node = root;
-        next_code++;
-      }
-      if (next_code >= MAX_CODE) {
-        trie_reset(root);
-        curr_node = root;
-        next_code = START_CODE;
-      }
-      prev_sym = curr_sym;
+  opts.protection = sb.st_mode;
+  static SymReader reader;
+  sym_reader_init(&reader, infile);
+  sym_reader_ahead(&reader, io_size, io_depth);
+  OutWriter writer;
+  out_writer_init(&writer, outfile, 0);
+  out_writer_behind(&writer, io_size, io_depth);
+  uint64_t read_total = 0;
+  uint64_t write_total = 0;
+  // Phases are only timed with "-S", so the clock is not read otherwise
+  lz78_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  lz78_stats *timed = json_stats ? &stats : NULL;
+
+  // Framed output, its blocks compressed by a pool of threads
+  if (threads > 0) {
+    if (!frame_encode(&reader, &writer, &opts, threads, block_size,
+            &read_total, &write_total, timed)) {
+      printf("Unable to write output file.\n");
+      stop_io(&reader, &writer);
+      return -1;
     }
+  } else if (pipelined) {
+    // Plain output, parsed on this thread and packed on another
+    if (!pipe_encode(&reader, &writer, &opts, &read_total, &write_total,
+            timed)) {
+      printf("Unable to write output file.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+  } else {
+    // Plain output, compressed as one stream
+    lz78_encoder *enc = lz78_encoder_create(&opts);
+    if (enc == NULL) {
+      printf("Failed to allocate encoder.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+    if (!compress_plain(enc, &reader, &writer, timed)) {
+      printf("Unable to write output file.\n");
+      stop_io(&reader, &writer);
+      return -1;
+    }
+    read_total = enc->total_in;
+    write_total = enc->total_out;
+    lz78_encoder_stats(enc, &stats);
+    lz78_encoder_delete(enc);
   }
 
-  // Output Incomplete Pair
-  if (curr_node != root) {
-    buffer_pair(outfile, prev_node->code, prev_sym, bit_len(next_code));
-    next_code = (next_code + 1) % MAX_CODE;
+  if (!stop_io(&reader, &writer)) {
+    printf("Unable to write output file.\n");
+    return -1;
   }
 
-  // Output STOP_CODE
-  buffer_pair(outfile, STOP_CODE, 0, bit_len(next_code));
-  flush_pairs(outfile);
+  if (json_stats) {
+    print_stats(&stats, read_total, write_total, io_syscalls());
+  }
 
   if (display_stats) {
-    float ratio = (float)1 - (float)write_total / read_total;
+    float ratio = read_total == 0 ? (float)0.0 :
+        (float)1 - (float)write_total / read_total;
     ratio = ratio * (float)100.0;
     if (out_file_name != NULL) {
       fprintf(stderr, "Compressed file size: ");
@@ -150,6 +587,6 @@ int main(int argc, char **argv) {
   // Cleanup
   close(infile);
   close(outfile);
-  trie_delete(root);
+  lz78_dict_delete(dict);
   return 0;
 }
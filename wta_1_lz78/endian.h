@@ -7,6 +7,7 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
 
 //
 // Checks if the order of bytes on the system is big endian.
@@ -71,4 +72,41 @@ static inline uint64_t swap64(uint64_t x) {
   return result;
 }
 
+//
+// Loads 4 bytes as a little endian uint32_t.
+//
+// p: Address of the bytes.
+// returns: The loaded value.
+//
+static inline uint32_t load32(const uint8_t *p) {
+  uint32_t x = 0;
+  memcpy(&x, p, sizeof(x));
+  return is_big() ? swap32(x) : x;
+}
+
+//
+// Loads 8 bytes as a little endian uint64_t.
+//
+// p: Address of the bytes.
+// returns: The loaded value.
+//
+static inline uint64_t load64(const uint8_t *p) {
+  uint64_t x = 0;
+  memcpy(&x, p, sizeof(x));
+  return is_big() ? swap64(x) : x;
+}
+
+//
+// Stores a uint32_t as 4 little endian bytes.
+//
+// p: Address to store the bytes at.
+// x: Value to store.
+// returns: Void.
+//
+static inline void store32(uint8_t *p, uint32_t x) {
+  x = is_big() ? swap32(x) : x;
+  memcpy(p, &x, sizeof(x));
+  return;
+}
+
 #endif
@@ -0,0 +1,1075 @@
+//
+// Contains implementation of the block framed container format
+//
+
+#include "frame.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks read ahead of the oldest block not yet written, per thread
+#define SLOTS_PER_THREAD 2
+
+// States of a Slot
+#define SLOT_FREE 0
+#define SLOT_READY 1
+#define SLOT_BUSY 2
+#define SLOT_DONE 3
+
+//
+// Struct definition of a Source, which gathers input into blocks.
+//
+// reader: SymReader of the input file.
+// syms: Bytes read from reader and not yet gathered.
+// len: Number of bytes in syms.
+// eof: True once reader has run out.
+//
+typedef struct Source {
+  SymReader *reader;
+  const uint8_t *syms;
+  uint64_t len;
+  bool eof;
+} Source;
+
+//
+// Struct definition of a Slot, which holds one block in flight.
+//
+// raw: Uncompressed bytes of the block.
+// raw_buf: Memory raw is copied to when the input is not mapped.
+// raw_len: Number of bytes in raw.
+// comp: Compressed bytes of the block.
+// comp_len: Number of bytes in comp.
+// comp_cap: Size of comp.
+// seq: Position of the block in the file.
+// state: One of the SLOT_ states.
+// failed: True if the block could not be compressed.
+// stored: True if the block is stored as it is, and comp is unused.
+//
+typedef struct Slot {
+  const uint8_t *raw;
+  uint8_t *raw_buf;
+  uint64_t raw_len;
+  uint8_t *comp;
+  uint64_t comp_len;
+  uint64_t comp_cap;
+  uint64_t seq;
+  int state;
+  bool failed;
+  bool stored;
+} Slot;
+
+//
+// Struct definition of a TokenBuffer, which holds the pairs of a block
+// between its two stages when it is entropy coded.
+//
+// tokens: Pairs of the block, see PairWriter.
+// cap: Number of pairs tokens has room for.
+//
+typedef struct TokenBuffer {
+  uint32_t *tokens;
+  uint64_t cap;
+} TokenBuffer;
+
+//
+// Struct definition of a Pool, shared by the threads compressing blocks.
+//
+// lock: Guards the states of the slots and quit.
+// work: Signalled when a slot becomes SLOT_READY, or on quit.
+// done: Signalled when a slot becomes SLOT_DONE.
+// slots: Blocks in flight.
+// nslots: Number of slots.
+// opts: Options for the encoders of the blocks.
+// stats: Statistics the blocks are added to, guarded by lock, or NULL.
+// quit: True once no more blocks will be made ready.
+//
+typedef struct Pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  Slot *slots;
+  uint32_t nslots;
+  const lz78_options *opts;
+  lz78_stats *stats;
+  bool quit;
+} Pool;
+
+//
+// Struct definition of an IndexWriter, which collects the block index.
+//
+// bytes: Entries of the index, as they will be written.
+// count: Number of entries.
+// cap: Number of entries bytes has room for.
+//
+typedef struct IndexWriter {
+  uint8_t *bytes;
+  uint64_t count;
+  uint64_t cap;
+} IndexWriter;
+
+//
+// Struct definition of a Decoding, shared by the threads decoding blocks.
+//
+// lock: Guards next and failed.
+// file: Compressed file.
+// index: Block index of the file.
+// dict: Dictionary the blocks start from, or NULL.
+// block_size: Block size of the file.
+// outfile: File descriptor of the output file.
+// dst: Mapping of the output file blocks are decoded to, or NULL to write
+//      them with pwrite.
+// next: Index of the next block to decode.
+// failed: True once a block could not be decoded or written.
+//
+typedef struct Decoding {
+  pthread_mutex_t lock;
+  const uint8_t *file;
+  FrameIndex *index;
+  const lz78_dict *dict;
+  uint32_t block_size;
+  int outfile;
+  uint8_t *dst;
+  uint64_t next;
+  bool failed;
+} Decoding;
+
+//
+// Loads a little endian uint32_t.
+//
+static inline uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+//
+// Stores a uint32_t little endian.
+//
+static inline void put32(uint8_t *p, uint32_t x) {
+  p[0] = x & 0xFF;
+  p[1] = (x >> 8) & 0xFF;
+  p[2] = (x >> 16) & 0xFF;
+  p[3] = (x >> 24) & 0xFF;
+  return;
+}
+
+//
+// Loads a little endian uint64_t.
+//
+static inline uint64_t get64(const uint8_t *p) {
+  return (uint64_t)get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+//
+// Stores a uint64_t little endian.
+//
+static inline void put64(uint8_t *p, uint64_t x) {
+  put32(p, x & 0xFFFFFFFF);
+  put32(p + 4, x >> 32);
+  return;
+}
+
+//
+// Reads FRAME_HEADER_SIZE little endian bytes into a FrameHeader, followed
+// by the FRAME_SIZE_FIELD bytes of raw_size if the flags have FRAME_SIZED,
+// then the FRAME_DICT_FIELD bytes of dict_id if they have FRAME_DICT.
+//
+// in: Memory holding the header.
+// header: Pointer to memory where the read header should go.
+// returns: Void.
+//
+void read_frame_header(const uint8_t *in, FrameHeader *header) {
+  header->magic = get32(in);
+  header->protection = (uint16_t)(in[4] | in[5] << 8);
+  header->flags = (uint16_t)(in[6] | in[7] << 8);
+  header->block_size = get32(in + 8);
+  header->code_bits = in[12];
+  header->policy = in[13];
+  header->mode = in[14];
+  header->raw_size = 0;
+  header->dict_id = 0;
+  in += FRAME_HEADER_SIZE;
+  if (header->flags & FRAME_SIZED) {
+    header->raw_size = get64(in);
+    in += FRAME_SIZE_FIELD;
+  }
+  if (header->flags & FRAME_DICT) {
+    header->dict_id = get32(in);
+  }
+  return;
+}
+
+//
+// Writes a FrameHeader as frame_header_len little endian bytes.
+//
+// out: Memory to write the header to.
+// header: Pointer to the header to write out.
+// returns: Void.
+//
+void write_frame_header(uint8_t *out, FrameHeader *header) {
+  memset(out, 0, FRAME_HEADER_SIZE);
+  put32(out, header->magic);
+  out[4] = header->protection & 0xFF;
+  out[5] = (header->protection >> 8) & 0xFF;
+  out[6] = header->flags & 0xFF;
+  out[7] = (header->flags >> 8) & 0xFF;
+  put32(out + 8, header->block_size);
+  out[12] = header->code_bits;
+  out[13] = header->policy;
+  out[14] = header->mode;
+  out += FRAME_HEADER_SIZE;
+  if (header->flags & FRAME_SIZED) {
+    put64(out, header->raw_size);
+    out += FRAME_SIZE_FIELD;
+  }
+  if (header->flags & FRAME_DICT) {
+    put32(out, header->dict_id);
+  }
+  return;
+}
+
+//
+// Returns the number of bytes a FrameHeader takes up in a framed file.
+//
+// header: FrameHeader whose flags are set.
+// returns: FRAME_HEADER_SIZE, plus FRAME_SIZE_FIELD if it has raw_size and
+//          FRAME_DICT_FIELD if it has dict_id.
+//
+uint32_t frame_header_len(const FrameHeader *header) {
+  return FRAME_HEADER_SIZE +
+         (header->flags & FRAME_SIZED ? FRAME_SIZE_FIELD : 0) +
+         (header->flags & FRAME_DICT ? FRAME_DICT_FIELD : 0);
+}
+
+//
+// Returns the raw_size of a framed file once the raw_len of its blocks are
+// found to add up to it, walking the block headers, so that a corrupt size
+// is never used to size the output file.
+//
+// file: Compressed file, mapped into memory, or NULL if it is not mapped.
+// file_len: Number of bytes in file.
+// header: FrameHeader of the file.
+// returns: raw_size, or 0 if the file is not mapped, has no raw_size or
+//          its blocks disagree with it.
+//
+uint64_t frame_checked_size(const uint8_t *file, uint64_t file_len,
+    const FrameHeader *header) {
+  if (file == NULL || !(header->flags & FRAME_SIZED)) {
+    return 0;
+  }
+  uint64_t pos = frame_header_len(header);
+  uint64_t raw_size = 0;
+  while (file_len >= BLOCK_HEADER_SIZE && pos <= file_len - BLOCK_HEADER_SIZE) {
+    uint32_t comp_len = get32(file + pos);
+    uint32_t raw_len = get32(file + pos + 4);
+    if (comp_len == 0 && raw_len == 0) {
+      return raw_size == header->raw_size ? raw_size : 0;
+    }
+    raw_size += raw_len;
+    if (raw_size > header->raw_size) {
+      return 0;
+    }
+    pos += BLOCK_HEADER_SIZE + (uint64_t)block_bytes(comp_len);
+  }
+  return 0;
+}
+
+//
+// Gathers up to n bytes of input. If the bytes are contiguous in what the
+// SymReader returned they are not copied, otherwise they are copied to buf.
+// Bytes not copied stay valid until the next call, or for as long as the
+// SymReader is open if it mapped the input file.
+//
+// s: Source to gather from.
+// buf: Memory of at least n bytes.
+// n: Number of bytes wanted.
+// data: Pointer to memory which stores the address of the bytes.
+// returns: Number of bytes gathered, less than n only at the end of input.
+//
+static uint64_t gather(Source *s, uint8_t *buf, uint64_t n,
+    const uint8_t **data) {
+  if (s->len == 0 && !s->eof && s->reader->map == NULL) {
+    uint8_t *syms = NULL;
+    s->len = read_syms(s->reader, &syms);
+    s->syms = syms;
+    s->eof = s->len == 0;
+  }
+
+  // A mapped file is returned whole, so reading again would unmap it
+  if (s->len >= n || s->reader->map != NULL) {
+    uint64_t got = s->len < n ? s->len : n;
+    *data = s->syms;
+    s->syms += got;
+    s->len -= got;
+    return got;
+  }
+
+  uint64_t got = 0;
+  while (got < n && !s->eof) {
+    if (s->len == 0) {
+      uint8_t *syms = NULL;
+      s->len = read_syms(s->reader, &syms);
+      s->syms = syms;
+      s->eof = s->len == 0;
+      continue;
+    }
+    uint64_t take = n - got < s->len ? n - got : s->len;
+    memcpy(buf + got, s->syms, take);
+    got += take;
+    s->syms += take;
+    s->len -= take;
+  }
+  *data = buf;
+  return got;
+}
+
+//
+// Adds the entry of a block to the block index.
+//
+// w: IndexWriter of the index.
+// offset: Offset of the block's BlockHeader in the file.
+// comp_len: comp_len of the block, as it is written.
+// raw_len: Number of bytes the block decompresses to.
+// returns: True on success, false if memory ran out.
+//
+static bool index_add(IndexWriter *w, uint64_t offset, uint32_t comp_len,
+    uint32_t raw_len) {
+  if (w->count == w->cap) {
+    uint64_t cap = w->cap * 2 + 64;
+    uint8_t *bytes = (uint8_t *)realloc(w->bytes, cap * INDEX_ENTRY_SIZE);
+    if (bytes == NULL) {
+      return false;
+    }
+    w->bytes = bytes;
+    w->cap = cap;
+  }
+  uint8_t *entry = w->bytes + w->count * INDEX_ENTRY_SIZE;
+  put64(entry, offset);
+  put32(entry + 8, comp_len);
+  put32(entry + 12, raw_len);
+  w->count++;
+  return true;
+}
+
+//
+// Makes sure the comp buffer of a slot has room for len more bytes.
+//
+// slot: Slot holding the block.
+// len: Number of bytes needed after slot->comp_len.
+// returns: True on success, false if memory ran out.
+//
+static bool comp_reserve(Slot *slot, uint64_t len) {
+  if (slot->comp_cap - slot->comp_len < len) {
+    uint64_t cap = slot->comp_cap * 2 + len;
+    uint8_t *comp = (uint8_t *)realloc(slot->comp, cap);
+    if (comp == NULL) {
+      return false;
+    }
+    slot->comp = comp;
+    slot->comp_cap = cap;
+  }
+  return true;
+}
+
+//
+// Entropy codes the pairs of a block, collected by its encoder, into the
+// comp buffer of its slot: the EntropyModels built from the pairs, then
+// every pair coded with them.
+//
+// w: PairWriter that collected the pairs.
+// slot: Slot holding the block.
+// pairs: True if the pairs have symbols, false for codes only.
+// returns: True on success, false if memory ran out.
+//
+static bool entropy_block(const PairWriter *w, Slot *slot, bool pairs) {
+  if (w->token_count > w->token_cap) {
+    return false;
+  }
+  slot->comp_len = 0;
+  uint64_t bound = ENTROPY_MODELS_SIZE +
+                   w->token_count * ENTROPY_PAIR_BITS / 8 + 16;
+  if (!comp_reserve(slot, bound)) {
+    return false;
+  }
+  EntropyModels models;
+  entropy_models_build(&models, w->tokens, w->token_count, pairs);
+  entropy_models_write(&models, slot->comp);
+
+  PairWriter out;
+  memset(&out, 0, sizeof(out));
+  out.buf = slot->comp + ENTROPY_MODELS_SIZE;
+  for (uint64_t i = 0; i < w->token_count; i++) {
+    uint32_t token = w->tokens[i];
+    buffer_entropy(&out, &models, token & 0xFFFFFF, token >> 24, pairs);
+  }
+  flush_pairs(&out);
+  slot->comp_len = ENTROPY_MODELS_SIZE + out.len;
+  return true;
+}
+
+//
+// Compresses the block of a slot into its comp buffer, which is grown as
+// needed. Every block starts with an empty dictionary and no FileHeader.
+// An entropy coded block is compressed in two stages: its pairs are first
+// collected in tokens, which is grown as needed, then coded by
+// entropy_block. A block that samples as random is stored without being
+// compressed, and one that compresses to no fewer bytes than it has is
+// stored after all.
+//
+// e: Encoder of the thread.
+// slot: Slot holding the block.
+// tokens: TokenBuffer of the thread.
+// entropy: True if the block is entropy coded.
+// returns: True on success, false if memory ran out.
+//
+static bool compress_block(lz78_encoder *e, Slot *slot, TokenBuffer *tokens,
+    bool entropy) {
+  slot->comp_len = 0;
+  slot->stored = lz78_incompressible(slot->raw, slot->raw_len);
+  if (slot->stored) {
+    return true;
+  }
+  lz78_encoder_reset(e, false);
+  if (entropy) {
+    // Every pair but the last few and the resets consumes at least a byte
+    uint64_t cap = slot->raw_len + slot->raw_len / 1024 + 16;
+    if (tokens->cap < cap) {
+      uint32_t *grown =
+          (uint32_t *)realloc(tokens->tokens, cap * sizeof(uint32_t));
+      if (grown == NULL) {
+        return false;
+      }
+      tokens->tokens = grown;
+      tokens->cap = cap;
+    }
+    e->writer.tokens = tokens->tokens;
+    e->writer.token_cap = tokens->cap;
+  }
+  slot->comp_len = 0;
+  uint64_t pos = 0;
+  bool finished = false;
+  while (!finished) {
+    if (!comp_reserve(slot, OUT_BLOCK)) {
+      return false;
+    }
+    uint8_t *out = slot->comp + slot->comp_len;
+    size_t room = slot->comp_cap - slot->comp_len;
+    int64_t len = 0;
+    if (pos < slot->raw_len) {
+      size_t used = 0;
+      len = lz78_compress(e, slot->raw + pos, slot->raw_len - pos, &used, out,
+          room);
+      pos += used;
+    } else {
+      len = lz78_compress_finish(e, out, room);
+      finished = true;
+    }
+    if (len < 0) {
+      return false;
+    }
+    slot->comp_len += len;
+  }
+  if (entropy && !entropy_block(&e->writer, slot, e->mode == MODE_LZ78)) {
+    return false;
+  }
+  slot->stored = slot->comp_len >= slot->raw_len;
+  return true;
+}
+
+//
+// Entry of a compressing thread: compresses ready slots, oldest first,
+// until the pool quits.
+//
+// arg: Pool of the thread.
+// returns: NULL.
+//
+static void *compress_worker(void *arg) {
+  Pool *pool = (Pool *)arg;
+  lz78_encoder *e = lz78_encoder_create(pool->opts);
+  TokenBuffer tokens = {NULL, 0};
+
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    Slot *slot = NULL;
+    for (uint32_t i = 0; i < pool->nslots; i++) {
+      Slot *s = &pool->slots[i];
+      if (s->state == SLOT_READY && (slot == NULL || s->seq < slot->seq)) {
+        slot = s;
+      }
+    }
+    if (slot == NULL) {
+      if (pool->quit) {
+        break;
+      }
+      pthread_cond_wait(&pool->work, &pool->lock);
+      continue;
+    }
+    slot->state = SLOT_BUSY;
+    pthread_mutex_unlock(&pool->lock);
+    uint64_t start = pool->stats != NULL ? clock_ns() : 0;
+    bool ok = e != NULL &&
+              compress_block(e, slot, &tokens, pool->opts->entropy);
+    uint64_t end = pool->stats != NULL ? clock_ns() : 0;
+    pthread_mutex_lock(&pool->lock);
+    if (ok && pool->stats != NULL) {
+      if (slot->stored) {
+        pool->stats->stored++;
+      } else {
+        lz78_encoder_stats(e, pool->stats);
+      }
+      pool->stats->code_ns += end - start;
+    }
+    slot->failed = !ok;
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  lz78_encoder_delete(e);
+  free(tokens.tokens);
+  return NULL;
+}
+
+//
+// Compresses the input file into a framed file. The input is split into
+// blocks of block_size bytes, which are compressed by a pool of threads,
+// each with its own dictionary, and written out in their original order.
+// The size of an input file that is a regular file is kept in the header.
+//
+// r: SymReader of the input file.
+// out: OutWriter of the output file.
+// opts: Options for the encoders of the blocks. The ID of their dictionary,
+//       if any, is kept in the header.
+// threads: Number of threads to compress with.
+// block_size: Number of bytes in a block.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// stats: Statistics to add the blocks and the time spent to, or NULL.
+// returns: True on success, false if memory or the output ran out.
+//
+bool frame_encode(SymReader *r, OutWriter *out, const lz78_options *opts,
+    uint32_t threads, uint32_t block_size, uint64_t *total_in,
+    uint64_t *total_out, lz78_stats *stats) {
+  *total_in = 0;
+  *total_out = 0;
+
+  uint8_t head[MAX_FRAME_HEADER_SIZE];
+  uint64_t raw_size = sym_reader_size(r);
+  uint16_t flags = FRAME_INDEXED | (opts->entropy ? FRAME_ENTROPY : 0) |
+                   (raw_size > 0 ? FRAME_SIZED : 0) |
+                   (opts->dict != NULL ? FRAME_DICT : 0);
+  FrameHeader header = {FRAME_MAGIC, opts->protection, flags, block_size,
+      opts->code_bits, opts->policy, opts->mode, raw_size,
+      opts->dict != NULL ? opts->dict->id : 0};
+  write_frame_header(head, &header);
+  if (!out_write(out, head, frame_header_len(&header))) {
+    return false;
+  }
+  *total_out += frame_header_len(&header);
+
+  Pool pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.nslots = threads * SLOTS_PER_THREAD;
+  pool.opts = opts;
+  pool.stats = stats;
+  pool.slots = (Slot *)calloc(pool.nslots, sizeof(Slot));
+  pthread_t *workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (pool.slots == NULL || workers == NULL) {
+    free(pool.slots);
+    free(workers);
+    return false;
+  }
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  uint32_t started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, compress_worker, &pool)) {
+      break;
+    }
+  }
+
+  Source src = {r, NULL, 0, false};
+  IndexWriter index = {NULL, 0, 0};
+  bool ok = started > 0;
+  bool eof = false;
+  uint64_t seq_read = 0;
+  uint64_t seq_written = 0;
+  pthread_mutex_lock(&pool.lock);
+  while (ok) {
+    // Gather blocks into free slots while the window allows
+    while (!eof && seq_read - seq_written < pool.nslots) {
+      Slot *slot = &pool.slots[seq_read % pool.nslots];
+      pthread_mutex_unlock(&pool.lock);
+      if (slot->raw_buf == NULL && r->map == NULL) {
+        slot->raw_buf = (uint8_t *)malloc(block_size);
+      }
+      uint64_t got = 0;
+      uint64_t start = stats != NULL ? clock_ns() : 0;
+      if (slot->raw_buf != NULL || r->map != NULL) {
+        const uint8_t *data = NULL;
+        got = gather(&src, slot->raw_buf, block_size, &data);
+        if (r->map == NULL && data != slot->raw_buf) {
+          memcpy(slot->raw_buf, data, got);
+          data = slot->raw_buf;
+        }
+        slot->raw = data;
+      } else {
+        ok = false;
+      }
+      if (stats != NULL) {
+        stats->read_ns += clock_ns() - start;
+      }
+      pthread_mutex_lock(&pool.lock);
+      eof = got < block_size;
+      if (!ok || got == 0) {
+        break;
+      }
+      slot->raw_len = got;
+      slot->seq = seq_read++;
+      slot->state = SLOT_READY;
+      *total_in += got;
+      pthread_cond_signal(&pool.work);
+    }
+    if (!ok || seq_written == seq_read) {
+      break;
+    }
+
+    // Write the oldest block once it is compressed
+    Slot *slot = &pool.slots[seq_written % pool.nslots];
+    while (slot->state != SLOT_DONE) {
+      pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    const uint8_t *bytes = slot->stored ? slot->raw : slot->comp;
+    uint64_t len = slot->stored ? slot->raw_len : slot->comp_len;
+    uint32_t comp_len = (uint32_t)len | (slot->stored ? BLOCK_STORED : 0);
+    uint8_t block[BLOCK_HEADER_SIZE];
+    put32(block, comp_len);
+    put32(block + 4, (uint32_t)slot->raw_len);
+    uint64_t start = stats != NULL ? clock_ns() : 0;
+    ok = !slot->failed &&
+         index_add(&index, *total_out, comp_len, (uint32_t)slot->raw_len) &&
+         out_write(out, block, BLOCK_HEADER_SIZE) &&
+         out_write(out, bytes, len);
+    *total_out += BLOCK_HEADER_SIZE + len;
+    pthread_mutex_lock(&pool.lock);
+    if (stats != NULL) {
+      stats->write_ns += clock_ns() - start;
+    }
+    slot->state = SLOT_FREE;
+    seq_written++;
+  }
+  pool.quit = true;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  for (uint32_t i = 0; i < pool.nslots; i++) {
+    free(pool.slots[i].raw_buf);
+    free(pool.slots[i].comp);
+  }
+  pthread_cond_destroy(&pool.done);
+  pthread_cond_destroy(&pool.work);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.slots);
+  free(workers);
+
+  // End of blocks, then the block index and its footer
+  if (ok) {
+    uint8_t block[BLOCK_HEADER_SIZE] = {0};
+    uint8_t footer[FRAME_FOOTER_SIZE] = {0};
+    put64(footer, index.count);
+    put32(footer + 8, INDEX_MAGIC);
+    ok = out_write(out, block, BLOCK_HEADER_SIZE) &&
+         out_write(out, index.bytes, index.count * INDEX_ENTRY_SIZE) &&
+         out_write(out, footer, FRAME_FOOTER_SIZE);
+    *total_out += BLOCK_HEADER_SIZE + index.count * INDEX_ENTRY_SIZE +
+                  FRAME_FOOTER_SIZE;
+  }
+  free(index.bytes);
+  return ok;
+}
+
+//
+// Decodes one block into raw_len bytes of memory. A stored block is copied.
+// The EntropyModels of an entropy coded block are read first, and the pairs
+// decoded with them.
+//
+// d: Decoder to decode with, given the dictionary of a file with FRAME_DICT.
+// frame: FrameHeader of the file.
+// comp: Compressed bytes of the block.
+// comp_len: comp_len of the block, as it is on disk.
+// raw: Memory to store the decoded block to.
+// raw_len: Number of bytes the block decodes to.
+// returns: True on success, false if the block is corrupt.
+//
+static bool decode_block(lz78_decoder *d, const FrameHeader *frame,
+    const uint8_t *comp, uint32_t comp_len, uint8_t *raw, uint32_t raw_len) {
+  if (comp_len & BLOCK_STORED) {
+    if (block_bytes(comp_len) != raw_len) {
+      return false;
+    }
+    memcpy(raw, comp, raw_len);
+    return true;
+  }
+  FileHeader header = {MAGIC, frame->protection, frame->code_bits,
+      frame->policy, frame->mode, frame->dict_id, false};
+  lz78_decoder_reset(d, &header);
+  EntropyModels models;
+  if (frame->flags & FRAME_ENTROPY) {
+    if (comp_len < ENTROPY_MODELS_SIZE || !entropy_models_read(&models, comp)) {
+      return false;
+    }
+    d->reader.models = &models;
+    comp += ENTROPY_MODELS_SIZE;
+    comp_len -= ENTROPY_MODELS_SIZE;
+  }
+  size_t used = 0;
+  int64_t len = lz78_decompress(d, comp, comp_len, &used, raw, raw_len);
+  // STOP_CODE is only read with room for another byte, which it must not use
+  if (len == raw_len && !lz78_decoder_done(d)) {
+    uint8_t spare = 0;
+    size_t more = 0;
+    if (lz78_decompress(d, comp + used, comp_len - used, &more, &spare, 1)) {
+      len = LZ78_ERR_CORRUPT;
+    }
+  }
+  d->reader.models = NULL;
+  return len == raw_len && lz78_decoder_done(d);
+}
+
+//
+// Decompresses the blocks of a framed file, after its FrameHeader.
+//
+// r: SymReader of the input file.
+// syms: Bytes already read from r that follow the FrameHeader.
+// syms_len: Number of bytes in syms.
+// header: FrameHeader of the file.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// out: OutWriter of the output file, which blocks are decoded straight to.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// returns: True on success, false if the input is corrupt or output failed.
+//
+bool frame_decode(SymReader *r, const uint8_t *syms, uint64_t syms_len,
+    FrameHeader *header, const lz78_dict *dict, OutWriter *out,
+    uint64_t *total_in, uint64_t *total_out) {
+  *total_in = frame_header_len(header);
+  *total_out = 0;
+  if (header->block_size == 0 || header->block_size > MAX_BLOCK_SIZE) {
+    return false;
+  }
+
+  lz78_decoder *d = lz78_decoder_create();
+  uint8_t *comp_buf = NULL;
+  uint64_t comp_cap = 0;
+  if (d == NULL) {
+    return false;
+  }
+  lz78_decoder_set_dict(d, dict);
+
+  Source src = {r, syms, syms_len, false};
+  bool ok = true;
+  while (ok) {
+    uint8_t head[BLOCK_HEADER_SIZE];
+    const uint8_t *data = NULL;
+    if (gather(&src, head, BLOCK_HEADER_SIZE, &data) < BLOCK_HEADER_SIZE) {
+      ok = false;
+      break;
+    }
+    BlockHeader block = {get32(data), get32(data + 4)};
+    *total_in += BLOCK_HEADER_SIZE;
+    if (block.comp_len == 0 && block.raw_len == 0) {
+      break;
+    }
+    uint32_t bytes = block_bytes(block.comp_len);
+    if (block.raw_len > header->block_size ||
+        (block.comp_len & BLOCK_STORED && bytes != block.raw_len) ||
+        (header->flags & FRAME_SIZED &&
+         block.raw_len > header->raw_size - *total_out)) {
+      ok = false;
+      break;
+    }
+
+    // A stored block is gathered straight into the output
+    uint64_t room = 0;
+    if (block.comp_len & BLOCK_STORED) {
+      uint8_t *raw = out_reserve(out, block.raw_len, &room);
+      ok = raw != NULL && gather(&src, raw, bytes, &data) == bytes;
+      if (ok) {
+        if (data != raw) {
+          memcpy(raw, data, bytes);
+        }
+        out_commit(out, bytes);
+        *total_in += bytes;
+        *total_out += bytes;
+      }
+      continue;
+    }
+
+    if (comp_cap < bytes) {
+      uint8_t *grown = (uint8_t *)realloc(comp_buf, bytes);
+      if (grown == NULL) {
+        ok = false;
+        break;
+      }
+      comp_buf = grown;
+      comp_cap = bytes;
+    }
+    if (gather(&src, comp_buf, bytes, &data) < bytes) {
+      ok = false;
+      break;
+    }
+    *total_in += bytes;
+
+    uint8_t *raw = out_reserve(out, block.raw_len, &room);
+    ok = raw != NULL &&
+         decode_block(d, header, data, block.comp_len, raw, block.raw_len);
+    if (ok) {
+      out_commit(out, block.raw_len);
+      *total_out += block.raw_len;
+    }
+  }
+
+  lz78_decoder_delete(d);
+  free(comp_buf);
+  return ok && (!(header->flags & FRAME_SIZED) ||
+                *total_out == header->raw_size);
+}
+
+//
+// Reads the block index at the end of a framed file.
+//
+// file: Compressed file, mapped into memory.
+// file_len: Number of bytes in file.
+// index: FrameIndex to fill in, freed with frame_index_free.
+// returns: True if the file has a valid index, false otherwise.
+//
+bool frame_index_read(const uint8_t *file, uint64_t file_len,
+    FrameIndex *index) {
+  memset(index, 0, sizeof(FrameIndex));
+  uint64_t least = FRAME_HEADER_SIZE + BLOCK_HEADER_SIZE + FRAME_FOOTER_SIZE;
+  if (file_len < least) {
+    return false;
+  }
+  FrameHeader *header = &index->header;
+  read_frame_header(file, header);
+  const uint8_t *footer = file + file_len - FRAME_FOOTER_SIZE;
+  uint64_t count = get64(footer);
+  if (header->magic != FRAME_MAGIC || !(header->flags & FRAME_INDEXED) ||
+      header->block_size == 0 || header->block_size > MAX_BLOCK_SIZE ||
+      get32(footer + 8) != INDEX_MAGIC ||
+      count > (file_len - least) / INDEX_ENTRY_SIZE) {
+    return false;
+  }
+
+  // Blocks must lie between the FrameHeader and the end of blocks
+  uint64_t start = file_len - FRAME_FOOTER_SIZE - count * INDEX_ENTRY_SIZE;
+  uint64_t end = start - BLOCK_HEADER_SIZE;
+  index->entries = (BlockEntry *)calloc(count + 1, sizeof(BlockEntry));
+  if (index->entries == NULL) {
+    return false;
+  }
+  index->count = count;
+  uint64_t raw_offset = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    const uint8_t *entry = file + start + i * INDEX_ENTRY_SIZE;
+    BlockEntry *b = &index->entries[i];
+    b->offset = get64(entry);
+    b->comp_len = get32(entry + 8);
+    b->raw_len = get32(entry + 12);
+    b->raw_offset = raw_offset;
+    raw_offset += b->raw_len;
+    if (b->offset < frame_header_len(header) || b->offset > end ||
+        end - b->offset <
+            BLOCK_HEADER_SIZE + (uint64_t)block_bytes(b->comp_len) ||
+        b->raw_len > header->block_size ||
+        get32(file + b->offset) != b->comp_len ||
+        get32(file + b->offset + 4) != b->raw_len) {
+      frame_index_free(index);
+      return false;
+    }
+  }
+  if (header->flags & FRAME_SIZED && raw_offset != header->raw_size) {
+    frame_index_free(index);
+    return false;
+  }
+  index->raw_size = raw_offset;
+  return true;
+}
+
+//
+// Destructor for the entries of a FrameIndex.
+//
+// index: FrameIndex to free memory for.
+// returns: Void.
+//
+void frame_index_free(FrameIndex *index) {
+  free(index->entries);
+  memset(index, 0, sizeof(FrameIndex));
+  return;
+}
+
+//
+// Entry of a decoding thread: decodes blocks, in the order they are taken,
+// each one to its place in the mapped output file or written there.
+//
+// arg: Decoding of the thread.
+// returns: NULL.
+//
+static void *decode_worker(void *arg) {
+  Decoding *job = (Decoding *)arg;
+  lz78_decoder *d = lz78_decoder_create();
+  uint8_t *raw = NULL;
+  if (job->dst == NULL) {
+    raw = (uint8_t *)malloc(job->block_size);
+  }
+  bool ok = d != NULL && (raw != NULL || job->dst != NULL);
+  if (d != NULL) {
+    lz78_decoder_set_dict(d, job->dict);
+  }
+
+  while (true) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = job->failed || !ok;
+    uint64_t i = job->next++;
+    bool stop = job->failed || i >= job->index->count;
+    pthread_mutex_unlock(&job->lock);
+    if (stop) {
+      break;
+    }
+    BlockEntry *b = &job->index->entries[i];
+    uint8_t *dst = job->dst != NULL ? job->dst + b->raw_offset : raw;
+    ok = decode_block(d, &job->index->header,
+             job->file + b->offset + BLOCK_HEADER_SIZE, b->comp_len, dst,
+             b->raw_len) &&
+         (job->dst != NULL ||
+             pwrite_bytes(job->outfile, raw, b->raw_len, b->raw_offset));
+  }
+
+  lz78_decoder_delete(d);
+  free(raw);
+  return NULL;
+}
+
+//
+// Decompresses a framed file on a pool of threads, using its block index.
+// Each thread decodes whole blocks straight to their place in a mapped
+// output file, or writes them there with pwrite, so the output file must be
+// seekable. The output file is sized up front either way.
+//
+// file: Compressed file, mapped into memory.
+// index: Block index of the file, from frame_index_read.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// out: OutWriter of the output file, with no output yet.
+// threads: Number of threads to decompress with.
+// total_out: Pointer to memory which stores the number of bytes written.
+// returns: True on success, false if the input is corrupt or output failed.
+//
+bool frame_decode_parallel(const uint8_t *file, FrameIndex *index,
+    const lz78_dict *dict, OutWriter *out, uint32_t threads,
+    uint64_t *total_out) {
+  *total_out = 0;
+  uint64_t room = 0;
+  uint8_t *dst = NULL;
+  if (out->mappable && index->raw_size > 0) {
+    dst = out_reserve(out, index->raw_size, &room);
+    if (dst == NULL) {
+      return false;
+    }
+  } else if (index->raw_size > 0) {
+    posix_fallocate(out->outfile, 0, index->raw_size);
+  }
+  pthread_t *workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (workers == NULL) {
+    return false;
+  }
+  Decoding job;
+  memset(&job, 0, sizeof(job));
+  pthread_mutex_init(&job.lock, NULL);
+  job.file = file;
+  job.index = index;
+  job.dict = dict;
+  job.block_size = index->header.block_size;
+  job.outfile = out->outfile;
+  job.dst = dst;
+
+  uint32_t started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&workers[started], NULL, decode_worker, &job)) {
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+
+  bool ok = started > 0 && !job.failed;
+  if (ok && dst != NULL) {
+    out_commit(out, index->raw_size);
+  }
+  *total_out = ok ? index->raw_size : 0;
+  return ok;
+}
+
+//
+// Decodes bytes offset to offset + len of the uncompressed file, decoding
+// only the blocks the range overlaps.
+//
+// file: Compressed file, mapped into memory.
+// index: Block index of the file, from frame_index_read.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// offset: Offset of the first byte to read in the uncompressed file.
+// len: Number of bytes to read.
+// out: Memory of at least len bytes to store the bytes to.
+// returns: Number of bytes stored, fewer than len only past the end of the
+//          file, or LZ78_ERR_CORRUPT if a block could not be decoded.
+//
+int64_t frame_read_range(const uint8_t *file, FrameIndex *index,
+    const lz78_dict *dict, uint64_t offset, uint64_t len, uint8_t *out) {
+  if (offset >= index->raw_size) {
+    return 0;
+  }
+  if (len > index->raw_size - offset) {
+    len = index->raw_size - offset;
+  }
+
+  // Find the last block starting at or before offset
+  uint64_t lo = 0;
+  uint64_t hi = index->count - 1;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo + 1) / 2;
+    if (index->entries[mid].raw_offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  lz78_decoder *d = lz78_decoder_create();
+  uint8_t *raw = (uint8_t *)malloc(index->header.block_size);
+  bool ok = d != NULL && raw != NULL;
+  if (d != NULL) {
+    lz78_decoder_set_dict(d, dict);
+  }
+  uint64_t copied = 0;
+  for (uint64_t i = lo; ok && copied < len && i < index->count; i++) {
+    BlockEntry *b = &index->entries[i];
+    ok = decode_block(d, &index->header, file + b->offset + BLOCK_HEADER_SIZE,
+        b->comp_len, raw, b->raw_len);
+    uint64_t skip = offset + copied - b->raw_offset;
+    uint64_t take = b->raw_len - skip;
+    take = take < len - copied ? take : len - copied;
+    if (ok) {
+      memcpy(out + copied, raw + skip, take);
+      copied += take;
+    }
+  }
+  lz78_decoder_delete(d);
+  free(raw);
+  return ok ? (int64_t)copied : LZ78_ERR_CORRUPT;
+}
@@ -0,0 +1,285 @@
+//
+// Contains definitions for the block framed container format, whose blocks
+// are compressed independently and so can be worked on in parallel
+//
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "io.h"
+#include "lz78.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Magic number of a block framed file, next to the MAGIC of a plain file
+#define FRAME_MAGIC 0x8badf00d
+
+// Number of bytes a FrameHeader and a BlockHeader take up
+#define FRAME_HEADER_SIZE 16
+#define BLOCK_HEADER_SIZE 8
+
+// FrameHeader flag set when the blocks are followed by a block index
+#define FRAME_INDEXED 0x1
+
+// FrameHeader flag set when the pairs of every block are entropy coded.
+// Such a block starts with its EntropyModels, see huff.h.
+#define FRAME_ENTROPY 0x2
+
+// FrameHeader flag set when the header is followed by the size of the
+// uncompressed file, in FRAME_SIZE_FIELD little endian bytes, so that the
+// output can be sized before it is decoded
+#define FRAME_SIZED 0x4
+#define FRAME_SIZE_FIELD 8
+
+// FrameHeader flag set when every block starts from a shared dictionary,
+// whose ID follows the header (and raw_size, if any) in FRAME_DICT_FIELD
+// little endian bytes
+#define FRAME_DICT 0x8
+#define FRAME_DICT_FIELD 4
+
+// Most bytes a FrameHeader takes up with the fields its flags add
+#define MAX_FRAME_HEADER_SIZE \
+  (FRAME_HEADER_SIZE + FRAME_SIZE_FIELD + FRAME_DICT_FIELD)
+
+// Magic number of the footer which ends a block index
+#define INDEX_MAGIC 0x8bad1de8
+
+// Number of bytes an index entry and the index footer take up
+#define INDEX_ENTRY_SIZE 16
+#define FRAME_FOOTER_SIZE 16
+
+// Bit set in the comp_len of a stored block, whose raw_len bytes follow its
+// BlockHeader as they are, so that data LZ78 would expand is copied instead
+#define BLOCK_STORED 0x80000000
+
+
+#define MEGABYTE 0x100000
+
+// Block sizes accepted by frame_encode, and the default
+#define MIN_BLOCK_SIZE MEGABYTE
+#define MAX_BLOCK_SIZE (64 * MEGABYTE)
+#define DEFAULT_BLOCK_SIZE (4 * MEGABYTE)
+
+//
+// Struct definition of a FrameHeader, found at the start of a framed file.
+//
+// magic: FRAME_MAGIC.
+// protection: Protection / permissions of the original, uncompressed file.
+// flags: FRAME_INDEXED, if the file ends with a block index,
+//        FRAME_ENTROPY, if its blocks are entropy coded, FRAME_SIZED,
+//        if raw_size follows the header, and FRAME_DICT, if dict_id does.
+// block_size: Largest number of uncompressed bytes in a block.
+// code_bits: Dictionary size in bits of every block, stored in byte 12.
+// policy: DictPolicy of every block, stored in byte 13.
+// mode: CodecMode of every block, stored in byte 14.
+// raw_size: Number of bytes the file decompresses to, if FRAME_SIZED is set.
+// dict_id: ID of the shared dictionary of every block, if FRAME_DICT is set.
+//
+typedef struct FrameHeader {
+  uint32_t magic;
+  uint16_t protection;
+  uint16_t flags;
+  uint32_t block_size;
+  uint8_t code_bits;
+  uint8_t policy;
+  uint8_t mode;
+  uint64_t raw_size;
+  uint32_t dict_id;
+} FrameHeader;
+
+//
+// Struct definition of a BlockHeader, found before every block. The blocks
+// end with a BlockHeader whose sizes are both 0.
+//
+// comp_len: Number of compressed bytes following the header, with
+//           BLOCK_STORED set if the block is stored.
+// raw_len: Number of bytes the block decompresses to.
+//
+typedef struct BlockHeader {
+  uint32_t comp_len;
+  uint32_t raw_len;
+} BlockHeader;
+
+//
+// Struct definition of a BlockEntry, which locates a block in a framed file.
+// On disk an entry is offset (8 bytes), comp_len and raw_len, little endian.
+// The entries are followed by a footer of the entry count (8 bytes),
+// INDEX_MAGIC and 4 reserved bytes.
+//
+// offset: Offset of the block's BlockHeader in the compressed file.
+// raw_offset: Offset of the block's bytes in the uncompressed file.
+// comp_len: Number of compressed bytes in the block, with BLOCK_STORED set
+//           if the block is stored.
+// raw_len: Number of bytes the block decompresses to.
+//
+typedef struct BlockEntry {
+  uint64_t offset;
+  uint64_t raw_offset;
+  uint32_t comp_len;
+  uint32_t raw_len;
+} BlockEntry;
+
+//
+// Struct definition of a FrameIndex, the block index of a framed file.
+//
+// header: FrameHeader of the file.
+// entries: One BlockEntry per block, in file order.
+// count: Number of entries.
+// raw_size: Number of bytes the file decompresses to.
+//
+typedef struct FrameIndex {
+  FrameHeader header;
+  BlockEntry *entries;
+  uint64_t count;
+  uint64_t raw_size;
+} FrameIndex;
+
+//
+// Returns the number of bytes a block takes up after its BlockHeader.
+//
+// comp_len: comp_len of the block, as it is on disk.
+// returns: comp_len without BLOCK_STORED.
+//
+static inline uint32_t block_bytes(uint32_t comp_len) {
+  return comp_len & ~(uint32_t)BLOCK_STORED;
+}
+
+//
+// Reads FRAME_HEADER_SIZE little endian bytes into a FrameHeader, followed
+// by the FRAME_SIZE_FIELD bytes of raw_size if the flags have FRAME_SIZED,
+// then the FRAME_DICT_FIELD bytes of dict_id if they have FRAME_DICT.
+//
+// in: Memory holding the header.
+// header: Pointer to memory where the read header should go.
+// returns: Void.
+//
+void read_frame_header(const uint8_t *in, FrameHeader *header);
+
+//
+// Writes a FrameHeader as frame_header_len little endian bytes.
+//
+// out: Memory to write the header to.
+// header: Pointer to the header to write out.
+// returns: Void.
+//
+void write_frame_header(uint8_t *out, FrameHeader *header);
+
+//
+// Returns the number of bytes a FrameHeader takes up in a framed file.
+//
+// header: FrameHeader whose flags are set.
+// returns: FRAME_HEADER_SIZE, plus FRAME_SIZE_FIELD if it has raw_size and
+//          FRAME_DICT_FIELD if it has dict_id.
+//
+uint32_t frame_header_len(const FrameHeader *header);
+
+//
+// Returns the raw_size of a framed file once the raw_len of its blocks are
+// found to add up to it, walking the block headers, so that a corrupt size
+// is never used to size the output file.
+//
+// file: Compressed file, mapped into memory, or NULL if it is not mapped.
+// file_len: Number of bytes in file.
+// header: FrameHeader of the file.
+// returns: raw_size, or 0 if the file is not mapped, has no raw_size or
+//          its blocks disagree with it.
+//
+uint64_t frame_checked_size(const uint8_t *file, uint64_t file_len,
+    const FrameHeader *header);
+
+//
+// Compresses the input file into a framed file. The input is split into
+// blocks of block_size bytes, which are compressed by a pool of threads,
+// each with its own dictionary, and written out in their original order.
+// A block that lz78_incompressible samples as random, or that compresses
+// to no fewer bytes than it has, is stored as it is instead.
+// The size of an input file that is a regular file is kept in the header.
+//
+// r: SymReader of the input file.
+// out: OutWriter of the output file.
+// opts: Options for the encoders of the blocks. The ID of their dictionary,
+//       if any, is kept in the header.
+// threads: Number of threads to compress with.
+// block_size: Number of bytes in a block.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// stats: Statistics to add the blocks and the time spent to, or NULL.
+// returns: True on success, false if memory or the output ran out.
+//
+bool frame_encode(SymReader *r, OutWriter *out, const lz78_options *opts,
+    uint32_t threads, uint32_t block_size, uint64_t *total_in,
+    uint64_t *total_out, lz78_stats *stats);
+
+//
+// Decompresses the blocks of a framed file, after its FrameHeader.
+//
+// r: SymReader of the input file.
+// syms: Bytes already read from r that follow the FrameHeader.
+// syms_len: Number of bytes in syms.
+// header: FrameHeader of the file.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// out: OutWriter of the output file, which blocks are decoded straight to.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// returns: True on success, false if the input is corrupt or output failed.
+//
+bool frame_decode(SymReader *r, const uint8_t *syms, uint64_t syms_len,
+    FrameHeader *header, const lz78_dict *dict, OutWriter *out,
+    uint64_t *total_in, uint64_t *total_out);
+
+//
+// Reads the block index at the end of a framed file.
+//
+// file: Compressed file, mapped into memory.
+// file_len: Number of bytes in file.
+// index: FrameIndex to fill in, freed with frame_index_free.
+// returns: True if the file has a valid index, false otherwise.
+//
+bool frame_index_read(const uint8_t *file, uint64_t file_len,
+    FrameIndex *index);
+
+//
+// Destructor for the entries of a FrameIndex.
+//
+// index: FrameIndex to free memory for.
+// returns: Void.
+//
+void frame_index_free(FrameIndex *index);
+
+//
+// Decompresses a framed file on a pool of threads, using its block index.
+// Each thread decodes whole blocks straight to their place in a mapped
+// output file, or writes them there with pwrite, so the output file must be
+// seekable. The output file is sized up front either way.
+//
+// file: Compressed file, mapped into memory.
+// index: Block index of the file, from frame_index_read.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// out: OutWriter of the output file, with no output yet.
+// threads: Number of threads to decompress with.
+// total_out: Pointer to memory which stores the number of bytes written.
+// returns: True on success, false if the input is corrupt or output failed.
+//
+bool frame_decode_parallel(const uint8_t *file, FrameIndex *index,
+    const lz78_dict *dict, OutWriter *out, uint32_t threads,
+    uint64_t *total_out);
+
+//
+// Decodes bytes offset to offset + len of the uncompressed file, decoding
+// only the blocks the range overlaps.
+//
+// file: Compressed file, mapped into memory.
+// index: Block index of the file, from frame_index_read.
+// dict: Dictionary the blocks of a file with FRAME_DICT start from, or NULL.
+// offset: Offset of the first byte to read in the uncompressed file.
+// len: Number of bytes to read.
+// out: Memory of at least len bytes to store the bytes to.
+// returns: Number of bytes stored, fewer than len only past the end of the
+//          file, or LZ78_ERR_CORRUPT if a block could not be decoded.
+//
+int64_t frame_read_range(const uint8_t *file, FrameIndex *index,
+    const lz78_dict *dict, uint64_t offset, uint64_t len, uint8_t *out);
+
+#endif
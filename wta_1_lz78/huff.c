@@ -0,0 +1,312 @@
+//
+// Contains implementation of the canonical Huffman codes of the optional
+// entropy coding stage
+//
+
+#include "huff.h"
+
+#include <string.h>
+
+//
+// Returns the class a code is sent as.
+//
+// code: Code to classify, below 2 ^ MAX_CODE_BITS.
+// returns: Class of the code, below CODE_CLASSES.
+//
+uint32_t code_class(uint32_t code) {
+  if (code < 4) {
+    return code;
+  }
+  uint32_t len = 3;
+  while (code >> len != 0) {
+    len++;
+  }
+  return 2 * (len - 1) + ((code >> (len - 2)) & 1);
+}
+
+//
+// Returns the number of bits sent below the class of a code.
+//
+// class: Class of the code.
+// returns: Number of bits.
+//
+uint32_t code_class_extra(uint32_t class) {
+  return class < 4 ? 0 : class / 2 - 1;
+}
+
+//
+// Returns the lowest code of a class.
+//
+// class: Class of the code.
+// returns: Lowest code sent as the class.
+//
+static uint32_t code_class_base(uint32_t class) {
+  if (class < 4) {
+    return class;
+  }
+  return (2 | (class & 1)) << code_class_extra(class);
+}
+
+//
+// Works out Huffman code lengths of the used symbols, limited to
+// HUFF_MAX_LEN bits.
+//
+// The tree is built with two queues over the symbols sorted by count, so
+// no heap is needed. Codes that come out too long are shortened the way
+// the JPEG standard does (Annex K.3): two of the deepest leaves are moved
+// up, and the shallower leaf that makes room for them moves down one.
+//
+// lens: Memory which stores the length of each symbol.
+// freq: Number of times each symbol occurs.
+// order: The used symbols, at least 2.
+// used: Number of used symbols.
+// returns: Void.
+//
+static void huff_lengths(uint8_t *lens, const uint64_t *freq,
+    uint32_t *order, uint32_t used) {
+  // Sort by count, keeping the symbol order of ties so the output is stable
+  for (uint32_t i = 1; i < used; i++) {
+    uint32_t sym = order[i];
+    uint32_t j = i;
+    while (j > 0 && freq[order[j - 1]] > freq[sym]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = sym;
+  }
+
+  uint64_t weight[2 * SYM_CLASSES];
+  uint32_t parent[2 * SYM_CLASSES];
+  for (uint32_t i = 0; i < used; i++) {
+    weight[i] = freq[order[i]];
+  }
+  uint32_t leaf = 0;
+  uint32_t node = used;
+  for (uint32_t next = used; next < 2 * used - 1; next++) {
+    uint32_t pick[2];
+    for (uint32_t k = 0; k < 2; k++) {
+      if (leaf < used && (node == next || weight[leaf] <= weight[node])) {
+        pick[k] = leaf++;
+      } else {
+        pick[k] = node++;
+      }
+    }
+    weight[next] = weight[pick[0]] + weight[pick[1]];
+    parent[pick[0]] = next;
+    parent[pick[1]] = next;
+  }
+
+  // Parents come after their children, so depths are filled in from the top
+  uint32_t count[SYM_CLASSES] = {0};
+  uint32_t depth[2 * SYM_CLASSES];
+  uint32_t max_len = 0;
+  depth[2 * used - 2] = 0;
+  for (uint32_t i = 2 * used - 2; i-- > 0;) {
+    depth[i] = depth[parent[i]] + 1;
+    if (i < used) {
+      count[depth[i]]++;
+      max_len = depth[i] > max_len ? depth[i] : max_len;
+    }
+  }
+  for (uint32_t i = max_len; i > HUFF_MAX_LEN; i--) {
+    while (count[i] > 0) {
+      uint32_t j = i - 2;
+      while (count[j] == 0) {
+        j--;
+      }
+      count[i] -= 2;
+      count[i - 1]++;
+      count[j + 1] += 2;
+      count[j]--;
+    }
+  }
+
+  // The rarest symbols get the longest codes
+  uint32_t i = 0;
+  for (uint32_t len = HUFF_MAX_LEN; len > 0; len--) {
+    for (uint32_t k = 0; k < count[len]; k++) {
+      lens[order[i++]] = len;
+    }
+  }
+  return;
+}
+
+//
+// Gives every symbol of a HuffModel its canonical code from its length,
+// and fills in the decoding table.
+//
+// m: HuffModel whose lens are set.
+// returns: Void.
+//
+static void huff_codes(HuffModel *m) {
+  uint32_t count[HUFF_MAX_LEN + 1] = {0};
+  for (uint32_t sym = 0; sym < SYM_CLASSES; sym++) {
+    count[m->lens[sym]]++;
+  }
+  uint32_t next[HUFF_MAX_LEN + 1];
+  uint32_t code = 0;
+  count[0] = 0;
+  for (uint32_t len = 1; len <= HUFF_MAX_LEN; len++) {
+    code = (code + count[len - 1]) << 1;
+    next[len] = code;
+  }
+
+  HuffEntry invalid = {0, HUFF_INVALID, 0};
+  for (uint32_t i = 0; i < HUFF_TABLE_SIZE; i++) {
+    m->table[i] = invalid;
+  }
+  for (uint32_t sym = 0; sym < SYM_CLASSES; sym++) {
+    uint32_t len = m->lens[sym];
+    if (len == 0) {
+      m->codes[sym] = 0;
+      continue;
+    }
+    uint32_t c = next[len]++;
+    uint32_t rev = 0;
+    for (uint32_t b = 0; b < len; b++) {
+      rev = rev << 1 | ((c >> b) & 1);
+    }
+    m->codes[sym] = rev;
+    HuffEntry e = {sym, len, 0};
+    for (uint32_t i = rev; i < HUFF_TABLE_SIZE; i += (uint32_t)1 << len) {
+      m->table[i] = e;
+    }
+  }
+  return;
+}
+
+//
+// Builds a HuffModel from the number of times each symbol occurs, with no
+// code longer than HUFF_MAX_LEN.
+//
+// m: HuffModel to build.
+// freq: Number of times each symbol occurs.
+// n: Number of symbols, at most SYM_CLASSES.
+// returns: Void.
+//
+void huff_build(HuffModel *m, const uint64_t *freq, uint32_t n) {
+  uint32_t order[SYM_CLASSES];
+  uint32_t used = 0;
+  memset(m->lens, 0, sizeof(m->lens));
+  for (uint32_t sym = 0; sym < n; sym++) {
+    if (freq[sym] > 0) {
+      order[used++] = sym;
+    }
+  }
+  if (used == 1) {
+    m->lens[order[0]] = 1;
+  } else if (used > 1) {
+    huff_lengths(m->lens, freq, order, used);
+  }
+  huff_codes(m);
+  return;
+}
+
+//
+// Turns the symbols in the decoding table of a HuffModel of code classes
+// into the lowest code of each class and the number of bits below it.
+//
+// m: HuffModel of code classes.
+// returns: Void.
+//
+static void classify(HuffModel *m) {
+  for (uint32_t i = 0; i < HUFF_TABLE_SIZE; i++) {
+    HuffEntry *e = &m->table[i];
+    if (e->len != HUFF_INVALID) {
+      e->extra = code_class_extra(e->value);
+      e->value = code_class_base(e->value);
+    }
+  }
+  return;
+}
+
+//
+// Builds the EntropyModels of a block from its pairs.
+//
+// m: EntropyModels to build.
+// tokens: Pairs of the block, each a code with its symbol in the top byte.
+// count: Number of pairs.
+// pairs: True if the pairs have symbols, false for codes only.
+// returns: Void.
+//
+void entropy_models_build(EntropyModels *m, const uint32_t *tokens,
+    uint64_t count, bool pairs) {
+  uint64_t code_freq[CODE_CLASSES] = {0};
+  uint64_t sym_freq[SYM_CLASSES] = {0};
+  for (uint64_t i = 0; i < count; i++) {
+    code_freq[code_class(tokens[i] & 0xFFFFFF)]++;
+    sym_freq[tokens[i] >> 24]++;
+  }
+  if (!pairs) {
+    memset(sym_freq, 0, sizeof(sym_freq));
+  }
+  huff_build(&m->codes, code_freq, CODE_CLASSES);
+  huff_build(&m->syms, sym_freq, SYM_CLASSES);
+  classify(&m->codes);
+  return;
+}
+
+//
+// Writes the code lengths of EntropyModels as ENTROPY_MODELS_SIZE bytes.
+//
+// m: EntropyModels to write.
+// out: Memory to write to.
+// returns: Void.
+//
+void entropy_models_write(const EntropyModels *m, uint8_t *out) {
+  uint8_t lens[CODE_CLASSES + SYM_CLASSES];
+  memcpy(lens, m->codes.lens, CODE_CLASSES);
+  memcpy(lens + CODE_CLASSES, m->syms.lens, SYM_CLASSES);
+  for (uint32_t i = 0; i < ENTROPY_MODELS_SIZE; i++) {
+    out[i] = lens[2 * i] | lens[2 * i + 1] << 4;
+  }
+  return;
+}
+
+//
+// Reads the code lengths of one HuffModel and builds its codes, checking
+// that no bit pattern is claimed by two codes.
+//
+// m: HuffModel to read into.
+// lens: Code lengths, as written.
+// n: Number of symbols.
+// returns: True if the lengths make a valid Huffman code, false otherwise.
+//
+static bool huff_read(HuffModel *m, const uint8_t *lens, uint32_t n) {
+  uint32_t space = 0;
+  memset(m->lens, 0, sizeof(m->lens));
+  for (uint32_t sym = 0; sym < n; sym++) {
+    if (lens[sym] > HUFF_MAX_LEN) {
+      return false;
+    }
+    m->lens[sym] = lens[sym];
+    space += lens[sym] != 0 ? HUFF_TABLE_SIZE >> lens[sym] : 0;
+  }
+  if (space > HUFF_TABLE_SIZE) {
+    return false;
+  }
+  huff_codes(m);
+  return true;
+}
+
+//
+// Reads the code lengths of EntropyModels from ENTROPY_MODELS_SIZE bytes,
+// and builds their decoding tables.
+//
+// m: EntropyModels to read into.
+// in: Memory to read from.
+// returns: True if the lengths make valid Huffman codes, false otherwise.
+//
+bool entropy_models_read(EntropyModels *m, const uint8_t *in) {
+  uint8_t lens[CODE_CLASSES + SYM_CLASSES];
+  for (uint32_t i = 0; i < ENTROPY_MODELS_SIZE; i++) {
+    lens[2 * i] = in[i] & 0xF;
+    lens[2 * i + 1] = in[i] >> 4;
+  }
+  if (!huff_read(&m->codes, lens, CODE_CLASSES) ||
+      !huff_read(&m->syms, lens + CODE_CLASSES, SYM_CLASSES)) {
+    return false;
+  }
+  classify(&m->codes);
+  return true;
+}
@@ -0,0 +1,137 @@
+//
+// Contains definitions for the canonical Huffman codes of the optional
+// entropy coding stage, which packs the pairs of a block in fewer bits
+//
+
+#ifndef __HUFF_H__
+#define __HUFF_H__
+
+#include "code.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Longest Huffman code, so that a code is decoded with one table lookup
+#define HUFF_MAX_LEN 11
+#define HUFF_TABLE_SIZE (1 << HUFF_MAX_LEN)
+
+// Length of the HuffEntries of bit patterns no code starts with. It is
+// longer than any accumulator, so such a pattern is never taken as a code.
+#define HUFF_INVALID 64
+
+// Number of classes codes are sent as: 0 to 3 on their own, then two
+// classes for each bit length up to MAX_CODE_BITS, split by the bit after
+// the leading one. The bits below that are sent as they are.
+#define CODE_CLASSES (2 * MAX_CODE_BITS)
+
+// Number of distinct symbols
+#define SYM_CLASSES 256
+
+// Number of bytes the code lengths of a pair of HuffModels take up, 4 bits
+// per class
+#define ENTROPY_MODELS_SIZE ((CODE_CLASSES + SYM_CLASSES) / 2)
+
+// Most bits an entropy coded pair takes up: a code class, the bits below
+// it and a symbol
+#define ENTROPY_PAIR_BITS (2 * HUFF_MAX_LEN + MAX_CODE_BITS - 2)
+
+//
+// Struct definition of a HuffEntry, the decoding of a bit pattern.
+//
+// value: Symbol, or the lowest code of the class for a code class.
+// len: Number of bits of the Huffman code, or HUFF_INVALID.
+// extra: Number of bits that follow the Huffman code, added to value.
+//
+typedef struct HuffEntry {
+  uint32_t value;
+  uint8_t len;
+  uint8_t extra;
+} HuffEntry;
+
+//
+// Struct definition of a HuffModel, a canonical Huffman code for up to
+// SYM_CLASSES symbols. Codes are sent lowest bit first, so they are stored
+// bit reversed, and table is indexed by the next HUFF_MAX_LEN bits read.
+//
+// lens: Length of the Huffman code of each symbol, 0 if it is unused.
+// codes: Huffman code of each symbol, bit reversed.
+// table: Decoding of every HUFF_MAX_LEN bit pattern.
+//
+typedef struct HuffModel {
+  uint8_t lens[SYM_CLASSES];
+  uint16_t codes[SYM_CLASSES];
+  HuffEntry table[HUFF_TABLE_SIZE];
+} HuffModel;
+
+//
+// Struct definition of the EntropyModels of a block: one HuffModel for the
+// classes of its codes, one for its symbols.
+//
+// codes: HuffModel of the code classes.
+// syms: HuffModel of the symbols, unused in the modes that send codes only.
+//
+typedef struct EntropyModels {
+  HuffModel codes;
+  HuffModel syms;
+} EntropyModels;
+
+//
+// Returns the class a code is sent as.
+//
+// code: Code to classify, below 2 ^ MAX_CODE_BITS.
+// returns: Class of the code, below CODE_CLASSES.
+//
+uint32_t code_class(uint32_t code);
+
+//
+// Returns the number of bits sent below the class of a code.
+//
+// class: Class of the code.
+// returns: Number of bits.
+//
+uint32_t code_class_extra(uint32_t class);
+
+//
+// Builds a HuffModel from the number of times each symbol occurs, with no
+// code longer than HUFF_MAX_LEN.
+//
+// m: HuffModel to build.
+// freq: Number of times each symbol occurs.
+// n: Number of symbols, at most SYM_CLASSES.
+// returns: Void.
+//
+void huff_build(HuffModel *m, const uint64_t *freq, uint32_t n);
+
+//
+// Builds the EntropyModels of a block from its pairs.
+//
+// m: EntropyModels to build.
+// tokens: Pairs of the block, each a code with its symbol in the top byte.
+// count: Number of pairs.
+// pairs: True if the pairs have symbols, false for codes only.
+// returns: Void.
+//
+void entropy_models_build(EntropyModels *m, const uint32_t *tokens,
+    uint64_t count, bool pairs);
+
+//
+// Writes the code lengths of EntropyModels as ENTROPY_MODELS_SIZE bytes.
+//
+// m: EntropyModels to write.
+// out: Memory to write to.
+// returns: Void.
+//
+void entropy_models_write(const EntropyModels *m, uint8_t *out);
+
+//
+// Reads the code lengths of EntropyModels from ENTROPY_MODELS_SIZE bytes,
+// and builds their decoding tables.
+//
+// m: EntropyModels to read into.
+// in: Memory to read from.
+// returns: True if the lengths make valid Huffman codes, false otherwise.
+//
+bool entropy_models_read(EntropyModels *m, const uint8_t *in);
+
+#endif
@@ -3,228 +3,901 @@
 //
 
 #include "io.h"
-#include "word.h"
 
-#define BITS_IN_BYTE 8
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
-extern uint64_t read_total;
-extern uint64_t write_total;
+// Number of bits in the 4 KB blocks the original writer flushed pairs in
+#define BLOCK_BITS (FOUR_KB * BITS_IN_BYTE)
 
-// Static variables for keeping track of buffers across multiple functions
-static uint8_t buffer[FOUR_KB];
-static uint32_t total_bits = 0;
-static uint32_t total_bytes = 0;
+//
+// Struct definition of an IoQueue, a ring of buffers between a thread doing
+// the reads or writes of a file and the caller. When reading ahead, the
+// thread fills buffers and the caller empties them; when writing behind,
+// the caller fills them and the thread writes them out.
+//
+// lock: Guards head, tail, done and failed.
+// filled: Signalled when a buffer is filled, or once done.
+// emptied: Signalled when a buffer is emptied, or once done.
+// thread: The thread doing the reads or writes.
+// fd: File descriptor of the file.
+// bufs: The buffers, used in turn.
+// lens: Number of bytes in each filled buffer.
+// caps: Size of each buffer.
+// size: Size the buffers start out with.
+// depth: Number of buffers.
+// head: Number of buffers filled.
+// tail: Number of buffers emptied.
+// held: True while the caller reading ahead holds the buffer at tail.
+// done: True once the input has ended, or once the queue is stopped.
+// failed: True once a write has failed.
+//
+struct IoQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t emptied;
+  pthread_t thread;
+  int fd;
+  uint8_t *bufs[IO_MAX_DEPTH];
+  uint64_t lens[IO_MAX_DEPTH];
+  uint64_t caps[IO_MAX_DEPTH];
+  uint64_t size;
+  uint32_t depth;
+  uint64_t head;
+  uint64_t tail;
+  bool held;
+  bool done;
+  bool failed;
+};
+
+//
+// Entry of a thread reading ahead: fills free buffers in turn until the
+// input ends or the queue is stopped. It can only be cancelled while it
+// waits in read, so a stopped queue does not wait on a pipe that may never
+// be written to again.
+//
+// arg: IoQueue of the thread.
+// returns: NULL.
+//
+static void *read_ahead(void *arg) {
+  IoQueue *q = (IoQueue *)arg;
+  int state = 0;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+  pthread_mutex_lock(&q->lock);
+  while (!q->done) {
+    if (q->head - q->tail == q->depth) {
+      pthread_cond_wait(&q->emptied, &q->lock);
+      continue;
+    }
+    uint32_t slot = q->head % q->depth;
+    pthread_mutex_unlock(&q->lock);
+    uint64_t len = 0;
+    while (len < q->size) {
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+      ssize_t bytes_read = read(q->fd, q->bufs[slot] + len, q->size - len);
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+      if (bytes_read < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes_read < 1) {
+        break;
+      }
+      len += bytes_read;
+      // A buffer is handed over early rather than wait for more input, so
+      // input that arrives slowly is not held back
+      struct pollfd ready = {q->fd, POLLIN, 0};
+      if (len < q->size && poll(&ready, 1, 0) != 1) {
+        break;
+      }
+    }
+    pthread_mutex_lock(&q->lock);
+    q->lens[slot] = len;
+    q->head += len > 0;
+    q->done = q->done || len == 0;
+    pthread_cond_signal(&q->filled);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+//
+// Entry of a thread writing behind: writes filled buffers in order until
+// the queue is stopped and every buffer is written. After a failed write
+// the rest are dropped, so the caller never waits for a free buffer.
+//
+// arg: IoQueue of the thread.
+// returns: NULL.
+//
+static void *write_behind(void *arg) {
+  IoQueue *q = (IoQueue *)arg;
+  pthread_mutex_lock(&q->lock);
+  while (q->head != q->tail || !q->done) {
+    if (q->head == q->tail) {
+      pthread_cond_wait(&q->filled, &q->lock);
+      continue;
+    }
+    uint32_t slot = q->tail % q->depth;
+    bool failed = q->failed;
+    pthread_mutex_unlock(&q->lock);
+    failed = failed || !write_bytes(q->fd, q->bufs[slot], q->lens[slot]);
+    pthread_mutex_lock(&q->lock);
+    q->failed = failed;
+    q->tail++;
+    pthread_cond_signal(&q->emptied);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+//
+// Stops the thread of an IoQueue and frees it. A thread writing behind
+// writes every filled buffer first.
+//
+// q: IoQueue to stop.
+// cancel: True to cancel a thread reading ahead that waits on its input.
+// returns: True if every write succeeded, false otherwise.
+//
+static bool io_queue_stop(IoQueue *q, bool cancel) {
+  pthread_mutex_lock(&q->lock);
+  q->done = true;
+  pthread_cond_broadcast(&q->filled);
+  pthread_cond_broadcast(&q->emptied);
+  pthread_mutex_unlock(&q->lock);
+  if (cancel) {
+    pthread_cancel(q->thread);
+  }
+  pthread_join(q->thread, NULL);
+  bool ok = !q->failed;
+  for (uint32_t i = 0; i < q->depth; i++) {
+    free(q->bufs[i]);
+  }
+  pthread_cond_destroy(&q->emptied);
+  pthread_cond_destroy(&q->filled);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+  return ok;
+}
 
-// Buffer specifically for read bytes in decode.c, len is how full it is
-static uint8_t encoded[FOUR_KB];
-static uint32_t encoded_len = 0;
+//
+// Creates an IoQueue of empty buffers and starts its thread.
+//
+// fd: File descriptor of the file to read or write.
+// size: Size of the buffers.
+// depth: Number of buffers, at most IO_MAX_DEPTH.
+// run: read_ahead or write_behind.
+// returns: The IoQueue, or NULL if memory or threads ran out.
+//
+static IoQueue *io_queue_start(int fd, uint64_t size, uint32_t depth,
+    void *(*run)(void *)) {
+  IoQueue *q = (IoQueue *)calloc(1, sizeof(IoQueue));
+  if (q == NULL) {
+    return (void *)0;
+  }
+  q->fd = fd;
+  q->size = size;
+  q->depth = depth;
+  bool ok = true;
+  for (uint32_t i = 0; i < depth; i++) {
+    q->bufs[i] = (uint8_t *)malloc(size);
+    q->caps[i] = size;
+    ok = ok && q->bufs[i] != NULL;
+  }
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->filled, NULL);
+  pthread_cond_init(&q->emptied, NULL);
+  if (!ok || pthread_create(&q->thread, NULL, run, q) != 0) {
+    for (uint32_t i = 0; i < depth; i++) {
+      free(q->bufs[i]);
+    }
+    pthread_cond_destroy(&q->emptied);
+    pthread_cond_destroy(&q->filled);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+    return (void *)0;
+  }
+  return q;
+}
 
 //
-// Reads in sizeof (FileHeader) bytes from the input file.
-// These bytes are read into the supplied FileHeader, header.
-// Endianness is swapped if byte order isn’t little endian.
+// Reads HEADER_SIZE bytes from memory into the supplied FileHeader, header,
+// followed by DICT_ID_SIZE more if byte 7 has HEADER_DICT set.
+// The bytes are little endian whatever the byte order of the system.
 //
-// infile: File descriptor of input file to read header from.
-// header: Pointer to memory where the bytes of the read header should go.
+// in: Memory holding the header.
+// header: Pointer to memory where the read header should go.
 // returns: Void.
 //
-void read_header(int infile, FileHeader *header) {
-  read_total += sizeof(header);
-  read(infile, header, sizeof(header));
-  if (is_big()) {
-    header->magic = swap32(header->magic);
-    header->protection = swap16(header->protection);
+void read_header(const uint8_t *in, FileHeader *header) {
+  header->magic = (uint32_t)in[0] | (uint32_t)in[1] << 8 |
+                  (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+  header->protection = (uint16_t)(in[4] | in[5] << 8);
+  header->code_bits = in[6] != 0 ? in[6] : DEFAULT_CODE_BITS;
+  header->policy = in[7] & 0x0F;
+  header->mode = (in[7] & ~(HEADER_DICT | HEADER_STORED)) >> 4;
+  header->stored = (in[7] & HEADER_STORED) != 0;
+  header->dict_id = 0;
+  if (in[7] & HEADER_DICT) {
+    header->dict_id = load32(in + HEADER_SIZE);
   }
   return;
 }
 
 //
-// Writes sizeof (FileHeader) bytes to the output file.
-// These bytes are from the supplied FileHeader, header.
-// Endianness is swapped if byte order isn’t little endian.
+// Writes the supplied FileHeader, header, to memory as file_header_len
+// bytes. The bytes are little endian whatever the byte order of the system.
 //
-// outfile: File descriptor of output file to write header to.
+// out: Memory to write the header to.
 // header: Pointer to the header to write out.
 // returns: Void.
 //
-void write_header(int outfile, FileHeader *header) {
-  write_total += sizeof(header);
-  write(outfile, header, sizeof(header));
-  if (is_big()) {
-    header->magic = swap32(header->magic);
-    header->protection = swap16(header->protection);
+void write_header(uint8_t *out, FileHeader *header) {
+  memset(out, 0, HEADER_SIZE);
+  store32(out, header->magic);
+  out[4] = header->protection & 0xFF;
+  out[5] = header->protection >> 8;
+  out[6] = header->code_bits != DEFAULT_CODE_BITS ? header->code_bits : 0;
+  out[7] = (header->policy & 0x0F) | header->mode << 4;
+  if (header->stored) {
+    out[7] |= HEADER_STORED;
+  } else if (header->dict_id != 0) {
+    out[7] |= HEADER_DICT;
+    store32(out + HEADER_SIZE, header->dict_id);
   }
   return;
 }
 
 //
-// "Reads" a symbol from the input file.
-// The "read" symbol is placed into the pointer to sym. (e.g. * sym = val )
+// Returns the number of bytes a FileHeader takes up in a compressed file.
 //
-// Returns true if there are symbols to be read, false otherwise.
+// header: FileHeader whose dict_id and stored are set.
+// returns: HEADER_SIZE, plus DICT_ID_SIZE if it names a dictionary.
 //
-// infile: File descriptor of input file to read symbols from.
-// sym: Pointer to memory which stores the read symbol.
-// returns: True if there are symbols to be read, false otherwise.
+uint32_t file_header_len(const FileHeader *header) {
+  bool dict = header->dict_id != 0 && !header->stored;
+  return HEADER_SIZE + (dict ? DICT_ID_SIZE : 0);
+}
+
 //
-bool read_sym(int infile, uint8_t *sym) {
-  int16_t bytes_read = read(infile, sym, 1);
-  if (bytes_read > 0) {
-    read_total += 1;
-    return true;
-  }
-  return false;
+// Sets up a SymReader to read the input file infile.
+//
+// r: SymReader to set up.
+// infile: File descriptor of the input file.
+// returns: Void.
+//
+void sym_reader_init(SymReader *r, int infile) {
+  r->infile = infile;
+  r->map = NULL;
+  r->map_len = 0;
+  r->started = false;
+  r->ahead_size = 0;
+  r->ahead_depth = 0;
+  r->ahead = NULL;
+  return;
 }
 
 //
-// Buffers a pair. A pair is comprised of a code and a symbol.
-// The code buffered has a bit - length of bitlen.
-// The buffer is written out whenever it is filled.
+// Has input that cannot be mapped read ahead by a thread, into depth
+// buffers of size bytes, so that reading overlaps with the work done on
+// the input. Call before the first read_syms.
 //
-// outfile: File descriptor of the output file to write to.
-// code Code of the pair to buffer.
-// sym: Symbol of the pair to buffer.
-// bitlen: Number of bits of the code to buffer.
+// r: SymReader to read ahead with.
+// size: Size of the buffers, IO_MIN_BUFFER to IO_MAX_BUFFER.
+// depth: Number of buffers, IO_MIN_DEPTH to IO_MAX_DEPTH, or 0 to read
+//        input when it is asked for.
 // returns: Void.
 //
-void buffer_pair(int outfile, uint16_t code, uint8_t sym, uint8_t bitlen) {
-  // Writes the code in variable bit length
-  for (uint8_t i = 0; i < bitlen; i++) {
-    if (total_bits >= FOUR_KB * BITS_IN_BYTE) {
-      flush_pairs(outfile);
+void sym_reader_ahead(SymReader *r, uint64_t size, uint32_t depth) {
+  r->ahead_size = size;
+  r->ahead_depth = depth;
+  return;
+}
+
+//
+// Parses the buffers of read ahead and write behind, given as SIZE or
+// SIZE:COUNT with SIZE in KB, or 0 for none.
+//
+// arg: Text to parse.
+// size: Pointer to memory which stores the size of a buffer in bytes.
+// depth: Pointer to memory which stores the number of buffers, IO_DEPTH if
+//        not given, or 0 for none.
+// returns: True if the text is valid and within the limits, false otherwise.
+//
+bool io_buffers_parse(const char *arg, uint64_t *size, uint32_t *depth) {
+  char *end = NULL;
+  uint64_t kb = strtoull(arg, &end, 10);
+  uint64_t count = IO_DEPTH;
+  if (end == arg) {
+    return false;
+  }
+  if (*end == ':') {
+    const char *start = end + 1;
+    count = strtoull(start, &end, 10);
+    if (end == start) {
+      return false;
     }
-    uint8_t bit_val = (code >> i) & 0x01;
-    uint32_t byte_to_write = total_bits / BITS_IN_BYTE;
-    uint8_t bit_pos_write = total_bits % BITS_IN_BYTE;
-    uint8_t new_byte = buffer[byte_to_write] | (bit_val << bit_pos_write);
-    buffer[byte_to_write] = new_byte;
-    total_bits++;
   }
-  // Writes the symbol as 8 individual bits
-  for (uint8_t i = 0; i < BITS_IN_BYTE; i++) {
-    if (total_bits >= FOUR_KB * BITS_IN_BYTE) {
-      flush_pairs(outfile);
+  if (*end != '\0') {
+    return false;
+  }
+  *size = kb * 1024;
+  *depth = kb > 0 ? count : 0;
+  return kb == 0 || (kb <= IO_MAX_BUFFER / 1024 &&
+                     *size >= IO_MIN_BUFFER && count >= IO_MIN_DEPTH &&
+                     count <= IO_MAX_DEPTH);
+}
+
+//
+// Returns the next buffer filled by the thread reading ahead, giving the
+// previous one back to it.
+//
+// q: IoQueue of the thread.
+// syms: Pointer to memory which stores the address of the buffer.
+// returns: Number of bytes in the buffer, 0 once the input is exhausted.
+//
+static uint64_t read_queued(IoQueue *q, uint8_t **syms) {
+  pthread_mutex_lock(&q->lock);
+  if (q->held) {
+    q->held = false;
+    q->tail++;
+    pthread_cond_signal(&q->emptied);
+  }
+  while (q->head == q->tail && !q->done) {
+    pthread_cond_wait(&q->filled, &q->lock);
+  }
+  uint64_t len = 0;
+  if (q->head != q->tail) {
+    uint32_t slot = q->tail % q->depth;
+    *syms = q->bufs[slot];
+    len = q->lens[slot];
+    q->held = true;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return len;
+}
+
+//
+// "Reads" a block of symbols from the input file.
+// The "read" block is placed into the pointer to syms. (e.g. * syms = block )
+//
+// A regular file is mapped into memory and returned as a single block, so
+// no copies or system calls are needed per symbol. Pipes and terminals are
+// read through a buffer of SYMS_BLOCK bytes instead.
+//
+// r: SymReader of the input file to read symbols from.
+// syms: Pointer to memory which stores the address of the block.
+// returns: Number of symbols in the block, 0 once the input is exhausted.
+//
+uint64_t read_syms(SymReader *r, uint8_t **syms) {
+  if (!r->started) {
+    r->started = true;
+    struct stat sb;
+    if (fstat(r->infile, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+      void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, r->infile, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, sb.st_size, MADV_SEQUENTIAL);
+        r->map = map;
+        r->map_len = sb.st_size;
+        *syms = r->map;
+        return r->map_len;
+      }
     }
-    uint8_t bit_val = (sym >> i) & 0x01;
-    uint32_t byte_to_write = total_bits / BITS_IN_BYTE;
-    uint8_t bit_pos_write = total_bits % BITS_IN_BYTE;
-    uint8_t new_byte = buffer[byte_to_write] | (bit_val << bit_pos_write);
-    buffer[byte_to_write] = new_byte;
-    total_bits++;
   }
+  if (r->map != NULL) {
+    sym_reader_close(r);
+    return 0;
+  }
+  // Input that is read ahead falls back to plain reads if no thread starts
+  if (r->ahead == NULL && r->ahead_depth > 0) {
+    r->ahead = io_queue_start(r->infile, r->ahead_size, r->ahead_depth,
+        read_ahead);
+    r->ahead_depth = r->ahead != NULL ? r->ahead_depth : 0;
+  }
+  if (r->ahead != NULL) {
+    return read_queued(r->ahead, syms);
+  }
+  ssize_t bytes_read = read(r->infile, r->buffer, SYMS_BLOCK);
+  if (bytes_read > 0) {
+    *syms = r->buffer;
+    return bytes_read;
+  }
+  return 0;
 }
 
 //
-// Writes out any remaining pairs of symbols and codes to the output file.
+// Returns the size of the input file of a SymReader, if it is a regular
+// file. The size is taken when the call is made, so it is only a hint.
 //
-// outfile: File descriptor of the output file to write to.
+// r: SymReader of the input file.
+// returns: Number of bytes in the input file, or 0 if it is not known.
+//
+uint64_t sym_reader_size(SymReader *r) {
+  if (r->map != NULL) {
+    return r->map_len;
+  }
+  struct stat sb;
+  if (fstat(r->infile, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    return sb.st_size;
+  }
+  return 0;
+}
+
+//
+// Releases the mapping of a SymReader, if it has one.
+//
+// r: SymReader to close.
 // returns: Void.
 //
-void flush_pairs(int outfile) {
-  if (total_bits >= FOUR_KB * BITS_IN_BYTE) {
-    write_total += FOUR_KB;
-    write(outfile, buffer, FOUR_KB);
-  } else {
-    write_total += (total_bits / BITS_IN_BYTE) + 1;
-    write(outfile, buffer, (total_bits / BITS_IN_BYTE) + 1);
+void sym_reader_close(SymReader *r) {
+  if (r->map != NULL) {
+    munmap(r->map, r->map_len);
+    r->map = NULL;
   }
-  for (uint32_t i = 0; i < FOUR_KB; i++) {
-    buffer[i] = 0;
+  if (r->ahead != NULL) {
+    io_queue_stop(r->ahead, true);
+    r->ahead = NULL;
+    r->ahead_depth = 0;
   }
-  total_bits = 0;
   return;
 }
 
 //
-// "Reads" a pair (code and symbol) from the input file.
-// The "read" code is placed in the pointer to code (e.g. * code = val)
-// The "read" symbol is placed in the pointer to sym (e.g. * sym = val).
+// Writes a buffer to the output file, retrying short writes.
 //
-// Returns true if there are pairs left to read in the buffer, else false.
-// There are pairs left to read if the read code is not STOP_CODE.
+// outfile: File descriptor of the output file to write to.
+// buf: Bytes to write.
+// len: Number of bytes to write.
+// returns: True if every byte was written, false otherwise.
 //
-// infile: File descriptor of the input file to read from.
-// code: Pointer to memory which stores the read code.
-// sym: Pointer to memory which stores the read symbol.
-// bitlen: Length in bits of the code to read.
-// returns: True if there are pairs left to read, false otherwise.
-//
-bool read_pair(int infile, uint16_t *code, uint8_t *sym, uint8_t bitlen) {
-  // Reads in a variable bit length code bit by bit
-  uint16_t temp = 0;
-  for (uint8_t i = 0; i < bitlen; i++) {
-    if (total_bits >= FOUR_KB * BITS_IN_BYTE || encoded_len == 0) {
-      encoded_len = read(infile, encoded, FOUR_KB);
-      if (encoded_len < 1) {
-        return false;
-      }
-      read_total += encoded_len;
-      total_bits = 0;
-    }
-    uint32_t byte_to_read = total_bits / BITS_IN_BYTE;
-    uint8_t bit_pos = total_bits % BITS_IN_BYTE;
-    uint8_t bit_to_read = (encoded[byte_to_read] >> bit_pos) & 0x01;
-    temp = temp | (bit_to_read << i);
-    total_bits++;
-  }
-  *code = temp;
-  // Reads in a symbol bit by bit with a given length of 8
-  uint8_t temp_sym = 0;
-  for (uint8_t i = 0; i < BITS_IN_BYTE; i++) {
-    if (total_bits >= FOUR_KB * BITS_IN_BYTE || encoded_len == 0) {
-      encoded_len = read(infile, encoded, FOUR_KB);
-      if (encoded_len < 1) {
-        return false;
-      }
-      read_total += encoded_len;
-      total_bits = 0;
+bool write_bytes(int outfile, const uint8_t *buf, uint64_t len) {
+  while (len > 0) {
+    ssize_t bytes_written = write(outfile, buf, len);
+    if (bytes_written < 1) {
+      return false;
     }
-    uint32_t byte_to_read = total_bits / BITS_IN_BYTE;
-    uint8_t bit_pos = total_bits % BITS_IN_BYTE;
-    uint8_t bit_to_read = (encoded[byte_to_read] >> bit_pos) & 0x01;
-    temp_sym = temp_sym | (bit_to_read << i);
-    total_bits++;
+    buf += bytes_written;
+    len -= bytes_written;
   }
-  *sym = temp_sym;
   return true;
 }
 
 //
-// Buffers a Word, or more specifically, the symbols of a Word.
-// Each symbol of the Word is placed into a buffer.
-// The buffer is written out when it is filled.
+// Writes a buffer to the output file at the given offset, retrying short
+// writes. The file offset of outfile is left unchanged.
 //
 // outfile: File descriptor of the output file to write to.
-// w: Word to buffer.
+// buf: Bytes to write.
+// len: Number of bytes to write.
+// offset: Offset in the output file to write the first byte to.
+// returns: True if every byte was written, false otherwise.
+//
+bool pwrite_bytes(int outfile, const uint8_t *buf, uint64_t len,
+    uint64_t offset) {
+  while (len > 0) {
+    ssize_t bytes_written = pwrite(outfile, buf, len, offset);
+    if (bytes_written < 1) {
+      return false;
+    }
+    buf += bytes_written;
+    len -= bytes_written;
+    offset += bytes_written;
+  }
+  return true;
+}
+
+//
+// Sets up an OutWriter to write the output file outfile. A regular file
+// that is empty and at offset 0 is mapped; anything else is buffered.
+//
+// w: OutWriter to set up.
+// outfile: File descriptor of the output file.
+// size: Expected number of bytes of output, which the file is sized to up
+//       front, or 0 if it is not known.
 // returns: Void.
 //
-void buffer_word(int outfile, Word *w) {
-  for (uint32_t i = 0; i < w->len; i++) {
-    if (total_bytes >= FOUR_KB) {
-      flush_words(outfile);
+void out_writer_init(OutWriter *w, int outfile, uint64_t size) {
+  memset(w, 0, sizeof(OutWriter));
+  w->outfile = outfile;
+  struct stat sb;
+  w->mappable = fstat(outfile, &sb) == 0 && S_ISREG(sb.st_mode) &&
+                sb.st_size == 0 && lseek(outfile, 0, SEEK_CUR) == 0;
+  if (w->mappable && size > 0) {
+    uint64_t room = 0;
+    out_reserve(w, size, &room);
+  }
+  return;
+}
+
+//
+// Has output that cannot be mapped written behind by a thread, from depth
+// buffers of size bytes, so that writing overlaps with the work producing
+// the output. Call after out_writer_init, before any output.
+//
+// w: OutWriter to write behind with.
+// size: Size of the buffers, IO_MIN_BUFFER to IO_MAX_BUFFER.
+// depth: Number of buffers, IO_MIN_DEPTH to IO_MAX_DEPTH, or 0 to write
+//        output when a buffer fills.
+// returns: Void.
+//
+void out_writer_behind(OutWriter *w, uint64_t size, uint32_t depth) {
+  w->behind_size = size;
+  w->behind_depth = depth;
+  return;
+}
+
+//
+// Outputs the bytes in the buffer of an OutWriter that is not mapped. When
+// written behind, the buffer is handed to the thread and the next free one
+// is taken.
+//
+// w: OutWriter of the output file.
+// returns: True if the output has not failed, false otherwise.
+//
+static bool out_flush(OutWriter *w) {
+  IoQueue *q = w->behind;
+  if (q == NULL) {
+    bool ok = write_bytes(w->outfile, w->buffer, w->buffer_len);
+    w->buffer_len = 0;
+    return ok;
+  }
+  pthread_mutex_lock(&q->lock);
+  if (w->buffer_len > 0) {
+    q->lens[q->head % q->depth] = w->buffer_len;
+    q->head++;
+    pthread_cond_signal(&q->filled);
+  }
+  while (q->head - q->tail == q->depth) {
+    pthread_cond_wait(&q->emptied, &q->lock);
+  }
+  uint32_t slot = q->head % q->depth;
+  bool ok = !q->failed;
+  pthread_mutex_unlock(&q->lock);
+  w->buffer = q->bufs[slot];
+  w->buffer_cap = q->caps[slot];
+  w->buffer_len = 0;
+  return ok;
+}
+
+//
+// Grows the mapping of an output file to at least len bytes. The blocks of
+// the new extent are allocated before it is mapped, so that running out of
+// space fails here rather than with SIGBUS on a store to the mapping.
+// If the file cannot be mapped at all, the OutWriter buffers it instead.
+//
+// w: OutWriter of the output file.
+// len: Number of bytes needed in the mapping.
+// returns: True if the mapping or the buffer can be used, false otherwise.
+//
+static bool out_grow(OutWriter *w, uint64_t len) {
+  uint64_t grow = w->map_len < OUT_EXTENT ? w->map_len : OUT_EXTENT;
+  grow = grow < OUT_BUFFER ? OUT_BUFFER : grow;
+  uint64_t new_len = w->map_len + grow;
+  new_len = new_len < len ? len : new_len;
+  if (w->map != NULL) {
+    munmap(w->map, w->map_len);
+    w->map = NULL;
+  }
+  if (ftruncate(w->outfile, new_len) == 0) {
+    if (posix_fallocate(w->outfile, w->map_len, new_len - w->map_len)) {
+      return false;
+    }
+    void *map = mmap(NULL, new_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+        w->outfile, 0);
+    if (map != MAP_FAILED) {
+      w->map = map;
+      w->map_len = new_len;
+      return true;
     }
-    buffer[total_bytes] = w->syms[i];
-    total_bytes++;
   }
+  // Only a file that was never mapped can still be written another way
+  if (w->map_len > 0 || ftruncate(w->outfile, 0) != 0) {
+    return false;
+  }
+  w->mappable = false;
+  return true;
 }
 
 //
-// Writes out any remaining symbols in the buffer.
+// Returns memory for the next bytes of output, with room for at least need
+// bytes. Bytes stored to it are output once they are committed with
+// out_commit; the memory is valid until the next call on w.
 //
-// outfile: File descriptor of the output file to write to.
+// w: OutWriter of the output file.
+// need: Number of bytes needed.
+// room: Pointer to memory which stores the number of bytes there is room
+//       for, at least need.
+// returns: Memory to store the output to, or NULL if the output failed.
+//
+uint8_t *out_reserve(OutWriter *w, uint64_t need, uint64_t *room) {
+  if (w->mappable && w->map_len - w->len < need &&
+      !out_grow(w, w->len + need)) {
+    return NULL;
+  }
+  if (w->mappable) {
+    *room = w->map_len - w->len;
+    return w->map + w->len;
+  }
+  // Output written behind falls back to plain writes if no thread starts
+  if (w->behind == NULL && w->behind_depth > 0) {
+    w->behind = io_queue_start(w->outfile, w->behind_size, w->behind_depth,
+        write_behind);
+    w->behind_depth = w->behind != NULL ? w->behind_depth : 0;
+    if (w->behind != NULL) {
+      free(w->buffer);
+      w->buffer = w->behind->bufs[0];
+      w->buffer_cap = w->behind->caps[0];
+    }
+  }
+  if (w->buffer_cap - w->buffer_len < need && !out_flush(w)) {
+    return NULL;
+  }
+  if (w->buffer_cap < need || w->buffer == NULL) {
+    uint64_t cap = need < OUT_BUFFER ? OUT_BUFFER : need;
+    uint8_t *grown = (uint8_t *)realloc(w->buffer, cap);
+    if (grown == NULL) {
+      return NULL;
+    }
+    w->buffer = grown;
+    w->buffer_cap = cap;
+    // The thread only touches buffers it was handed, so this one is free
+    if (w->behind != NULL) {
+      w->behind->bufs[w->behind->head % w->behind->depth] = grown;
+      w->behind->caps[w->behind->head % w->behind->depth] = cap;
+    }
+  }
+  *room = w->buffer_cap - w->buffer_len;
+  return w->buffer + w->buffer_len;
+}
+
+//
+// Outputs the first len bytes of the memory given by out_reserve.
+//
+// w: OutWriter of the output file.
+// len: Number of bytes to output, at most the room reserved.
 // returns: Void.
 //
-void flush_words(int outfile) {
-  if (total_bytes >= FOUR_KB) {
-    write_total += FOUR_KB;
-    write(outfile, buffer, FOUR_KB);
+void out_commit(OutWriter *w, uint64_t len) {
+  w->len += len;
+  if (!w->mappable) {
+    w->buffer_len += len;
+  }
+  return;
+}
+
+//
+// Outputs a buffer.
+//
+// w: OutWriter of the output file.
+// buf: Bytes to output.
+// len: Number of bytes to output.
+// returns: True if the bytes were output, false otherwise.
+//
+bool out_write(OutWriter *w, const uint8_t *buf, uint64_t len) {
+  // Large buffers of a buffered output are written as they are, unless
+  // output is written behind, as it would then be written out of order
+  if (!w->mappable && w->behind_depth == 0 && len >= OUT_BUFFER) {
+    if (!write_bytes(w->outfile, w->buffer, w->buffer_len) ||
+        !write_bytes(w->outfile, buf, len)) {
+      return false;
+    }
+    w->buffer_len = 0;
+    w->len += len;
+    return true;
+  }
+  uint64_t room = 0;
+  uint8_t *dst = out_reserve(w, len, &room);
+  if (dst == NULL) {
+    return false;
+  }
+  memcpy(dst, buf, len);
+  out_commit(w, len);
+  return true;
+}
+
+//
+// Writes any buffered output, releases the mapping of an OutWriter and cuts
+// a mapped output file to the length of its output.
+//
+// w: OutWriter to close.
+// returns: True if every byte was written, false otherwise.
+//
+bool out_writer_close(OutWriter *w) {
+  bool ok = true;
+  if (w->map != NULL) {
+    munmap(w->map, w->map_len);
+    w->map = NULL;
+  }
+  if (w->mappable) {
+    ok = w->map_len == w->len || ftruncate(w->outfile, w->len) == 0;
+  } else if (w->behind != NULL) {
+    ok = out_flush(w);
+    ok = io_queue_stop(w->behind, false) && ok;
+    w->behind = NULL;
+    w->behind_depth = 0;
+    w->buffer = NULL;
   } else {
-    write_total += total_bytes;
-    write(outfile, buffer, total_bytes);
+    ok = write_bytes(w->outfile, w->buffer, w->buffer_len);
   }
-  for (uint32_t i = 0; i < FOUR_KB; i++) {
-    buffer[i] = 0;
+  free(w->buffer);
+  w->buffer = NULL;
+  w->buffer_len = 0;
+  return ok;
+}
+
+//
+// Returns the time of a monotonic clock, for timing phases of work.
+//
+// returns: Time in nanoseconds.
+//
+uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+// Returns the number of read and write system calls the process has made,
+// as counted by /proc/self/io.
+//
+// returns: Number of system calls, or 0 if /proc does not say.
+//
+uint64_t io_syscalls(void) {
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  uint64_t total = 0;
+  char line[128];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    uint64_t count = 0;
+    if (sscanf(line, "syscr: %" SCNu64, &count) == 1 ||
+        sscanf(line, "syscw: %" SCNu64, &count) == 1) {
+      total += count;
+    }
+  }
+  fclose(f);
+  return total;
+}
+
+//
+// Collects a pair into w->tokens for the entropy coding stage. Pairs past
+// token_cap are counted but not stored.
+//
+// w: PairWriter collecting pairs.
+// token: Code of the pair with its symbol in the top byte.
+// bits: Number of bits the pair would have been packed in.
+// returns: Void.
+//
+void collect_pair(PairWriter *w, uint32_t token, uint32_t bits) {
+  if (w->token_count < w->token_cap) {
+    w->tokens[w->token_count] = token;
+    if (w->token_bits != NULL) {
+      w->token_bits[w->token_count] = bits;
+    }
   }
-  total_bytes = 0;
+  w->token_count++;
+  w->bits += bits;
   return;
 }
+
+//
+// Buffers a pair entropy coded with the given EntropyModels: the Huffman
+// code of the class of its code, the bits of the code below its class,
+// then the Huffman code of its symbol.
+// At most 8 bytes are stored to w->buf, which must have room for them.
+//
+// w: PairWriter to buffer the pair with.
+// m: EntropyModels of the block.
+// code: Code of the pair to buffer.
+// sym: Symbol of the pair to buffer.
+// pair: True if the symbol is sent, false for a code on its own.
+// returns: Void.
+//
+void buffer_entropy(PairWriter *w, const EntropyModels *m, uint32_t code,
+    uint8_t sym, bool pair) {
+  uint32_t class = code_class(code);
+  buffer_code(w, m->codes.codes[class], m->codes.lens[class]);
+  buffer_code(w, code, code_class_extra(class));
+  if (pair) {
+    buffer_code(w, m->syms.codes[sym], m->syms.lens[sym]);
+  }
+  return;
+}
+
+//
+// Stores any remaining bits of buffered pairs.
+// At most 4 bytes are stored to w->buf, which must have room for them.
+//
+// The original writer flushed pairs in 4 KB blocks, and wrote a block that
+// was not completely full with one byte more than its whole bytes of bits.
+// The same padding is kept so the output is unchanged.
+//
+// w: PairWriter to flush.
+// returns: Void.
+//
+void flush_pairs(PairWriter *w) {
+  if (w->tokens != NULL) {
+    return;
+  }
+  uint32_t len = w->count / BITS_IN_BYTE;
+  if (w->bits % BLOCK_BITS != 0) {
+    len += 1;
+  }
+  store32(w->buf + w->len, (uint32_t)w->acc);
+  w->len += len;
+  w->acc = 0;
+  w->count = 0;
+  return;
+}
+
+//
+// Moves whole bytes from r->buf into the bit accumulator until it holds at
+// least need bits.
+//
+// r: PairReader to fill.
+// need: Number of bits needed, at most 56.
+// returns: True if the accumulator holds need bits, false if r->buf ran out.
+//
+bool fill_bits(PairReader *r, uint32_t need) {
+  while (r->count < need) {
+    if (r->len - r->pos >= sizeof(uint64_t)) {
+      // Take as many whole bytes of the next 8 as fit, in one load
+      uint32_t take = (63 - r->count) / BITS_IN_BYTE;
+      r->acc |= load64(r->buf + r->pos) << r->count;
+      r->pos += take;
+      r->count += take * BITS_IN_BYTE;
+      r->acc &= ((uint64_t)1 << r->count) - 1;
+    } else if (r->pos < r->len) {
+      r->acc |= (uint64_t)r->buf[r->pos++] << r->count;
+      r->count += BITS_IN_BYTE;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+//
+// Reads an entropy coded pair. Each Huffman code is decoded with a single
+// lookup of the next HUFF_MAX_LEN bits in its table. At the end of r->buf
+// the accumulator may hold fewer bits than the longest pair, in which case
+// the bits past the end read as zeros and the pair is only taken if it
+// fits in the bits that are there.
+//
+// r: PairReader to read from, with r->models set.
+// code: Pointer to memory which stores the read code.
+// sym: Pointer to memory which stores the read symbol.
+// pair: True if the pair has a symbol, false for a code on its own.
+// returns: True if a pair was read, false otherwise.
+//
+bool read_entropy(PairReader *r, uint32_t *code, uint8_t *sym, bool pair) {
+  if (r->count < ENTROPY_PAIR_BITS) {
+    fill_bits(r, ENTROPY_PAIR_BITS);
+  }
+  HuffEntry c = r->models->codes.table[r->acc & (HUFF_TABLE_SIZE - 1)];
+  uint32_t used = c.len;
+  if (used > r->count) {
+    return false;
+  }
+  uint64_t acc = r->acc >> used;
+  uint32_t value = c.value + (uint32_t)(acc & (((uint64_t)1 << c.extra) - 1));
+  used += c.extra;
+  if (pair) {
+    acc >>= c.extra;
+    HuffEntry s = r->models->syms.table[acc & (HUFF_TABLE_SIZE - 1)];
+    used += s.len;
+    *sym = (uint8_t)s.value;
+  }
+  if (used > r->count) {
+    return false;
+  }
+  *code = value;
+  r->acc >>= used;
+  r->count -= used;
+  return true;
+}
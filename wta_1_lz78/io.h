@@ -5,120 +5,607 @@
 #ifndef __IO_H__
 #define __IO_H__
 
+#include "code.h"
 #include "endian.h"
-#include "word.h"
+#include "huff.h"
 
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 
 #define FOUR_KB 0x1000
 
+#define BITS_IN_BYTE 8
+
+// Size of the buffer used to read input that cannot be mapped
+#define SYMS_BLOCK 0x10000
+
+// Size of the buffer output is collected in before it is written
+#define OUT_BLOCK 0x10000
+
+// Size of the buffer of an OutWriter whose output cannot be mapped
+#define OUT_BUFFER 0x100000
+
+// Largest extent a mapped output file is grown by at once
+#define OUT_EXTENT 0x4000000
+
+// Default size and number of the buffers input that cannot be mapped is
+// read ahead through, and output that cannot be mapped is written behind
+// through, and the limits on them
+#define IO_BUFFER 0x100000
+#define IO_DEPTH 3
+#define IO_MIN_BUFFER 0x10000
+#define IO_MAX_BUFFER 0x4000000
+#define IO_MIN_DEPTH 2
+#define IO_MAX_DEPTH 8
+
 // Program's magic number
 #define MAGIC 0x8badbeef
 
+// Number of bytes a FileHeader takes up in a compressed file
+#define HEADER_SIZE 8
+
+// Flag in byte 7 of a FileHeader that is followed by the DICT_ID_SIZE
+// little endian bytes of the ID of the dictionary the stream starts with,
+// and the most bytes a FileHeader takes up with it
+#define HEADER_DICT 0x80
+#define DICT_ID_SIZE 4
+#define MAX_HEADER_SIZE (HEADER_SIZE + DICT_ID_SIZE)
+
+// Flag in byte 7 of a FileHeader whose stream is stored rather than coded:
+// records of STORED_LEN_SIZE little endian bytes of length, followed by
+// that many bytes as they are, ended by a record of length 0
+#define HEADER_STORED 0x40
+#define STORED_LEN_SIZE 4
+
 //
 // Struct definition of a FileHeader.
 //
 // magic: Magic number indicating a file compressed by this program.
 // protection: Protection / permissions of the original, uncompressed file.
+// code_bits: Dictionary size in bits. Stored as 0 when it is
+//            DEFAULT_CODE_BITS, so such files match the original format.
+// policy: DictPolicy of the stream, stored in the low 4 bits of byte 7.
+// mode: CodecMode of the stream, stored in bits 4 and 5 of byte 7.
+// dict_id: ID of the dictionary the stream starts with, or 0 for none.
+//          Stored after the header, with HEADER_DICT set, so that older
+//          decoders find an unknown mode rather than a wrong dictionary.
+// stored: True if the stream is stored records, with HEADER_STORED set,
+//         which older decoders also find to be an unknown mode. A stored
+//         stream names no dictionary.
 //
 typedef struct FileHeader {
   uint32_t magic;
   uint16_t protection;
+  uint8_t code_bits;
+  uint8_t policy;
+  uint8_t mode;
+  uint32_t dict_id;
+  bool stored;
 } FileHeader;
 
 //
-// Reads in sizeof (FileHeader) bytes from the input file.
-// These bytes are read into the supplied FileHeader, header.
-// Endianness is swapped if byte order isn’t little endian.
+// Struct definition of an IoQueue, the buffers a thread reads input ahead
+// into or writes output behind from, see io.c.
+//
+typedef struct IoQueue IoQueue;
+
+//
+// Struct definition of a SymReader, which reads an input file in blocks.
+//
+// infile: File descriptor of the input file.
+// map: Address the input file is mapped at, or NULL.
+// map_len: Length of the mapping.
+// started: True once the first block has been read.
+// ahead_size: Size of the buffers input is read ahead into.
+// ahead_depth: Number of buffers input is read ahead into, or 0 to read it
+//              when it is asked for.
+// ahead: IoQueue of the thread reading ahead, or NULL.
+// buffer: Buffer for input files that cannot be mapped.
+//
+typedef struct SymReader {
+  int infile;
+  uint8_t *map;
+  uint64_t map_len;
+  bool started;
+  uint64_t ahead_size;
+  uint32_t ahead_depth;
+  IoQueue *ahead;
+  uint8_t buffer[SYMS_BLOCK];
+} SymReader;
+
+//
+// Struct definition of an OutWriter, which hands out memory for output to
+// be stored to directly. A new regular output file is sized with ftruncate,
+// its blocks are allocated with posix_fallocate and it is mapped, so output
+// is stored straight into the file; it is grown in extents of up to
+// OUT_EXTENT bytes and cut to length when closed. Other outputs, such as
+// pipes, are collected in a buffer of OUT_BUFFER bytes or more and written
+// once it is full.
+//
+// outfile: File descriptor of the output file.
+// map: Address the output file is mapped at, or NULL.
+// map_len: Length of the mapping, and the size of the file until closed.
+// mappable: True if the output file may be mapped.
+// len: Number of bytes of output so far.
+// buffer: Buffer for output files that cannot be mapped.
+// buffer_len: Number of bytes in buffer.
+// buffer_cap: Size of buffer.
+// behind_size: Size of the buffers output is written behind from.
+// behind_depth: Number of buffers output is written behind from, or 0 to
+//               write it when a buffer fills.
+// behind: IoQueue of the thread writing behind, or NULL.
+//
+typedef struct OutWriter {
+  int outfile;
+  uint8_t *map;
+  uint64_t map_len;
+  bool mappable;
+  uint64_t len;
+  uint8_t *buffer;
+  uint64_t buffer_len;
+  uint64_t buffer_cap;
+  uint64_t behind_size;
+  uint32_t behind_depth;
+  IoQueue *behind;
+} OutWriter;
+
 //
-// infile: File descriptor of input file to read header from.
-// header: Pointer to memory where the bytes of the read header should go.
+// Struct definition of a PairWriter, which packs pairs into memory.
+//
+// buf: Memory the next bytes are stored to.
+// len: Number of bytes stored to buf so far.
+// acc: Bits not yet stored, lowest bit first.
+// count: Number of bits in acc.
+// bits: Number of bits of pairs buffered since the writer was created.
+// tokens: If not NULL, pairs are collected here instead of being packed,
+//         each as its code with its symbol in the top byte, so that they
+//         can be entropy coded once the whole block is known.
+// token_bits: If not NULL, the number of bits each collected pair would
+//             have been packed in, so that it can be packed later.
+// token_count: Number of pairs collected, which may exceed token_cap.
+// token_cap: Number of pairs tokens has room for.
+//
+typedef struct PairWriter {
+  uint8_t *buf;
+  size_t len;
+  uint64_t acc;
+  uint32_t count;
+  uint64_t bits;
+  uint32_t *tokens;
+  uint8_t *token_bits;
+  uint64_t token_count;
+  uint64_t token_cap;
+} PairWriter;
+
+//
+// Struct definition of a PairReader, which unpacks pairs from memory.
+//
+// buf: Memory the next bytes are loaded from.
+// len: Number of bytes in buf.
+// pos: Number of bytes of buf already loaded.
+// acc: Bits loaded but not yet read, lowest bit first.
+// count: Number of bits in acc.
+// models: If not NULL, pairs are entropy coded with these EntropyModels.
+// tokens: If not NULL, pairs are taken from here instead of being unpacked,
+//         each as its code with its symbol in the top byte.
+// token_count: Number of pairs in tokens.
+// token_pos: Number of pairs of tokens already read.
+//
+typedef struct PairReader {
+  const uint8_t *buf;
+  size_t len;
+  size_t pos;
+  uint64_t acc;
+  uint32_t count;
+  const EntropyModels *models;
+  const uint32_t *tokens;
+  uint64_t token_count;
+  uint64_t token_pos;
+} PairReader;
+
+//
+// Reads HEADER_SIZE bytes from memory into the supplied FileHeader, header,
+// followed by DICT_ID_SIZE more if byte 7 has HEADER_DICT set.
+// The bytes are little endian whatever the byte order of the system.
+//
+// in: Memory holding the header.
+// header: Pointer to memory where the read header should go.
 // returns: Void.
 //
-void read_header(int infile, FileHeader *header);
+void read_header(const uint8_t *in, FileHeader *header);
 
 //
-// Writes sizeof (FileHeader) bytes to the output file.
-// These bytes are from the supplied FileHeader, header.
-// Endianness is swapped if byte order isn’t little endian.
+// Writes the supplied FileHeader, header, to memory as file_header_len
+// bytes. The bytes are little endian whatever the byte order of the system.
 //
-// outfile: File descriptor of output file to write header to.
+// out: Memory to write the header to.
 // header: Pointer to the header to write out.
 // returns: Void.
 //
-void write_header(int outfile, FileHeader *header);
+void write_header(uint8_t *out, FileHeader *header);
 
 //
-// "Reads" a symbol from the input file.
-// The "read" symbol is placed into the pointer to sym. (e.g. * sym = val )
+// Returns the number of bytes a FileHeader takes up in a compressed file.
 //
-// Returns true if there are symbols to be read, false otherwise.
+// header: FileHeader whose dict_id and stored are set.
+// returns: HEADER_SIZE, plus DICT_ID_SIZE if it names a dictionary.
 //
-// infile: File descriptor of input file to read symbols from.
-// sym: Pointer to memory which stores the read symbol.
-// returns: True if there are symbols to be read, false otherwise.
+uint32_t file_header_len(const FileHeader *header);
+
+//
+// Sets up a SymReader to read the input file infile.
+//
+// r: SymReader to set up.
+// infile: File descriptor of the input file.
+// returns: Void.
 //
-bool read_sym(int infile, uint8_t *sym);
+void sym_reader_init(SymReader *r, int infile);
+
+//
+// Has input that cannot be mapped read ahead by a thread, into depth
+// buffers of size bytes, so that reading overlaps with the work done on
+// the input. Call before the first read_syms.
+//
+// r: SymReader to read ahead with.
+// size: Size of the buffers, IO_MIN_BUFFER to IO_MAX_BUFFER.
+// depth: Number of buffers, IO_MIN_DEPTH to IO_MAX_DEPTH, or 0 to read
+//        input when it is asked for.
+// returns: Void.
+//
+void sym_reader_ahead(SymReader *r, uint64_t size, uint32_t depth);
+
+//
+// Parses the buffers of read ahead and write behind, given as SIZE or
+// SIZE:COUNT with SIZE in KB, or 0 for none.
+//
+// arg: Text to parse.
+// size: Pointer to memory which stores the size of a buffer in bytes.
+// depth: Pointer to memory which stores the number of buffers, IO_DEPTH if
+//        not given, or 0 for none.
+// returns: True if the text is valid and within the limits, false otherwise.
+//
+bool io_buffers_parse(const char *arg, uint64_t *size, uint32_t *depth);
+
+//
+// "Reads" a block of symbols from the input file.
+// The "read" block is placed into the pointer to syms. (e.g. * syms = block )
+//
+// A regular file is mapped into memory and returned as a single block, so
+// no copies or system calls are needed per symbol. Pipes and terminals are
+// read through a buffer of SYMS_BLOCK bytes instead, or, if they are read
+// ahead, through the buffers the thread fills. A block is valid until the
+// next call.
+//
+// r: SymReader of the input file to read symbols from.
+// syms: Pointer to memory which stores the address of the block.
+// returns: Number of symbols in the block, 0 once the input is exhausted.
+//
+uint64_t read_syms(SymReader *r, uint8_t **syms);
+
+//
+// Returns the size of the input file of a SymReader, if it is a regular
+// file. The size is taken when the call is made, so it is only a hint.
+//
+// r: SymReader of the input file.
+// returns: Number of bytes in the input file, or 0 if it is not known.
+//
+uint64_t sym_reader_size(SymReader *r);
+
+//
+// Releases the mapping of a SymReader, if it has one, and stops the thread
+// reading ahead.
+//
+// r: SymReader to close.
+// returns: Void.
+//
+void sym_reader_close(SymReader *r);
+
+//
+// Writes a buffer to the output file, retrying short writes.
+//
+// outfile: File descriptor of the output file to write to.
+// buf: Bytes to write.
+// len: Number of bytes to write.
+// returns: True if every byte was written, false otherwise.
+//
+bool write_bytes(int outfile, const uint8_t *buf, uint64_t len);
+
+//
+// Writes a buffer to the output file at the given offset, retrying short
+// writes. The file offset of outfile is left unchanged.
+//
+// outfile: File descriptor of the output file to write to.
+// buf: Bytes to write.
+// len: Number of bytes to write.
+// offset: Offset in the output file to write the first byte to.
+// returns: True if every byte was written, false otherwise.
+//
+bool pwrite_bytes(int outfile, const uint8_t *buf, uint64_t len,
+    uint64_t offset);
+
+//
+// Sets up an OutWriter to write the output file outfile. A regular file
+// that is empty and at offset 0 is mapped; anything else is buffered.
+//
+// w: OutWriter to set up.
+// outfile: File descriptor of the output file.
+// size: Expected number of bytes of output, which the file is sized to up
+//       front, or 0 if it is not known.
+// returns: Void.
+//
+void out_writer_init(OutWriter *w, int outfile, uint64_t size);
+
+//
+// Has output that cannot be mapped written behind by a thread, from depth
+// buffers of size bytes, so that writing overlaps with the work producing
+// the output. Call after out_writer_init, before any output.
+//
+// w: OutWriter to write behind with.
+// size: Size of the buffers, IO_MIN_BUFFER to IO_MAX_BUFFER.
+// depth: Number of buffers, IO_MIN_DEPTH to IO_MAX_DEPTH, or 0 to write
+//        output when a buffer fills.
+// returns: Void.
+//
+void out_writer_behind(OutWriter *w, uint64_t size, uint32_t depth);
+
+//
+// Returns memory for the next bytes of output, with room for at least need
+// bytes. Bytes stored to it are output once they are committed with
+// out_commit; the memory is valid until the next call on w.
+//
+// w: OutWriter of the output file.
+// need: Number of bytes needed.
+// room: Pointer to memory which stores the number of bytes there is room
+//       for, at least need.
+// returns: Memory to store the output to, or NULL if the output failed.
+//
+uint8_t *out_reserve(OutWriter *w, uint64_t need, uint64_t *room);
+
+//
+// Outputs the first len bytes of the memory given by out_reserve.
+//
+// w: OutWriter of the output file.
+// len: Number of bytes to output, at most the room reserved.
+// returns: Void.
+//
+void out_commit(OutWriter *w, uint64_t len);
+
+//
+// Outputs a buffer.
+//
+// w: OutWriter of the output file.
+// buf: Bytes to output.
+// len: Number of bytes to output.
+// returns: True if the bytes were output, false otherwise.
+//
+bool out_write(OutWriter *w, const uint8_t *buf, uint64_t len);
+
+//
+// Writes any buffered output, waiting for the thread writing behind,
+// releases the mapping of an OutWriter and cuts a mapped output file to the
+// length of its output.
+//
+// w: OutWriter to close.
+// returns: True if every byte was written, false otherwise.
+//
+bool out_writer_close(OutWriter *w);
+
+//
+// Returns the time of a monotonic clock, for timing phases of work.
+//
+// returns: Time in nanoseconds.
+//
+uint64_t clock_ns(void);
+
+//
+// Returns the number of read and write system calls the process has made,
+// as counted by /proc/self/io.
+//
+// returns: Number of system calls, or 0 if /proc does not say.
+//
+uint64_t io_syscalls(void);
+
+//
+// Collects a pair into w->tokens for the entropy coding stage. Pairs past
+// token_cap are counted but not stored.
+//
+// w: PairWriter collecting pairs.
+// token: Code of the pair with its symbol in the top byte.
+// bits: Number of bits the pair would have been packed in.
+// returns: Void.
+//
+void collect_pair(PairWriter *w, uint32_t token, uint32_t bits);
 
 //
 // Buffers a pair. A pair is comprised of a code and a symbol.
 // The code buffered has a bit - length of bitlen.
-// The buffer is written out whenever it is filled.
+// At most 4 bytes are stored to w->buf, which must have room for them.
 //
-// outfile: File descriptor of the output file to write to.
+// The pair is added to a 64 bit accumulator in one go, and the accumulator
+// is stored 32 bits at a time, lowest bits first. It is defined here so
+// that it is inlined into the loops of the codec, which keep bitlen the
+// same for as long as the code width does.
+//
+// w: PairWriter to buffer the pair with.
 // code Code of the pair to buffer.
 // sym: Symbol of the pair to buffer.
 // bitlen: Number of bits of the code to buffer.
 // returns: Void.
 //
-void buffer_pair(int outfile, uint16_t code, uint8_t sym, uint8_t bitlen);
+static inline void buffer_pair(PairWriter *w, uint32_t code, uint8_t sym,
+    uint8_t bitlen) {
+  if (w->tokens != NULL) {
+    collect_pair(w, code | (uint32_t)sym << 24, bitlen + BITS_IN_BYTE);
+    return;
+  }
+  uint64_t pair = code & (((uint64_t)1 << bitlen) - 1);
+  w->acc |= (pair | (uint64_t)sym << bitlen) << w->count;
+  w->count += bitlen + BITS_IN_BYTE;
+  w->bits += bitlen + BITS_IN_BYTE;
+  if (w->count >= 32) {
+    store32(w->buf + w->len, (uint32_t)w->acc);
+    w->acc >>= 32;
+    w->count -= 32;
+    w->len += 4;
+  }
+  return;
+}
 
 //
-// Writes out any remaining pairs of symbols and codes to the output file.
+// Buffers a code on its own, for the modes that send no symbols.
+// At most 4 bytes are stored to w->buf, which must have room for them.
 //
-// outfile: File descriptor of the output file to write to.
+// w: PairWriter to buffer the code with.
+// code: Code to buffer.
+// bitlen: Number of bits of the code to buffer.
 // returns: Void.
 //
-void flush_pairs(int outfile);
+static inline void buffer_code(PairWriter *w, uint32_t code, uint8_t bitlen) {
+  if (w->tokens != NULL) {
+    collect_pair(w, code, bitlen);
+    return;
+  }
+  w->acc |= (code & (((uint64_t)1 << bitlen) - 1)) << w->count;
+  w->count += bitlen;
+  w->bits += bitlen;
+  if (w->count >= 32) {
+    store32(w->buf + w->len, (uint32_t)w->acc);
+    w->acc >>= 32;
+    w->count -= 32;
+    w->len += 4;
+  }
+  return;
+}
 
 //
-// "Reads" a pair (code and symbol) from the input file.
-// The "read" code is placed in the pointer to code (e.g. * code = val)
-// The "read" symbol is placed in the pointer to sym (e.g. * sym = val).
+// Buffers a pair entropy coded with the given EntropyModels: the Huffman
+// code of the class of its code, the bits of the code below its class,
+// then the Huffman code of its symbol.
+// At most 8 bytes are stored to w->buf, which must have room for them.
+//
+// w: PairWriter to buffer the pair with.
+// m: EntropyModels of the block.
+// code: Code of the pair to buffer.
+// sym: Symbol of the pair to buffer.
+// pair: True if the symbol is sent, false for a code on its own.
+// returns: Void.
+//
+void buffer_entropy(PairWriter *w, const EntropyModels *m, uint32_t code,
+    uint8_t sym, bool pair);
+
+//
+// Stores any remaining bits of buffered pairs.
+// At most 4 bytes are stored to w->buf, which must have room for them.
 //
-// Returns true if there are pairs left to read in the buffer, else false.
-// There are pairs left to read if the read code is not STOP_CODE.
+// w: PairWriter to flush.
+// returns: Void.
+//
+void flush_pairs(PairWriter *w);
+
+//
+// Moves whole bytes from r->buf into the bit accumulator until it holds at
+// least need bits.
+//
+// r: PairReader to fill.
+// need: Number of bits needed, at most 56.
+// returns: True if the accumulator holds need bits, false if r->buf ran out.
 //
-// infile: File descriptor of the input file to read from.
+bool fill_bits(PairReader *r, uint32_t need);
+
+//
+// Reads an entropy coded pair, with a single table lookup per Huffman code.
+//
+// r: PairReader to read from, with r->models set.
 // code: Pointer to memory which stores the read code.
 // sym: Pointer to memory which stores the read symbol.
-// bitlen: Length in bits of the code to read.
-// returns: True if there are pairs left to read, false otherwise.
+// pair: True if the pair has a symbol, false for a code on its own.
+// returns: True if a pair was read, false otherwise.
 //
-bool read_pair(int infile, uint16_t *code, uint8_t *sym, uint8_t bitlen);
+bool read_entropy(PairReader *r, uint32_t *code, uint8_t *sym, bool pair);
 
 //
-// Buffers a Word, or more specifically, the symbols of a Word.
-// Each symbol of the Word is placed into a buffer.
-// The buffer is written out when it is filled.
+// Reads a pair that was unpacked ahead of time from r->tokens.
 //
-// outfile: File descriptor of the output file to write to.
-// w: Word to buffer.
-// returns: Void.
+// r: PairReader to read from, with r->tokens set.
+// code: Pointer to memory which stores the read code.
+// sym: Pointer to memory which stores the read symbol.
+// returns: True if a pair was read, false once the tokens run out.
 //
-void buffer_word(int outfile, Word *w);
+static inline bool read_token(PairReader *r, uint32_t *code, uint8_t *sym) {
+  if (r->token_pos == r->token_count) {
+    return false;
+  }
+  uint32_t token = r->tokens[r->token_pos++];
+  *code = token & 0xFFFFFF;
+  *sym = token >> 24;
+  return true;
+}
 
 //
-// Writes out any remaining symbols in the buffer.
+// "Reads" a pair (code and symbol) from memory.
+// The "read" code is placed in the pointer to code (e.g. * code = val)
+// The "read" symbol is placed in the pointer to sym (e.g. * sym = val).
 //
-// outfile: File descriptor of the output file to write to.
-// returns: Void.
+// Returns false if r->buf runs out before the whole pair is read. The bits
+// read so far are kept, so the pair can be read again once r->buf has been
+// pointed at more input. Like buffer_pair, it is defined here to be inlined.
+//
+// r: PairReader to read from.
+// code: Pointer to memory which stores the read code.
+// sym: Pointer to memory which stores the read symbol.
+// bitlen: Length in bits of the code to read.
+// returns: True if a pair was read, false otherwise.
+//
+static inline bool read_pair(PairReader *r, uint32_t *code, uint8_t *sym,
+    uint8_t bitlen) {
+  if (r->models != NULL) {
+    return read_entropy(r, code, sym, true);
+  }
+  if (r->tokens != NULL) {
+    return read_token(r, code, sym);
+  }
+  uint32_t pair_len = bitlen + BITS_IN_BYTE;
+  if (r->count < pair_len && !fill_bits(r, pair_len)) {
+    return false;
+  }
+  *code = r->acc & (((uint64_t)1 << bitlen) - 1);
+  *sym = r->acc >> bitlen;
+  r->acc >>= pair_len;
+  r->count -= pair_len;
+  return true;
+}
+
+//
+// "Reads" a code on its own from memory, for the modes that send no
+// symbols. As with read_pair, a code cut short by the end of r->buf can be
+// read again once more input is available.
+//
+// r: PairReader to read from.
+// code: Pointer to memory which stores the read code.
+// bitlen: Length in bits of the code to read.
+// returns: True if a code was read, false otherwise.
 //
-void flush_words(int outfile);
+static inline bool read_code(PairReader *r, uint32_t *code, uint8_t bitlen) {
+  if (r->models != NULL) {
+    uint8_t sym = 0;
+    return read_entropy(r, code, &sym, false);
+  }
+  if (r->tokens != NULL) {
+    uint8_t sym = 0;
+    return read_token(r, code, &sym);
+  }
+  if (r->count < bitlen && !fill_bits(r, bitlen)) {
+    return false;
+  }
+  *code = r->acc & (((uint64_t)1 << bitlen) - 1);
+  r->acc >>= bitlen;
+  r->count -= bitlen;
+  return true;
+}
 
 #endif
@@ -0,0 +1,1843 @@
+//
+// Contains implementation of the streaming LZ78 encoder and decoder library
+//
+
+#include "lz78.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes buffer_pair may store for the pairs of a single step: a phrase and
+// possibly a reset
+#define PAIR_ROOM 8
+
+// Input bytes over which DICT_ADAPTIVE measures the ratio, and the ratio
+// of data that is not compressed, in bits per 256 bytes
+#define RATIO_WINDOW 0x10000
+#define RAW_RATIO (8 << 8)
+
+// Most input lz78_compress takes at once while the table pool of its Trie
+// is still short of tables_cap
+#define GROW_CHUNK 0x100000
+
+// Most code bits a workspace takes with the dense backend, whose whole
+// table pool (1 GB at 20 bits) a workspace holds from the start
+#define DENSE_WORKSPACE_BITS 20
+
+// Most bytes pick_cut matches past its cuts, per byte of the longest phrase
+#define CUT_STEPS 32
+
+// Number of shorter cuts of each phrase compress_ahead tries at each level
+static const uint32_t level_cuts[LZ78_MAX_LEVEL + 1] = {
+    0, 0, 1, 2, 4, 8, 16, 32, 64, 128};
+
+//
+// Parses the name of a DictPolicy ("reset", "freeze", "adaptive" or
+// "prune").
+//
+// name: Name of the policy.
+// policy: Pointer to memory which stores the parsed policy.
+// returns: True if the name is a known policy, false otherwise.
+//
+bool lz78_policy_parse(const char *name, DictPolicy *policy) {
+  if (strcmp(name, "reset") == 0) {
+    *policy = DICT_RESET;
+  } else if (strcmp(name, "freeze") == 0) {
+    *policy = DICT_FREEZE;
+  } else if (strcmp(name, "adaptive") == 0) {
+    *policy = DICT_ADAPTIVE;
+  } else if (strcmp(name, "prune") == 0) {
+    *policy = DICT_PRUNE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+//
+// Returns the name of a DictPolicy.
+//
+// policy: The policy to name.
+// returns: Name of the policy.
+//
+const char *lz78_policy_name(DictPolicy policy) {
+  switch (policy) {
+  case DICT_RESET:
+    return "reset";
+  case DICT_FREEZE:
+    return "freeze";
+  case DICT_ADAPTIVE:
+    return "adaptive";
+  case DICT_PRUNE:
+    return "prune";
+  }
+  return "unknown";
+}
+
+//
+// Parses the name of a CodecMode ("lz78", "lzw" or "lzap").
+//
+// name: Name of the mode.
+// mode: Pointer to memory which stores the parsed mode.
+// returns: True if the name is a known mode, false otherwise.
+//
+bool lz78_mode_parse(const char *name, CodecMode *mode) {
+  if (strcmp(name, "lz78") == 0) {
+    *mode = MODE_LZ78;
+  } else if (strcmp(name, "lzw") == 0) {
+    *mode = MODE_LZW;
+  } else if (strcmp(name, "lzap") == 0) {
+    *mode = MODE_LZAP;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+//
+// Returns the name of a CodecMode.
+//
+// mode: The mode to name.
+// returns: Name of the mode.
+//
+const char *lz78_mode_name(CodecMode mode) {
+  switch (mode) {
+  case MODE_LZ78:
+    return "lz78";
+  case MODE_LZW:
+    return "lzw";
+  case MODE_LZAP:
+    return "lzap";
+  }
+  return "unknown";
+}
+
+//
+// Fills in the default options: the hybrid Trie, protection 0644,
+// DEFAULT_CODE_BITS, DICT_RESET, MODE_LZ78 and LZ78_MIN_LEVEL, with
+// incompressible input stored.
+//
+// opts: Options to fill in.
+// returns: Void.
+//
+void lz78_options_default(lz78_options *opts) {
+  opts->backend = TRIE_HYBRID;
+  opts->protection = 0644;
+  opts->code_bits = DEFAULT_CODE_BITS;
+  opts->policy = DICT_RESET;
+  opts->mode = MODE_LZ78;
+  opts->entropy = false;
+  opts->dict = NULL;
+  opts->level = LZ78_MIN_LEVEL;
+  opts->store = true;
+  return;
+}
+
+//
+// Empties the dictionary of an encoder, back to the codes its Trie was
+// sealed with, see seed_trie.
+//
+// e: Encoder whose dictionary to empty.
+// returns: Code the next phrase will be given.
+//
+static uint32_t start_dict(lz78_encoder *e) {
+  trie_reset(e->trie);
+  if (e->leaves != NULL) {
+    lq_reset(e->leaves);
+  }
+  e->prev_phrase = NULL;
+  e->prev_len = 0;
+  e->depth = e->seed_depth;
+  return e->first_code;
+}
+
+//
+// Returns the number of bytes of memory seed_trie needs to seal a Trie.
+//
+// opts: Options the Trie is seeded for.
+// returns: Number of bytes, a multiple of 8.
+//
+static size_t seed_size(const lz78_options *opts) {
+  uint32_t first = dict_first_code(opts->dict, opts->mode);
+  return first == START_CODE ? 0 : trie_seal_size(opts->backend, first);
+}
+
+//
+// Gives a Trie the codes every stream starts with and seals them, so that
+// a reset keeps them: in the modes that send codes only every single
+// symbol, and then the phrases of the shared dictionary, if any.
+//
+// t: Empty Trie to seed.
+// opts: Options the Trie is seeded for.
+// mem: Memory of seed_size bytes to seal the Trie with, or NULL to have it
+//      allocated.
+// returns: True on success, false if allocation failed.
+//
+static bool seed_trie(Trie *t, const lz78_options *opts, void *mem) {
+  const lz78_dict *dict = opts->dict;
+  CodecMode mode = opts->mode;
+  if (mode != MODE_LZ78) {
+    for (uint32_t sym = 0; sym < ALPHABET; sym++) {
+      trie_insert(t, t->root, sym, LITERAL_CODE(sym));
+    }
+  }
+  // Single symbols of the dictionary are the literals already given
+  uint32_t i = dict != NULL && mode != MODE_LZ78 ? dict->singles : 0;
+  for (; dict != NULL && i < dict->count; i++) {
+    TrieNode *parent = &t->nodes[dict_parent_code(dict, mode, i)];
+    if (trie_insert(t, parent, dict_sym(dict, i),
+            dict_code(dict, mode, i)) == NULL) {
+      return false;
+    }
+  }
+  uint32_t first = dict_first_code(dict, mode);
+  return first == START_CODE || trie_seal(t, first, mem);
+}
+
+//
+// Returns whether options may be used to create an encoder.
+//
+// opts: Options to check.
+// returns: True if the options are valid, false otherwise.
+//
+static bool options_valid(const lz78_options *opts) {
+  return opts->code_bits >= MIN_CODE_BITS &&
+         opts->code_bits <= MAX_CODE_BITS && opts->policy <= DICT_PRUNE &&
+         opts->mode <= MODE_LZAP && opts->level >= LZ78_MIN_LEVEL &&
+         opts->level <= LZ78_MAX_LEVEL &&
+         (opts->policy != DICT_PRUNE ||
+             (opts->mode == MODE_LZ78 && opts->level == LZ78_MIN_LEVEL)) &&
+         (opts->dict == NULL ||
+             (opts->policy != DICT_PRUNE &&
+                 dict_first_code(opts->dict, opts->mode) <
+                     MAX_CODE_OF(opts->code_bits)));
+}
+
+//
+// Starts the first stream of an encoder whose memory is in place.
+//
+// e: Encoder to start, with its seeded Trie, phrase and LeafQueue set.
+// opts: Options the encoder is created with.
+// returns: Void.
+//
+static void encoder_setup(lz78_encoder *e, const lz78_options *opts) {
+  e->curr_node = e->trie->root;
+  e->mode = opts->mode;
+  e->first_code = dict_first_code(opts->dict, opts->mode);
+  e->seed_depth = opts->mode == MODE_LZ78 ? 0 : 1;
+  for (uint32_t i = 0; opts->dict != NULL && i < opts->dict->count; i++) {
+    if (opts->dict->entries[i].len > e->seed_depth) {
+      e->seed_depth = opts->dict->entries[i].len;
+    }
+  }
+  e->next_code = start_dict(e);
+  e->max_code = MAX_CODE_OF(opts->code_bits);
+  e->level = opts->level;
+  e->policy = opts->policy;
+  e->store = opts->store;
+  e->header.magic = MAGIC;
+  e->header.protection = opts->protection;
+  e->header.code_bits = opts->code_bits;
+  e->header.policy = opts->policy;
+  e->header.mode = opts->mode;
+  e->header.dict_id = opts->dict != NULL ? opts->dict->id : 0;
+  e->header.stored = false;
+  return;
+}
+
+//
+// Constructor for an encoder.
+//
+// opts: Options to create the encoder with, or NULL for the defaults.
+// returns: Pointer to the encoder, or NULL if allocation failed or the
+//          options are not valid, such as a dictionary with more phrases
+//          than the code bits allow.
+//
+lz78_encoder *lz78_encoder_create(const lz78_options *opts) {
+  lz78_options defaults;
+  if (opts == NULL) {
+    lz78_options_default(&defaults);
+    opts = &defaults;
+  }
+  if (!options_valid(opts)) {
+    return (void *)0;
+  }
+  lz78_encoder *new = (lz78_encoder *)calloc(1, sizeof(lz78_encoder));
+  if (new == NULL) {
+    return (void *)0;
+  }
+  new->trie = trie_create(opts->backend, opts->code_bits);
+  if (opts->policy == DICT_PRUNE) {
+    new->leaves = lq_create(opts->code_bits);
+  }
+  // A phrase is never longer than the number of codes
+  if (opts->mode != MODE_LZ78) {
+    new->phrase = (uint8_t *)malloc(MAX_CODE_OF(opts->code_bits));
+  }
+  if (new->trie == NULL || !seed_trie(new->trie, opts, NULL) ||
+      (opts->policy == DICT_PRUNE && new->leaves == NULL) ||
+      (opts->mode != MODE_LZ78 && new->phrase == NULL)) {
+    lz78_encoder_delete(new);
+    return (void *)0;
+  }
+  encoder_setup(new, opts);
+  return new;
+}
+
+//
+// Destructor for an encoder.
+//
+// e: Encoder to free memory for.
+// returns: Void.
+//
+void lz78_encoder_delete(lz78_encoder *e) {
+  if (e != NULL) {
+    trie_delete(e->trie);
+    lq_delete(e->leaves);
+    free(e->phrase);
+    free(e);
+  }
+  return;
+}
+
+//
+// Starts a new stream on an existing encoder, keeping its memory.
+//
+// e: Encoder to reset.
+// header: Whether the new stream starts with a FileHeader.
+// returns: Void.
+//
+void lz78_encoder_reset(lz78_encoder *e, bool header) {
+  e->next_code = start_dict(e);
+  e->curr_node = e->trie->root;
+  e->prev_node = NULL;
+  e->prev_sym = 0;
+  e->phrase_len = 0;
+  e->window_in = 0;
+  e->window_bits = 0;
+  e->best_ratio = 0;
+  e->resets = 0;
+  e->nodes = 0;
+  memset(e->widths, 0, sizeof(e->widths));
+  memset(&e->writer, 0, sizeof(e->writer));
+  e->stored = false;
+  e->header.stored = false;
+  e->header_done = !header;
+  e->finished = false;
+  e->total_in = 0;
+  e->total_out = 0;
+  return;
+}
+
+//
+// Sets the protection the FileHeader of the encoder's streams records, so
+// that one encoder can compress files of different permissions.
+//
+// e: Encoder to set the protection of, between streams.
+// protection: Protection / permissions of the original file.
+// returns: Void.
+//
+void lz78_encoder_set_protection(lz78_encoder *e, uint16_t protection) {
+  e->header.protection = protection;
+  return;
+}
+
+//
+// Adds the counts of the encoder's stream so far to stats, so that the
+// streams of several encoders, such as the blocks of a framed file, can
+// be summed. Times in stats are left as they are.
+//
+// e: Encoder of the stream.
+// stats: Statistics to add to.
+// returns: Void.
+//
+void lz78_encoder_stats(const lz78_encoder *e, lz78_stats *stats) {
+  for (uint32_t bits = 0; bits <= MAX_CODE_BITS; bits++) {
+    stats->widths[bits] += e->widths[bits];
+    stats->phrases += e->widths[bits];
+  }
+  stats->nodes += e->nodes;
+  stats->resets += e->resets;
+  stats->stored += e->stored ? 1 : 0;
+  return;
+}
+
+//
+// Points the encoder's PairWriter at out, writing the FileHeader first if
+// it has not been written yet.
+//
+// e: Encoder of the stream.
+// out: Memory to store compressed bytes to.
+// returns: Void.
+//
+static void start_output(lz78_encoder *e, uint8_t *out) {
+  e->writer.buf = out;
+  e->writer.len = 0;
+  if (!e->header_done) {
+    write_header(out, &e->header);
+    e->writer.len = file_header_len(&e->header);
+    e->header_done = true;
+  }
+  return;
+}
+
+//
+// Measures the ratio of a full dictionary for DICT_ADAPTIVE. The bits per
+// input byte of each RATIO_WINDOW are compared with the best window since
+// the dictionary filled, and the dictionary is due to be reset once they
+// are an eighth worse.
+//
+// e: Encoder of the stream.
+// pos: Input consumed so far.
+// returns: True if the dictionary should be reset, false otherwise.
+//
+static bool ratio_dropped(lz78_encoder *e, uint64_t pos) {
+  uint64_t bits = e->writer.bits;
+  uint64_t bytes = pos - e->window_in;
+  if (e->best_ratio != 0 && bytes < RATIO_WINDOW) {
+    return false;
+  }
+  uint64_t ratio = ((bits - e->window_bits) << 8) / bytes;
+  e->window_in = pos;
+  e->window_bits = bits;
+  // The first ratio is that of filling the dictionary, which a new
+  // dictionary would be expected to match. A dictionary that no longer
+  // compresses at all is reset whatever its best
+  if (ratio < RAW_RATIO && (e->best_ratio == 0 || ratio < e->best_ratio)) {
+    e->best_ratio = ratio;
+  } else if (ratio >= RAW_RATIO || ratio * 8 > e->best_ratio * 9) {
+    e->best_ratio = 0;
+    e->resets++;
+    return true;
+  }
+  return false;
+}
+
+//
+// Applies the policy of a full dictionary once a phrase has been buffered.
+//
+// DICT_PRUNE gives the phrase the code of the oldest leaf. DICT_ADAPTIVE
+// resets the dictionary once its ratio drops, which the decoder learns
+// from a (STOP_CODE, RESET_SYM) pair.
+//
+// e: Encoder of the stream.
+// node: TrieNode the phrase extends.
+// sym: Symbol the phrase extends it with.
+// pos: Input consumed, including the phrase.
+// returns: Code the next phrase will be given.
+//
+static uint32_t dict_full(lz78_encoder *e, TrieNode *node, uint8_t sym,
+    uint64_t pos) {
+  if (e->policy == DICT_PRUNE) {
+    LeafQueue *q = e->leaves;
+    uint32_t victim = lq_evict(q, node->code);
+    if (victim != 0) {
+      trie_remove(e->trie, &e->trie->nodes[q->parent[victim]],
+          q->sym[victim]);
+      trie_insert(e->trie, node, sym, victim);
+      lq_link(q, victim, node->code, sym);
+      e->nodes++;
+    }
+  } else if (e->policy == DICT_ADAPTIVE && ratio_dropped(e, pos)) {
+    buffer_pair(&e->writer, STOP_CODE, RESET_SYM, bit_len(e->max_code));
+    return start_dict(e);
+  }
+  return e->max_code;
+}
+
+//
+// Grows the dictionary once a phrase has been sent in the modes that send
+// codes only. The previous phrase is appended with the first symbol of
+// this one (MODE_LZW) or with every prefix of it (MODE_LZAP).
+//
+// The decoder only learns a phrase once its code arrives, so entries are
+// added one phrase late, and a phrase never refers to an entry made from
+// itself. An entry that is already in the Trie still takes a code, since
+// the decoder cannot tell, but is not added again.
+//
+// e: Encoder of the stream.
+// node: TrieNode of the phrase just sent, whose symbols are in e->phrase.
+// returns: Void.
+//
+static void grow_codes(lz78_encoder *e, TrieNode *node) {
+  TrieNode *prev = e->prev_phrase;
+  e->prev_phrase = node;
+  if (prev == NULL) {
+    return;
+  }
+  uint32_t count = e->mode == MODE_LZW ? 1 : e->phrase_len;
+  for (uint32_t j = 0; j < count && e->next_code < e->max_code; j++) {
+    TrieNode *next = trie_step(e->trie, prev, e->phrase[j]);
+    if (next == NULL) {
+      next = trie_insert(e->trie, prev, e->phrase[j], e->next_code);
+      e->nodes++;
+    }
+    prev = next;
+    e->next_code++;
+    if (e->next_code == e->max_code && e->policy == DICT_RESET) {
+      e->next_code = start_dict(e);
+      e->resets++;
+      return;
+    }
+  }
+  return;
+}
+
+//
+// Compresses a chunk of input in the modes that send codes only. The
+// phrase being matched always starts with a single symbol, which every
+// dictionary holds, so no symbols need to be sent.
+//
+// e: Encoder of the stream, with e->writer pointed at the output.
+// in: Bytes to compress.
+// in_len: Number of bytes to compress.
+// limit: Length of output after which no more phrases are sent.
+// returns: Number of bytes consumed.
+//
+static size_t compress_codes(lz78_encoder *e, const uint8_t *in,
+    size_t in_len, size_t limit) {
+  Trie *trie = e->trie;
+  TrieNode *curr_node = e->curr_node;
+  uint8_t *phrase = e->phrase;
+  uint32_t phrase_len = e->phrase_len;
+  CodeWidth width = code_width(e->next_code);
+  size_t i = 0;
+  for (; i < in_len && e->writer.len <= limit; i++) {
+    uint8_t curr_sym = in[i];
+    TrieNode *next_node = trie_step(trie, curr_node, curr_sym);
+    if (next_node == NULL) {
+      if (e->next_code < width.low || e->next_code >= width.high) {
+        width = code_width(e->next_code);
+      }
+      buffer_code(&e->writer, curr_node->code, width.bits);
+      e->widths[width.bits]++;
+      e->phrase_len = phrase_len;
+      grow_codes(e, curr_node);
+      if (e->next_code == e->max_code && e->policy == DICT_ADAPTIVE &&
+          ratio_dropped(e, e->total_in + i)) {
+        buffer_code(&e->writer, EMPTY_CODE, bit_len(e->max_code));
+        e->next_code = start_dict(e);
+      }
+      // Literals are never removed, so the TrieNode of one is at its code
+      next_node = &trie->nodes[LITERAL_CODE(curr_sym)];
+      phrase_len = 0;
+    }
+    curr_node = next_node;
+    phrase[phrase_len++] = curr_sym;
+  }
+  e->curr_node = curr_node;
+  e->phrase_len = phrase_len;
+  return i;
+}
+
+//
+// Returns the length of the longest phrase of the dictionary that a run of
+// input starts with.
+//
+// t: Trie of the dictionary.
+// in: Input the phrase starts at.
+// len: Number of bytes of input to match at most.
+// last: Pointer to memory which stores the TrieNode of the phrase, or NULL.
+// returns: Length of the phrase, at most len.
+//
+static uint32_t match_len(Trie *t, const uint8_t *in, size_t len,
+    TrieNode **last) {
+  TrieNode *node = t->root;
+  TrieNode *next = NULL;
+  uint32_t k = 0;
+  while (k < len && (next = trie_step(t, node, in[k])) != NULL) {
+    node = next;
+    k++;
+  }
+  if (last != NULL) {
+    *last = node;
+  }
+  return k;
+}
+
+//
+// Picks the length of the phrase a run of input is sent with: the longest
+// phrase, or one of up to cuts shorter ones if the phrase after it then
+// ends more than margin bytes further on. Each phrase costs about the same
+// number of bits, so covering more input with two phrases leaves fewer to
+// send.
+//
+// No phrase is longer than depth, so once a cut is too short to gain even
+// with a phrase that long after it, neither it nor a shorter one is tried.
+// The phrases after the cuts are matched for CUT_STEPS bytes per byte of
+// the longest phrase at most, in all, and a phrase cut off by that only
+// gains if what was matched of it does.
+//
+// t: Trie of the dictionary.
+// in: Input the phrase starts at.
+// len: Number of bytes of input, more than longest.
+// longest: Length of the longest phrase, from match_len.
+// cuts: Number of shorter phrases to try.
+// pairs: Whether each phrase is followed by a symbol (MODE_LZ78), rather
+//        than needing one symbol at least.
+// margin: Number of bytes a shorter phrase must gain by.
+// depth: Length of the longest phrase the dictionary may hold.
+// returns: Length of the phrase to send.
+//
+static uint32_t pick_cut(Trie *t, const uint8_t *in, size_t len,
+    uint32_t longest, uint32_t cuts, bool pairs, uint32_t margin,
+    uint32_t depth) {
+  uint32_t shortest = pairs ? 0 : 1;
+  uint32_t best = longest;
+  uint64_t best_end = longest + pairs +
+      match_len(t, in + longest + pairs, len - longest - pairs, NULL);
+  uint64_t steps = (uint64_t)CUT_STEPS * (longest + 1);
+  for (uint32_t k = longest; k > shortest && longest - k < cuts;) {
+    k--;
+    if ((uint64_t)k + pairs + depth <= best_end + margin || steps == 0) {
+      break;
+    }
+    size_t reach = len - k - pairs < steps ? len - k - pairs : steps;
+    uint32_t matched = match_len(t, in + k + pairs, reach, NULL);
+    steps -= matched;
+    uint64_t end = k + pairs + matched;
+    if (end > best_end + margin) {
+      best = k;
+      best_end = end;
+    }
+  }
+  return best;
+}
+
+//
+// Sends a phrase and the symbol after it (MODE_LZ78), and adds them to the
+// dictionary unless the dictionary holds them already, as it does when the
+// phrase was cut short. The code is taken either way, as the decoder
+// cannot tell.
+//
+// e: Encoder of the stream, with e->writer pointed at the output.
+// node: TrieNode of the phrase.
+// sym: Symbol after the phrase.
+// pos: Input consumed, including the symbol.
+// returns: Void.
+//
+static void send_pair(lz78_encoder *e, TrieNode *node, uint8_t sym,
+    uint64_t pos) {
+  uint8_t bits = bit_len(e->next_code);
+  buffer_pair(&e->writer, node->code, sym, bits);
+  e->widths[bits]++;
+  if (e->next_code >= e->max_code) {
+    e->next_code = dict_full(e, node, sym, pos);
+    return;
+  }
+  if (trie_step(e->trie, node, sym) == NULL) {
+    trie_insert(e->trie, node, sym, e->next_code);
+    e->nodes++;
+  }
+  e->next_code++;
+  if (e->next_code >= e->max_code && e->policy == DICT_RESET) {
+    e->next_code = start_dict(e);
+    e->resets++;
+  }
+  return;
+}
+
+//
+// Sends a phrase in the modes that send codes only, and grows the
+// dictionary as compress_codes does.
+//
+// e: Encoder of the stream, with e->writer pointed at the output.
+// node: TrieNode of the phrase, whose symbols are in e->phrase.
+// pos: Input consumed, including the phrase.
+// returns: Void.
+//
+static void send_code(lz78_encoder *e, TrieNode *node, uint64_t pos) {
+  uint8_t bits = bit_len(e->next_code);
+  buffer_code(&e->writer, node->code, bits);
+  e->widths[bits]++;
+  grow_codes(e, node);
+  if (e->next_code == e->max_code && e->policy == DICT_ADAPTIVE &&
+      ratio_dropped(e, pos)) {
+    buffer_code(&e->writer, EMPTY_CODE, bit_len(e->max_code));
+    e->next_code = start_dict(e);
+  }
+  return;
+}
+
+//
+// Compresses a chunk of input above LZ78_MIN_LEVEL, in any mode. Each
+// phrase is picked by pick_cut from the dictionary as it stands, so the
+// decoder builds the same one. A phrase that runs to the end of the chunk
+// cannot be looked past, so it, and the rest of it in the next chunk, is
+// matched greedily; the output then depends a little on how the input is
+// split.
+//
+// In MODE_LZ78 and MODE_LZW the entry a phrase cut short makes is one the
+// dictionary holds already, which still takes a code. The entries a
+// greedy parse would have made are what lets phrases grow, so a cut must
+// gain more than the longest phrase; otherwise a repetitive input, whose
+// phrases are long, compresses much worse. In MODE_LZAP every prefix of
+// the next phrase still makes a new entry, so any gain will do.
+//
+// Each phrase raises e->depth to the longest entry it can make, so that
+// pick_cut knows how far any phrase can reach: one symbol longer than the
+// phrase (MODE_LZ78), or the previous phrase and one symbol (MODE_LZW) or
+// all of this one (MODE_LZAP).
+//
+// e: Encoder of the stream, with e->writer pointed at the output.
+// in: Bytes to compress.
+// in_len: Number of bytes to compress.
+// limit: Length of output after which no more phrases are sent.
+// returns: Number of bytes consumed.
+//
+static size_t compress_ahead(lz78_encoder *e, const uint8_t *in,
+    size_t in_len, size_t limit) {
+  Trie *trie = e->trie;
+  bool pairs = e->mode == MODE_LZ78;
+  bool grows = e->mode == MODE_LZAP;
+  uint32_t cuts = level_cuts[e->level];
+  size_t i = 0;
+  while (i < in_len && e->writer.len <= limit) {
+    TrieNode *node = e->curr_node;
+    TrieNode *found = NULL;
+    uint32_t longest = 0;
+    if (node == trie->root &&
+        i + (longest = match_len(trie, in + i, in_len - i, &found)) <
+            in_len) {
+      uint32_t len = pick_cut(trie, in + i, in_len - i, longest, cuts,
+          pairs, grows ? 0 : longest + 1, e->depth);
+      if (len == longest) {
+        node = found;
+      } else {
+        for (uint32_t k = 0; k < len; k++) {
+          node = trie_step(trie, node, in[i + k]);
+        }
+      }
+      if (!pairs) {
+        memcpy(e->phrase, in + i, len);
+      }
+      e->phrase_len = len;
+      i += len;
+    } else {
+      TrieNode *next_node = NULL;
+      while (i < in_len && (next_node = trie_step(trie, node, in[i])) != NULL) {
+        if (!pairs) {
+          e->phrase[e->phrase_len] = in[i];
+        }
+        e->phrase_len++;
+        e->prev_node = node;
+        e->prev_sym = in[i];
+        node = next_node;
+        i++;
+      }
+      if (i == in_len) {
+        e->curr_node = node;
+        break;
+      }
+    }
+    uint32_t grown = pairs ? e->phrase_len + 1 :
+        e->prev_len + (grows ? e->phrase_len : 1);
+    if (grown > e->depth) {
+      e->depth = grown;
+    }
+    if (pairs) {
+      send_pair(e, node, in[i], e->total_in + i + 1);
+      i++;
+    } else {
+      send_code(e, node, e->total_in + i);
+      e->prev_len = e->prev_phrase != NULL ? e->phrase_len : 0;
+    }
+    e->phrase_len = 0;
+    e->curr_node = trie->root;
+  }
+  return i;
+}
+
+//
+// Grows the table pool of an encoder's Trie ahead of a chunk of input. A
+// phrase inserts at most one TrieNode per symbol it takes, and each
+// TrieNode at most one table for its parent, so a pool that is still short
+// of tables_cap is grown for the chunk, cut to GROW_CHUNK, and the phrase
+// carried into it. Inserts then never fail half way through a phrase.
+//
+// e: Encoder of the stream.
+// in_len: Pointer to the number of bytes of input, which is cut to what
+//         the pool has room for.
+// returns: True on success, false if the pool could not be grown.
+//
+static bool reserve_tables(lz78_encoder *e, size_t *in_len) {
+  Trie *t = e->trie;
+  if (t->tables_max >= t->tables_cap) {
+    return true;
+  }
+  size_t take = *in_len < GROW_CHUNK ? *in_len : GROW_CHUNK;
+  if (!trie_reserve(t, take + e->phrase_len + 2)) {
+    return false;
+  }
+  if (t->tables_max < t->tables_cap) {
+    *in_len = take;
+  }
+  return true;
+}
+
+//
+// Estimates whether bytes are too close to random for LZ78 to shrink them,
+// from a sample of up to SAMPLE_CHUNKS chunks of SAMPLE_CHUNK bytes spread
+// over them. The sample is taken as incompressible when the chance of two
+// of its bytes being alike is under 1.4 / 256, its order 0 collision
+// entropy over 7.5 bits a byte, as every literal costs 8 bits plus a code.
+//
+// raw: Bytes to sample.
+// len: Number of bytes in raw.
+// returns: True if the bytes should be stored, false otherwise.
+//
+bool lz78_incompressible(const uint8_t *raw, uint64_t len) {
+  // Too few bytes to tell, and too few to be worth skipping
+  if (len < SAMPLE_CHUNK) {
+    return false;
+  }
+  uint64_t counts[256] = {0};
+  uint64_t stride = len / SAMPLE_CHUNKS;
+  uint64_t chunk = stride < SAMPLE_CHUNK ? stride : SAMPLE_CHUNK;
+  for (uint32_t i = 0; i < SAMPLE_CHUNKS; i++) {
+    const uint8_t *p = raw + i * stride;
+    for (uint64_t j = 0; j < chunk; j++) {
+      counts[p[j]]++;
+    }
+  }
+  uint64_t n = chunk * SAMPLE_CHUNKS;
+  uint64_t alike = 0;
+  for (uint32_t sym = 0; sym < 256; sym++) {
+    if (counts[sym] > 1) {
+      alike += counts[sym] * (counts[sym] - 1);
+    }
+  }
+  return alike * 256 * 10 < n * (n - 1) * 14;
+}
+
+//
+// Decides whether a stream is stored from bytes of its input, as the first
+// lz78_compress of the stream does with its own when it has any. Call it
+// first to decide from other bytes, such as when that call has none.
+//
+// e: Encoder of the stream, before its FileHeader is written.
+// in: Bytes from the start of the input.
+// in_len: Number of bytes in in.
+// returns: True if the stream is stored, false otherwise.
+//
+bool lz78_encoder_sample(lz78_encoder *e, const uint8_t *in, size_t in_len) {
+  if (!e->header_done && e->store) {
+    e->stored = lz78_incompressible(in, in_len);
+    e->header.stored = e->stored;
+  }
+  return e->stored;
+}
+
+//
+// Copies as much of a chunk of input as fits in out into a record of a
+// stored stream. A chunk of no bytes makes no record, as a record of
+// length 0 ends the stream.
+//
+// e: Encoder of the stream, which is stored.
+// in: Bytes to store.
+// in_len: Number of bytes to store.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store the record to.
+// out_cap: Size of out, at least LZ78_MIN_OUT.
+// returns: Number of bytes stored to out.
+//
+static int64_t store_chunk(lz78_encoder *e, const uint8_t *in, size_t in_len,
+    size_t *in_used, uint8_t *out, size_t out_cap) {
+  start_output(e, out);
+  size_t take = out_cap - e->writer.len - STORED_LEN_SIZE;
+  take = in_len < take ? in_len : take;
+  take = take < UINT32_MAX ? take : UINT32_MAX;
+  if (take > 0) {
+    store32(out + e->writer.len, (uint32_t)take);
+    memcpy(out + e->writer.len + STORED_LEN_SIZE, in, take);
+    e->writer.len += STORED_LEN_SIZE + take;
+  }
+  *in_used = take;
+  e->total_in += take;
+  e->total_out += e->writer.len;
+  return e->writer.len;
+}
+
+//
+// Compresses a chunk of input, which may be of any size.
+//
+// Input is consumed until it runs out or out is nearly full, and the
+// number of bytes consumed is placed in in_used. Call again with the rest
+// of the input once the output has been dealt with.
+//
+// e: Encoder of the stream.
+// in: Bytes to compress.
+// in_len: Number of bytes to compress.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store compressed bytes to.
+// out_cap: Size of out, at least LZ78_MIN_OUT.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress(lz78_encoder *e, const uint8_t *in, size_t in_len,
+    size_t *in_used, uint8_t *out, size_t out_cap) {
+  *in_used = 0;
+  if (e->finished) {
+    return LZ78_ERR_STATE;
+  }
+  if (out_cap < LZ78_MIN_OUT) {
+    return LZ78_ERR_CAPACITY;
+  }
+  // The first input of the stream decides whether it is stored
+  if (!e->header_done && in_len > 0) {
+    lz78_encoder_sample(e, in, in_len);
+  }
+  if (e->stored) {
+    return store_chunk(e, in, in_len, in_used, out, out_cap);
+  }
+  if (!reserve_tables(e, &in_len)) {
+    return LZ78_ERR_MEMORY;
+  }
+  start_output(e, out);
+  if (e->mode != MODE_LZ78 || e->level > LZ78_MIN_LEVEL) {
+    size_t limit = out_cap - PAIR_ROOM;
+    size_t used = e->level > LZ78_MIN_LEVEL ?
+        compress_ahead(e, in, in_len, limit) :
+        compress_codes(e, in, in_len, limit);
+    *in_used = used;
+    e->total_in += used;
+    e->total_out += e->writer.len;
+    return e->writer.len;
+  }
+
+  Trie *trie = e->trie;
+  TrieNode *root = trie->root;
+  TrieNode *curr_node = e->curr_node;
+  TrieNode *prev_node = e->prev_node;
+  uint32_t next_code = e->next_code;
+  uint32_t max_code = e->max_code;
+  size_t limit = out_cap - PAIR_ROOM;
+  size_t i = 0;
+  while (i < in_len && e->writer.len <= limit) {
+    // Each segment sends phrases of a single width, which is worked out
+    // once at its start rather than for every phrase
+    CodeWidth width = code_width(next_code);
+    uint64_t sent = 0;
+    for (; i < in_len && e->writer.len <= limit; i++) {
+      uint8_t curr_sym = in[i];
+      TrieNode *next_node = trie_step(trie, curr_node, curr_sym);
+      if (next_node != NULL) {
+        prev_node = curr_node;
+        curr_node = next_node;
+        continue;
+      }
+      buffer_pair(&e->writer, curr_node->code, curr_sym, width.bits);
+      sent++;
+      if (next_code < max_code) {
+        trie_insert(trie, curr_node, curr_sym, next_code);
+        if (e->leaves != NULL) {
+          lq_link(e->leaves, next_code, curr_node->code, curr_sym);
+        }
+        e->nodes++;
+        next_code++;
+        if (next_code >= max_code && e->policy == DICT_RESET) {
+          trie_reset(trie);
+          next_code = e->first_code;
+          e->resets++;
+        }
+      } else {
+        next_code = dict_full(e, curr_node, curr_sym, e->total_in + i + 1);
+      }
+      curr_node = root;
+      if (next_code < width.low || next_code >= width.high) {
+        i++;
+        break;
+      }
+    }
+    e->widths[width.bits] += sent;
+  }
+  if (i > 0) {
+    e->prev_sym = in[i - 1];
+  }
+  e->curr_node = curr_node;
+  e->prev_node = prev_node;
+  e->next_code = next_code;
+
+  *in_used = i;
+  e->total_in += i;
+  e->total_out += e->writer.len;
+  return e->writer.len;
+}
+
+//
+// Ends the stream: stores the last, incomplete phrase and STOP_CODE.
+//
+// e: Encoder of the stream.
+// out: Memory to store compressed bytes to.
+// out_cap: Size of out, at least LZ78_MIN_OUT.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress_finish(lz78_encoder *e, uint8_t *out, size_t out_cap) {
+  if (e->finished) {
+    return LZ78_ERR_STATE;
+  }
+  size_t none = 0;
+  if (out_cap < LZ78_MIN_OUT) {
+    return LZ78_ERR_CAPACITY;
+  }
+
+  // A stored stream ends with a record of length 0
+  if (e->stored) {
+    start_output(e, out);
+    store32(out + e->writer.len, 0);
+    e->writer.len += STORED_LEN_SIZE;
+    e->finished = true;
+    e->total_out += e->writer.len;
+    return e->writer.len;
+  }
+  if (!reserve_tables(e, &none)) {
+    return LZ78_ERR_MEMORY;
+  }
+  start_output(e, out);
+
+  // Output the last phrase and STOP_CODE on their own
+  if (e->mode != MODE_LZ78) {
+    if (e->curr_node != e->trie->root) {
+      uint8_t width = bit_len(e->next_code);
+      buffer_code(&e->writer, e->curr_node->code, width);
+      e->widths[width]++;
+      grow_codes(e, e->curr_node);
+    }
+    buffer_code(&e->writer, STOP_CODE, bit_len(e->next_code));
+    flush_pairs(&e->writer);
+    e->finished = true;
+    e->total_out += e->writer.len;
+    return e->writer.len;
+  }
+
+  // Output Incomplete Pair
+  if (e->curr_node != e->trie->root) {
+    uint8_t width = bit_len(e->next_code);
+    buffer_pair(&e->writer, e->prev_node->code, e->prev_sym, width);
+    e->widths[width]++;
+    // A full dictionary that is kept stays full. Otherwise the code wraps
+    // to 0 rather than the first code, as in the original format
+    if (e->next_code < e->max_code) {
+      e->next_code++;
+      if (e->next_code == e->max_code && e->policy == DICT_RESET) {
+        e->next_code = 0;
+      }
+    }
+  }
+
+  // Output STOP_CODE
+  buffer_pair(&e->writer, STOP_CODE, 0, bit_len(e->next_code));
+  flush_pairs(&e->writer);
+  e->finished = true;
+  e->total_out += e->writer.len;
+  return e->writer.len;
+}
+
+//
+// Constructor for a decoder.
+//
+// returns: Pointer to the decoder, or NULL if allocation failed.
+//
+lz78_decoder *lz78_decoder_create(void) {
+  lz78_decoder *new = (lz78_decoder *)calloc(1, sizeof(lz78_decoder));
+  if (new == NULL) {
+    return (void *)0;
+  }
+  new->table = wt_create(DEFAULT_CODE_BITS);
+  if (new->table == NULL) {
+    free(new);
+    return (void *)0;
+  }
+  new->next_code = START_CODE;
+  new->header_need = HEADER_SIZE;
+  return new;
+}
+
+//
+// Destructor for a decoder.
+//
+// d: Decoder to free memory for.
+// returns: Void.
+//
+void lz78_decoder_delete(lz78_decoder *d) {
+  if (d != NULL) {
+    wt_delete(d->table);
+    lq_delete(d->leaves);
+    free(d);
+  }
+  return;
+}
+
+//
+// Gives a decoder the dictionary to decode streams that name one with. A
+// stream naming another dictionary fails with LZ78_ERR_DICT. The phrases
+// of the dictionary are recorded once and kept from stream to stream.
+//
+// d: Decoder to give the dictionary to, between streams.
+// dict: Dictionary, which must outlive the decoder, or NULL for none.
+// returns: Void.
+//
+void lz78_decoder_set_dict(lz78_decoder *d, const lz78_dict *dict) {
+  d->dict = dict;
+  return;
+}
+
+//
+// Starts a new stream on an existing decoder, keeping its memory.
+//
+// d: Decoder to reset.
+// header: FileHeader of a stream that has none, or NULL if the stream
+//         starts with its FileHeader.
+// returns: Void.
+//
+void lz78_decoder_reset(lz78_decoder *d, const FileHeader *header) {
+  if (d->table != NULL) {
+    wt_forget(d->table);
+  }
+  if (d->leaves != NULL) {
+    lq_reset(d->leaves);
+  }
+  memset(&d->reader, 0, sizeof(d->reader));
+  d->next_code = START_CODE;
+  d->first_code = 0;
+  d->prev_code = 0;
+  d->header_len = header != NULL ? HEADER_SIZE : 0;
+  d->header_need = HEADER_SIZE;
+  if (header != NULL) {
+    d->header = *header;
+  } else {
+    memset(&d->header, 0, sizeof(d->header));
+  }
+  d->stored_left = 0;
+  d->stored_len_len = 0;
+  d->done = false;
+  d->total_in = 0;
+  d->total_out = 0;
+  return;
+}
+
+//
+// Copies decoded bytes that have not been returned yet into out.
+//
+// wt: WordTable holding the decoded bytes.
+// out: Memory to copy to.
+// room: Size of out.
+// returns: Number of bytes copied.
+//
+static size_t drain(WordTable *wt, uint8_t *out, size_t room) {
+  size_t len = wt->len - wt->flushed;
+  if (len > room) {
+    len = room;
+  }
+  memcpy(out, wt->hist + wt->flushed, len);
+  wt->flushed += len;
+  return len;
+}
+
+//
+// Decodes a code in the modes that send codes only, growing the dictionary
+// the same way grow_codes did, or resets the dictionary for EMPTY_CODE.
+// code must be below d->next_code.
+//
+// d: Decoder of the stream.
+// wt: WordTable of the stream, with room in hist for the phrase.
+// code: Code to decode.
+// returns: Void.
+//
+static void decode_code(lz78_decoder *d, WordTable *wt, uint32_t code) {
+  if (code == EMPTY_CODE) {
+    d->next_code = d->first_code;
+    d->prev_code = 0;
+    return;
+  }
+  uint64_t pos = wt->base + wt->len;
+  WordEntry *entry = &wt->entries[code];
+  Word w = wt_add(wt, entry->parent, entry->sym, code);
+
+  // The previous phrase, with this one appended, is at d->prev_pos
+  uint32_t next_code = d->next_code;
+  if (d->prev_code != 0) {
+    uint32_t count = d->header.mode == MODE_LZW ? 1 : w.len;
+    uint32_t parent = d->prev_code;
+    for (uint32_t j = 0; j < count && next_code < wt->max_code; j++) {
+      wt_define(wt, next_code, parent, w.syms[j], d->prev_pos);
+      parent = next_code++;
+      if (next_code == wt->max_code && d->header.policy == DICT_RESET) {
+        next_code = d->first_code;
+        code = 0;
+        break;
+      }
+    }
+  }
+  d->next_code = next_code;
+  d->prev_code = code;
+  d->prev_pos = pos;
+  return;
+}
+
+//
+// Starts the dictionary of a stream once its FileHeader is in, with the
+// codes the encoder's Trie was seeded with: in the modes that send codes
+// only every single symbol, and then the phrases of the dictionary the
+// stream names. Those are only recorded if the WordTable does not already
+// hold them from an earlier stream, and are rebuilt from their parents the
+// first time they are used, as their positions are before the stream.
+//
+// d: Decoder of the stream, with its WordTable sized.
+// returns: 0 on success, LZ78_ERR_DICT if the stream names a dictionary
+//          the decoder was not given, or LZ78_ERR_CORRUPT.
+//
+static int64_t start_stream(lz78_decoder *d) {
+  WordTable *wt = d->table;
+  CodecMode mode = d->header.mode;
+  const lz78_dict *dict = NULL;
+  if (d->header.dict_id != 0) {
+    dict = d->dict;
+    if (dict == NULL || dict->id != d->header.dict_id) {
+      return LZ78_ERR_DICT;
+    }
+    if (d->header.policy == DICT_PRUNE) {
+      return LZ78_ERR_CORRUPT;
+    }
+  }
+  uint32_t first = dict_first_code(dict, mode);
+  if (first >= wt->max_code) {
+    return LZ78_ERR_CORRUPT;
+  }
+  if (mode != MODE_LZ78) {
+    wt_literals(wt);
+  }
+  if (dict != NULL && (d->table_dict != dict || d->table_mode != mode)) {
+    uint32_t i = mode != MODE_LZ78 ? dict->singles : 0;
+    for (; i < dict->count; i++) {
+      wt_define(wt, dict_code(dict, mode, i), dict_parent_code(dict, mode, i),
+          dict_sym(dict, i), 0);
+    }
+    wt_forget(wt);
+  }
+  // A stream without the dictionary gives its codes to its own phrases
+  d->table_dict = dict;
+  d->table_mode = mode;
+  d->first_code = first;
+  d->next_code = first;
+  return 0;
+}
+
+//
+// Copies the records of a stored stream into out, for lz78_decompress once
+// the FileHeader has been received. A record may arrive over several calls,
+// as may the bytes of its length.
+//
+// d: Decoder of the stream.
+// in: Compressed bytes.
+// in_len: Number of compressed bytes.
+// used: Number of bytes of in already consumed, by the FileHeader.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store decompressed bytes to.
+// out_cap: Size of out.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+static int64_t decompress_stored(lz78_decoder *d, const uint8_t *in,
+    size_t in_len, size_t used, size_t *in_used, uint8_t *out,
+    size_t out_cap) {
+  // A stored stream names no dictionary
+  if (d->header.dict_id != 0) {
+    return LZ78_ERR_CORRUPT;
+  }
+  size_t start = used;
+  size_t written = 0;
+  while (!d->done && used < in_len) {
+    if (d->stored_left == 0) {
+      while (d->stored_len_len < STORED_LEN_SIZE && used < in_len) {
+        d->stored_len[d->stored_len_len++] = in[used++];
+      }
+      if (d->stored_len_len < STORED_LEN_SIZE) {
+        break;
+      }
+      d->stored_len_len = 0;
+      d->stored_left = load32(d->stored_len);
+      d->done = d->stored_left == 0;
+      continue;
+    }
+    if (written == out_cap) {
+      break;
+    }
+    size_t take = d->stored_left;
+    take = in_len - used < take ? in_len - used : take;
+    take = out_cap - written < take ? out_cap - written : take;
+    memcpy(out + written, in + used, take);
+    d->stored_left -= take;
+    used += take;
+    written += take;
+  }
+  d->total_in += used - start;
+  d->total_out += written;
+  *in_used = used;
+  return written;
+}
+
+//
+// Decompresses a chunk of compressed input, which may be of any size.
+//
+// Input is consumed until it runs out, out is full or the stream ends, and
+// the number of bytes consumed is placed in in_used. Decoded bytes that did
+// not fit in out are kept and returned by the next call, so call again
+// (with no input if need be) while out keeps getting filled.
+//
+// d: Decoder of the stream.
+// in: Compressed bytes.
+// in_len: Number of compressed bytes.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store decompressed bytes to.
+// out_cap: Size of out.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_decompress(lz78_decoder *d, const uint8_t *in, size_t in_len,
+    size_t *in_used, uint8_t *out, size_t out_cap) {
+  size_t used = 0;
+  *in_used = 0;
+
+  // Read File Header, which may arrive over several calls, and is longer
+  // when it names a dictionary
+  if (d->header_len < d->header_need) {
+    while (d->header_len < d->header_need && used < in_len) {
+      d->header_bytes[d->header_len++] = in[used++];
+      if (d->header_len == HEADER_SIZE &&
+          (d->header_bytes[HEADER_SIZE - 1] & HEADER_DICT)) {
+        d->header_need = MAX_HEADER_SIZE;
+      }
+    }
+    *in_used = used;
+    d->total_in += used;
+    if (d->header_len < d->header_need) {
+      return 0;
+    }
+    read_header(d->header_bytes, &d->header);
+    if (d->header.magic != MAGIC) {
+      return LZ78_ERR_MAGIC;
+    }
+  }
+  if (d->header.stored) {
+    return decompress_stored(d, in, in_len, used, in_used, out, out_cap);
+  }
+
+  // Size the WordTable for the stream's dictionary
+  uint8_t code_bits = d->header.code_bits;
+  if (d->table == NULL || d->table->max_code != MAX_CODE_OF(code_bits)) {
+    if (code_bits < MIN_CODE_BITS || code_bits > MAX_CODE_BITS) {
+      return LZ78_ERR_CORRUPT;
+    }
+    wt_delete(d->table);
+    d->table = wt_create(code_bits);
+    d->table_dict = NULL;
+    if (d->table == NULL) {
+      return LZ78_ERR_MEMORY;
+    }
+  }
+  DictPolicy policy = d->header.policy;
+  CodecMode mode = d->header.mode;
+  if (policy > DICT_PRUNE || mode > MODE_LZAP ||
+      (policy == DICT_PRUNE && mode != MODE_LZ78)) {
+    return LZ78_ERR_CORRUPT;
+  }
+  if (d->first_code == 0) {
+    int64_t err = start_stream(d);
+    if (err < 0) {
+      return err;
+    }
+  }
+  if (policy == DICT_PRUNE &&
+      (d->leaves == NULL || d->leaves->max_code != MAX_CODE_OF(code_bits))) {
+    lq_delete(d->leaves);
+    d->leaves = lq_create(code_bits);
+    if (d->leaves == NULL) {
+      return LZ78_ERR_MEMORY;
+    }
+  }
+
+  WordTable *wt = d->table;
+  PairReader *r = &d->reader;
+  r->buf = in;
+  r->len = in_len;
+  r->pos = used;
+
+  size_t written = 0;
+  bool starved = false;
+  CodeWidth width = code_width(d->next_code);
+  while (true) {
+    // Decode pairs while their output fits in out and in the history
+    while (!d->done && !starved && wt->len - wt->flushed < out_cap - written &&
+           wt->len < 2 * WINDOW) {
+      uint8_t curr_sym = 0;
+      uint32_t curr_code = 0;
+      uint32_t next_code = d->next_code;
+      if (next_code < width.low || next_code >= width.high) {
+        width = code_width(next_code);
+      }
+      if (mode != MODE_LZ78) {
+        if (!read_code(r, &curr_code, width.bits)) {
+          starved = true;
+          break;
+        }
+        if (curr_code == STOP_CODE) {
+          d->done = true;
+          break;
+        }
+        if (curr_code >= next_code ||
+            (curr_code == EMPTY_CODE && policy != DICT_ADAPTIVE)) {
+          *in_used = r->pos;
+          return LZ78_ERR_CORRUPT;
+        }
+        decode_code(d, wt, curr_code);
+        continue;
+      }
+      if (!read_pair(r, &curr_code, &curr_sym, width.bits)) {
+        starved = true;
+        break;
+      }
+      if (curr_code == STOP_CODE) {
+        if (curr_sym == RESET_SYM && policy == DICT_ADAPTIVE) {
+          wt_reset(wt);
+          d->next_code = d->first_code;
+          continue;
+        }
+        d->done = true;
+        break;
+      }
+      if (curr_code >= next_code) {
+        *in_used = r->pos;
+        return LZ78_ERR_CORRUPT;
+      }
+      if (next_code < wt->max_code) {
+        wt_add(wt, curr_code, curr_sym, next_code);
+        if (d->leaves != NULL && policy == DICT_PRUNE) {
+          lq_link(d->leaves, next_code, curr_code, curr_sym);
+        }
+        next_code = next_code + 1;
+        if (next_code >= wt->max_code && policy == DICT_RESET) {
+          wt_reset(wt);
+          next_code = d->first_code;
+        }
+      } else {
+        // The phrase of a full dictionary is decoded into the spare entry
+        // at max_code unless pruning frees a code for it
+        uint32_t code = next_code;
+        if (policy == DICT_PRUNE) {
+          uint32_t victim = lq_evict(d->leaves, curr_code);
+          if (victim != 0) {
+            code = victim;
+            lq_link(d->leaves, victim, curr_code, curr_sym);
+          }
+        }
+        wt_add(wt, curr_code, curr_sym, code);
+      }
+      d->next_code = next_code;
+    }
+    written += drain(wt, out + written, out_cap - written);
+    if (wt->len > wt->flushed || d->done || starved || written == out_cap) {
+      break;
+    }
+    if (wt->len >= 2 * WINDOW) {
+      wt_slide(wt);
+    }
+  }
+
+  d->total_in += r->pos - used;
+  d->total_out += written;
+  *in_used = r->pos;
+  return written;
+}
+
+//
+// Returns whether a decoder has reached the end of its stream and has no
+// decoded bytes left to return.
+//
+// d: Decoder of the stream.
+// returns: True if the stream has been fully decoded, false otherwise.
+//
+bool lz78_decoder_done(lz78_decoder *d) {
+  // A stored stream keeps no decoded bytes, nor a WordTable
+  return d->done &&
+         (d->header.stored || d->table->len == d->table->flushed);
+}
+
+//
+// Returns whether the FileHeader of a stream has been received.
+//
+// d: Decoder of the stream.
+// returns: True if d->header is valid, false otherwise.
+//
+bool lz78_decoder_has_header(lz78_decoder *d) {
+  return d->header_len == d->header_need;
+}
+
+//
+// Returns the largest number of bytes lz78_compress_buffer may produce
+// from n bytes, whatever its options: the FileHeader, 4 bytes per input
+// byte (a phrase of one byte with a 24 bit code and its symbol), a pair
+// per dictionary reset, and the last phrase and STOP_CODE.
+//
+// n: Number of bytes to compress.
+// returns: Number of bytes an output buffer needs.
+//
+size_t lz78_compress_bound(size_t n) {
+  // A dictionary sends a reset at most once it has filled again, which
+  // takes more than 2048 phrases at MIN_CODE_BITS
+  return MAX_HEADER_SIZE + 4 * (n + n / 2048 + 1) + PAIR_ROOM +
+         2 * LZ78_MIN_OUT;
+}
+
+//
+// Returns the number of bytes of memory lz78_workspace_init needs.
+//
+// opts: Options to compress with, or NULL for the defaults. Their code bits
+//       are also the most that buffers decompressed with it may use.
+// returns: Number of bytes, or 0 if the options are not valid for a
+//          workspace. The dense backend takes at most 20 bit codes, as
+//          its tables are not grown in a workspace.
+//
+size_t lz78_workspace_size(const lz78_options *opts) {
+  lz78_options defaults;
+  if (opts == NULL) {
+    lz78_options_default(&defaults);
+    opts = &defaults;
+  }
+  if (!options_valid(opts) || opts->policy == DICT_PRUNE ||
+      (opts->backend == TRIE_DENSE &&
+       opts->code_bits > DENSE_WORKSPACE_BITS)) {
+    return 0;
+  }
+  uint32_t max_code = MAX_CODE_OF(opts->code_bits);
+  size_t size = ALIGN_UP(sizeof(lz78_workspace));
+  size += trie_size(opts->backend, opts->code_bits);
+  size += seed_size(opts);
+  if (opts->mode != MODE_LZ78) {
+    size += ALIGN_UP((size_t)max_code);
+  }
+  // The spare entry at max_code is never needed, as nothing is recorded
+  // for the phrases of a full dictionary
+  size += (size_t)max_code * sizeof(WordSpan);
+  return size;
+}
+
+//
+// Sets up a workspace in memory the caller owns. Nothing is allocated,
+// then or later. DICT_PRUNE is refused, as removing phrases from a Trie
+// may grow it. A workspace is used by one thread at a time.
+//
+// mem: Memory of lz78_workspace_size bytes, aligned as malloc aligns it.
+// size: Size of mem.
+// opts: Options to compress with, or NULL for the defaults.
+// returns: Pointer to the workspace, at mem, or NULL if mem is too small
+//          or the options are not valid for a workspace.
+//
+lz78_workspace *lz78_workspace_init(void *mem, size_t size,
+    const lz78_options *opts) {
+  lz78_options defaults;
+  if (opts == NULL) {
+    lz78_options_default(&defaults);
+    opts = &defaults;
+  }
+  size_t need = lz78_workspace_size(opts);
+  if (mem == NULL || need == 0 || size < need) {
+    return (void *)0;
+  }
+  lz78_workspace *ws = (lz78_workspace *)mem;
+  uint8_t *next = (uint8_t *)mem + ALIGN_UP(sizeof(lz78_workspace));
+  memset(ws, 0, sizeof(*ws));
+  trie_init(&ws->trie, opts->backend, opts->code_bits, next);
+  next += trie_size(opts->backend, opts->code_bits);
+  seed_trie(&ws->trie, opts, seed_size(opts) > 0 ? next : NULL);
+  next += seed_size(opts);
+  ws->encoder.trie = &ws->trie;
+  if (opts->mode != MODE_LZ78) {
+    ws->encoder.phrase = next;
+    next += ALIGN_UP((size_t)MAX_CODE_OF(opts->code_bits));
+  }
+  ws->spans = (WordSpan *)next;
+  ws->code_bits = opts->code_bits;
+  ws->dict = opts->dict;
+  encoder_setup(&ws->encoder, opts);
+  return ws;
+}
+
+//
+// Compresses a whole buffer into a plain stream, FileHeader included, as
+// lz78_compress and lz78_compress_finish would. The dictionary is only
+// rewound between calls, so a call costs little more than its bytes.
+//
+// ws: Workspace to compress with.
+// src: Bytes to compress.
+// src_len: Number of bytes to compress.
+// dst: Memory to store compressed bytes to.
+// dst_cap: Size of dst; lz78_compress_bound(src_len) always suffices.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress_buffer(lz78_workspace *ws, const uint8_t *src,
+    size_t src_len, uint8_t *dst, size_t dst_cap) {
+  lz78_encoder *e = &ws->encoder;
+  if (dst_cap < 2 * LZ78_MIN_OUT) {
+    return LZ78_ERR_CAPACITY;
+  }
+  lz78_encoder_reset(e, true);
+
+  // The last LZ78_MIN_OUT bytes are kept back for lz78_compress_finish
+  size_t used = 0;
+  int64_t len = lz78_compress(e, src, src_len, &used, dst,
+      dst_cap - LZ78_MIN_OUT);
+  if (len < 0) {
+    return len;
+  }
+  if (used < src_len) {
+    return LZ78_ERR_CAPACITY;
+  }
+  int64_t end = lz78_compress_finish(e, dst + len, dst_cap - len);
+  if (end < 0) {
+    return end;
+  }
+  return len + end;
+}
+
+//
+// Decodes the codes of a stream in the modes that send codes only straight
+// into a buffer, growing the dictionary as decode_code does.
+//
+// ws: Workspace to decode with.
+// r: PairReader of the codes, past the FileHeader.
+// header: FileHeader of the stream.
+// dict: Dictionary of the stream, or NULL.
+// dst: Memory to store decompressed bytes to.
+// dst_cap: Size of dst, at most UINT32_MAX.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value.
+//
+static int64_t decode_codes_buffer(lz78_workspace *ws, PairReader *r,
+    const FileHeader *header, const lz78_dict *dict, uint8_t *dst,
+    size_t dst_cap) {
+  WordSpan *spans = ws->spans;
+  uint32_t max_code = MAX_CODE_OF(header->code_bits);
+  uint32_t first_code = dict_first_code(dict, header->mode);
+  uint32_t next_code = first_code;
+  uint32_t prev_code = 0;
+  WordSpan prev = {0, 0};
+  size_t out = 0;
+  CodeWidth width = code_width(next_code);
+  while (true) {
+    uint32_t code = 0;
+    if (next_code < width.low || next_code >= width.high) {
+      width = code_width(next_code);
+    }
+    if (!read_code(r, &code, width.bits)) {
+      return LZ78_ERR_CORRUPT;
+    }
+    if (code == STOP_CODE) {
+      return out;
+    }
+    if (code >= next_code ||
+        (code == EMPTY_CODE && header->policy != DICT_ADAPTIVE)) {
+      return LZ78_ERR_CORRUPT;
+    }
+    if (code == EMPTY_CODE) {
+      next_code = first_code;
+      prev_code = 0;
+      continue;
+    }
+
+    // Literals have no WordSpan and phrases of the dictionary are in its
+    // text; every other phrase was seen before
+    WordSpan w = {(uint32_t)out, 1};
+    if (code < WORD_START_CODE) {
+      if (out == dst_cap) {
+        return LZ78_ERR_CAPACITY;
+      }
+      dst[out] = code - LITERAL_CODE(0);
+    } else if (code < first_code) {
+      const DictEntry *e =
+          &dict->entries[code - WORD_START_CODE + dict->singles];
+      w.len = e->len;
+      if (w.len > dst_cap - out) {
+        return LZ78_ERR_CAPACITY;
+      }
+      memcpy(dst + out, dict->text + e->pos, w.len);
+    } else {
+      w.len = spans[code].len;
+      if (w.len > dst_cap - out) {
+        return LZ78_ERR_CAPACITY;
+      }
+      memcpy(dst + out, dst + spans[code].pos, w.len);
+    }
+    out += w.len;
+
+    // The previous phrase, with this one appended, is at prev.pos
+    if (prev_code != 0) {
+      uint32_t count = header->mode == MODE_LZW ? 1 : w.len;
+      for (uint32_t j = 0; j < count && next_code < max_code; j++) {
+        spans[next_code].pos = prev.pos;
+        spans[next_code].len = prev.len + j + 1;
+        next_code++;
+        if (next_code == max_code && header->policy == DICT_RESET) {
+          next_code = first_code;
+          code = 0;
+          break;
+        }
+      }
+    }
+    prev_code = code;
+    prev = w;
+  }
+}
+
+//
+// Copies the records of a stored stream straight into a buffer.
+//
+// src: Compressed bytes.
+// src_len: Number of compressed bytes.
+// pos: Position of the first record in src, past the FileHeader.
+// dst: Memory to store decompressed bytes to.
+// dst_cap: Size of dst.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value.
+//
+static int64_t decode_stored_buffer(const uint8_t *src, size_t src_len,
+    size_t pos, uint8_t *dst, size_t dst_cap) {
+  size_t out = 0;
+  while (true) {
+    if (src_len - pos < STORED_LEN_SIZE) {
+      return LZ78_ERR_CORRUPT;
+    }
+    uint32_t len = load32(src + pos);
+    pos += STORED_LEN_SIZE;
+    if (len == 0) {
+      return out;
+    }
+    if (len > src_len - pos) {
+      return LZ78_ERR_CORRUPT;
+    }
+    if (len > dst_cap - out) {
+      return LZ78_ERR_CAPACITY;
+    }
+    memcpy(dst + out, src + pos, len);
+    pos += len;
+    out += len;
+  }
+}
+
+//
+// Decompresses a whole plain stream, FileHeader included, straight into a
+// buffer. Every phrase is copied from its last appearance in dst, so no
+// history is kept. DICT_PRUNE streams are refused with LZ78_ERR_STATE, as
+// are streams of more code bits than the workspace with LZ78_ERR_MEMORY and
+// streams naming another dictionary than the workspace's with LZ78_ERR_DICT.
+// Phrases of the dictionary are copied from its text, and the records of a
+// stored stream whatever its options.
+//
+// ws: Workspace to decompress with.
+// src: Compressed bytes.
+// src_len: Number of compressed bytes.
+// dst: Memory to store decompressed bytes to.
+// dst_cap: Size of dst, of which at most 4 GB is used.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value;
+//          LZ78_ERR_CAPACITY if they did not fit.
+//
+int64_t lz78_decompress_buffer(lz78_workspace *ws, const uint8_t *src,
+    size_t src_len, uint8_t *dst, size_t dst_cap) {
+  FileHeader header;
+  if (src_len < HEADER_SIZE ||
+      ((src[HEADER_SIZE - 1] & HEADER_DICT) && src_len < MAX_HEADER_SIZE)) {
+    return LZ78_ERR_CORRUPT;
+  }
+  read_header(src, &header);
+  if (header.magic != MAGIC) {
+    return LZ78_ERR_MAGIC;
+  }
+  if (header.code_bits < MIN_CODE_BITS || header.code_bits > MAX_CODE_BITS ||
+      header.policy > DICT_PRUNE || header.mode > MODE_LZAP ||
+      (header.policy == DICT_PRUNE && header.mode != MODE_LZ78) ||
+      (header.stored && header.dict_id != 0)) {
+    return LZ78_ERR_CORRUPT;
+  }
+  // Records are copied whatever dictionary the encoder was given
+  if (header.stored) {
+    return decode_stored_buffer(src, src_len, file_header_len(&header), dst,
+        dst_cap);
+  }
+  if (header.policy == DICT_PRUNE) {
+    return LZ78_ERR_STATE;
+  }
+  if (header.code_bits > ws->code_bits) {
+    return LZ78_ERR_MEMORY;
+  }
+  const lz78_dict *dict = NULL;
+  if (header.dict_id != 0) {
+    dict = ws->dict;
+    if (dict == NULL || dict->id != header.dict_id) {
+      return LZ78_ERR_DICT;
+    }
+  }
+  uint32_t first_code = dict_first_code(dict, header.mode);
+  if (first_code >= MAX_CODE_OF(header.code_bits)) {
+    return LZ78_ERR_CORRUPT;
+  }
+  // Positions of WordSpans take 32 bits
+  if (dst_cap > UINT32_MAX) {
+    dst_cap = UINT32_MAX;
+  }
+
+  PairReader r;
+  memset(&r, 0, sizeof(r));
+  r.buf = src;
+  r.len = src_len;
+  r.pos = file_header_len(&header);
+  if (header.mode != MODE_LZ78) {
+    return decode_codes_buffer(ws, &r, &header, dict, dst, dst_cap);
+  }
+
+  WordSpan *spans = ws->spans;
+  uint32_t max_code = MAX_CODE_OF(header.code_bits);
+  uint32_t next_code = first_code;
+  size_t out = 0;
+  CodeWidth width = code_width(next_code);
+  spans[EMPTY_CODE].pos = 0;
+  spans[EMPTY_CODE].len = 0;
+  while (true) {
+    uint8_t sym = 0;
+    uint32_t code = 0;
+    if (next_code < width.low || next_code >= width.high) {
+      width = code_width(next_code);
+    }
+    if (!read_pair(&r, &code, &sym, width.bits)) {
+      return LZ78_ERR_CORRUPT;
+    }
+    if (code == STOP_CODE) {
+      if (sym == RESET_SYM && header.policy == DICT_ADAPTIVE) {
+        next_code = first_code;
+        continue;
+      }
+      return out;
+    }
+    if (code >= next_code) {
+      return LZ78_ERR_CORRUPT;
+    }
+    // Phrases of the dictionary are in its text, every other one in dst
+    const uint8_t *from = dst + spans[code].pos;
+    uint32_t len = spans[code].len;
+    if (code < first_code && code >= START_CODE) {
+      const DictEntry *e = &dict->entries[code - START_CODE];
+      from = dict->text + e->pos;
+      len = e->len;
+    }
+    if (len >= dst_cap - out) {
+      return LZ78_ERR_CAPACITY;
+    }
+    memcpy(dst + out, from, len);
+    dst[out + len] = sym;
+
+    // The phrases of a full dictionary that is kept are not recorded
+    if (next_code < max_code) {
+      spans[next_code].pos = out;
+      spans[next_code].len = len + 1;
+      next_code++;
+      if (next_code >= max_code && header.policy == DICT_RESET) {
+        next_code = first_code;
+      }
+    }
+    out += len + 1;
+  }
+}
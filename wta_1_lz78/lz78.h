@@ -0,0 +1,545 @@
+//
+// Contains definitions for the streaming LZ78 encoder and decoder library
+//
+
+#ifndef __LZ78_H__
+#define __LZ78_H__
+
+#include "code.h"
+#include "dict.h"
+#include "io.h"
+#include "prune.h"
+#include "trie.h"
+#include "word.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Errors returned instead of a byte count
+#define LZ78_ERR_CAPACITY -1
+#define LZ78_ERR_MAGIC -2
+#define LZ78_ERR_CORRUPT -3
+#define LZ78_ERR_STATE -4
+#define LZ78_ERR_MEMORY -5
+#define LZ78_ERR_DICT -6
+
+// Smallest output buffer lz78_compress and lz78_compress_finish accept
+#define LZ78_MIN_OUT 32
+
+// Compression levels: the greedy parse, and the level that looks furthest
+// ahead
+#define LZ78_MIN_LEVEL 1
+#define LZ78_MAX_LEVEL 9
+
+// Number and size of the chunks lz78_incompressible samples bytes with
+#define SAMPLE_CHUNKS 16
+#define SAMPLE_CHUNK 4096
+
+//
+// Struct definition of the options an encoder is created with.
+//
+// backend: Child lookup strategy of the encoder's Trie.
+// protection: Protection / permissions recorded in the FileHeader.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS. A
+//            larger dictionary is reset less often, for more memory.
+// policy: What to do once the dictionary is full, see DictPolicy.
+// mode: How phrases are sent, see CodecMode. DICT_PRUNE needs MODE_LZ78.
+// entropy: Entropy code the pairs of each block of a framed file. Only
+//          frame_encode uses it, as a plain stream is never held whole.
+// dict: Dictionary every stream starts with, or NULL for none. Its ID is
+//       recorded in the FileHeader, or the FrameHeader of a framed file.
+//       It must outlive the encoder. DICT_PRUNE does not take one.
+// level: LZ78_MIN_LEVEL to LZ78_MAX_LEVEL. Above LZ78_MIN_LEVEL a phrase
+//        may be cut short where that lets the next one reach further,
+//        trying more cuts at higher levels. Decoders see no difference.
+//        DICT_PRUNE needs LZ78_MIN_LEVEL.
+// store: Store a plain stream as it is when lz78_incompressible samples
+//        the input of its first lz78_compress as random, so that it grows
+//        by a few bytes rather than by a third. Only streams with a
+//        FileHeader are stored, see HEADER_STORED, which decoders older
+//        than it cannot read. Framed files store such blocks regardless.
+//
+typedef struct lz78_options {
+  TrieBackend backend;
+  uint16_t protection;
+  uint8_t code_bits;
+  DictPolicy policy;
+  CodecMode mode;
+  bool entropy;
+  const lz78_dict *dict;
+  uint8_t level;
+  bool store;
+} lz78_options;
+
+//
+// Struct definition of the statistics of encoding, which
+// lz78_encoder_stats adds the counts of a stream to. Times are filled in
+// by the caller, which knows what it spent them on, and are summed over
+// threads when there are several.
+//
+// phrases: Number of phrases sent.
+// nodes: Number of phrases added to the dictionary.
+// resets: Number of times the dictionary was started over.
+// widths: Number of phrases sent at each code width, in bits.
+// stored: Number of blocks of a framed file, or plain streams, stored as
+//         they are.
+// read_ns: Nanoseconds spent reading input.
+// code_ns: Nanoseconds spent compressing. Walking the Trie and packing
+//          pairs take turns phrase by phrase, so they are timed together.
+// write_ns: Nanoseconds spent writing output.
+//
+typedef struct lz78_stats {
+  uint64_t phrases;
+  uint64_t nodes;
+  uint64_t resets;
+  uint64_t widths[MAX_CODE_BITS + 1];
+  uint64_t stored;
+  uint64_t read_ns;
+  uint64_t code_ns;
+  uint64_t write_ns;
+} lz78_stats;
+
+//
+// Struct definition of an encoder, which holds all the state of one stream.
+//
+// trie: Dictionary of the phrases seen so far.
+// curr_node: TrieNode of the phrase being matched.
+// prev_node: Parent of curr_node.
+// prev_sym: Last symbol consumed.
+// mode: How phrases are sent.
+// prev_phrase: TrieNode of the last phrase sent, which the next one is
+//              appended to, or NULL after a reset (MODE_LZW, MODE_LZAP).
+// phrase: Symbols of the phrase being matched (MODE_LZW, MODE_LZAP).
+// phrase_len: Number of symbols in phrase, or matched so far (MODE_LZ78
+//             above LZ78_MIN_LEVEL).
+// prev_len: Number of symbols in prev_phrase (above LZ78_MIN_LEVEL).
+// next_code: Code the next phrase will be given, max_code once full.
+// first_code: Code the first phrase made after a reset is given, after
+//             the literals and the phrases of the shared dictionary.
+// seed_depth: Length of the longest phrase the dictionary holds after a
+//             reset.
+// depth: Length the longest phrase of the dictionary has at most (above
+//        LZ78_MIN_LEVEL).
+// max_code: Code at which the dictionary is full.
+// level: Compression level, see lz78_options.
+// policy: What to do once the dictionary is full.
+// leaves: Leaf phrases in the order pruning takes them (DICT_PRUNE).
+// window_in: Input consumed when the current ratio window started, or 0
+//            before the dictionary is full (DICT_ADAPTIVE).
+// window_bits: Bits of pairs buffered when the window started.
+// best_ratio: Lowest bits per 256 input bytes of a window since the
+//             dictionary filled, or 0 before the first window ends.
+// resets: Number of times the dictionary was started over.
+// nodes: Number of phrases added to the dictionary.
+// widths: Number of phrases sent at each code width, in bits.
+// writer: PairWriter the pairs are packed with.
+// store: Whether the stream may be stored, see lz78_options.
+// stored: True if the stream is stored records rather than pairs.
+// header: FileHeader written at the start of the stream.
+// header_done: True once the FileHeader has been written.
+// finished: True once lz78_compress_finish has ended the stream.
+// total_in: Number of bytes consumed.
+// total_out: Number of bytes produced.
+//
+typedef struct lz78_encoder {
+  Trie *trie;
+  TrieNode *curr_node;
+  TrieNode *prev_node;
+  uint8_t prev_sym;
+  CodecMode mode;
+  TrieNode *prev_phrase;
+  uint8_t *phrase;
+  uint32_t phrase_len;
+  uint32_t prev_len;
+  uint32_t next_code;
+  uint32_t first_code;
+  uint32_t seed_depth;
+  uint32_t depth;
+  uint32_t max_code;
+  uint8_t level;
+  DictPolicy policy;
+  LeafQueue *leaves;
+  uint64_t window_in;
+  uint64_t window_bits;
+  uint64_t best_ratio;
+  uint64_t resets;
+  uint64_t nodes;
+  uint64_t widths[MAX_CODE_BITS + 1];
+  PairWriter writer;
+  bool store;
+  bool stored;
+  FileHeader header;
+  bool header_done;
+  bool finished;
+  uint64_t total_in;
+  uint64_t total_out;
+} lz78_encoder;
+
+//
+// Struct definition of a workspace for compressing and decompressing whole
+// buffers, which lives in memory the caller owns, so that no call made with
+// it allocates. Its memory follows it: the TrieNodes, tables and slots of
+// the Trie and what sealing it takes, the phrase of the encoder, and the
+// WordSpans of the decoder.
+//
+// encoder: Encoder of every buffer compressed with the workspace.
+// trie: Trie of encoder.
+// spans: One WordSpan per code of the decoder.
+// code_bits: Largest dictionary size in bits the workspace decodes.
+// dict: Dictionary of the options, which buffers compressed with the
+//       workspace start with, and the only one it decodes, or NULL.
+//
+typedef struct lz78_workspace {
+  lz78_encoder encoder;
+  Trie trie;
+  WordSpan *spans;
+  uint8_t code_bits;
+  const lz78_dict *dict;
+} lz78_workspace;
+
+//
+// Struct definition of a decoder, which holds all the state of one stream.
+//
+// table: Dictionary of the phrases seen so far, and the recent output. It
+//        is sized for the code bits of the stream once its header is read.
+// leaves: Leaf phrases in the order pruning takes them, allocated once a
+//         DICT_PRUNE stream is met.
+// reader: PairReader the pairs are unpacked with.
+// dict: Dictionary streams that name one are decoded with, or NULL.
+// table_dict: Dictionary whose phrases the entries of table hold, for
+//             table_mode, so that they are only recorded once, or NULL.
+// table_mode: CodecMode the phrases of table_dict are recorded for.
+// next_code: Code the next phrase will be given, max_code once full.
+// first_code: Code the first phrase made after a reset is given, or 0
+//             until the stream has started.
+// prev_code: Code of the last phrase decoded, or 0 after a reset
+//            (MODE_LZW, MODE_LZAP).
+// prev_pos: Position in the decoded output of the last phrase.
+// header_bytes: Bytes of the FileHeader received so far.
+// header_len: Number of bytes in header_bytes.
+// header_need: Number of bytes of the FileHeader, known once byte 7 is in.
+// header: FileHeader of the stream, once all of it has been received.
+// stored_left: Bytes of the current record of a stored stream still to
+//              be copied.
+// stored_len: Bytes of the length of the next record received so far.
+// stored_len_len: Number of bytes in stored_len.
+// done: True once STOP_CODE, or the last record, has been read.
+// total_in: Number of bytes consumed.
+// total_out: Number of bytes produced.
+//
+typedef struct lz78_decoder {
+  WordTable *table;
+  LeafQueue *leaves;
+  PairReader reader;
+  const lz78_dict *dict;
+  const lz78_dict *table_dict;
+  CodecMode table_mode;
+  uint32_t next_code;
+  uint32_t first_code;
+  uint32_t prev_code;
+  uint64_t prev_pos;
+  uint8_t header_bytes[MAX_HEADER_SIZE];
+  uint32_t header_len;
+  uint32_t header_need;
+  FileHeader header;
+  uint32_t stored_left;
+  uint8_t stored_len[STORED_LEN_SIZE];
+  uint32_t stored_len_len;
+  bool done;
+  uint64_t total_in;
+  uint64_t total_out;
+} lz78_decoder;
+
+//
+// Parses the name of a DictPolicy ("reset", "freeze", "adaptive" or
+// "prune").
+//
+// name: Name of the policy.
+// policy: Pointer to memory which stores the parsed policy.
+// returns: True if the name is a known policy, false otherwise.
+//
+bool lz78_policy_parse(const char *name, DictPolicy *policy);
+
+//
+// Returns the name of a DictPolicy.
+//
+// policy: The policy to name.
+// returns: Name of the policy.
+//
+const char *lz78_policy_name(DictPolicy policy);
+
+//
+// Parses the name of a CodecMode ("lz78", "lzw" or "lzap").
+//
+// name: Name of the mode.
+// mode: Pointer to memory which stores the parsed mode.
+// returns: True if the name is a known mode, false otherwise.
+//
+bool lz78_mode_parse(const char *name, CodecMode *mode);
+
+//
+// Returns the name of a CodecMode.
+//
+// mode: The mode to name.
+// returns: Name of the mode.
+//
+const char *lz78_mode_name(CodecMode mode);
+
+//
+// Fills in the default options: the hybrid Trie, protection 0644,
+// DEFAULT_CODE_BITS, DICT_RESET, MODE_LZ78 and LZ78_MIN_LEVEL, with
+// incompressible input stored.
+//
+// opts: Options to fill in.
+// returns: Void.
+//
+void lz78_options_default(lz78_options *opts);
+
+//
+// Constructor for an encoder.
+//
+// opts: Options to create the encoder with, or NULL for the defaults.
+// returns: Pointer to the encoder, or NULL if allocation failed or the
+//          options are not valid, such as a dictionary with more phrases
+//          than the code bits allow.
+//
+lz78_encoder *lz78_encoder_create(const lz78_options *opts);
+
+//
+// Destructor for an encoder.
+//
+// e: Encoder to free memory for.
+// returns: Void.
+//
+void lz78_encoder_delete(lz78_encoder *e);
+
+//
+// Starts a new stream on an existing encoder, keeping its memory.
+//
+// e: Encoder to reset.
+// header: Whether the new stream starts with a FileHeader.
+// returns: Void.
+//
+void lz78_encoder_reset(lz78_encoder *e, bool header);
+
+//
+// Sets the protection the FileHeader of the encoder's streams records, so
+// that one encoder can compress files of different permissions.
+//
+// e: Encoder to set the protection of, between streams.
+// protection: Protection / permissions of the original file.
+// returns: Void.
+//
+void lz78_encoder_set_protection(lz78_encoder *e, uint16_t protection);
+
+//
+// Adds the counts of the encoder's stream so far to stats, so that the
+// streams of several encoders, such as the blocks of a framed file, can
+// be summed. Times in stats are left as they are.
+//
+// e: Encoder of the stream.
+// stats: Statistics to add to.
+// returns: Void.
+//
+void lz78_encoder_stats(const lz78_encoder *e, lz78_stats *stats);
+
+//
+// Estimates whether bytes are too close to random for LZ78 to shrink them,
+// from a sample of up to SAMPLE_CHUNKS chunks of SAMPLE_CHUNK bytes spread
+// over them. The sample is taken as incompressible when the chance of two
+// of its bytes being alike is under 1.4 / 256, its order 0 collision
+// entropy over 7.5 bits a byte, as every literal costs 8 bits plus a code.
+//
+// raw: Bytes to sample.
+// len: Number of bytes in raw.
+// returns: True if the bytes should be stored, false otherwise.
+//
+bool lz78_incompressible(const uint8_t *raw, uint64_t len);
+
+//
+// Decides whether a stream is stored from bytes of its input, as the first
+// lz78_compress of the stream does with its own when it has any. Call it
+// first to decide from other bytes, such as when that call has none.
+//
+// e: Encoder of the stream, before its FileHeader is written.
+// in: Bytes from the start of the input.
+// in_len: Number of bytes in in.
+// returns: True if the stream is stored, false otherwise.
+//
+bool lz78_encoder_sample(lz78_encoder *e, const uint8_t *in, size_t in_len);
+
+//
+// Compresses a chunk of input, which may be of any size.
+//
+// Input is consumed until it runs out or out is nearly full, and the
+// number of bytes consumed is placed in in_used. Call again with the rest
+// of the input once the output has been dealt with.
+//
+// e: Encoder of the stream.
+// in: Bytes to compress.
+// in_len: Number of bytes to compress.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store compressed bytes to.
+// out_cap: Size of out, at least LZ78_MIN_OUT.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress(lz78_encoder *e, const uint8_t *in, size_t in_len,
+    size_t *in_used, uint8_t *out, size_t out_cap);
+
+//
+// Ends the stream: stores the last, incomplete phrase and STOP_CODE.
+//
+// e: Encoder of the stream.
+// out: Memory to store compressed bytes to.
+// out_cap: Size of out, at least LZ78_MIN_OUT.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress_finish(lz78_encoder *e, uint8_t *out, size_t out_cap);
+
+//
+// Constructor for a decoder.
+//
+// returns: Pointer to the decoder, or NULL if allocation failed.
+//
+lz78_decoder *lz78_decoder_create(void);
+
+//
+// Destructor for a decoder.
+//
+// d: Decoder to free memory for.
+// returns: Void.
+//
+void lz78_decoder_delete(lz78_decoder *d);
+
+//
+// Gives a decoder the dictionary to decode streams that name one with. A
+// stream naming another dictionary fails with LZ78_ERR_DICT. The phrases
+// of the dictionary are recorded once and kept from stream to stream.
+//
+// d: Decoder to give the dictionary to, between streams.
+// dict: Dictionary, which must outlive the decoder, or NULL for none.
+// returns: Void.
+//
+void lz78_decoder_set_dict(lz78_decoder *d, const lz78_dict *dict);
+
+//
+// Starts a new stream on an existing decoder, keeping its memory.
+//
+// d: Decoder to reset.
+// header: FileHeader of a stream that has none, or NULL if the stream
+//         starts with its FileHeader.
+// returns: Void.
+//
+void lz78_decoder_reset(lz78_decoder *d, const FileHeader *header);
+
+//
+// Decompresses a chunk of compressed input, which may be of any size.
+//
+// Input is consumed until it runs out, out is full or the stream ends, and
+// the number of bytes consumed is placed in in_used. Decoded bytes that did
+// not fit in out are kept and returned by the next call, so call again
+// (with no input if need be) while out keeps getting filled.
+//
+// d: Decoder of the stream.
+// in: Compressed bytes.
+// in_len: Number of compressed bytes.
+// in_used: Pointer to memory which stores the number of bytes consumed.
+// out: Memory to store decompressed bytes to.
+// out_cap: Size of out.
+// returns: Number of bytes stored to out, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_decompress(lz78_decoder *d, const uint8_t *in, size_t in_len,
+    size_t *in_used, uint8_t *out, size_t out_cap);
+
+//
+// Returns whether a decoder has reached the end of its stream and has no
+// decoded bytes left to return.
+//
+// d: Decoder of the stream.
+// returns: True if the stream has been fully decoded, false otherwise.
+//
+bool lz78_decoder_done(lz78_decoder *d);
+
+//
+// Returns whether the FileHeader of a stream has been received.
+//
+// d: Decoder of the stream.
+// returns: True if d->header is valid, false otherwise.
+//
+bool lz78_decoder_has_header(lz78_decoder *d);
+
+//
+// Returns the largest number of bytes lz78_compress_buffer may produce
+// from n bytes, whatever its options: the FileHeader, 4 bytes per input
+// byte (a phrase of one byte with a 24 bit code and its symbol), a pair
+// per dictionary reset, and the last phrase and STOP_CODE. A stored stream
+// takes far less.
+//
+// n: Number of bytes to compress.
+// returns: Number of bytes an output buffer needs.
+//
+size_t lz78_compress_bound(size_t n);
+
+//
+// Returns the number of bytes of memory lz78_workspace_init needs.
+//
+// opts: Options to compress with, or NULL for the defaults. Their code bits
+//       are also the most that buffers decompressed with it may use.
+// returns: Number of bytes, or 0 if the options are not valid for a
+//          workspace. The dense backend takes at most 20 bit codes, as
+//          its tables are not grown in a workspace.
+//
+size_t lz78_workspace_size(const lz78_options *opts);
+
+//
+// Sets up a workspace in memory the caller owns. Nothing is allocated,
+// then or later. DICT_PRUNE is refused, as removing phrases from a Trie
+// may grow it. A workspace is used by one thread at a time.
+//
+// mem: Memory of lz78_workspace_size bytes, aligned as malloc aligns it.
+// size: Size of mem.
+// opts: Options to compress with, or NULL for the defaults.
+// returns: Pointer to the workspace, at mem, or NULL if mem is too small
+//          or the options are not valid for a workspace.
+//
+lz78_workspace *lz78_workspace_init(void *mem, size_t size,
+    const lz78_options *opts);
+
+//
+// Compresses a whole buffer into a plain stream, FileHeader included, as
+// lz78_compress and lz78_compress_finish would. The dictionary is only
+// rewound between calls, so a call costs little more than its bytes.
+//
+// ws: Workspace to compress with.
+// src: Bytes to compress.
+// src_len: Number of bytes to compress.
+// dst: Memory to store compressed bytes to.
+// dst_cap: Size of dst; lz78_compress_bound(src_len) always suffices.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value.
+//
+int64_t lz78_compress_buffer(lz78_workspace *ws, const uint8_t *src,
+    size_t src_len, uint8_t *dst, size_t dst_cap);
+
+//
+// Decompresses a whole plain stream, FileHeader included, straight into a
+// buffer. Every phrase is copied from its last appearance in dst, so no
+// history is kept. DICT_PRUNE streams are refused with LZ78_ERR_STATE, as
+// are streams of more code bits than the workspace with LZ78_ERR_MEMORY and
+// streams naming another dictionary than the workspace's with LZ78_ERR_DICT.
+// Phrases of the dictionary are copied from its text, and the records of a
+// stored stream whatever its options.
+//
+// ws: Workspace to decompress with.
+// src: Compressed bytes.
+// src_len: Number of compressed bytes.
+// dst: Memory to store decompressed bytes to.
+// dst_cap: Size of dst, of which at most 4 GB is used.
+// returns: Number of bytes stored to dst, or a negative LZ78_ERR_ value;
+//          LZ78_ERR_CAPACITY if they did not fit.
+//
+int64_t lz78_decompress_buffer(lz78_workspace *ws, const uint8_t *src,
+    size_t src_len, uint8_t *dst, size_t dst_cap);
+
+#endif
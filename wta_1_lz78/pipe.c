@@ -0,0 +1,609 @@
+//
+// Contains implementation of the pipelined codec
+//
+
+#include "pipe.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes buffer_pair or flush_pairs store at most per call
+#define PACK_ROOM 4
+
+//
+// Struct definition of a Batch, the pairs handed from one stage to the next
+// in one go.
+//
+// tokens: Pairs, each a code with its symbol in the top byte.
+// bits: Number of bits each pair is packed in, or NULL if unused.
+// count: Number of pairs in tokens.
+//
+typedef struct Batch {
+  uint32_t *tokens;
+  uint8_t *bits;
+  uint64_t count;
+} Batch;
+
+//
+// Struct definition of a Ring of PIPE_DEPTH Batches between a stage that
+// fills them and the stage that empties them. The lock is only taken once
+// per Batch, so the stages hardly ever wait on each other.
+//
+// lock: Guards head, tail, closed and failed.
+// filled: Signalled when a Batch is pushed, or on close.
+// emptied: Signalled when a Batch is released, or on close.
+// batches: The Batches, used in turn.
+// head: Number of Batches pushed.
+// tail: Number of Batches released.
+// closed: True once no more Batches will be pushed, or on failure.
+// failed: True once either stage has failed, so the other stops too.
+//
+typedef struct Ring {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t emptied;
+  Batch batches[PIPE_DEPTH];
+  uint64_t head;
+  uint64_t tail;
+  bool closed;
+  bool failed;
+} Ring;
+
+//
+// Struct definition of a Packing, the work of the thread that packs the
+// pairs of pipe_encode.
+//
+// ring: Ring the pairs arrive on.
+// out: OutWriter of the output file.
+// pairs: True if the pairs have symbols, false for codes only.
+// written: Number of bytes output.
+// timed: True if the time spent is measured.
+// ns: Nanoseconds spent packing and writing, if timed.
+//
+typedef struct Packing {
+  Ring ring;
+  OutWriter *out;
+  bool pairs;
+  uint64_t written;
+  bool timed;
+  uint64_t ns;
+} Packing;
+
+//
+// Struct definition of an Unpacking, the work of the thread that reads and
+// unpacks the pairs of pipe_decode. It follows the code width the way the
+// decoder does.
+//
+// ring: Ring the pairs are handed over on.
+// reader: SymReader of the input file.
+// r: PairReader of the input read so far.
+// next_code: Code the next phrase will be given.
+// first_code: Code the first phrase made after a reset is given.
+// max_code: Largest code of the dictionary.
+// policy: DictPolicy of the stream.
+// total_in: Number of bytes of input unpacked.
+//
+typedef struct Unpacking {
+  Ring ring;
+  SymReader *reader;
+  PairReader r;
+  uint32_t next_code;
+  uint32_t first_code;
+  uint32_t max_code;
+  DictPolicy policy;
+  uint64_t total_in;
+} Unpacking;
+
+//
+// Frees the Batches of a Ring and its lock.
+//
+// ring: Ring to free.
+// returns: Void.
+//
+static void ring_destroy(Ring *ring) {
+  for (uint32_t i = 0; i < PIPE_DEPTH; i++) {
+    free(ring->batches[i].tokens);
+    free(ring->batches[i].bits);
+  }
+  pthread_cond_destroy(&ring->emptied);
+  pthread_cond_destroy(&ring->filled);
+  pthread_mutex_destroy(&ring->lock);
+  return;
+}
+
+//
+// Sets up an empty Ring.
+//
+// ring: Ring to set up.
+// bits: True if the Batches carry the bits of their pairs.
+// returns: True on success, false if memory ran out.
+//
+static bool ring_init(Ring *ring, bool bits) {
+  memset(ring, 0, sizeof(*ring));
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->filled, NULL);
+  pthread_cond_init(&ring->emptied, NULL);
+  for (uint32_t i = 0; i < PIPE_DEPTH; i++) {
+    Batch *b = &ring->batches[i];
+    b->tokens = (uint32_t *)malloc(PIPE_BATCH * sizeof(uint32_t));
+    b->bits = bits ? (uint8_t *)malloc(PIPE_BATCH) : NULL;
+    if (b->tokens == NULL || (bits && b->bits == NULL)) {
+      ring_destroy(ring);
+      return false;
+    }
+  }
+  return true;
+}
+
+//
+// Waits for a free Batch to fill, for the stage before the Ring.
+//
+// ring: Ring to fill.
+// returns: The Batch, or NULL once the stage after the Ring has failed.
+//
+static Batch *ring_claim(Ring *ring) {
+  pthread_mutex_lock(&ring->lock);
+  while (!ring->failed && ring->head - ring->tail == PIPE_DEPTH) {
+    pthread_cond_wait(&ring->emptied, &ring->lock);
+  }
+  Batch *b = ring->failed ? NULL : &ring->batches[ring->head % PIPE_DEPTH];
+  pthread_mutex_unlock(&ring->lock);
+  return b;
+}
+
+//
+// Hands the Batch given by ring_claim to the stage after the Ring.
+//
+// ring: Ring being filled.
+// returns: Void.
+//
+static void ring_push(Ring *ring) {
+  pthread_mutex_lock(&ring->lock);
+  ring->head++;
+  pthread_cond_signal(&ring->filled);
+  pthread_mutex_unlock(&ring->lock);
+  return;
+}
+
+//
+// Waits for the oldest pushed Batch, for the stage after the Ring.
+//
+// ring: Ring to empty.
+// returns: The Batch, or NULL once the Ring is closed and empty, or failed.
+//
+static Batch *ring_take(Ring *ring) {
+  pthread_mutex_lock(&ring->lock);
+  while (!ring->closed && ring->head == ring->tail) {
+    pthread_cond_wait(&ring->filled, &ring->lock);
+  }
+  Batch *b = NULL;
+  if (!ring->failed && ring->head != ring->tail) {
+    b = &ring->batches[ring->tail % PIPE_DEPTH];
+  }
+  pthread_mutex_unlock(&ring->lock);
+  return b;
+}
+
+//
+// Gives the Batch given by ring_take back to the stage before the Ring.
+//
+// ring: Ring being emptied.
+// returns: Void.
+//
+static void ring_release(Ring *ring) {
+  pthread_mutex_lock(&ring->lock);
+  ring->tail++;
+  pthread_cond_signal(&ring->emptied);
+  pthread_mutex_unlock(&ring->lock);
+  return;
+}
+
+//
+// Closes a Ring, once no more Batches will be pushed or a stage failed.
+//
+// ring: Ring to close.
+// failed: True if a stage failed, which stops both.
+// returns: Void.
+//
+static void ring_close(Ring *ring, bool failed) {
+  pthread_mutex_lock(&ring->lock);
+  ring->closed = true;
+  ring->failed = ring->failed || failed;
+  pthread_cond_broadcast(&ring->filled);
+  pthread_cond_broadcast(&ring->emptied);
+  pthread_mutex_unlock(&ring->lock);
+  return;
+}
+
+//
+// Packs the pairs of a Batch straight into the output.
+//
+// p: Packing of the stream.
+// w: PairWriter of the stream, whose bits carry over from Batch to Batch.
+// batch: Batch to pack.
+// returns: True on success, false if the output failed.
+//
+static bool pack_batch(Packing *p, PairWriter *w, const Batch *batch) {
+  uint64_t room = 0;
+  w->buf = out_reserve(p->out, batch->count * PACK_ROOM + PACK_ROOM, &room);
+  w->len = 0;
+  if (w->buf == NULL) {
+    return false;
+  }
+  for (uint64_t i = 0; i < batch->count; i++) {
+    uint32_t code = batch->tokens[i] & 0xFFFFFF;
+    if (p->pairs) {
+      buffer_pair(w, code, batch->tokens[i] >> 24,
+          batch->bits[i] - BITS_IN_BYTE);
+    } else {
+      buffer_code(w, code, batch->bits[i]);
+    }
+  }
+  out_commit(p->out, w->len);
+  p->written += w->len;
+  return true;
+}
+
+//
+// Entry of the packing thread of pipe_encode: packs Batches in order until
+// the Ring is closed, then stores the last bits.
+//
+// arg: Packing of the stream.
+// returns: NULL.
+//
+static void *pack_worker(void *arg) {
+  Packing *p = (Packing *)arg;
+  PairWriter w;
+  memset(&w, 0, sizeof(w));
+  bool ok = true;
+  Batch *batch = NULL;
+  while (ok && (batch = ring_take(&p->ring)) != NULL) {
+    uint64_t start = p->timed ? clock_ns() : 0;
+    ok = pack_batch(p, &w, batch);
+    if (p->timed) {
+      p->ns += clock_ns() - start;
+    }
+    ring_release(&p->ring);
+  }
+  if (ok) {
+    uint64_t room = 0;
+    w.buf = out_reserve(p->out, PACK_ROOM, &room);
+    w.len = 0;
+    ok = w.buf != NULL;
+    if (ok) {
+      flush_pairs(&w);
+      out_commit(p->out, w.len);
+      p->written += w.len;
+    }
+  }
+  if (!ok) {
+    ring_close(&p->ring, true);
+  }
+  return NULL;
+}
+
+//
+// Points the PairWriter of an encoder at a Batch, so that the pairs it
+// sends are collected there.
+//
+// e: Encoder of the stream.
+// batch: Batch to collect pairs in.
+// returns: Void.
+//
+static void start_batch(lz78_encoder *e, Batch *batch) {
+  e->writer.tokens = batch->tokens;
+  e->writer.token_bits = batch->bits;
+  e->writer.token_cap = PIPE_BATCH;
+  e->writer.token_count = 0;
+  return;
+}
+
+//
+// Stores a chunk of input of a stored stream to the output, as it is.
+//
+// e: Encoder of the stream, which is stored.
+// out: OutWriter of the output file.
+// syms: Bytes to store.
+// syms_len: Number of bytes in syms.
+// returns: True on success, false if the output ran out.
+//
+static bool store_syms(lz78_encoder *e, OutWriter *out, const uint8_t *syms,
+    uint64_t syms_len) {
+  while (syms_len > 0) {
+    size_t used = 0;
+    uint64_t room = 0;
+    uint8_t *dst = out_reserve(out, OUT_BLOCK, &room);
+    int64_t len = dst == NULL ? LZ78_ERR_CAPACITY :
+        lz78_compress(e, syms, syms_len, &used, dst, room);
+    if (len < 0) {
+      return false;
+    }
+    out_commit(out, len);
+    syms += used;
+    syms_len -= used;
+  }
+  return true;
+}
+
+//
+// Compresses the input file into a plain stream on two threads: this one
+// reads the input and parses it into pairs, and the other packs the pairs
+// into bits and stores them to the output. The output is the same as that
+// of lz78_compress. A stream that is stored has nothing to parse or pack,
+// so it is copied on this thread alone.
+//
+// r: SymReader of the input file.
+// out: OutWriter of the output file.
+// opts: Options for the encoder of the stream.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// stats: Statistics to add the stream and the time spent to, or NULL. The
+//        packing thread's time is counted as write_ns.
+// returns: True on success, false if memory or the output ran out.
+//
+bool pipe_encode(SymReader *r, OutWriter *out, const lz78_options *opts,
+    uint64_t *total_in, uint64_t *total_out, lz78_stats *stats) {
+  *total_in = 0;
+  *total_out = 0;
+  lz78_encoder *e = lz78_encoder_create(opts);
+  if (e == NULL) {
+    return false;
+  }
+  Packing pack;
+  memset(&pack, 0, sizeof(pack));
+  pack.out = out;
+  pack.pairs = opts->mode == MODE_LZ78;
+  pack.timed = stats != NULL;
+  if (!ring_init(&pack.ring, true)) {
+    lz78_encoder_delete(e);
+    return false;
+  }
+
+  // The first input decides whether the stream is stored, before the
+  // FileHeader records it
+  uint8_t *syms = NULL;
+  uint64_t mark = stats != NULL ? clock_ns() : 0;
+  uint64_t syms_len = read_syms(r, &syms);
+  bool stored = lz78_encoder_sample(e, syms, syms_len);
+
+  // The FileHeader is output before any pairs are collected, and scratch
+  // is then only handed to the encoder because it expects room for output
+  uint8_t scratch[LZ78_MIN_OUT];
+  size_t used = 0;
+  int64_t head = lz78_compress(e, NULL, 0, &used, scratch, sizeof(scratch));
+  pthread_t packer;
+  bool ok = head >= 0 && out_write(out, scratch, head) &&
+            (stored ||
+                pthread_create(&packer, NULL, pack_worker, &pack) == 0);
+  bool started = ok && !stored;
+
+  Batch *batch = NULL;
+  for (; ok && syms_len > 0; syms_len = read_syms(r, &syms)) {
+    uint64_t start = stats != NULL ? clock_ns() : 0;
+    if (stats != NULL) {
+      stats->read_ns += start - mark;
+    }
+    if (stored) {
+      ok = store_syms(e, out, syms, syms_len);
+    }
+    while (ok && !stored && syms_len > 0) {
+      if (batch == NULL) {
+        if ((batch = ring_claim(&pack.ring)) == NULL) {
+          ok = false;
+          break;
+        }
+        start_batch(e, batch);
+      }
+      // Each byte sends at most two pairs, a phrase and a reset
+      uint64_t take = (PIPE_BATCH - e->writer.token_count) / 2;
+      take = take < syms_len ? take : syms_len;
+      ok = lz78_compress(e, syms, take, &used, scratch, sizeof(scratch)) >= 0;
+      syms += used;
+      syms_len -= used;
+      if (PIPE_BATCH - e->writer.token_count < PIPE_BATCH / 8) {
+        batch->count = e->writer.token_count;
+        ring_push(&pack.ring);
+        batch = NULL;
+      }
+    }
+    // Hand over what there is, rather than keep it while reading a pipe
+    if (batch != NULL && e->writer.token_count > 0) {
+      batch->count = e->writer.token_count;
+      ring_push(&pack.ring);
+      batch = NULL;
+    }
+    mark = stats != NULL ? clock_ns() : 0;
+    if (stats != NULL) {
+      stats->code_ns += mark - start;
+    }
+  }
+
+  // The last record of a stored stream, or the last phrase and STOP_CODE
+  if (ok && stored) {
+    uint64_t room = 0;
+    uint8_t *dst = out_reserve(out, OUT_BLOCK, &room);
+    int64_t len = dst == NULL ? LZ78_ERR_CAPACITY :
+        lz78_compress_finish(e, dst, room);
+    ok = len >= 0;
+    if (ok) {
+      out_commit(out, len);
+    }
+  }
+  if (ok && !stored && batch == NULL) {
+    if ((batch = ring_claim(&pack.ring)) == NULL) {
+      ok = false;
+    } else {
+      start_batch(e, batch);
+    }
+  }
+  if (ok && !stored) {
+    ok = lz78_compress_finish(e, scratch, sizeof(scratch)) >= 0;
+    batch->count = e->writer.token_count;
+    ring_push(&pack.ring);
+  }
+  ring_close(&pack.ring, !ok);
+  if (started) {
+    pthread_join(packer, NULL);
+  }
+  ok = ok && !pack.ring.failed;
+
+  *total_in = e->total_in;
+  *total_out = stored ? e->total_out : head + pack.written;
+  if (stats != NULL) {
+    lz78_encoder_stats(e, stats);
+    stats->write_ns += pack.ns;
+  }
+  ring_destroy(&pack.ring);
+  lz78_encoder_delete(e);
+  return ok;
+}
+
+//
+// Decodes the pairs of a Batch, storing the decoded bytes to the output.
+//
+// d: Decoder of the stream.
+// out: OutWriter of the output file.
+// batch: Batch to decode.
+// returns: True on success, false if the input is corrupt or output failed.
+//
+static bool decode_batch(lz78_decoder *d, OutWriter *out, const Batch *batch) {
+  d->reader.tokens = batch->tokens;
+  d->reader.token_count = batch->count;
+  d->reader.token_pos = 0;
+  uint64_t room = 0;
+  int64_t len = 0;
+  do {
+    size_t used = 0;
+    uint8_t *dst = out_reserve(out, OUT_BLOCK, &room);
+    len = dst == NULL ? LZ78_ERR_CAPACITY :
+        lz78_decompress(d, NULL, 0, &used, dst, room);
+    if (len < 0) {
+      return false;
+    }
+    out_commit(out, len);
+  } while ((uint64_t)len == room);
+  return true;
+}
+
+//
+// Entry of the unpacking thread of pipe_decode: reads the input and hands
+// its pairs over in Batches until STOP_CODE or the end of the input.
+//
+// arg: Unpacking of the stream.
+// returns: NULL.
+//
+static void *unpack_worker(void *arg) {
+  Unpacking *u = (Unpacking *)arg;
+  PairReader *r = &u->r;
+  CodeWidth width = code_width(u->next_code);
+  bool more = true;
+  while (more) {
+    Batch *batch = ring_claim(&u->ring);
+    if (batch == NULL) {
+      break;
+    }
+    uint64_t count = 0;
+    while (count < PIPE_BATCH) {
+      uint32_t next_code = u->next_code;
+      if (next_code < width.low || next_code >= width.high) {
+        width = code_width(next_code);
+      }
+      uint32_t code = 0;
+      uint8_t sym = 0;
+      if (!read_pair(r, &code, &sym, width.bits)) {
+        // Hand over what there is before waiting for more input
+        if (count > 0) {
+          break;
+        }
+        uint8_t *syms = NULL;
+        u->total_in += r->pos;
+        r->len = read_syms(u->reader, &syms);
+        r->buf = syms;
+        r->pos = 0;
+        if (r->len == 0) {
+          more = false;
+          break;
+        }
+        continue;
+      }
+      batch->tokens[count++] = code | (uint32_t)sym << 24;
+      if (code == STOP_CODE) {
+        if (sym == RESET_SYM && u->policy == DICT_ADAPTIVE) {
+          u->next_code = u->first_code;
+          continue;
+        }
+        more = false;
+        break;
+      }
+      if (next_code < u->max_code) {
+        next_code++;
+        if (next_code >= u->max_code && u->policy == DICT_RESET) {
+          next_code = u->first_code;
+        }
+        u->next_code = next_code;
+      }
+    }
+    batch->count = count;
+    ring_push(&u->ring);
+  }
+  u->total_in += r->pos;
+  ring_close(&u->ring, false);
+  return NULL;
+}
+
+//
+// Decompresses the rest of a plain stream in MODE_LZ78, which is not
+// stored, on two threads: the other reads the input and unpacks its pairs,
+// and this one decodes the pairs and stores the decoded bytes to the
+// output.
+//
+// d: Decoder of the stream, which has received the FileHeader.
+// r: SymReader of the input file.
+// syms: Bytes already read from r that follow the FileHeader.
+// syms_len: Number of bytes in syms.
+// out: OutWriter of the output file.
+// returns: True on success, false if the input is corrupt or ends before
+//          the stream does, or output failed.
+//
+bool pipe_decode(lz78_decoder *d, SymReader *r, const uint8_t *syms,
+    uint64_t syms_len, OutWriter *out) {
+  if (d->header.mode != MODE_LZ78 || d->header.stored) {
+    return false;
+  }
+  Unpacking unpack;
+  memset(&unpack, 0, sizeof(unpack));
+  unpack.reader = r;
+  unpack.r.buf = syms;
+  unpack.r.len = syms_len;
+  unpack.next_code = d->next_code;
+  unpack.first_code = d->first_code;
+  unpack.max_code = d->table->max_code;
+  unpack.policy = d->header.policy;
+  if (!ring_init(&unpack.ring, false)) {
+    return false;
+  }
+  pthread_t unpacker;
+  if (pthread_create(&unpacker, NULL, unpack_worker, &unpack) != 0) {
+    ring_destroy(&unpack.ring);
+    return false;
+  }
+
+  bool ok = true;
+  Batch *batch = NULL;
+  while (ok && (batch = ring_take(&unpack.ring)) != NULL) {
+    ok = decode_batch(d, out, batch);
+    ring_release(&unpack.ring);
+  }
+  if (!ok) {
+    ring_close(&unpack.ring, true);
+  }
+  pthread_join(unpacker, NULL);
+
+  d->reader.tokens = NULL;
+  d->reader.token_count = 0;
+  d->reader.token_pos = 0;
+  d->total_in += unpack.total_in;
+  ring_destroy(&unpack.ring);
+  return ok && lz78_decoder_done(d);
+}
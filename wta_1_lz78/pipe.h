@@ -0,0 +1,62 @@
+//
+// Contains definitions for the pipelined codec, which splits a single plain
+// stream into stages run on their own threads, with the same output as
+// lz78_compress and lz78_decompress
+//
+
+#ifndef __PIPE_H__
+#define __PIPE_H__
+
+#include "io.h"
+#include "lz78.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of pairs in a batch handed from one stage to the next
+#define PIPE_BATCH 0x10000
+
+// Number of batches in flight between two stages
+#define PIPE_DEPTH 4
+
+//
+// Compresses the input file into a plain stream on two threads: this one
+// reads the input and parses it into pairs, and the other packs the pairs
+// into bits and stores them to the output. The output is the same as that
+// of lz78_compress. A stream that is stored has nothing to parse or pack,
+// so it is copied on this thread alone.
+//
+// r: SymReader of the input file.
+// out: OutWriter of the output file.
+// opts: Options for the encoder of the stream.
+// total_in: Pointer to memory which stores the number of bytes read.
+// total_out: Pointer to memory which stores the number of bytes written.
+// stats: Statistics to add the stream and the time spent to, or NULL. The
+//        packing thread's time is counted as write_ns.
+// returns: True on success, false if memory or the output ran out.
+//
+bool pipe_encode(SymReader *r, OutWriter *out, const lz78_options *opts,
+    uint64_t *total_in, uint64_t *total_out, lz78_stats *stats);
+
+//
+// Decompresses the rest of a plain stream in MODE_LZ78, which is not
+// stored, on two threads: the other reads the input and unpacks its pairs,
+// and this one decodes the pairs and stores the decoded bytes to the
+// output.
+//
+// Only MODE_LZ78 is pipelined, as in MODE_LZAP the width of a code depends
+// on the length of the phrases before it, which only decoding tells.
+//
+// d: Decoder of the stream, which has received the FileHeader.
+// r: SymReader of the input file.
+// syms: Bytes already read from r that follow the FileHeader.
+// syms_len: Number of bytes in syms.
+// out: OutWriter of the output file.
+// returns: True on success, false if the input is corrupt or ends before
+//          the stream does, or output failed.
+//
+bool pipe_decode(lz78_decoder *d, SymReader *r, const uint8_t *syms,
+    uint64_t syms_len, OutWriter *out);
+
+#endif
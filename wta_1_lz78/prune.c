@@ -0,0 +1,153 @@
+//
+// Contains implementation of the LeafQueue
+//
+
+#include "prune.h"
+
+#include <stdlib.h>
+
+//
+// Appends a code to the back of the queue.
+//
+// q: LeafQueue to append to.
+// code: Code to append.
+// returns: Void.
+//
+static void push(LeafQueue *q, uint32_t code) {
+  q->prev[code] = q->tail;
+  q->next[code] = 0;
+  if (q->tail != 0) {
+    q->next[q->tail] = code;
+  } else {
+    q->head = code;
+  }
+  q->tail = code;
+  return;
+}
+
+//
+// Takes a code out of the queue, wherever it is.
+//
+// q: LeafQueue to take from.
+// code: Code to take out.
+// returns: Void.
+//
+static void unlink(LeafQueue *q, uint32_t code) {
+  if (q->prev[code] != 0) {
+    q->next[q->prev[code]] = q->next[code];
+  } else {
+    q->head = q->next[code];
+  }
+  if (q->next[code] != 0) {
+    q->prev[q->next[code]] = q->prev[code];
+  } else {
+    q->tail = q->prev[code];
+  }
+  return;
+}
+
+//
+// Creates an empty LeafQueue with room for MAX_CODE_OF(code_bits) codes.
+//
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Pointer to the LeafQueue, or NULL if allocation failed.
+//
+LeafQueue *lq_create(uint8_t code_bits) {
+  LeafQueue *new = (LeafQueue *)calloc(1, sizeof(LeafQueue));
+  if (new == NULL) {
+    return (void *)0;
+  }
+  new->max_code = MAX_CODE_OF(code_bits);
+  new->prev = (uint32_t *)calloc(new->max_code, sizeof(uint32_t));
+  new->next = (uint32_t *)calloc(new->max_code, sizeof(uint32_t));
+  new->kids = (uint32_t *)calloc(new->max_code, sizeof(uint32_t));
+  new->parent = (uint32_t *)calloc(new->max_code, sizeof(uint32_t));
+  new->sym = (uint8_t *)calloc(new->max_code, sizeof(uint8_t));
+  if (new->prev == NULL || new->next == NULL || new->kids == NULL ||
+      new->parent == NULL || new->sym == NULL) {
+    lq_delete(new);
+    return (void *)0;
+  }
+  return new;
+}
+
+//
+// Empties a LeafQueue, for a dictionary that has been reset.
+//
+// Entries are overwritten by lq_link before they can be used again, so
+// only the root's count of children needs to be cleared.
+//
+// q: LeafQueue to reset.
+// returns: Void.
+//
+void lq_reset(LeafQueue *q) {
+  q->head = 0;
+  q->tail = 0;
+  q->kids[EMPTY_CODE] = 0;
+  return;
+}
+
+//
+// Deletes a LeafQueue.
+//
+// q: LeafQueue to free memory for.
+// returns: Void.
+//
+void lq_delete(LeafQueue *q) {
+  if (q != NULL) {
+    free(q->prev);
+    free(q->next);
+    free(q->kids);
+    free(q->parent);
+    free(q->sym);
+    free(q);
+  }
+  return;
+}
+
+//
+// Records a new phrase, which is a leaf, and the phrase it extends, which
+// no longer is.
+//
+// q: LeafQueue to add to.
+// code: Code of the new phrase.
+// parent: Code of the phrase it extends.
+// sym: Symbol it extends its parent with.
+// returns: Void.
+//
+void lq_link(LeafQueue *q, uint32_t code, uint32_t parent, uint8_t sym) {
+  // The root is never a leaf, so it is never queued
+  if (q->kids[parent]++ == 0 && parent != EMPTY_CODE) {
+    unlink(q, parent);
+  }
+  q->parent[code] = parent;
+  q->sym[code] = sym;
+  q->kids[code] = 0;
+  push(q, code);
+  return;
+}
+
+//
+// Removes the oldest leaf from the queue, so its code can be reused. Its
+// parent and sym are left in place for the caller to look up.
+//
+// q: LeafQueue to take from.
+// keep: Code that must not be taken, the parent of the next phrase.
+// returns: Code of the removed leaf, or 0 if there is none to take.
+//
+uint32_t lq_evict(LeafQueue *q, uint32_t keep) {
+  uint32_t code = q->head;
+  if (code == keep) {
+    code = q->next[code];
+  }
+  if (code == 0) {
+    return 0;
+  }
+  unlink(q, code);
+  // A parent left without children becomes the newest leaf
+  uint32_t parent = q->parent[code];
+  if (--q->kids[parent] == 0 && parent != EMPTY_CODE) {
+    push(q, parent);
+  }
+  return code;
+}
@@ -0,0 +1,90 @@
+//
+// Contains definitions for the LeafQueue, which picks the phrases a full
+// dictionary gives up when it is pruned
+//
+
+#ifndef __PRUNE_H__
+#define __PRUNE_H__
+
+#include "code.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Struct definition of a LeafQueue.
+//
+// The leaves of the dictionary, phrases no other phrase extends, are kept
+// in the order they became leaves. A leaf that is still a leaf when it
+// reaches the front was never used as a prefix since, so its code is the
+// one pruned and given to the next phrase. The encoder and the decoder
+// keep identical queues, so no codes need to be sent to mirror a pruning.
+//
+// max_code: Number of codes, MAX_CODE_OF the queue's code bits.
+// prev: Code of the leaf before each leaf in the queue, or 0.
+// next: Code of the leaf after each leaf in the queue, or 0.
+// kids: Number of phrases extending each code by one symbol.
+// parent: Code each code extends.
+// sym: Symbol each code extends its parent with.
+// head: Code of the oldest leaf, or 0 if the queue is empty.
+// tail: Code of the newest leaf, or 0 if the queue is empty.
+//
+typedef struct LeafQueue {
+  uint32_t max_code;
+  uint32_t *prev;
+  uint32_t *next;
+  uint32_t *kids;
+  uint32_t *parent;
+  uint8_t *sym;
+  uint32_t head;
+  uint32_t tail;
+} LeafQueue;
+
+//
+// Creates an empty LeafQueue with room for MAX_CODE_OF(code_bits) codes.
+//
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Pointer to the LeafQueue, or NULL if allocation failed.
+//
+LeafQueue *lq_create(uint8_t code_bits);
+
+//
+// Empties a LeafQueue, for a dictionary that has been reset.
+//
+// q: LeafQueue to reset.
+// returns: Void.
+//
+void lq_reset(LeafQueue *q);
+
+//
+// Deletes a LeafQueue.
+//
+// q: LeafQueue to free memory for.
+// returns: Void.
+//
+void lq_delete(LeafQueue *q);
+
+//
+// Records a new phrase, which is a leaf, and the phrase it extends, which
+// no longer is.
+//
+// q: LeafQueue to add to.
+// code: Code of the new phrase.
+// parent: Code of the phrase it extends.
+// sym: Symbol it extends its parent with.
+// returns: Void.
+//
+void lq_link(LeafQueue *q, uint32_t code, uint32_t parent, uint8_t sym);
+
+//
+// Removes the oldest leaf from the queue, so its code can be reused. Its
+// parent and sym are left in place for the caller to look up.
+//
+// q: LeafQueue to take from.
+// keep: Code that must not be taken, the parent of the next phrase.
+// returns: Code of the removed leaf, or 0 if there is none to take.
+//
+uint32_t lq_evict(LeafQueue *q, uint32_t keep);
+
+#endif
@@ -0,0 +1,847 @@
+//
+// Trains a shared dictionary for encode and decode "-D" on sample files,
+// and predicts the ratio it gives on samples held out of training
+//
+
+#include "batch.h"
+#include "code.h"
+#include "dict.h"
+#include "lz78.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OPTIONS "o:m:d:n:l:H:T:L:"
+
+// Longest phrase counted by default, and the longest that may be asked for
+#define DEFAULT_PHRASE_LEN 32
+#define MAX_PHRASE_LEN 255
+
+// Percent of the samples held out of training by default, and the most
+#define DEFAULT_HELD_OUT 10
+#define MAX_HELD_OUT 50
+
+// Most substrings a Counter holds, the number of slots of its hash table,
+// and the number of counts told apart when it is pruned
+#define COUNT_NODES (1 << 21)
+#define COUNT_SLOT_BITS 22
+#define COUNT_SLOTS (1 << COUNT_SLOT_BITS)
+#define COUNT_LEVELS 4096
+
+// Number of positions of a sample counted side by side
+#define COUNT_LANES 8
+
+//
+// Struct definition of an entry of a Counter's hash table, which holds its
+// key so that probing does not touch the nodes.
+//
+// key: (parent << 8 | symbol) + 1, or 0 for an empty slot.
+// node: Index of the node.
+//
+typedef struct CountSlot {
+  uint32_t key;
+  uint32_t node;
+} CountSlot;
+
+//
+// Struct definition of a Counter, which counts how often the substrings of
+// the samples of one thread appear. The substrings form a trie: node 0 is
+// the empty string and every other node extends its parent by a symbol. A
+// node only gains children once it has been seen before, so substrings
+// that appear once cost a single node. Once the Counter is full the
+// rarest substrings are pruned. A node is never counted more often than
+// its parent, so what is left is still a trie.
+//
+// parent: Index of the parent of each node.
+// count: Number of times each node was seen.
+// sym: Last symbol of each node.
+// depth: Length of each node's substring.
+// remap: Index each node is moved to when pruning or merging.
+// slots: Open addressing table of nodes keyed on (parent, sym).
+// used: Number of nodes, the root included.
+// max_len: Longest substring counted.
+// bytes: Number of bytes of samples counted.
+//
+typedef struct Counter {
+  uint32_t *parent;
+  uint32_t *count;
+  uint8_t *sym;
+  uint8_t *depth;
+  uint32_t *remap;
+  CountSlot *slots;
+  uint32_t used;
+  uint32_t max_len;
+  uint64_t bytes;
+} Counter;
+
+//
+// Struct definition of an Evaluator, which compresses held out samples
+// with and without the dictionary on one thread.
+//
+// with: Workspace that starts from the dictionary.
+// without: Workspace that starts empty.
+// out: Buffer compressed samples are written to.
+// out_cap: Number of bytes out has room for.
+// total_in: Number of bytes of samples compressed.
+// total_with: Number of bytes they compressed to with the dictionary.
+// total_without: Number of bytes they compressed to without it.
+//
+typedef struct Evaluator {
+  lz78_workspace *with;
+  lz78_workspace *without;
+  uint8_t *out;
+  size_t out_cap;
+  uint64_t total_in;
+  uint64_t total_with;
+  uint64_t total_without;
+} Evaluator;
+
+//
+// Maps a sample file into memory.
+//
+// path: Path of the file.
+// len: Pointer to memory which stores the length of the file.
+// returns: The mapping, NULL for an empty file, or MAP_FAILED if the file
+//          could not be read. The reason is printed.
+//
+static uint8_t *map_sample(const char *path, uint64_t *len) {
+  int fd = open(path, O_RDONLY);
+  struct stat sb;
+  if (fd == -1 || fstat(fd, &sb) == -1) {
+    printf("%s: Unable to open sample file.\n", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return (uint8_t *)MAP_FAILED;
+  }
+  *len = sb.st_size;
+  void *map = (void *)0;
+  if (*len > 0) {
+    map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      printf("%s: Unable to map sample file.\n", path);
+    } else {
+      madvise(map, *len, MADV_SEQUENTIAL);
+    }
+  }
+  close(fd);
+  return (uint8_t *)map;
+}
+
+//
+// Constructor for a Counter.
+//
+// max_len: Longest substring to count.
+// returns: Pointer to the Counter, or NULL if allocation failed.
+//
+static Counter *counter_create(uint32_t max_len) {
+  Counter *c = (Counter *)calloc(1, sizeof(Counter));
+  if (c == NULL) {
+    return (void *)0;
+  }
+  c->parent = (uint32_t *)malloc(COUNT_NODES * sizeof(uint32_t));
+  c->count = (uint32_t *)malloc(COUNT_NODES * sizeof(uint32_t));
+  c->sym = (uint8_t *)malloc(COUNT_NODES);
+  c->depth = (uint8_t *)malloc(COUNT_NODES);
+  c->remap = (uint32_t *)malloc(COUNT_NODES * sizeof(uint32_t));
+  c->slots = (CountSlot *)calloc(COUNT_SLOTS, sizeof(CountSlot));
+  if (c->parent == NULL || c->count == NULL || c->sym == NULL ||
+      c->depth == NULL || c->remap == NULL || c->slots == NULL) {
+    free(c->parent);
+    free(c->count);
+    free(c->sym);
+    free(c->depth);
+    free(c->remap);
+    free(c->slots);
+    free(c);
+    return (void *)0;
+  }
+  c->parent[0] = 0;
+  c->count[0] = 0;
+  c->sym[0] = 0;
+  c->depth[0] = 0;
+  c->used = 1;
+  c->max_len = max_len;
+  return c;
+}
+
+//
+// Destructor for a Counter.
+//
+// c: Counter to free memory for.
+// returns: Void.
+//
+static void counter_delete(Counter *c) {
+  free(c->parent);
+  free(c->count);
+  free(c->sym);
+  free(c->depth);
+  free(c->remap);
+  free(c->slots);
+  free(c);
+  return;
+}
+
+//
+// Returns the slot of the child of a node for a symbol: the slot holding
+// it, or the empty slot it would take.
+//
+// c: Counter to look in.
+// parent: Index of the node.
+// sym: Symbol of the child.
+// returns: Index of the slot.
+//
+static inline uint32_t counter_slot(const Counter *c, uint32_t parent,
+    uint8_t sym) {
+  uint32_t key = (parent << 8 | sym) + 1;
+  uint32_t i = (key * 0x9e3779b1u) >> (32 - COUNT_SLOT_BITS);
+  while (c->slots[i].key != key && c->slots[i].key != 0) {
+    i = (i + 1) & (COUNT_SLOTS - 1);
+  }
+  return i;
+}
+
+//
+// Adds a node below a parent, in an empty slot found by counter_slot.
+//
+// c: Counter to add to.
+// slot: Index of the slot.
+// parent: Index of the parent.
+// sym: Last symbol of the node.
+// count: Count the node starts with.
+// returns: Index of the node.
+//
+static inline uint32_t counter_add(Counter *c, uint32_t slot,
+    uint32_t parent, uint8_t sym, uint32_t count) {
+  uint32_t n = c->used++;
+  c->parent[n] = parent;
+  c->count[n] = count;
+  c->sym[n] = sym;
+  c->depth[n] = c->depth[parent] + 1;
+  c->slots[slot].key = (parent << 8 | sym) + 1;
+  c->slots[slot].node = n;
+  return n;
+}
+
+//
+// Prunes the rarest nodes of a Counter until it holds at most limit nodes,
+// keeping the order of the rest, so parents still come before children.
+//
+// c: Counter to prune.
+// limit: Most nodes to keep, the root included.
+// returns: Void.
+//
+static void counter_prune(Counter *c, uint32_t limit) {
+  if (c->used <= limit) {
+    return;
+  }
+
+  // Find the lowest count that keeps few enough nodes
+  uint32_t levels[COUNT_LEVELS] = {0};
+  for (uint32_t n = 1; n < c->used; n++) {
+    uint32_t count = c->count[n];
+    levels[count < COUNT_LEVELS ? count : COUNT_LEVELS - 1] += 1;
+  }
+  uint32_t keep = 1;
+  uint32_t floor = COUNT_LEVELS - 1;
+  while (floor > 1 && keep + levels[floor] + levels[floor - 1] <= limit) {
+    keep += levels[floor];
+    floor--;
+  }
+
+  // Move the nodes counted at least floor times down, then rehash them
+  memset(c->slots, 0, COUNT_SLOTS * sizeof(CountSlot));
+  uint32_t used = 1;
+  c->remap[0] = 0;
+  for (uint32_t n = 1; n < c->used; n++) {
+    if (c->count[n] < floor || used == limit) {
+      continue;
+    }
+    uint32_t parent = c->remap[c->parent[n]];
+    c->remap[n] = used;
+    c->parent[used] = parent;
+    c->count[used] = c->count[n];
+    c->sym[used] = c->sym[n];
+    c->depth[used] = c->depth[n];
+    CountSlot *slot = &c->slots[counter_slot(c, parent, c->sym[used])];
+    slot->key = (parent << 8 | c->sym[used]) + 1;
+    slot->node = used;
+    used++;
+  }
+  c->used = used;
+  return;
+}
+
+//
+// Counts the substrings of one sample. Counting starts at every position
+// and follows the trie as far as it goes, adding one node where it stops.
+// COUNT_LANES positions are followed side by side, a symbol at a time, so
+// that the misses of their lookups overlap.
+//
+// state: Counter of the thread.
+// path: Path of the sample file.
+// returns: True on success, false if the file could not be read.
+//
+static bool count_file(void *state, const char *path) {
+  Counter *c = (Counter *)state;
+  uint64_t len = 0;
+  uint8_t *data = map_sample(path, &len);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  for (uint64_t pos = 0; pos < len; pos += COUNT_LANES) {
+    if (c->used + COUNT_LANES > COUNT_NODES) {
+      counter_prune(c, COUNT_NODES / 2);
+    }
+    uint32_t nodes[COUNT_LANES] = {0};
+    uint64_t ends[COUNT_LANES];
+    uint32_t active = 0;
+    for (uint32_t l = 0; l < COUNT_LANES && pos + l < len; l++) {
+      uint64_t start = pos + l;
+      ends[l] = len - start < c->max_len ? len : start + c->max_len;
+      active |= 1u << l;
+    }
+    for (uint32_t depth = 0; active != 0; depth++) {
+      for (uint32_t l = 0; l < COUNT_LANES; l++) {
+        uint64_t i = pos + l + depth;
+        if ((active >> l & 1) == 0) {
+          continue;
+        }
+        if (i == ends[l]) {
+          active &= ~(1u << l);
+          continue;
+        }
+        uint32_t slot = counter_slot(c, nodes[l], data[i]);
+        if (c->slots[slot].key == 0) {
+          counter_add(c, slot, nodes[l], data[i], 1);
+          active &= ~(1u << l);
+          continue;
+        }
+        nodes[l] = c->slots[slot].node;
+        c->count[nodes[l]] += 1;
+      }
+    }
+  }
+  c->bytes += len;
+  if (len > 0) {
+    munmap(data, len);
+  }
+  return true;
+}
+
+//
+// Adds the counts of one Counter to another, pruning both first if their
+// nodes would not fit together.
+//
+// dst: Counter to add to.
+// src: Counter to add, which may be pruned.
+// returns: Void.
+//
+static void counter_merge(Counter *dst, Counter *src) {
+  if (dst->used + src->used > COUNT_NODES) {
+    counter_prune(dst, COUNT_NODES / 2);
+    counter_prune(src, COUNT_NODES / 2);
+  }
+  src->remap[0] = 0;
+  for (uint32_t n = 1; n < src->used; n++) {
+    uint32_t parent = src->remap[src->parent[n]];
+    uint32_t slot = counter_slot(dst, parent, src->sym[n]);
+    if (dst->slots[slot].key == 0) {
+      src->remap[n] =
+          counter_add(dst, slot, parent, src->sym[n], src->count[n]);
+    } else {
+      src->remap[n] = dst->slots[slot].node;
+      dst->count[src->remap[n]] += src->count[n];
+    }
+  }
+  dst->bytes += src->bytes;
+  return;
+}
+
+//
+// Returns how much a node is expected to save. Each time the encoder's
+// parse passes through a node it gets one symbol further with one code,
+// so a node saves about one symbol for each time it is seen. Weighing
+// longer nodes more was tried and predicted a slightly worse ratio.
+//
+// c: Counter of the node.
+// n: Index of the node.
+// returns: Score of the node.
+//
+static inline uint64_t node_score(const Counter *c, uint32_t n) {
+  return c->count[n];
+}
+
+//
+// Moves a node up a binary max heap of nodes ordered by node_score.
+//
+// c: Counter of the nodes.
+// heap: The heap.
+// i: Position of the node in heap.
+// returns: Void.
+//
+static void heap_up(const Counter *c, uint32_t *heap, uint32_t i) {
+  uint32_t n = heap[i];
+  while (i > 0 && node_score(c, heap[(i - 1) / 2]) < node_score(c, n)) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = n;
+  return;
+}
+
+//
+// Moves the first node of a binary max heap down to its place.
+//
+// c: Counter of the nodes.
+// heap: The heap.
+// size: Number of nodes in heap.
+// returns: Void.
+//
+static void heap_down(const Counter *c, uint32_t *heap, uint32_t size) {
+  uint32_t n = heap[0];
+  uint32_t i = 0;
+  while (2 * i + 1 < size) {
+    uint32_t kid = 2 * i + 1;
+    if (kid + 1 < size && node_score(c, heap[kid + 1]) >
+                              node_score(c, heap[kid])) {
+      kid++;
+    }
+    if (node_score(c, heap[kid]) <= node_score(c, n)) {
+      break;
+    }
+    heap[i] = heap[kid];
+    i = kid;
+  }
+  heap[i] = n;
+  return;
+}
+
+//
+// Takes nodes best first from those whose parent is taken already, so the
+// phrases are closed under prefixes, until the budget of codes is spent.
+// Nodes seen only once are never taken. In the modes that send codes only,
+// single symbols have codes of their own and are not counted against the
+// budget.
+//
+// c: Counter holding the counts of every sample.
+// mode: CodecMode the dictionary is for.
+// budget: Most codes the dictionary may take.
+// kids: Memory for the first child of every node.
+// next: Memory for the next sibling of every node.
+// heap: Memory for the heap of nodes that may be taken next.
+// taken: Zeroed flags of every node, set to 1 for the nodes taken.
+// chosen: Memory which stores the nodes taken, in the order taken.
+// returns: Number of nodes taken.
+//
+static uint32_t take_nodes(const Counter *c, CodecMode mode, uint32_t budget,
+    uint32_t *kids, uint32_t *next, uint32_t *heap, uint8_t *taken,
+    uint32_t *chosen) {
+  // Link the children of every node, the last added last
+  memset(kids, 0, c->used * sizeof(uint32_t));
+  for (uint32_t n = c->used - 1; n > 0; n--) {
+    next[n] = kids[c->parent[n]];
+    kids[c->parent[n]] = n;
+  }
+
+  uint32_t size = 0;
+  uint32_t count = 0;
+  for (uint32_t n = kids[0]; n != 0; n = next[n]) {
+    if (c->count[n] > 1) {
+      heap[size] = n;
+      heap_up(c, heap, size++);
+    }
+  }
+  uint32_t spent = 0;
+  while (size > 0 && spent < budget) {
+    uint32_t n = heap[0];
+    heap[0] = heap[--size];
+    heap_down(c, heap, size);
+    taken[n] = 1;
+    chosen[count++] = n;
+    spent += mode == MODE_LZ78 || c->depth[n] > 1;
+    for (uint32_t kid = kids[n]; kid != 0; kid = next[kid]) {
+      if (c->count[kid] > 1) {
+        heap[size] = kid;
+        heap_up(c, heap, size++);
+      }
+    }
+  }
+  return count;
+}
+
+//
+// Builds the dictionary from the nodes taken. Only the phrases no other
+// one extends are given to lz78_dict_build, which adds their prefixes
+// back. Their text is written out backwards from the last symbol.
+//
+// c: Counter holding the counts of every sample.
+// taken: Flags of every node, 1 for the nodes taken.
+// chosen: Nodes taken, which the leaves are moved to the front of.
+// count: Number of nodes taken.
+// returns: Pointer to the dictionary, or NULL if allocation failed or no
+//          node was taken.
+//
+static lz78_dict *build_leaves(const Counter *c, uint8_t *taken,
+    uint32_t *chosen, uint32_t count) {
+  uint64_t text_len = 0;
+  uint32_t leaves = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    taken[c->parent[chosen[i]]] = 2;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (taken[chosen[i]] == 1) {
+      chosen[leaves++] = chosen[i];
+      text_len += c->depth[chosen[i]];
+    }
+  }
+  if (leaves == 0) {
+    return (void *)0;
+  }
+  uint8_t *text = (uint8_t *)malloc(text_len);
+  const uint8_t **phrases =
+      (const uint8_t **)malloc(leaves * sizeof(uint8_t *));
+  uint32_t *lens = (uint32_t *)malloc(leaves * sizeof(uint32_t));
+  lz78_dict *dict = (void *)0;
+  if (text != NULL && phrases != NULL && lens != NULL) {
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < leaves; i++) {
+      uint32_t n = chosen[i];
+      lens[i] = c->depth[n];
+      phrases[i] = text + pos;
+      pos += lens[i];
+      for (uint32_t j = lens[i]; j > 0; j--) {
+        text[pos - lens[i] + j - 1] = c->sym[n];
+        n = c->parent[n];
+      }
+    }
+    dict = lz78_dict_build(phrases, lens, leaves);
+  }
+  free(text);
+  free(phrases);
+  free(lens);
+  return dict;
+}
+
+//
+// Selects the phrases of the dictionary, see take_nodes, and builds it.
+//
+// c: Counter holding the counts of every sample.
+// mode: CodecMode the dictionary is for.
+// budget: Most codes the dictionary may take.
+// returns: Pointer to the dictionary, or NULL if allocation failed or no
+//          phrase was seen twice.
+//
+static lz78_dict *select_phrases(Counter *c, CodecMode mode,
+    uint32_t budget) {
+  uint32_t *kids = (uint32_t *)malloc(c->used * sizeof(uint32_t));
+  uint32_t *next = (uint32_t *)malloc(c->used * sizeof(uint32_t));
+  uint32_t *heap = (uint32_t *)malloc(c->used * sizeof(uint32_t));
+  uint8_t *taken = (uint8_t *)calloc(c->used, 1);
+  uint32_t *chosen = (uint32_t *)malloc(c->used * sizeof(uint32_t));
+  lz78_dict *dict = (void *)0;
+  if (kids != NULL && next != NULL && heap != NULL && taken != NULL &&
+      chosen != NULL) {
+    uint32_t count =
+        take_nodes(c, mode, budget, kids, next, heap, taken, chosen);
+    dict = build_leaves(c, taken, chosen, count);
+  }
+  free(kids);
+  free(next);
+  free(heap);
+  free(taken);
+  free(chosen);
+  return dict;
+}
+
+//
+// Compresses one held out sample with and without the dictionary.
+//
+// state: Evaluator of the thread.
+// path: Path of the sample file.
+// returns: True on success, false if the file could not be read or
+//          compressed.
+//
+static bool evaluate_file(void *state, const char *path) {
+  Evaluator *e = (Evaluator *)state;
+  uint64_t len = 0;
+  uint8_t *data = map_sample(path, &len);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  size_t need = lz78_compress_bound(len);
+  if (need > e->out_cap) {
+    uint8_t *out = (uint8_t *)realloc(e->out, need);
+    if (out == NULL) {
+      printf("%s: Failed to allocate output buffer.\n", path);
+      if (len > 0) {
+        munmap(data, len);
+      }
+      return false;
+    }
+    e->out = out;
+    e->out_cap = need;
+  }
+  int64_t with = lz78_compress_buffer(e->with, data, len, e->out, need);
+  int64_t without =
+      lz78_compress_buffer(e->without, data, len, e->out, need);
+  if (len > 0) {
+    munmap(data, len);
+  }
+  if (with < 0 || without < 0) {
+    printf("%s: Unable to compress sample file.\n", path);
+    return false;
+  }
+  e->total_in += len;
+  e->total_with += with;
+  e->total_without += without;
+  return true;
+}
+
+//
+// Compresses the held out samples on a pool of threads, and prints their
+// size with and without the dictionary.
+//
+// list: Held out samples.
+// opts: Options to compress with, whose dict is the trained dictionary.
+// threads: Number of threads.
+// returns: True on success, false if a sample failed or memory ran out.
+//
+static bool evaluate(const BatchList *list, const lz78_options *opts,
+    uint32_t threads) {
+  threads = threads < list->count ? threads : list->count;
+  lz78_options plain = *opts;
+  plain.dict = NULL;
+  size_t with_size = lz78_workspace_size(opts);
+  size_t without_size = lz78_workspace_size(&plain);
+  Evaluator **workers = (Evaluator **)calloc(threads, sizeof(Evaluator *));
+  bool ok = workers != NULL;
+  for (uint32_t t = 0; ok && t < threads; t++) {
+    workers[t] = (Evaluator *)calloc(1, sizeof(Evaluator));
+    void *with_mem = workers[t] == NULL ? NULL : malloc(with_size);
+    void *without_mem = workers[t] == NULL ? NULL : malloc(without_size);
+    if (with_mem == NULL || without_mem == NULL) {
+      free(with_mem);
+      free(without_mem);
+      ok = false;
+      break;
+    }
+    // A workspace starts at the memory it is set up in
+    workers[t]->with = (lz78_workspace *)with_mem;
+    workers[t]->without = (lz78_workspace *)without_mem;
+    ok = lz78_workspace_init(with_mem, with_size, opts) != NULL &&
+         lz78_workspace_init(without_mem, without_size, &plain) != NULL;
+  }
+  if (!ok) {
+    printf("Failed to allocate workspace.\n");
+  } else {
+    ok = batch_run(list, threads, evaluate_file, (void **)workers) == 0;
+  }
+
+  uint64_t total_in = 0;
+  uint64_t total_with = 0;
+  uint64_t total_without = 0;
+  for (uint32_t t = 0; workers != NULL && t < threads; t++) {
+    if (workers[t] != NULL) {
+      total_in += workers[t]->total_in;
+      total_with += workers[t]->total_with;
+      total_without += workers[t]->total_without;
+      free(workers[t]->with);
+      free(workers[t]->without);
+      free(workers[t]->out);
+      free(workers[t]);
+    }
+  }
+  free(workers);
+  if (ok && total_in > 0) {
+    printf("Held out samples: %" PRIu32 " files, %" PRIu64 " bytes\n",
+        list->count, total_in);
+    printf("Without dictionary: %" PRIu64 " bytes, ratio %2.2f%%\n",
+        total_without, 100.0 - 100.0 * total_without / total_in);
+    printf("With dictionary: %" PRIu64 " bytes, ratio %2.2f%%\n",
+        total_with, 100.0 - 100.0 * total_with / total_in);
+  }
+  return ok;
+}
+
+//
+// Default entry to program
+//
+int main(int argc, char **argv) {
+
+  // Default values for program arguments
+  char *out_file_name = NULL;
+  CodecMode mode = MODE_LZ78;
+  uint32_t code_bits = DEFAULT_CODE_BITS;
+  uint32_t budget = 0;
+  uint32_t max_len = DEFAULT_PHRASE_LEN;
+  uint32_t held_out = DEFAULT_HELD_OUT;
+  uint32_t threads = 0;
+  char *manifest = NULL;
+
+  char c = 0;
+  while ((c = getopt(argc, argv, OPTIONS)) != -1) {
+    if (c == 'o') {
+      out_file_name = optarg;
+    } else if (c == 'm') {
+      if (!lz78_mode_parse(optarg, &mode)) {
+        printf("Unknown mode, expected lz78, lzw or lzap.\n");
+        return -1;
+      }
+    } else if (c == 'd') {
+      code_bits = strtoul(optarg, NULL, 10);
+      if (code_bits < MIN_CODE_BITS || code_bits > MAX_CODE_BITS) {
+        printf("Dictionary size must be between %d and %d bits.\n",
+            MIN_CODE_BITS, MAX_CODE_BITS);
+        return -1;
+      }
+    } else if (c == 'n') {
+      budget = strtoul(optarg, NULL, 10);
+      if (budget < 1 || budget > DICT_MAX_PHRASES) {
+        printf("Phrase count must be between 1 and %d.\n",
+            DICT_MAX_PHRASES);
+        return -1;
+      }
+    } else if (c == 'l') {
+      max_len = strtoul(optarg, NULL, 10);
+      if (max_len < 2 || max_len > MAX_PHRASE_LEN) {
+        printf("Phrase length must be between 2 and %d.\n",
+            MAX_PHRASE_LEN);
+        return -1;
+      }
+    } else if (c == 'H') {
+      held_out = strtoul(optarg, NULL, 10);
+      if (held_out > MAX_HELD_OUT) {
+        printf("Held out percent must be between 0 and %d.\n",
+            MAX_HELD_OUT);
+        return -1;
+      }
+    } else if (c == 'T') {
+      threads = strtoul(optarg, NULL, 10);
+      if (threads < 1 || threads > 256) {
+        printf("Thread count must be between 1 and 256.\n");
+        return -1;
+      }
+    } else if (c == 'L') {
+      manifest = optarg;
+    }
+  }
+  if (out_file_name == NULL) {
+    printf("An output file must be given with -o.\n");
+    return -1;
+  }
+
+  // By default half of the codes are left for the stream's own phrases
+  uint32_t first = dict_first_code((void *)0, mode);
+  if (budget == 0) {
+    budget = (MAX_CODE_OF(code_bits) + 1) / 2;
+  }
+  if (first + budget >= MAX_CODE_OF(code_bits)) {
+    printf("%" PRIu32 " phrases do not fit in %" PRIu32 " bit codes.\n",
+        budget, code_bits);
+    return -1;
+  }
+
+  // Every file below the named directories is a sample. An even share of
+  // them, spread through the list, is held out of training.
+  BatchList samples;
+  batch_list_init(&samples);
+  uint32_t failed = 0;
+  for (int i = optind; i < argc; i++) {
+    failed += !batch_add(&samples, argv[i], true, false);
+  }
+  if (manifest != NULL) {
+    FILE *f = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (f == NULL) {
+      printf("Unable to open manifest file specified.\n");
+      return -1;
+    }
+    failed += !batch_add_manifest(&samples, f, true, false);
+    if (f != stdin) {
+      fclose(f);
+    }
+  }
+  BatchList training;
+  BatchList testing;
+  batch_list_init(&training);
+  batch_list_init(&testing);
+  for (uint32_t i = 0; i < samples.count; i++) {
+    bool held = (uint64_t)i * held_out / 100 !=
+                ((uint64_t)i + 1) * held_out / 100;
+    BatchList *list = held ? &testing : &training;
+    failed += !batch_add(list, samples.paths[i], false, false);
+  }
+  if (failed > 0) {
+    return -1;
+  }
+  if (training.count == 0) {
+    printf("No samples to train on.\n");
+    return -1;
+  }
+
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online < 1 ? 1 : online > 256 ? 256 : online;
+  }
+  uint32_t count_threads = threads < training.count ? threads :
+      training.count;
+  Counter **counters = (Counter **)calloc(count_threads, sizeof(Counter *));
+  for (uint32_t t = 0; counters != NULL && t < count_threads; t++) {
+    if ((counters[t] = counter_create(max_len)) == NULL) {
+      free(counters);
+      counters = (void *)0;
+    }
+  }
+  if (counters == NULL) {
+    printf("Failed to allocate counter.\n");
+    return -1;
+  }
+  if (batch_run(&training, count_threads, count_file, (void **)counters)) {
+    return -1;
+  }
+  for (uint32_t t = 1; t < count_threads; t++) {
+    counter_merge(counters[0], counters[t]);
+    counter_delete(counters[t]);
+  }
+  printf("Training samples: %" PRIu32 " files, %" PRIu64 " bytes\n",
+      training.count, counters[0]->bytes);
+
+  lz78_dict *dict = select_phrases(counters[0], mode, budget);
+  counter_delete(counters[0]);
+  free(counters);
+  if (dict == NULL) {
+    printf("No phrase appears twice in the samples.\n");
+    return -1;
+  }
+  if (!lz78_dict_save(dict, out_file_name)) {
+    printf("Unable to write output file.\n");
+    return -1;
+  }
+  printf("Dictionary: %" PRIu32 " phrases, %" PRIu32 " bytes of text, "
+         "ID %08" PRIx32 "\n",
+      dict->count, dict->text_len, dict->id);
+
+  int status = 0;
+  if (testing.count > 0) {
+    lz78_options opts;
+    lz78_options_default(&opts);
+    opts.code_bits = code_bits;
+    opts.mode = mode;
+    opts.dict = dict;
+    status = evaluate(&testing, &opts, threads) ? 0 : -1;
+  }
+  lz78_dict_delete(dict);
+  batch_list_free(&samples);
+  batch_list_free(&training);
+  batch_list_free(&testing);
+  return status;
+}
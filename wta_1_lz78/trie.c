@@ -4,74 +4,371 @@
 
 #include "trie.h"
 
+#include <string.h>
+
+//
+// Hashes a (parent code, symbol) key into a slot of the hash backend.
+//
+// t: Trie whose table the slot is in.
+// key: The key to hash.
+// returns: Index of the first slot to probe.
+//
+static inline uint32_t trie_hash(Trie *t, uint32_t key) {
+  return (key * 0x9E3779B1u) >> (32 - t->hash_bits);
+}
+
 //
-// Constructor for a TrieNode.
+// Hands out a dense child table, reusing one given back by trie_remove if
+// there is one. The pool only fills up if trie_reserve was not called
+// ahead, or once TrieNodes have been removed, as a removed TrieNode may
+// leave a table with few children behind, so it is then grown.
 //
-// code: Code of the constructed TrieNode.
-// returns: Pointer to a TrieNode that has been allocated memory.
+// t: Trie to take the table from.
+// returns: Index of the table, or 0 if the pool could not be grown.
 //
-TrieNode *trie_node_create(uint16_t code) {
-  TrieNode *new = (TrieNode *)malloc(sizeof(TrieNode));
-  if (new) {
-    new->code = code;
-    for (uint32_t i = 0; i < ALPHABET; i++) {
-      new->children[i] = NULL;
+static uint32_t table_alloc(Trie *t) {
+  if (t->tables_free != 0) {
+    uint32_t table = t->tables_free;
+    t->tables_free = t->tables[(size_t)table * ALPHABET];
+    return table;
+  }
+  if (t->tables_used >= t->tables_max) {
+    uint32_t grown = t->tables_max + t->tables_max / 2 + 1;
+    uint32_t *tables = (uint32_t *)realloc(
+        t->tables, ((size_t)grown + 1) * ALPHABET * sizeof(uint32_t));
+    if (tables == NULL) {
+      return 0;
     }
-    return new;
+    t->tables = tables;
+    t->tables_max = grown;
+  }
+  // Table 0 is never handed out, so 0 can mean no table
+  return ++t->tables_used;
+}
+
+//
+// Parses the name of a TrieBackend ("dense", "hybrid" or "hash").
+//
+// name: Name of the backend.
+// backend: Pointer to memory which stores the parsed backend.
+// returns: True if the name is a known backend, false otherwise.
+//
+bool trie_backend_parse(const char *name, TrieBackend *backend) {
+  if (strcmp(name, "dense") == 0) {
+    *backend = TRIE_DENSE;
+  } else if (strcmp(name, "hybrid") == 0) {
+    *backend = TRIE_HYBRID;
+  } else if (strcmp(name, "hash") == 0) {
+    *backend = TRIE_HASH;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+//
+// Returns the name of a TrieBackend.
+//
+// backend: The backend to name.
+// returns: Name of the backend.
+//
+const char *trie_backend_name(TrieBackend backend) {
+  switch (backend) {
+  case TRIE_DENSE:
+    return "dense";
+  case TRIE_HYBRID:
+    return "hybrid";
+  case TRIE_HASH:
+    return "hash";
   }
-  return (void *)0;
+  return "unknown";
 }
 
 //
-// Destructor for a TrieNode.
+// Fills in the sizes of a Trie's memory for its backend and code bits.
 //
-// n: TrieNode to free allocated memory for.
+// t: Trie to fill in, zeroed.
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
 // returns: Void.
 //
-void trie_node_delete(TrieNode *n) {
-  free(n);
-  n = NULL;
+static void trie_layout(Trie *t, TrieBackend backend, uint8_t code_bits) {
+  t->backend = backend;
+  t->max_code = MAX_CODE_OF(code_bits);
+  // A dense TrieNode needs a table once it has a child, a hybrid TrieNode
+  // only once it has more than SPARSE_KIDS children
+  if (backend == TRIE_DENSE) {
+    t->tables_cap = t->max_code;
+  } else if (backend == TRIE_HYBRID) {
+    t->tables_cap = t->max_code / (SPARSE_KIDS + 1) + 1;
+  }
+  if (backend == TRIE_HASH) {
+    // Twice as many slots as codes keeps the table at most half full
+    t->hash_bits = code_bits + 1;
+    t->hash_mask = ((uint32_t)1 << t->hash_bits) - 1;
+    t->epoch = 1;
+  }
   return;
 }
 
 //
 // Initializes a Trie: a root TrieNode with the code EMPTY_CODE.
 //
-// returns: Pointer to the root of a Trie.
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Pointer to the Trie, or NULL if allocation failed.
+//
+Trie *trie_create(TrieBackend backend, uint8_t code_bits) {
+  Trie *new = (Trie *)calloc(1, sizeof(Trie));
+  if (new == NULL) {
+    return (void *)0;
+  }
+  trie_layout(new, backend, code_bits);
+  new->tables_max =
+      new->tables_cap < TABLES_START ? new->tables_cap : TABLES_START;
+  new->nodes = (TrieNode *)calloc(new->max_code, sizeof(TrieNode));
+  if (new->tables_max > 0) {
+    new->tables = (uint32_t *)malloc(
+        ((size_t)new->tables_max + 1) * ALPHABET * sizeof(uint32_t));
+  }
+  if (backend == TRIE_HASH) {
+    new->slots = (TrieSlot *)calloc(new->hash_mask + 1, sizeof(TrieSlot));
+  }
+  if (new->nodes == NULL || (new->tables_max > 0 && new->tables == NULL) ||
+      (backend == TRIE_HASH && new->slots == NULL)) {
+    trie_delete(new);
+    return (void *)0;
+  }
+  new->root = &new->nodes[EMPTY_CODE];
+  new->root->code = EMPTY_CODE;
+  return new;
+}
+
+//
+// Returns the number of bytes of memory trie_init needs for a Trie.
+//
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Number of bytes, a multiple of 8.
+//
+size_t trie_size(TrieBackend backend, uint8_t code_bits) {
+  Trie t = {0};
+  trie_layout(&t, backend, code_bits);
+  size_t size = ALIGN_UP((size_t)t.max_code * sizeof(TrieNode));
+  if (t.tables_cap > 0) {
+    size += ((size_t)t.tables_cap + 1) * ALPHABET * sizeof(uint32_t);
+  }
+  if (backend == TRIE_HASH) {
+    size += ALIGN_UP(((size_t)t.hash_mask + 1) * sizeof(TrieSlot));
+  }
+  return size;
+}
+
+//
+// Initializes a Trie in memory the caller owns, so that neither this nor
+// anything done with the Trie allocates. Only a Trie that TrieNodes are
+// never removed from may be initialized this way, as removing them may
+// grow the table pool, and it must not be given to trie_delete.
+//
+// t: Trie to initialize.
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// mem: Memory of trie_size bytes, aligned to 8 bytes.
+// returns: Void.
+//
+void trie_init(Trie *t, TrieBackend backend, uint8_t code_bits, void *mem) {
+  uint8_t *next = (uint8_t *)mem;
+  memset(t, 0, sizeof(*t));
+  trie_layout(t, backend, code_bits);
+  t->tables_max = t->tables_cap;
+  t->nodes = (TrieNode *)next;
+  next += ALIGN_UP((size_t)t->max_code * sizeof(TrieNode));
+  if (t->tables_max > 0) {
+    t->tables = (uint32_t *)next;
+    next += ((size_t)t->tables_max + 1) * ALPHABET * sizeof(uint32_t);
+  }
+  if (backend == TRIE_HASH) {
+    t->slots = (TrieSlot *)next;
+    memset(t->slots, 0, ((size_t)t->hash_mask + 1) * sizeof(TrieSlot));
+  }
+  t->root = &t->nodes[EMPTY_CODE];
+  memset(t->root, 0, sizeof(*t->root));
+  t->root->code = EMPTY_CODE;
+  return;
+}
+
+//
+// Makes sure the table pool of a Trie can hand out need more tables
+// without growing, or holds tables_cap of them already, growing it by at
+// least half if it must.
+//
+// t: Trie whose pool to grow.
+// need: Number of tables about to be needed.
+// returns: True on success, false if allocation failed.
+//
+bool trie_reserve(Trie *t, uint32_t need) {
+  if (t->tables_max >= t->tables_cap ||
+      t->tables_max - t->tables_used >= need) {
+    return true;
+  }
+  uint64_t grown = (uint64_t)t->tables_max + t->tables_max / 2 + 1;
+  if (grown < (uint64_t)t->tables_used + need) {
+    grown = (uint64_t)t->tables_used + need;
+  }
+  if (grown > t->tables_cap) {
+    grown = t->tables_cap;
+  }
+  uint32_t *tables = (uint32_t *)realloc(
+      t->tables, ((size_t)grown + 1) * ALPHABET * sizeof(uint32_t));
+  if (tables == NULL) {
+    return false;
+  }
+  t->tables = tables;
+  t->tables_max = (uint32_t)grown;
+  return true;
+}
+
+//
+// Returns the number of bytes of memory trie_seal needs.
+//
+// backend: Child lookup strategy of the Trie.
+// seed_code: Code after the last one the Trie holds when sealed.
+// returns: Number of bytes, a multiple of 8.
+//
+size_t trie_seal_size(TrieBackend backend, uint32_t seed_code) {
+  if (backend == TRIE_HASH) {
+    return 0;
+  }
+  return ALIGN_UP((size_t)seed_code * sizeof(TrieNode)) +
+         ALIGN_UP((size_t)seed_code * sizeof(uint32_t)) +
+         ALIGN_UP((size_t)seed_code);
+}
+
+//
+// Seals the TrieNodes inserted so far, every code below seed_code, so that
+// trie_reset rewinds the Trie to them rather than to just the root. The
+// sealed TrieNodes must never be removed.
+//
+// The hash backend moves their entries to SEALED_EPOCH, which no epoch
+// passes. The others keep a copy of the sealed TrieNodes, and note which
+// of them gain children, so that only those are put back; a sealed dense
+// table is put back by clearing the children it gained, which have codes
+// from seed_code up.
+//
+// t: Trie to seal, which holds no codes from seed_code up.
+// seed_code: Code after the last one inserted.
+// mem: Memory of trie_seal_size bytes, aligned to 8 bytes, or NULL to have
+//      it allocated.
+// returns: True on success, false if allocation failed.
+//
+bool trie_seal(Trie *t, uint32_t seed_code, void *mem) {
+  t->seed_code = seed_code;
+  t->seed_tables = t->tables_used;
+  if (t->backend == TRIE_HASH) {
+    for (uint32_t i = 0; i <= t->hash_mask; i++) {
+      if (t->slots[i].epoch == t->epoch) {
+        t->slots[i].epoch = SEALED_EPOCH;
+      }
+    }
+    return true;
+  }
+  size_t size = trie_seal_size(t->backend, seed_code);
+  t->seal_owned = mem == NULL;
+  if (mem == NULL && (mem = malloc(size)) == NULL) {
+    t->seed_code = 0;
+    t->seal_owned = false;
+    return false;
+  }
+  uint8_t *next = (uint8_t *)mem;
+  t->seed_nodes = (TrieNode *)next;
+  next += ALIGN_UP((size_t)seed_code * sizeof(TrieNode));
+  t->dirty = (uint32_t *)next;
+  next += ALIGN_UP((size_t)seed_code * sizeof(uint32_t));
+  t->dirty_marks = next;
+  memcpy(t->seed_nodes, t->nodes, (size_t)seed_code * sizeof(TrieNode));
+  memset(t->dirty_marks, 0, seed_code);
+  t->dirty_count = 0;
+  return true;
+}
+
+//
+// Puts back the sealed TrieNodes that have gained children.
+//
+// t: Sealed Trie to put back, not of the hash backend.
+// returns: Void.
 //
-TrieNode *trie_create(void) {
-  return trie_node_create(EMPTY_CODE);
+static void trie_unseal_dirty(Trie *t) {
+  for (uint32_t i = 0; i < t->dirty_count; i++) {
+    uint32_t code = t->dirty[i];
+    TrieNode *n = &t->nodes[code];
+    *n = t->seed_nodes[code];
+    if (n->table != 0) {
+      uint32_t *children = &t->tables[(size_t)n->table * ALPHABET];
+      for (uint32_t sym = 0; sym < ALPHABET; sym++) {
+        if (children[sym] >= t->seed_code) {
+          children[sym] = 0;
+        }
+      }
+    }
+    t->dirty_marks[code] = 0;
+  }
+  t->dirty_count = 0;
+  return;
 }
 
 //
-// Resets a Trie to just the root TrieNode.
+// Resets a Trie to just the root TrieNode in constant time, or, once it is
+// sealed, to the sealed TrieNodes in time linear in the sealed TrieNodes
+// that have gained children.
+//
+// TrieNodes are reinitialized by trie_insert when their code is reused, so
+// only the root, the table pool and the hash epoch need to be rewound.
 //
-// root: Root of the Trie to reset.
+// t: Trie to reset.
 // returns: Void.
 //
-void trie_reset(TrieNode *root) {
-  if (root != NULL) {
-    for (int i = 0; i < ALPHABET; i++) {
-      trie_delete(root->children[i]);
-      root->children[i] = NULL;
+void trie_reset(Trie *t) {
+  if (t != NULL) {
+    if (t->dirty_marks != NULL) {
+      trie_unseal_dirty(t);
+    } else if (t->seed_code == 0) {
+      t->root->table = 0;
+      t->root->count = 0;
+    }
+    t->tables_used = t->seed_tables;
+    t->tables_free = 0;
+    if (t->slots != NULL) {
+      t->epoch++;
+      // Entries from 2^32 - 2 resets ago would look valid again, so clear
+      // all but the sealed ones
+      if (t->epoch == SEALED_EPOCH) {
+        for (uint32_t i = 0; i <= t->hash_mask; i++) {
+          if (t->slots[i].epoch != SEALED_EPOCH) {
+            t->slots[i].epoch = 0;
+          }
+        }
+        t->epoch = 1;
+      }
     }
   }
   return;
 }
 
 //
-// Deletes a sub - Trie starting from the sub - Trie’s root.
+// Deletes a Trie and every TrieNode in it.
 //
-// n: Root of the sub - Trie to delete.
+// t: Trie to delete.
 // returns: Void.
 //
-void trie_delete(TrieNode *n) {
-  if (n != NULL) {
-    for (int i = 0; i < ALPHABET; i++) {
-      trie_delete(n->children[i]);
-      n->children[i] = NULL;
+void trie_delete(Trie *t) {
+  if (t != NULL) {
+    free(t->nodes);
+    free(t->tables);
+    free(t->slots);
+    if (t->seal_owned) {
+      free(t->seed_nodes);
     }
-    trie_node_delete(n);
+    free(t);
   }
   return;
 }
@@ -80,32 +377,193 @@ void trie_delete(TrieNode *n) {
 // Returns a pointer to the child TrieNode reprsenting the symbol sym.
 // If the symbol doesn’t exist, NULL is returned.
 //
+// t: Trie the TrieNode belongs to.
 // n: TrieNode to step from.
 // sym: Symbol to check for.
 // returns: Pointer to the TrieNode representing the symbol.
 //
-TrieNode *trie_step(TrieNode *n, uint8_t sym) {
-  return n->children[sym];
+TrieNode *trie_step(Trie *t, TrieNode *n, uint8_t sym) {
+  uint32_t child = 0;
+  if (t->backend == TRIE_HASH) {
+    uint32_t key = ((uint32_t)n->code << 8 | sym) + 1;
+    uint32_t i = trie_hash(t, key);
+    while (t->slots[i].epoch >= t->epoch) {
+      if (t->slots[i].key == key) {
+        return &t->nodes[t->slots[i].child];
+      }
+      i = (i + 1) & t->hash_mask;
+    }
+    return NULL;
+  }
+  if (n->table != 0) {
+    child = t->tables[(size_t)n->table * ALPHABET + sym];
+  } else {
+    for (uint8_t i = 0; i < n->count && n->syms[i] <= sym; i++) {
+      if (n->syms[i] == sym) {
+        child = n->kids[i];
+        break;
+      }
+    }
+  }
+  return child != 0 ? &t->nodes[child] : NULL;
 }
 
 //
-// Prints a Trie
+// Adds a child TrieNode representing the symbol sym below n.
+// The symbol must not already have a child below n.
+//
+// t: Trie the TrieNode belongs to.
+// n: TrieNode to add the child to.
+// sym: Symbol the child represents.
+// code: Code of the new child TrieNode.
+// returns: Pointer to the new child TrieNode, or NULL if the pool is empty.
+//
+TrieNode *trie_insert(Trie *t, TrieNode *n, uint8_t sym, uint32_t code) {
+  TrieNode *new = &t->nodes[code];
+  new->table = 0;
+  new->code = code;
+  new->count = 0;
+  // A sealed TrieNode that gains a child is put back by trie_reset
+  if (n->code < t->seed_code && t->dirty_marks != NULL &&
+      !t->dirty_marks[n->code]) {
+    t->dirty_marks[n->code] = 1;
+    t->dirty[t->dirty_count++] = n->code;
+  }
+  if (t->backend == TRIE_HASH) {
+    uint32_t key = ((uint32_t)n->code << 8 | sym) + 1;
+    uint32_t i = trie_hash(t, key);
+    while (t->slots[i].epoch >= t->epoch) {
+      i = (i + 1) & t->hash_mask;
+    }
+    t->slots[i].key = key;
+    t->slots[i].child = code;
+    t->slots[i].epoch = t->epoch;
+    return new;
+  }
+  if (t->backend == TRIE_HYBRID && n->table == 0 &&
+      n->count < SPARSE_KIDS) {
+    // Shift larger symbols up to keep the sparse list sorted
+    uint8_t i = n->count;
+    while (i > 0 && n->syms[i - 1] > sym) {
+      n->syms[i] = n->syms[i - 1];
+      n->kids[i] = n->kids[i - 1];
+      i--;
+    }
+    n->syms[i] = sym;
+    n->kids[i] = code;
+    n->count++;
+    return new;
+  }
+  if (n->table == 0) {
+    n->table = table_alloc(t);
+    if (n->table == 0) {
+      return (void *)0;
+    }
+    uint32_t *children = &t->tables[(size_t)n->table * ALPHABET];
+    memset(children, 0, ALPHABET * sizeof(uint32_t));
+    // Promote the sparse list of a hybrid TrieNode into its dense table
+    for (uint8_t i = 0; i < n->count; i++) {
+      children[n->syms[i]] = n->kids[i];
+    }
+  }
+  t->tables[(size_t)n->table * ALPHABET + sym] = code;
+  return new;
+}
+
+//
+// Removes the child TrieNode representing the symbol sym below n, so its
+// code can be given to another phrase. The child must have no children.
+//
+// In the hash backend the entries after the removed one are shifted back,
+// so that every entry can still be reached from the slot it hashes to.
+//
+// t: Trie the TrieNode belongs to.
+// n: TrieNode to remove the child from.
+// sym: Symbol the child represents.
+// returns: Void.
+//
+void trie_remove(Trie *t, TrieNode *n, uint8_t sym) {
+  if (t->backend == TRIE_HASH) {
+    uint32_t key = ((uint32_t)n->code << 8 | sym) + 1;
+    uint32_t i = trie_hash(t, key);
+    while (t->slots[i].epoch >= t->epoch && t->slots[i].key != key) {
+      i = (i + 1) & t->hash_mask;
+    }
+    if (t->slots[i].epoch < t->epoch) {
+      return;
+    }
+    uint32_t j = i;
+    while (true) {
+      j = (j + 1) & t->hash_mask;
+      if (t->slots[j].epoch < t->epoch) {
+        break;
+      }
+      // Move the entry back unless its home slot lies after the hole
+      uint32_t home = trie_hash(t, t->slots[j].key);
+      if (((j - home) & t->hash_mask) >= ((j - i) & t->hash_mask)) {
+        t->slots[i] = t->slots[j];
+        i = j;
+      }
+    }
+    t->slots[i].epoch = 0;
+    return;
+  }
+  uint32_t child = 0;
+  if (n->table != 0) {
+    child = t->tables[(size_t)n->table * ALPHABET + sym];
+    t->tables[(size_t)n->table * ALPHABET + sym] = 0;
+  } else {
+    for (uint8_t i = 0; i < n->count; i++) {
+      if (n->syms[i] == sym) {
+        child = n->kids[i];
+        for (; i + 1 < n->count; i++) {
+          n->syms[i] = n->syms[i + 1];
+          n->kids[i] = n->kids[i + 1];
+        }
+        n->count--;
+        break;
+      }
+    }
+  }
+  // A child that once had children may still hold a table
+  if (child != 0 && t->nodes[child].table != 0) {
+    uint32_t table = t->nodes[child].table;
+    t->tables[(size_t)table * ALPHABET] = t->tables_free;
+    t->tables_free = table;
+    t->nodes[child].table = 0;
+  }
+  return;
+}
+
+//
+// Prints the children of a TrieNode, indented by their depth.
 //
-// root: TrieNode representing root
+// t: Trie the TrieNode belongs to.
+// n: TrieNode whose children to print.
+// level: Depth of the children.
 // returns: Void.
 //
-void trie_print(TrieNode *root) {
-  static uint32_t level = 0;
+static void trie_print_node(Trie *t, TrieNode *n, uint32_t level) {
   for (uint32_t i = 0; i < ALPHABET; i++) {
-    if (root->children[i] != NULL) {
+    TrieNode *child = trie_step(t, n, i);
+    if (child != NULL) {
       for (uint32_t j = 0; j < level; j++) {
         printf(" ");
       }
-      printf("%c: %u\n", i, root->children[i]->code);
-      level = level + 1;
-      trie_print(root->children[i]);
-      level = level - 1;
+      printf("%c: %u\n", i, child->code);
+      trie_print_node(t, child, level + 1);
     }
   }
   return;
 }
+
+//
+// Prints a Trie
+//
+// t: Trie to print
+// returns: Void.
+//
+void trie_print(Trie *t) {
+  trie_print_node(t, t->root, 0);
+  return;
+}
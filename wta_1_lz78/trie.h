@@ -8,79 +8,272 @@
 
 #include "code.h"
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define ALPHABET 256
 
+// Number of children a hybrid TrieNode holds before growing a dense table
+#define SPARSE_KIDS 6
+
+// Number of dense tables the pool of a Trie from trie_create starts with,
+// 4 MB, before trie_reserve grows it
+#define TABLES_START 0x1000
+
+// Rounds a size up to a multiple of 8, so memory carved out after it for
+// another array stays aligned
+#define ALIGN_UP(size) (((size) + 7) & ~(size_t)7)
+
+// Epoch of the entries of the hash backend made before trie_seal, which
+// stay valid whatever the epoch of the Trie
+#define SEALED_EPOCH UINT32_MAX
+
+
+//
+// Child lookup strategies a Trie may be created with.
+//
+// TRIE_DENSE: Every TrieNode holds a table of ALPHABET children.
+// TRIE_HYBRID: Small sorted child list, promoted to a dense table when full.
+// TRIE_HASH: One open-addressing table keyed on (parent code, symbol).
+//
+typedef enum TrieBackend { TRIE_DENSE, TRIE_HYBRID, TRIE_HASH } TrieBackend;
+
 typedef struct TrieNode TrieNode;
 //
 // Struct definition of a TrieNode.
 //
-// children: Each TrieNode has ALPHABET number of children.
+// table: Index in the Trie's table pool of a dense table of ALPHABET child
+//        codes, or 0 if none is needed. An index instead of a pointer keeps
+//        the TrieNode small now that codes take 32 bits.
+// kids: Codes of the children held in the sparse list (hybrid backend).
+// syms: Symbols of the children held in the sparse list, kept sorted.
+// count: Number of children held in the sparse list.
 // code: Unique code for a TrieNode.
 //
-
 struct TrieNode {
-  TrieNode *children[ALPHABET];
-  uint16_t code;
+  uint32_t table;
+  uint32_t kids[SPARSE_KIDS];
+  uint8_t syms[SPARSE_KIDS];
+  uint8_t count;
+  uint32_t code;
 };
 
 //
-// Constructor for a TrieNode.
+// Struct definition of an entry in the hash backend's table.
 //
-// code: Code of the constructed TrieNode.
-// returns: Pointer to a TrieNode that has been allocated memory.
+// key: (parent code << 8 | symbol) + 1.
+// child: Code of the child TrieNode.
+// epoch: Epoch the entry was inserted in; entries of older epochs are empty.
+//        Entries that survive trie_reset have SEALED_EPOCH.
 //
-TrieNode *trie_node_create(uint16_t code);
+typedef struct TrieSlot {
+  uint32_t key;
+  uint32_t child;
+  uint32_t epoch;
+} TrieSlot;
 
 //
-// Destructor for a TrieNode.
+// Struct definition of a Trie.
 //
-// n: TrieNode to free allocated memory for.
-// returns: Void.
+// backend: Child lookup strategy used by every TrieNode of the Trie.
+// max_code: Number of codes, MAX_CODE_OF the Trie's code bits.
+// nodes: Every TrieNode of the Trie, indexed by code.
+// root: The root TrieNode, which has the code EMPTY_CODE.
+// tables: Pool of dense child tables, handed out by bumping tables_used.
+//         Table 0 is unused.
+// tables_used: Number of dense child tables in use.
+// tables_max: Number of dense child tables in the pool.
+// tables_cap: Most dense child tables the TrieNodes can need, one per code
+//             (dense backend) or per SPARSE_KIDS + 1 codes (hybrid).
+// tables_free: First table given back by trie_remove, or 0. The first
+//              entry of each free table holds the next one.
+// slots: Table of hash_mask + 1 entries, at most half full (hash backend).
+// hash_bits: Number of bits of a hash, the log2 of the number of slots.
+// hash_mask: Number of slots minus one.
+// epoch: Epoch of the entries in slots that are currently valid.
+// seed_code: Codes below it were inserted before trie_seal and survive
+//            trie_reset, or 0 if the Trie is not sealed.
+// seed_tables: Number of dense child tables in use when sealed.
+// seed_nodes: Copy of each TrieNode below seed_code as it was sealed
+//             (dense and hybrid backends).
+// dirty: Codes below seed_code whose TrieNodes have gained children since
+//        the last reset.
+// dirty_count: Number of codes in dirty.
+// dirty_marks: Whether each code below seed_code is in dirty.
+// seal_owned: True if trie_seal allocated seed_nodes.
+//
+// Every piece of memory but most of the table pool is allocated by
+// trie_create. The pool starts at TABLES_START tables and trie_reserve
+// grows it towards tables_cap ahead of the inserts that need it, so that
+// a wide dictionary only takes the memory its phrases use. trie_insert
+// grows it itself only if it runs out, as a Trie that TrieNodes are
+// removed from may need more than tables_cap. trie_reset only rewinds
+// tables_used and the epoch.
 //
-void trie_node_delete(TrieNode *n);
+typedef struct Trie {
+  TrieBackend backend;
+  uint32_t max_code;
+  TrieNode *nodes;
+  TrieNode *root;
+  uint32_t *tables;
+  uint32_t tables_used;
+  uint32_t tables_max;
+  uint32_t tables_cap;
+  uint32_t tables_free;
+  TrieSlot *slots;
+  uint32_t hash_bits;
+  uint32_t hash_mask;
+  uint32_t epoch;
+  uint32_t seed_code;
+  uint32_t seed_tables;
+  TrieNode *seed_nodes;
+  uint32_t *dirty;
+  uint32_t dirty_count;
+  uint8_t *dirty_marks;
+  bool seal_owned;
+} Trie;
+
+//
+// Parses the name of a TrieBackend ("dense", "hybrid" or "hash").
+//
+// name: Name of the backend.
+// backend: Pointer to memory which stores the parsed backend.
+// returns: True if the name is a known backend, false otherwise.
+//
+bool trie_backend_parse(const char *name, TrieBackend *backend);
+
+//
+// Returns the name of a TrieBackend.
+//
+// backend: The backend to name.
+// returns: Name of the backend.
+//
+const char *trie_backend_name(TrieBackend backend);
 
 //
 // Initializes a Trie: a root TrieNode with the code EMPTY_CODE.
 //
-// returns: Pointer to the root of a Trie.
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Pointer to the Trie, or NULL if allocation failed.
+//
+Trie *trie_create(TrieBackend backend, uint8_t code_bits);
+
+//
+// Returns the number of bytes of memory trie_init needs for a Trie.
+//
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Number of bytes, a multiple of 8.
+//
+size_t trie_size(TrieBackend backend, uint8_t code_bits);
+
+//
+// Initializes a Trie in memory the caller owns, its table pool at
+// tables_cap, so that neither this nor anything done with the Trie
+// allocates. Only a Trie that TrieNodes are never removed from may be
+// initialized this way, and it must not be given to trie_delete.
+//
+// t: Trie to initialize.
+// backend: Child lookup strategy to use.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// mem: Memory of trie_size bytes, aligned to 8 bytes.
+// returns: Void.
 //
-TrieNode *trie_create(void);
+void trie_init(Trie *t, TrieBackend backend, uint8_t code_bits, void *mem);
 
 //
-// Resets a Trie to just the root TrieNode.
+// Makes sure the table pool of a Trie can hand out need more tables
+// without growing, or holds tables_cap of them already, growing it by at
+// least half if it must.
+//
+// t: Trie whose pool to grow.
+// need: Number of tables about to be needed.
+// returns: True on success, false if allocation failed.
+//
+bool trie_reserve(Trie *t, uint32_t need);
+
+//
+// Returns the number of bytes of memory trie_seal needs.
+//
+// backend: Child lookup strategy of the Trie.
+// seed_code: Code after the last one the Trie holds when sealed.
+// returns: Number of bytes, a multiple of 8.
+//
+size_t trie_seal_size(TrieBackend backend, uint32_t seed_code);
+
+//
+// Seals the TrieNodes inserted so far, every code below seed_code, so that
+// trie_reset rewinds the Trie to them rather than to just the root. The
+// sealed TrieNodes must never be removed.
+//
+// t: Trie to seal, which holds no codes from seed_code up.
+// seed_code: Code after the last one inserted.
+// mem: Memory of trie_seal_size bytes, aligned to 8 bytes, or NULL to have
+//      it allocated.
+// returns: True on success, false if allocation failed.
 //
-// root: Root of the Trie to reset.
+bool trie_seal(Trie *t, uint32_t seed_code, void *mem);
+
+//
+// Resets a Trie to just the root TrieNode in constant time, or, once it is
+// sealed, to the sealed TrieNodes in time linear in the sealed TrieNodes
+// that have gained children.
+//
+// t: Trie to reset.
 // returns: Void.
 //
-void trie_reset(TrieNode *root);
+void trie_reset(Trie *t);
 
 //
-// Deletes a sub - Trie starting from the sub - Trie’s root.
+// Deletes a Trie and every TrieNode in it.
 //
-// n: Root of the sub - Trie to delete.
+// t: Trie to delete.
 // returns: Void.
 //
-void trie_delete(TrieNode *n);
+void trie_delete(Trie *t);
 
 //
 // Returns a pointer to the child TrieNode reprsenting the symbol sym.
 // If the symbol doesn’t exist, NULL is returned.
 //
+// t: Trie the TrieNode belongs to.
 // n: TrieNode to step from.
 // sym: Symbol to check for.
 // returns: Pointer to the TrieNode representing the symbol.
 //
-TrieNode *trie_step(TrieNode *n, uint8_t sym);
+TrieNode *trie_step(Trie *t, TrieNode *n, uint8_t sym);
+
+//
+// Adds a child TrieNode representing the symbol sym below n.
+// The symbol must not already have a child below n.
+//
+// t: Trie the TrieNode belongs to.
+// n: TrieNode to add the child to.
+// sym: Symbol the child represents.
+// code: Code of the new child TrieNode.
+// returns: Pointer to the new child TrieNode, or NULL if the pool is empty.
+//
+TrieNode *trie_insert(Trie *t, TrieNode *n, uint8_t sym, uint32_t code);
+
+//
+// Removes the child TrieNode representing the symbol sym below n, so its
+// code can be given to another phrase. The child must have no children.
+//
+// t: Trie the TrieNode belongs to.
+// n: TrieNode to remove the child from.
+// sym: Symbol the child represents.
+// returns: Void.
+//
+void trie_remove(Trie *t, TrieNode *n, uint8_t sym);
 
 //
 // Prints a Trie
 //
-// root: TrieNode representing root
+// t: Trie to print
 // returns: Void.
 //
-void trie_print(TrieNode *root);
+void trie_print(Trie *t);
 
 #endif
@@ -4,132 +4,171 @@
 
 #include "word.h"
 
+#include <string.h>
+
 //
-// Constructor for a word.
+// Creates a new WordTable with room for MAX_CODE_OF(code_bits) codes.
+// A WordTable is initialized with a single Word at index EMPTY_CODE.
+// This Word represents the empty word, a string of length of zero.
 //
-// syms: Array of symbols a Word represents.
-// len: Length of the array of symbols.
-// returns: Pointer to a Word that has been allocated memory.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Initialized WordTable.
 //
-Word *word_create(uint8_t *syms, uint64_t len) {
-  Word *new = (Word *)malloc(sizeof(Word));
+WordTable *wt_create(uint8_t code_bits) {
+  WordTable *new = (WordTable *)calloc(1, sizeof(WordTable));
   if (new != NULL) {
-    new->len = len;
-    new->syms = (uint8_t *)calloc(len, sizeof(uint8_t));
-    if (new->syms != NULL) {
-      for (uint64_t i = 0; i < len; i++) {
-        new->syms[i] = syms[i];
-      }
+    new->max_code = MAX_CODE_OF(code_bits);
+    // The entry at max_code holds the phrase of a full, kept dictionary
+    new->entries =
+        (WordEntry *)calloc((size_t)new->max_code + 1, sizeof(WordEntry));
+    new->hist = (uint8_t *)malloc(HISTORY_OF(new->max_code));
+    if (new->entries != NULL && new->hist != NULL) {
       return new;
     }
-    printf("Failed to allocate word symbols.\n");
+    wt_delete(new);
   }
-  free(new);
-  printf("Failed to allocate word memory.\n");
+  printf("Failed to allocate for word table.\n");
   return (void *)0;
 }
 
 //
-// Constructs a new Word from the specified Word appended with a symbol.
-// The Word specified to append to may be empty.
-// If the above is the case, the new Word should contain only the symbol.
+// Appends the Word for code followed by sym to the decoded output in hist,
+// and records it as the Word for next_code.
+// The caller must make sure len < 2 * WINDOW, see wt_slide.
 //
-// w: Word to append to.
+// wt: WordTable to add to.
+// code: Code of the Word to append to.
 // sym: Symbol to append.
-// returns: New Word which represents the result of appending.
-//
-Word *word_append_sym(Word *w, uint8_t sym) {
-  Word *new = (Word *)malloc(sizeof(Word));
-  if (new != NULL) {
-    new->len = w->len + 1;
-    new->syms = (uint8_t *)calloc(new->len, sizeof(uint8_t));
-    if (new->syms != NULL) {
-      for (uint64_t i = 0; i < w->len; i++) {
-        new->syms[i] = w->syms[i];
-      }
-      new->syms[w->len] = sym;
-      return new;
-    }
-    printf("Failed to allocate appended word symbols.\n");
+// next_code: Code of the new Word.
+// returns: The new Word, which points into hist.
+//
+Word wt_add(WordTable *wt, uint32_t code, uint8_t sym, uint32_t next_code) {
+  WordEntry *e = wt->entries;
+  uint8_t *dst = wt->hist + wt->len;
+  uint64_t pos = wt->base + wt->len;
+  uint32_t len = e[code].len + 1;
+  uint32_t i = len - 1;
+  dst[i] = sym;
+
+  // Rebuild the end of the Word from parents that slid out of hist, until
+  // a parent that is still in hist can be copied in one go. Every Word on
+  // the way now also appears at pos, so it is remembered there instead.
+  // Single symbols are always rebuilt, as literals may never have appeared
+  uint32_t c = code;
+  while (i > 0 && (i == 1 || e[c].pos < wt->base)) {
+    dst[--i] = e[c].sym;
+    e[c].pos = pos;
+    c = e[c].parent;
   }
-  free(new);
-  new = NULL;
-  printf("Failed to allocate appended word memory.\n");
-  return (void *)0;
+  if (i > 0) {
+    memcpy(dst, wt->hist + (e[c].pos - wt->base), i);
+    e[c].pos = pos;
+  }
+
+  e[next_code].pos = pos;
+  e[next_code].len = len;
+  e[next_code].parent = code;
+  e[next_code].sym = sym;
+  wt->len += len;
+
+  Word w = {dst, len};
+  return w;
 }
 
 //
-// Destructor for a Word.
+// Records a Word made of the Word for parent followed by sym, without
+// appending it to the decoded output, as it already appears at pos.
 //
-// w: Word to free memory for.
+// wt: WordTable to add to.
+// code: Code of the new Word.
+// parent: Code of the Word it extends.
+// sym: Symbol it extends the parent with.
+// pos: Position in the decoded output the new Word appears at.
 // returns: Void.
 //
-void word_delete(Word *w) {
-  free(w->syms);
-  w->syms = NULL;
-  free(w);
-  w = NULL;
+void wt_define(WordTable *wt, uint32_t code, uint32_t parent, uint8_t sym,
+    uint64_t pos) {
+  WordEntry *e = &wt->entries[code];
+  e->pos = pos;
+  e->len = wt->entries[parent].len + 1;
+  e->parent = parent;
+  e->sym = sym;
   return;
 }
 
 //
-// Creates a new WordTable, which is an array of Words.
-// A WordTable has a pre - defined size of MAX_CODE (UINT16_MAX - 1).
-// This is because codes are 16 - bit integers.
-// A WordTable is initialized with a single Word at index EMPTY_CODE.
-// This Word represents the empty word, a string of length of zero.
+// Records a Word for every single symbol, at LITERAL_CODE(sym), for the
+// modes that send codes only.
 //
-// returns: Initialized WordTable.
+// wt: WordTable to add to.
+// returns: Void.
 //
-WordTable *wt_create(void) {
-  WordTable *new = (WordTable *)malloc(MAX_CODE * sizeof(WordTable));
-  if (new != NULL) {
-    for (uint32_t i = 0; i < MAX_CODE; i++) {
-      new[i] = NULL;
-    }
-    //
-    // Causes error on timeshare infer, but not my Mac's newer infer
-    // The error is not detected in scan-build or valgrind either
-    new[EMPTY_CODE] = word_create(0, 0);
-    //
-    //
-    return new;
+void wt_literals(WordTable *wt) {
+  for (uint32_t sym = 0; sym < 256; sym++) {
+    wt_define(wt, LITERAL_CODE(sym), EMPTY_CODE, sym, 0);
   }
-  printf("Failed to allocate for word table.\n");
-  return (void *)0;
+  return;
+}
+
+//
+// Drops everything but the last WINDOW bytes from hist.
+// Every byte in hist must have been flushed before the call.
+//
+// wt: WordTable to slide.
+// returns: Void.
+//
+void wt_slide(WordTable *wt) {
+  if (wt->len > WINDOW) {
+    uint32_t drop = wt->len - WINDOW;
+    memmove(wt->hist, wt->hist + drop, WINDOW);
+    wt->base += drop;
+    wt->len = WINDOW;
+    wt->flushed -= drop;
+  }
+  return;
+}
+
+//
+// Forgets the decoded output in hist, as a new stream starts. Positions
+// keep counting up from stream to stream, so that a Word last seen in an
+// earlier stream is rebuilt from its parents rather than copied from hist.
+//
+// wt: WordTable whose output to forget.
+// returns: Void.
+//
+void wt_forget(WordTable *wt) {
+  wt->base += wt->len + 1;
+  wt->len = 0;
+  wt->flushed = 0;
+  return;
 }
 
 //
 // Resets a WordTable to having just the empty Word.
 //
+// Entries are overwritten by wt_add before they can be used again, and the
+// decoded output in hist stays valid, so nothing needs to be cleared.
+//
 // wt: WordTable to reset.
 // returns: Void.
 //
 void wt_reset(WordTable *wt) {
-  for (uint32_t i = 2; i < MAX_CODE; i++) {
-    if (wt[i] != NULL) {
-      word_delete(wt[i]);
-      wt[i] = NULL;
-    }
-  }
+  (void)wt;
   return;
 }
 
 //
 // Deletes an entire WordTable.
-// All Words in the WordTable must be deleted as well.
 //
 // wt: WordTable to free memory for.
 // returns: Void.
 //
 void wt_delete(WordTable *wt) {
-  for (uint32_t i = 1; i < MAX_CODE; i++) {
-    if (wt[i] != NULL) {
-      word_delete(wt[i]);
-      wt[i] = NULL;
-    }
+  if (wt != NULL) {
+    free(wt->entries);
+    free(wt->hist);
+    free(wt);
   }
-  free(wt);
   return;
 }
 
@@ -152,13 +191,22 @@ void word_print(Word *w) {
 // Prints a WordTable
 //
 // wt: WordTable to print
+// next_code: Code after the last one in the WordTable
 //
-void wt_print(WordTable *wt) {
-  uint32_t i = 1;
-  Word *w = NULL;
-  while ((w = wt[i]) != NULL) {
-    word_print(wt[i]);
-    i++;
+void wt_print(WordTable *wt, uint32_t next_code) {
+  uint8_t *syms = (uint8_t *)malloc(wt->max_code);
+  if (syms == NULL) {
+    return;
+  }
+  for (uint32_t code = START_CODE; code < next_code; code++) {
+    Word w = {syms, wt->entries[code].len};
+    uint32_t c = code;
+    for (uint32_t i = w.len; i > 0; i--) {
+      syms[i - 1] = wt->entries[c].sym;
+      c = wt->entries[c].parent;
+    }
+    word_print(&w);
   }
+  free(syms);
   return;
 }
@@ -7,10 +7,18 @@
 
 #include "code.h"
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+// Bytes of decoded output kept around for copying earlier phrases from
+#define WINDOW 0x100000
+
+// Size of the history buffer: two windows plus room for the longest phrase,
+// which is at most one byte per code
+#define HISTORY_OF(max_code) (2 * WINDOW + (max_code))
+
 //
 // Struct definition of a Word.
 //
@@ -23,48 +31,121 @@ typedef struct Word {
 } Word;
 
 //
-// Define an array of Words as a WordTable.
+// Struct definition of the WordTable entry for a single code.
+//
+// pos: Position in the decoded output where the Word last appeared.
+// len: Length of the Word.
+// parent: Code of the Word without its last symbol.
+// sym: Last symbol of the Word.
+//
+typedef struct WordEntry {
+  uint64_t pos;
+  uint32_t len;
+  uint32_t parent;
+  uint8_t sym;
+} WordEntry;
+
+//
+// Struct definition of a WordTable.
+//
+// Words are never copied into the table. Each code remembers where its Word
+// last appeared in the decoded output, and the output since base is kept in
+// hist, so a Word is produced with one copy out of hist. A Word that has
+// slid out of hist is rebuilt from its chain of parents instead.
+//
+// max_code: Number of codes, MAX_CODE_OF the table's code bits.
+// entries: One WordEntry per code.
+// hist: Decoded output starting at the position base.
+// len: Number of bytes in hist.
+// flushed: Number of bytes at the start of hist already written out.
+// base: Position in the decoded output of hist[0].
+//
+typedef struct WordTable {
+  uint32_t max_code;
+  WordEntry *entries;
+  uint8_t *hist;
+  uint32_t len;
+  uint32_t flushed;
+  uint64_t base;
+} WordTable;
+
+//
+// Struct definition of where a Word appears in output that is held whole,
+// as it is when decompressing into a single buffer, so a Word is copied
+// from its last appearance and needs neither a parent nor a history.
+//
+// pos: Position in the decoded output where the Word last appeared.
+// len: Length of the Word.
 //
-typedef Word *WordTable;
+typedef struct WordSpan {
+  uint32_t pos;
+  uint32_t len;
+} WordSpan;
 
 //
-// Constructor for a word.
+// Creates a new WordTable with room for MAX_CODE_OF(code_bits) codes.
+// A WordTable is initialized with a single Word at index EMPTY_CODE.
+// This Word represents the empty word, a string of length of zero.
 //
-// syms: Array of symbols a Word represents.
-// len: Length of the array of symbols.
-// returns: Pointer to a Word that has been allocated memory.
+// code_bits: Dictionary size in bits, MIN_CODE_BITS to MAX_CODE_BITS.
+// returns: Initialized WordTable.
 //
-Word *word_create(uint8_t *syms, uint64_t len);
+WordTable *wt_create(uint8_t code_bits);
 
 //
-// Constructs a new Word from the specified Word appended with a symbol.
-// The Word specified to append to may be empty.
-// If the above is the case, the new Word should contain only the symbol.
+// Appends the Word for code followed by sym to the decoded output in hist,
+// and records it as the Word for next_code.
+// The caller must make sure len < 2 * WINDOW, see wt_slide.
 //
-// w: Word to append to.
+// wt: WordTable to add to.
+// code: Code of the Word to append to.
 // sym: Symbol to append.
-// returns: New Word which represents the result of appending.
+// next_code: Code of the new Word.
+// returns: The new Word, which points into hist.
 //
-Word *word_append_sym(Word *w, uint8_t sym);
+Word wt_add(WordTable *wt, uint32_t code, uint8_t sym, uint32_t next_code);
 
 //
-// Destructor for a Word.
+// Records a Word made of the Word for parent followed by sym, without
+// appending it to the decoded output, as it already appears at pos.
 //
-// w: Word to free memory for.
+// wt: WordTable to add to.
+// code: Code of the new Word.
+// parent: Code of the Word it extends.
+// sym: Symbol it extends the parent with.
+// pos: Position in the decoded output the new Word appears at.
 // returns: Void.
 //
-void word_delete(Word *w);
+void wt_define(WordTable *wt, uint32_t code, uint32_t parent, uint8_t sym,
+    uint64_t pos);
 
 //
-// Creates a new WordTable, which is an array of Words.
-// A WordTable has a pre - defined size of MAX_CODE (UINT16_MAX - 1).
-// This is because codes are 16 - bit integers.
-// A WordTable is initialized with a single Word at index EMPTY_CODE.
-// This Word represents the empty word, a string of length of zero.
+// Records a Word for every single symbol, at LITERAL_CODE(sym), for the
+// modes that send codes only.
 //
-// returns: Initialized WordTable.
+// wt: WordTable to add to.
+// returns: Void.
+//
+void wt_literals(WordTable *wt);
+
+//
+// Drops everything but the last WINDOW bytes from hist.
+// Every byte in hist must have been flushed before the call.
+//
+// wt: WordTable to slide.
+// returns: Void.
+//
+void wt_slide(WordTable *wt);
+
+//
+// Forgets the decoded output in hist, as a new stream starts. Positions
+// keep counting up from stream to stream, so that a Word last seen in an
+// earlier stream is rebuilt from its parents rather than copied from hist.
+//
+// wt: WordTable whose output to forget.
+// returns: Void.
 //
-WordTable *wt_create(void);
+void wt_forget(WordTable *wt);
 
 //
 // Resets a WordTable to having just the empty Word.
@@ -76,7 +157,6 @@ void wt_reset(WordTable *wt);
 
 //
 // Deletes an entire WordTable.
-// All Words in the WordTable must be deleted as well.
 //
 // wt: WordTable to free memory for.
 // returns: Void.
@@ -94,7 +174,8 @@ void word_print(Word *w);
 // Prints a WordTable
 //
 // wt: WordTable to print
+// next_code: Code after the last one in the WordTable
 //
-void wt_print(WordTable *wt);
+void wt_print(WordTable *wt, uint32_t next_code);
 
 #endif